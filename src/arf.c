@@ -577,6 +577,8 @@ int Arf_put_arf (Isis_Arf_t *a, double *arf, double *arf_err, double *binlo, dou
    memcpy ((char *) a->arf, (char *) arf, size);
    memcpy ((char *) a->arf_err, (char *) arf_err, size);
 
+   Isis_Response_Serial++;
+
    return 0;
 }
 
@@ -600,6 +602,7 @@ int Arf_set_arf_exposure (Isis_Arf_t *a, double exposure)  /*{{{*/
      return -1;
 
    a->exposure = exposure;
+   Isis_Response_Serial++;
 
    return 0;
 }
@@ -671,6 +674,7 @@ int Arf_set_arf_info (Isis_Arf_t *a, Arf_Info_Type *ai) /*{{{*/
    isis_strcpy(a->grating,ai->grating, sizeof(a->grating));
 
    a->exposure = ai->exposure;
+   Isis_Response_Serial++;
    a->order = ai->order;
    a->part = ai->part;
    a->srcid = ai->srcid;
@@ -50,45 +50,53 @@ static int cash_function (Isis_Fit_Statistic_Type *st, /*{{{*/
                           double *y, double *fx, double *w, unsigned int npts,
                           double *vec, double *stat)
 {
-   double sum, s, *val;
-   unsigned int i;
+   double val[ISIS_SUM_BLOCK];
+   double sum, c;
+   unsigned int i, k, n;
 
    (void) w;
    (void) st;
 
    sum = 0.0;
-
-   if (NULL == (val = (double *) ISIS_MALLOC (npts * sizeof(double))))
-     return -1;
+   c = 0.0;
 
    /* The form of the statistic is modified according to the
     * suggestion of Castor described in the XSPEC manual.
+    *
+    * Bins are processed in blocks so the per-bin terms can be
+    * summed while still in cache, without a heap buffer.
     */
 
-   for (i = 0; i < npts; i++)
+   for (k = 0; k < npts; k += n)
      {
-        double fxi = fx[i];
-        double yi = y[i];
-        double log_fxi;
+        n = npts - k;
+        if (n > ISIS_SUM_BLOCK)
+          n = ISIS_SUM_BLOCK;
 
-        /* Want sum += (yi - fxi) +  yi * log (fxi/yi);
-         * but must avoid log(0) and f/0
-         */
+        for (i = 0; i < n; i++)
+          {
+             double fxi = fx[k+i];
+             double yi = y[k+i];
+             double s;
 
-        if (yi <= 0) yi = 1.e-5;
-        log_fxi = (fxi > 0) ? log(fxi) : (double) DBL_MIN_10_EXP;
+             /* Want sum += (yi - fxi) +  yi * log (fxi/yi);
+              * but must avoid log(0) and f/0
+              */
 
-        s = (yi - fxi);
-        s += yi * (log_fxi - log (yi));
-        s *= -2;
+             if (yi <= 0) yi = 1.e-5;
 
-        /* sum += s; */
-        val[i] = s;
-        vec[i] = isfinite(s) ? (s * SIGN(yi-fxi)) : DBL_MAX;
-     }
+             s = (yi - fxi);
+             /* one log per bin in the usual case */
+             s += yi * ((fxi > 0) ? log (fxi / yi)
+                        : ((double) DBL_MIN_10_EXP - log (yi)));
+             s *= -2;
 
-   sum = isis_kahan_sum (val, npts);
-   ISIS_FREE(val);
+             val[i] = s;
+             vec[k+i] = isfinite(s) ? (s * SIGN(yi-fxi)) : DBL_MAX;
+          }
+
+        isis_kahan_add (&sum, &c, isis_pairwise_sum (val, n));
+     }
 
    if (0 == isfinite (sum))
      sum = DBL_MAX;
@@ -436,6 +436,24 @@ int cfits_get_repeat_count (int *nelems, const char *colname, cfitsfile *fptr)
    return 0;
 }
 
+/* is_variable is set if the column holds variable-length arrays,
+ * in which case the repeat count describes only the descriptor. */
+int cfits_get_column_repeat (cfitsfile *ft, int col, long *repeat, int *is_variable)
+{
+   int status = 0, typecode;
+
+   if ((ft == NULL) || (repeat == NULL) || (is_variable == NULL))
+     return -1;
+
+   (void) fits_get_coltype ((fitsfile *) ft, col, &typecode, repeat, NULL, &status);
+   cfits_report_error (status);
+
+   if (status != 0) return -1;
+
+   *is_variable = (typecode < 0);
+   return 0;
+}
+
 /*}}}*/
 
 /*{{{ read bintable columns */
@@ -83,6 +83,7 @@ extern int cfits_test_keyword (const char *test_value, const char *keyword,
                                 cfitsfile *fptr);
 
 extern int cfits_get_repeat_count (int *nelems, const char *colname, cfitsfile *fptr);
+extern int cfits_get_column_repeat (cfitsfile *ft, int col, long *repeat, int *is_variable);
 
 extern int cfits_read_double_col (double *column_values, long num_values,
                                   long firstrow, const char *colname, cfitsfile *fptr);
@@ -69,69 +69,74 @@ static Chisqr_Type Chisqr_Types[] =
 
 /* Chi-square statistic */
 
-static int chisqr_function (Isis_Fit_Statistic_Type *st,  /*{{{*/
-                            double *y, double *fx, double *w,
-                            unsigned int npts, double *vec, double *stat)
+/* Fill vec[0..n-1] with the weighted residuals for one block of
+ * bins and return the number of bins given unit weight */
+static unsigned int chisqr_residuals (unsigned int sigma, double *y, double *fx, /*{{{*/
+                                      double *w, unsigned int n, double *vec)
 {
-   double sum, dy, wt;
-   unsigned int i, bad;
-
-   bad = 0;
-   sum = 0.0;
+   unsigned int i, bad = 0;
 
-   *stat = -1.0;
-
-   switch (st->sigma)
+   switch (sigma)
      {
       case DATA_VARIANCE:
-        for (i = 0; i < npts; i++)
+        for (i = 0; i < n; i++)
           {
-             dy = y[i] - fx[i];
-             /* sum += dy*dy * w[i]; */
-             vec[i] = dy * sqrt(w[i]);
+             vec[i] = (y[i] - fx[i]) * sqrt(w[i]);
           }
         break;
 
       case GEHRELS_VARIANCE:
-        for (i = 0; i < npts; i++)
+        for (i = 0; i < n; i++)
           {
-             dy = y[i] - fx[i];
-             if (y[i] >= 0.0) dy /= 1.0 + sqrt(y[i] + 0.75);
-             else bad++;
-             /* sum += dy*dy; */
-             vec[i] = dy;
-          }
-        if (bad && (st->message_string == NULL))
-          {
-             st->message_string =
-               "*** Warning: chisqr used sigma=1.0 for some points with negative data values";
+             double yi = y[i];
+             double dy = yi - fx[i];
+             int ok = (yi >= 0.0);
+             /* sigma = 1 for negative data */
+             vec[i] = ok ? dy / (1.0 + sqrt(yi + 0.75)) : dy;
+             bad += !ok;
           }
         break;
 
       case MODEL_VARIANCE:
-        for (i = 0; i < npts; i++)
+        for (i = 0; i < n; i++)
           {
-             dy = y[i] - fx[i];
-             wt = 1.0;
-             if (fx[i] != 0.0) wt = 1.0 / fabs(fx[i]);
-             else bad++;
-             /* sum += dy*dy * wt; */
-             vec[i] = dy * sqrt(wt);
+             double fxi = fx[i];
+             int ok = (fxi != 0.0);
+             /* sigma = 1 for model = 0 */
+             vec[i] = (y[i] - fxi) * (ok ? 1.0 / sqrt(fabs(fxi)) : 1.0);
+             bad += !ok;
           }
-        if (bad && (st->message_string == NULL))
+        break;
+
+      default:
+        for (i = 0; i < n; i++)
           {
-             st->message_string =
-               "*** Warning: chisqr used sigma=1.0 for some points with model=0";
+             vec[i] = y[i] - fx[i];
           }
         break;
+     }
+
+   return bad;
+}
+
+/*}}}*/
+
+static int chisqr_function (Isis_Fit_Statistic_Type *st,  /*{{{*/
+                            double *y, double *fx, double *w,
+                            unsigned int npts, double *vec, double *stat)
+{
+   double sq[ISIS_SUM_BLOCK];
+   double sum, c;
+   unsigned int i, k, n, bad;
 
+   *stat = -1.0;
+
+   switch (st->sigma)
+     {
+      case DATA_VARIANCE:
+      case GEHRELS_VARIANCE:
+      case MODEL_VARIANCE:
       case LEAST_SQUARES:
-        for (i = 0; i < npts; i++)
-          {
-             dy = y[i] - fx[i];
-             /* sum += dy*dy; */
-             vec[i] = dy;
-          }
         break;
 
       default:
@@ -139,7 +144,37 @@ static int chisqr_function (Isis_Fit_Statistic_Type *st,  /*{{{*/
         return -1;
      }
 
-   sum = isis_kahan_sum_squares (vec, npts);
+   bad = 0;
+   sum = 0.0;
+   c = 0.0;
+
+   /* Residuals and squares are computed a block at a time and
+    * summed while still in cache */
+   for (k = 0; k < npts; k += n)
+     {
+        n = npts - k;
+        if (n > ISIS_SUM_BLOCK)
+          n = ISIS_SUM_BLOCK;
+
+        bad += chisqr_residuals (st->sigma, y + k, fx + k, (w ? w + k : NULL), n, vec + k);
+
+        for (i = 0; i < n; i++)
+          {
+             sq[i] = vec[k+i] * vec[k+i];
+          }
+
+        isis_kahan_add (&sum, &c, isis_pairwise_sum (sq, n));
+     }
+
+   if (bad && (st->message_string == NULL))
+     {
+        if (st->sigma == GEHRELS_VARIANCE)
+          st->message_string =
+            "*** Warning: chisqr used sigma=1.0 for some points with negative data values";
+        else
+          st->message_string =
+            "*** Warning: chisqr used sigma=1.0 for some points with model=0";
+     }
 
    if (0 == isfinite(sum))
      sum = DBL_MAX;
@@ -107,6 +107,7 @@ struct _DB_t
    DB_line_t *line;
    int nlines;
    int *sorted_line_index;
+   unsigned int sort_serial;         /* incremented when the line list is re-sorted */
    DB_line_t **hash_table;
    unsigned int hash_table_size;
    int max_hash_misses;
@@ -2400,12 +2401,27 @@ int DB_sort_line_list (DB_t *db) /*{{{*/
 
    ISIS_FREE (db->sorted_line_index);
    db->sorted_line_index = index_array;
+   db->sort_serial++;
 
    return 0;
 }
 
 /*}}}*/
 
+/* Line indices in order of increasing wavelength. */
+int *DB_get_sorted_line_index (DB_t *db, unsigned int *serial) /*{{{*/
+{
+   if (db == NULL)
+     return NULL;
+
+   if (serial != NULL)
+     *serial = db->sort_serial;
+
+   return db->sorted_line_index;
+}
+
+/*}}}*/
+
 static int build_internals (DB_t *db) /*{{{*/
 {
    if ((NULL == db) || isis_user_break())
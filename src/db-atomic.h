@@ -120,6 +120,7 @@ extern void DB_end (DB_t *db);
 /* general db */
 
 extern int DB_sort_line_list (DB_t *db);
+extern int *DB_get_sorted_line_index (DB_t *db, unsigned int *serial);
 extern int DB_get_nlines (DB_t *db);
 extern DB_line_t *DB_get_line_from_index (int indx, DB_t *db);
 extern DB_line_t *DB_get_line (float wavelen, int proton_number, int ion_charge,
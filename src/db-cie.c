@@ -46,6 +46,10 @@
 #include "db-em.h"
 #include "db-cie.h"
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 #undef MAX
 #define MAX(a,b) (((a) < (b)) ? (b) : (a))
 
@@ -97,6 +101,7 @@ typedef struct _EM_cont_data_t EM_cont_data_t;
 typedef struct _EM_cont_emis_t EM_cont_emis_t;
 typedef struct _EM_ionfrac_t EM_ionfrac_t;
 typedef struct _EM_abund_t EM_abund_t;
+typedef struct _EM_line_cell_t EM_line_cell_t;
 
 struct _EM_t
 {
@@ -107,6 +112,7 @@ struct _EM_t
    EM_abund_t *abund;
    int chosen_abund_table;       /* user-specified abund table */
    int standard_abund_table;     /* the standard abund table */
+   unsigned int line_cell_serial;  /* changes invalidate the cell cache */
 };
 
 struct EM_filemap_t
@@ -119,17 +125,64 @@ struct EM_filemap_t
    char abund_table[CFLEN_KEYWORD];
 };
 
+typedef struct
+{
+   int npoints;
+   int idx[4];
+}
+EM_line_cell_key_t;
+
 struct _EM_line_data_t
 {
    EM_filemap_t *map;
    EM_line_emis_t **emis;   /* storage for memory resident mode */
+   EM_line_cell_t **cell_hash;          /* interpolation cells by corners */
+   EM_line_cell_t *cell_head;           /* most recently used first */
+   EM_line_cell_t *cell_tail;
+   EM_line_cell_key_t *evicted;         /* ring of recently evicted keys */
+   unsigned int num_evicted;
+   unsigned int num_cells;
+   unsigned int max_cells;
+   unsigned int cell_clock;
+   unsigned long cell_hits;
+   unsigned long cell_misses;
+};
+
+/* The cache starts with EM_NUM_LINE_CELLS cells and doubles, up to
+ * EM_MAX_LINE_CELLS, whenever a cell it evicted is asked for again,
+ * so it grows to the number of cells a model keeps using.
+ */
+#define EM_NUM_LINE_CELLS     8
+#define EM_MAX_LINE_CELLS     256
+#define EM_LINE_CELL_BUCKETS  64      /* power of 2 */
+
+/* Union of the line lists tabulated at the corners of one (T,n)
+ * interpolation cell, with the corner emissivities (already scaled
+ * to the chosen abundances) stored row by row, so that any (T,n)
+ * in the cell costs one weighted sum over the rows.
+ */
+struct _EM_line_cell_t
+{
+   EM_line_cell_t *hash_next;
+   EM_line_cell_t *prev;      /* recently used order */
+   EM_line_cell_t *next;
+   int idx[4];                /* filemap indices of the corners */
+   int npoints;
+   int nlines;
+   DB_line_t **line;          /* union line list, by wavelength */
+   float *emis;               /* npoints rows of nlines emissivities */
+   int *lookup;               /* database index -> position in line[] */
+   unsigned int serial;       /* em->line_cell_serial when built */
+   unsigned int line_order;   /* serial of the database wavelength sort */
+   int refcount;              /* callers using this cell right now */
+   int is_cached;             /* 0 => private, freed by put_line_cell */
 };
 
 struct _EM_line_emis_t
 {
    DB_line_t **line;          /* vector of ptrs to atomic data for each line */
    float *emissivity;         /* vector of line emissivities */
-   int *lookup;
+   int *lookup;               /* database index -> position, or NULL */
    float temperature;
    float density;
    int nlines;
@@ -502,6 +555,7 @@ int EM_set_chosen_abundance (EM_t *em, int k) /*{{{*/
      return -1;
 
    em->chosen_abund_table = k;
+   em->line_cell_serial++;
    return 0;
 }
 /*}}}*/
@@ -512,6 +566,7 @@ int EM_set_standard_abundance (EM_t *em, int k) /*{{{*/
      return -1;
 
    em->standard_abund_table = k;
+   em->line_cell_serial++;
    return 0;
 }
 /*}}}*/
@@ -1111,6 +1166,7 @@ void EM_free_alt_ionization_table (EM_t *em) /*{{{*/
 
    free_ioniz_table (em->ioniz_table[1]);
    em->ioniz_table[1] = NULL;
+   em->line_cell_serial++;
 }
 
 /*}}}*/
@@ -1127,6 +1183,7 @@ int EM_load_alt_ionization_table (char *file, EM_t *em) /*{{{*/
 
    free_ioniz_table (em->ioniz_table[1]);
    em->ioniz_table[1] = t;
+   em->line_cell_serial++;
 
    return 0;
 }
@@ -1748,8 +1805,72 @@ static int init_load_linefile_hdu (void ***vp, int nlines) /*{{{*/
 
 /*}}}*/
 
+typedef struct
+{
+   DB_line_t *line;
+   float emis;
+}
+Line_Emis_Pair_Type;
+
+static int compare_line_index (const void *a, const void *b) /*{{{*/
+{
+   DB_line_t *la = ((const Line_Emis_Pair_Type *) a)->line;
+   DB_line_t *lb = ((const Line_Emis_Pair_Type *) b)->line;
+
+   /* unidentified lines go at the end */
+   if (la == NULL)
+     return (lb == NULL) ? 0 : 1;
+   if (lb == NULL)
+     return -1;
+
+   if (la->indx < lb->indx)
+     return -1;
+   else if (la->indx > lb->indx)
+     return 1;
+   return 0;
+}
+
+/*}}}*/
+
+/* Line lists are kept sorted by line index so that the union of
+ * several lists can be formed by merging them.
+ */
+static int sort_line_emis_list (EM_line_emis_t *p) /*{{{*/
+{
+   Line_Emis_Pair_Type *x;
+   int k;
+
+   if (p->nlines < 2)
+     return 0;
+
+   if (NULL == (x = (Line_Emis_Pair_Type *) ISIS_MALLOC (p->nlines * sizeof(Line_Emis_Pair_Type))))
+     return -1;
+
+   for (k = 0; k < p->nlines; k++)
+     {
+        x[k].line = p->line[k];
+        x[k].emis = p->emissivity[k];
+     }
+
+   qsort (x, p->nlines, sizeof(Line_Emis_Pair_Type), compare_line_index);
+
+   for (k = 0; k < p->nlines; k++)
+     {
+        p->line[k] = x[k].line;
+        p->emissivity[k] = x[k].emis;
+     }
+
+   ISIS_FREE (x);
+   return 0;
+}
+
+/*}}}*/
+
 static int clean_load_linefile_hdu (void **vp, int ret) /*{{{*/
 {
+   if (ret == 0)
+     ret = sort_line_emis_list (*(EM_line_emis_t **)vp);
+
    if (ret)
      EM_free_line_emis_list (*(EM_line_emis_t **)vp);
 
@@ -1791,11 +1912,31 @@ static int do_load_linefile_hdu (void **vp, int nread, int start_row, /*{{{*/
 
 /*}}}*/
 
+static void free_line_cell (EM_line_cell_t *c) /*{{{*/
+{
+   ISIS_FREE (c->line);
+   ISIS_FREE (c->emis);
+   ISIS_FREE (c->lookup);
+   c->nlines = 0;
+}
+
+/*}}}*/
+
 static void free_line_data (EM_line_data_t *ld) /*{{{*/
 {
    if (NULL == ld)
      return;
 
+   while (ld->cell_head != NULL)
+     {
+        EM_line_cell_t *c = ld->cell_head;
+        ld->cell_head = c->next;
+        free_line_cell (c);
+        ISIS_FREE (c);
+     }
+   ISIS_FREE (ld->cell_hash);
+   ISIS_FREE (ld->evicted);
+
    if (ld->emis)
      {
         int i;
@@ -2715,117 +2856,634 @@ static int get_line_interp_points (EM_t *em, int npoints, int *idx, EM_line_emis
 
 /*}}}*/
 
-static EM_line_emis_t *interpolate_line_emis (char *flag, EM_line_emis_t **table, /*{{{*/
-                                             float *coef, int n, DB_t *db)
+/* Merges n line lists sorted by line index; each call returns the
+ * next line in the union and sets emis[j] to the emissivity of that
+ * line in list j.
+ */
+typedef struct
 {
-   EM_line_emis_t *result = NULL;
-   int j, k, nl, ntot;
-   int  ret = -1;
+   EM_line_emis_t **table;
+   int n;
+   int pos[4];
+}
+Line_Merge_Type;
 
-   struct line_interp_t
-     {
-        float emis;
-        DB_line_t *line;
-     }
-   *t = NULL;
+static void init_line_merge (Line_Merge_Type *m, EM_line_emis_t **table, int n) /*{{{*/
+{
+   int j;
 
-   if (NULL == table || NULL == coef
-       || (n != 2 && n != 4))
-     return NULL;
+   m->table = table;
+   m->n = n;
+   for (j = 0; j < n; j++)
+     m->pos[j] = 0;
+}
 
-   /* Use a temporary array of structures to
-    *  1) determine the union of the N line lists and
-    *  2) to assign an interpolated emissivity to each line.
-    *
-    * The temp array is used as a lookup table in which the array
-    * index is equal to the index of the line in the internal list.
-    * (e.g. it is big enough to hold the entire available line list).
-    *
-    * We waste a bit of memory, but this is a simple algorithm and
-    * is guaranteed to work (right?) even if the input line lists
-    * are unsorted.  and memory is cheap.... isnt it?
-    *
-    */
+/*}}}*/
 
-   if (-1 == (ntot = DB_get_nlines (db)))
-     return NULL;
-   if (NULL == (t = (struct line_interp_t *) ISIS_MALLOC (ntot * sizeof(struct line_interp_t))))
-     return NULL;
-   memset ((char *)t, 0, ntot * sizeof(struct line_interp_t));
+static DB_line_t *next_merged_line (Line_Merge_Type *m, float *emis, int *status) /*{{{*/
+{
+   DB_line_t *next = NULL;
+   int j;
+
+   *status = 0;
 
-   nl = 0;
-   for (j=0; j < n; j++)
+   for (j = 0; j < m->n; j++)
      {
-        EM_line_emis_t *tbl = table[j];
-        int nlines = tbl->nlines;
+        EM_line_emis_t *t = m->table[j];
+        DB_line_t *p;
 
-        for (k=0; k < nlines; k++)
+        if (m->pos[j] >= t->nlines)
+          continue;
+
+        /* unidentified lines are sorted to the end */
+        if (NULL == (p = t->line[m->pos[j]]))
           {
-             DB_line_t *p = tbl->line[k];
-             int idx;
+             *status = -1;
+             return NULL;
+          }
+
+        if ((next == NULL) || (p->indx < next->indx))
+          next = p;
+     }
 
-             if (p == NULL)
-               goto fail;
+   if (next == NULL)
+     return NULL;
+
+   for (j = 0; j < m->n; j++)
+     {
+        EM_line_emis_t *t = m->table[j];
+        int k = m->pos[j];
 
-             idx = p->indx;
+        emis[j] = 0.0;
 
-             if (t[idx].line == NULL)
+        while ((k < t->nlines)
+               && (t->line[k] != NULL)
+               && (t->line[k]->indx == next->indx))
+          {
+             if (t->line[k] != next)       /* safety check */
                {
-                  t[idx].line = p;
-                  nl++;
+                  *status = -1;
+                  return NULL;
                }
-             else if (t[idx].line != p)       /* safety check */
-               goto fail;
-
-             if (NULL == flag || flag[idx] != 0)
-               t[idx].emis += coef[j] * tbl->emissivity[k];
+             emis[j] += t->emissivity[k];
+             k++;
           }
+
+        m->pos[j] = k;
      }
 
-   if (nl == 0
-       || NULL == (result = new_line_emis_list (nl)))
-     goto fail;
+   return next;
+}
+
+/*}}}*/
+
+static int count_merged_lines (EM_line_emis_t **table, int n) /*{{{*/
+{
+   Line_Merge_Type m;
+   float emis[4];
+   int nl = 0, status;
+
+   init_line_merge (&m, table, n);
+
+   while (NULL != next_merged_line (&m, emis, &status))
+     nl++;
+
+   return status ? -1 : nl;
+}
+
+/*}}}*/
+
+/* Puts nl lines, with lookup[] mapping line index to position, into
+ * order of increasing wavelength.  The nrows rows of per-line values
+ * in emis[] are permuted along with the lines, and lookup is updated.
+ */
+static int sort_by_wavelength (DB_line_t **line, float *emis, int nrows, int nl, /*{{{*/
+                               int *lookup, DB_t *db)
+{
+   DB_line_t **new_line = NULL;
+   float *new_emis = NULL;
+   int *order;
+   int i, k, r, ntot, ret = -1;
+
+   if ((-1 == (ntot = DB_get_nlines (db)))
+       || (NULL == (order = DB_get_sorted_line_index (db, NULL))))
+     return -1;
+
+   if ((NULL == (new_line = (DB_line_t **) ISIS_MALLOC (nl * sizeof(DB_line_t *))))
+       || (NULL == (new_emis = (float *) ISIS_MALLOC (nrows * nl * sizeof(float)))))
+     goto finish;
 
    k = 0;
-   for (j=0; j < ntot; j++)
+   for (i = 0; i < ntot; i++)
      {
-        if (t[j].line == NULL)
+        int indx = order[i];
+        int pos = lookup[indx];
+
+        if (pos < 0)
           continue;
+        if (k == nl)
+          goto finish;
 
-        result->line[ k ] = t[j].line;
-        result->emissivity[ k ] = MAX(t[j].emis, 0.0);
-        k++;
+        new_line[k] = line[pos];
+        for (r = 0; r < nrows; r++)
+          new_emis[r * nl + k] = emis[r * nl + pos];
+        lookup[indx] = k++;
      }
 
    if (k != nl)
+     goto finish;
+
+   memcpy ((char *)line, (char *)new_line, nl * sizeof(DB_line_t *));
+   memcpy ((char *)emis, (char *)new_emis, nrows * nl * sizeof(float));
+
+   ret = 0;
+
+   finish:
+
+   ISIS_FREE (new_emis);
+   ISIS_FREE (new_line);
+
+   return ret;
+}
+
+/*}}}*/
+
+static EM_line_emis_t *interpolate_line_emis (char *flag, EM_line_emis_t **table, /*{{{*/
+                                             float *coef, int n, DB_t *db)
+{
+   EM_line_emis_t *result = NULL;
+   Line_Merge_Type m;
+   DB_line_t *line;
+   float emis[4];
+   int j, k, nl, status;
+
+   if (NULL == table || NULL == coef
+       || (n != 2 && n != 4))
+     return NULL;
+
+   if ((0 >= (nl = count_merged_lines (table, n)))
+       || (NULL == (result = new_line_emis_list (nl))))
+     return NULL;
+
+   init_line_merge (&m, table, n);
+
+   k = 0;
+   while (NULL != (line = next_merged_line (&m, emis, &status)))
+     {
+        float e = 0.0;
+
+        if (NULL == flag || flag[line->indx] != 0)
+          {
+             for (j = 0; j < n; j++)
+               e += coef[j] * emis[j];
+          }
+
+        result->line[k] = line;
+        result->emissivity[k] = MAX(e, 0.0);
+        k++;
+     }
+
+   if (status || (k != nl))
      {
         isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "Internal error in interpolate_line_emis");
-        goto fail;
+        EM_free_line_emis_list (result);
+        return NULL;
+     }
+
+   if ((-1 == build_lookup_table (result, db))
+       || (-1 == sort_by_wavelength (result->line, result->emissivity, 1, nl,
+                                     result->lookup, db)))
+     {
+        EM_free_line_emis_list (result);
+        return NULL;
      }
 
-   if (-1 == build_lookup_table (result, db))
-     goto fail;
+   return result;
+}
+/*}}}*/
+
+/*{{{ interpolation cell cache */
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t Line_Cell_Mutex = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_LINE_CELLS()    (void) pthread_mutex_lock (&Line_Cell_Mutex)
+# define UNLOCK_LINE_CELLS()  (void) pthread_mutex_unlock (&Line_Cell_Mutex)
+#else
+# define LOCK_LINE_CELLS()
+# define UNLOCK_LINE_CELLS()
+#endif
+
+static int fill_line_cell (EM_line_cell_t *c, EM_t *em, int npoints, int *idx) /*{{{*/
+{
+   EM_line_emis_t *tbl[4] = {NULL, NULL, NULL, NULL};
+   float f_abund[ISIS_MAX_PROTON_NUMBER+1];
+   float emis[4];
+   Line_Merge_Type m;
+   DB_line_t *p;
+   int i, j, k, nl, ntot, status, ret = -1;
+
+   if (-1 == get_line_interp_points (em, npoints, idx, tbl))
+     return -1;
+
+   for (i = 0; i <= ISIS_MAX_PROTON_NUMBER; i++)
+     f_abund[i] = 1.0;
+   if (use_alt_abund (em)
+       && (-1 == get_abundance_factor (f_abund, em)))
+     goto finish;
+
+   if ((-1 == (ntot = DB_get_nlines (em->db)))
+       || (0 >= (nl = count_merged_lines (tbl, npoints)))
+       || (NULL == (c->lookup = (int *) ISIS_MALLOC (ntot * sizeof(int))))
+       || (NULL == (c->line = (DB_line_t **) ISIS_MALLOC (nl * sizeof(DB_line_t *))))
+       || (NULL == (c->emis = (float *) ISIS_MALLOC (npoints * nl * sizeof(float)))))
+     goto finish;
+
+   for (i = 0; i < ntot; i++)
+     c->lookup[i] = INT_MIN;
+
+   init_line_merge (&m, tbl, npoints);
+
+   k = 0;
+   while (NULL != (p = next_merged_line (&m, emis, &status)))
+     {
+        float f = f_abund[p->proton_number];
+        for (j = 0; j < npoints; j++)
+          c->emis[j * nl + k] = emis[j] * f;
+        c->line[k] = p;
+        c->lookup[p->indx] = k++;
+     }
+
+   if (status || (k != nl))
+     goto finish;
+
+   (void) DB_get_sorted_line_index (em->db, &c->line_order);
+   if (-1 == sort_by_wavelength (c->line, c->emis, npoints, nl, c->lookup, em->db))
+     goto finish;
+
+   for (j = 0; j < npoints; j++)
+     c->idx[j] = idx[j];
+   c->npoints = npoints;
+   c->nlines = nl;
+   c->serial = em->line_cell_serial;
 
    ret = 0;
 
-   fail:
+   finish:
 
    if (ret)
+     free_line_cell (c);
+
+   if (EM_Load_Line_Emis == 0)
      {
-        EM_free_line_emis_list (result);
-        result = NULL;
+        for (j = 0; j < npoints; j++)
+          EM_free_line_emis_list (tbl[j]);
+     }
+
+   return ret;
+}
+
+/*}}}*/
+
+static unsigned int line_cell_bucket (int npoints, int *idx) /*{{{*/
+{
+   unsigned int h = npoints;
+   int j;
+
+   for (j = 0; j < npoints; j++)
+     h = 31 * h + (unsigned int) idx[j];
+
+   return h & (EM_LINE_CELL_BUCKETS - 1);
+}
+
+/*}}}*/
+
+static int line_cell_key_matches (int key_npoints, int *key_idx, int npoints, int *idx) /*{{{*/
+{
+   int j;
+
+   if (key_npoints != npoints)
+     return 0;
+
+   for (j = 0; j < npoints; j++)
+     {
+        if (key_idx[j] != idx[j])
+          return 0;
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
+static void delete_line_cell (EM_line_cell_t *c) /*{{{*/
+{
+   free_line_cell (c);
+   ISIS_FREE (c);
+}
+
+/*}}}*/
+
+static void touch_line_cell (EM_line_data_t *ld, EM_line_cell_t *c) /*{{{*/
+{
+   if (ld->cell_head == c)
+     return;
+
+   /* unlink ... */
+   if (c->prev) c->prev->next = c->next;
+   if (c->next) c->next->prev = c->prev;
+   if (ld->cell_tail == c) ld->cell_tail = c->prev;
+
+   /* ... and put first */
+   c->prev = NULL;
+   c->next = ld->cell_head;
+   if (ld->cell_head) ld->cell_head->prev = c;
+   ld->cell_head = c;
+   if (ld->cell_tail == NULL) ld->cell_tail = c;
+}
+
+/*}}}*/
+
+static void link_line_cell (EM_line_data_t *ld, EM_line_cell_t *c) /*{{{*/
+{
+   unsigned int b = line_cell_bucket (c->npoints, c->idx);
+
+   c->hash_next = ld->cell_hash[b];
+   ld->cell_hash[b] = c;
+
+   c->prev = c->next = NULL;
+   touch_line_cell (ld, c);
+
+   c->is_cached = 1;
+   ld->num_cells++;
+}
+
+/*}}}*/
+
+static void unlink_line_cell (EM_line_data_t *ld, EM_line_cell_t *c) /*{{{*/
+{
+   EM_line_cell_t **p = &ld->cell_hash[line_cell_bucket (c->npoints, c->idx)];
+
+   while (*p != c)
+     p = &(*p)->hash_next;
+   *p = c->hash_next;
+
+   if (c->prev) c->prev->next = c->next;
+   else ld->cell_head = c->next;
+   if (c->next) c->next->prev = c->prev;
+   else ld->cell_tail = c->prev;
+
+   c->hash_next = c->prev = c->next = NULL;
+   c->is_cached = 0;
+   ld->num_cells--;
+}
+
+/*}}}*/
+
+/* Returns the cached cell with the given corners, if it is current.
+ * Stale cells nobody is using are dropped on the way.
+ */
+static EM_line_cell_t *find_line_cell (EM_t *em, unsigned int line_order, /*{{{*/
+                                       int npoints, int *idx)
+{
+   EM_line_data_t *ld = em->line_data;
+   EM_line_cell_t *c, *next;
+
+   if (ld->cell_hash == NULL)
+     return NULL;
+
+   for (c = ld->cell_hash[line_cell_bucket (npoints, idx)]; c != NULL; c = next)
+     {
+        next = c->hash_next;
+
+        if (0 == line_cell_key_matches (c->npoints, c->idx, npoints, idx))
+          continue;
+
+        if ((c->serial == em->line_cell_serial)
+            && (c->line_order == line_order))
+          return c;
+
+        if (c->refcount == 0)
+          {
+             unlink_line_cell (ld, c);
+             delete_line_cell (c);
+          }
+     }
+
+   return NULL;
+}
+
+/*}}}*/
+
+static int was_evicted (EM_line_data_t *ld, int npoints, int *idx) /*{{{*/
+{
+   unsigned int i, n;
+
+   n = (ld->num_evicted < EM_MAX_LINE_CELLS) ? ld->num_evicted : EM_MAX_LINE_CELLS;
+
+   for (i = 0; i < n; i++)
+     {
+        EM_line_cell_key_t *k = &ld->evicted[i];
+        if (line_cell_key_matches (k->npoints, k->idx, npoints, idx))
+          return 1;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Makes room for one more cell, or returns -1 if every
+ * cell is in use and the cache can't grow.
+ */
+static int make_room_for_line_cell (EM_line_data_t *ld) /*{{{*/
+{
+   if (ld->cell_hash == NULL)
+     {
+        if ((NULL == (ld->cell_hash = (EM_line_cell_t **) ISIS_MALLOC (EM_LINE_CELL_BUCKETS * sizeof(EM_line_cell_t *))))
+            || (NULL == (ld->evicted = (EM_line_cell_key_t *) ISIS_MALLOC (EM_MAX_LINE_CELLS * sizeof(EM_line_cell_key_t)))))
+          {
+             ISIS_FREE (ld->cell_hash);
+             return -1;
+          }
+        memset ((char *)ld->cell_hash, 0, EM_LINE_CELL_BUCKETS * sizeof(EM_line_cell_t *));
+        ld->max_cells = EM_NUM_LINE_CELLS;
+        ld->num_evicted = 0;
+     }
+
+   while (ld->num_cells >= ld->max_cells)
+     {
+        EM_line_cell_t *c = ld->cell_tail;
+        EM_line_cell_key_t *k;
+
+        while ((c != NULL) && (c->refcount > 0))
+          c = c->prev;
+
+        if (c == NULL)
+          {
+             if (ld->max_cells >= EM_MAX_LINE_CELLS)
+               return -1;
+             ld->max_cells *= 2;
+             continue;
+          }
+
+        k = &ld->evicted[ld->num_evicted++ % EM_MAX_LINE_CELLS];
+        k->npoints = c->npoints;
+        memcpy ((char *)k->idx, (char *)c->idx, sizeof(k->idx));
+
+        unlink_line_cell (ld, c);
+        delete_line_cell (c);
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Returns the cell with the given corners, building it if necessary.
+ * Cells are built outside the lock, so a slow build doesn't hold up
+ * other threads.  When every cached cell is in use, the new cell is
+ * private to the caller.  Either way, the caller must release the
+ * cell with put_line_cell.
+ */
+static EM_line_cell_t *get_line_cell (EM_t *em, int npoints, int *idx) /*{{{*/
+{
+   EM_line_data_t *ld = em->line_data;
+   EM_line_cell_t *c, *found;
+   unsigned int line_order;
+
+   (void) DB_get_sorted_line_index (em->db, &line_order);
+
+   LOCK_LINE_CELLS();
+   if (NULL != (found = find_line_cell (em, line_order, npoints, idx)))
+     {
+        found->refcount++;
+        touch_line_cell (ld, found);
+        ld->cell_hits++;
+        UNLOCK_LINE_CELLS();
+        return found;
+     }
+   ld->cell_misses++;
+   if ((ld->evicted != NULL)
+       && (ld->max_cells < EM_MAX_LINE_CELLS)
+       && was_evicted (ld, npoints, idx))
+     ld->max_cells *= 2;
+   UNLOCK_LINE_CELLS();
+
+   if (NULL == (c = (EM_line_cell_t *) ISIS_MALLOC (sizeof(EM_line_cell_t))))
+     return NULL;
+   memset ((char *)c, 0, sizeof(*c));
+
+   if (-1 == fill_line_cell (c, em, npoints, idx))
+     {
+        ISIS_FREE (c);
+        return NULL;
+     }
+   c->refcount = 1;
+
+   LOCK_LINE_CELLS();
+   if (NULL != (found = find_line_cell (em, line_order, npoints, idx)))
+     {
+        /* another thread built it first */
+        found->refcount++;
+        touch_line_cell (ld, found);
+     }
+   else if (0 == make_room_for_line_cell (ld))
+     link_line_cell (ld, c);
+   UNLOCK_LINE_CELLS();
+
+   if (found != NULL)
+     {
+        delete_line_cell (c);
+        return found;
+     }
+
+   return c;
+}
+
+/*}}}*/
+
+static void put_line_cell (EM_line_cell_t *c) /*{{{*/
+{
+   int is_cached;
+
+   LOCK_LINE_CELLS();
+   c->refcount--;
+   is_cached = c->is_cached;
+   UNLOCK_LINE_CELLS();
+
+   if (is_cached == 0)
+     delete_line_cell (c);
+}
+
+/*}}}*/
+
+void EM_get_line_cell_stats (EM_t *em, unsigned long *hits, unsigned long *misses, /*{{{*/
+                             unsigned int *num_cells)
+{
+   EM_line_data_t *ld;
+
+   *hits = *misses = 0;
+   *num_cells = 0;
+
+   if ((em == NULL) || (NULL == (ld = em->line_data)))
+     return;
+
+   LOCK_LINE_CELLS();
+   *hits = ld->cell_hits;
+   *misses = ld->cell_misses;
+   *num_cells = ld->num_cells;
+   UNLOCK_LINE_CELLS();
+}
+
+/*}}}*/
+
+static EM_line_emis_t *interpolate_line_cell (char *flag, EM_line_cell_t *c, /*{{{*/
+                                              float *coef, DB_t *db)
+{
+   EM_line_emis_t *result;
+   float *emis;
+   int j, k, nl;
+
+   nl = c->nlines;
+
+   if (NULL == (result = new_line_emis_list (nl)))
+     return NULL;
+
+   /* result->lookup is left for EM_sum_line_emissivity to build
+    * if it needs it */
+   memcpy ((char *)result->line, (char *)c->line, nl * sizeof(DB_line_t *));
+
+   emis = result->emissivity;
+   memset ((char *)emis, 0, nl * sizeof(float));
+
+   for (j = 0; j < c->npoints; j++)
+     {
+        float *row = c->emis + j * nl;
+        float cj = coef[j];
+        for (k = 0; k < nl; k++)
+          emis[k] += cj * row[k];
+     }
+
+   for (k = 0; k < nl; k++)
+     {
+        if ((flag != NULL) && (flag[c->line[k]->indx] == 0))
+          emis[k] = 0.0;
+        else
+          emis[k] = MAX(emis[k], 0.0);
      }
 
-   ISIS_FREE (t);
    return result;
 }
+
+/*}}}*/
+
 /*}}}*/
 
 EM_line_emis_t *EM_get_line_spectrum (char *flag, float temp, float dens, float *ionpop_new, EM_t *em) /*{{{*/
 {
    EM_line_data_t *ld;
+   EM_line_cell_t *cell;
    EM_line_emis_t *line = NULL;
-   EM_line_emis_t *tbl[4] = {NULL, NULL, NULL, NULL};
    float coef[4] = {0.0, 0.0, 0.0, 0.0};
    int idx[4], npoints;
 
@@ -2837,31 +3495,21 @@ EM_line_emis_t *EM_get_line_spectrum (char *flag, float temp, float dens, float
    if (-1 == interp_coeffs (coef, idx, &npoints, temp, dens, ld->map))
      return NULL;
 
-   if (-1 == get_line_interp_points (em, npoints, idx, tbl))
-     goto close_and_return;
+   /* Abundance scaling is built into the cached emissivities */
+   if (NULL == (cell = get_line_cell (em, npoints, idx)))
+     return NULL;
 
-   line = interpolate_line_emis (flag, tbl, coef, npoints, em->db);
+   line = interpolate_line_cell (flag, cell, coef, em->db);
+   put_line_cell (cell);
    if (NULL == line)
-     goto close_and_return;
+     return NULL;
 
-   if (-1 == scale_line_abundance (line, em)
-       || -1 == scale_line_ionization (line, temp, dens, ionpop_new, em))
-     goto close_and_return;
+   if (-1 == scale_line_ionization (line, temp, dens, ionpop_new, em))
+     return line;
 
    line->temperature = temp;
    line->density = dens;
 
-   close_and_return:
-
-   if (EM_Load_Line_Emis == 0)
-     {
-        int j;
-        for (j=0; j < npoints; j++)
-          {
-             EM_free_line_emis_list (tbl[j]);
-          }
-     }
-
    return line;
 }
 /*}}}*/
@@ -2876,6 +3524,45 @@ int EM_get_nlines (EM_line_emis_t *t) /*{{{*/
 
 /*}}}*/
 
+/* The lines returned by EM_get_line_spectrum are in order of increasing
+ * wavelength.  Find the range [*k0, *k1) of lines with wlmin <= wl <= wlmax.
+ */
+int EM_get_line_range (EM_line_emis_t *t, double wlmin, double wlmax, int *k0, int *k1) /*{{{*/
+{
+   DB_line_t **line;
+   int n0, n1, n2;
+
+   if ((NULL == t) || (k0 == NULL) || (k1 == NULL))
+     return -1;
+
+   line = t->line;
+
+   n0 = 0;
+   n1 = t->nlines;
+   while (n0 < n1)
+     {
+        n2 = (n0 + n1) / 2;
+        if (line[n2]->wavelen < wlmin)
+          n0 = n2 + 1;
+        else n1 = n2;
+     }
+   *k0 = n0;
+
+   n1 = t->nlines;
+   while (n0 < n1)
+     {
+        n2 = (n0 + n1) / 2;
+        if (line[n2]->wavelen <= wlmax)
+          n0 = n2 + 1;
+        else n1 = n2;
+     }
+   *k1 = n0;
+
+   return 0;
+}
+
+/*}}}*/
+
 int _EM_get_line_emis_wl (DB_line_t **line, float *emis, float *wl, int k, /*{{{*/
                          EM_line_emis_t *t)
 {
@@ -2914,6 +3601,10 @@ int EM_sum_line_emissivity (float * emis, float temp, float dens, /*{{{*/
 
    max_index = DB_get_nlines (em->db);
 
+   if ((t->lookup == NULL)
+       && (-1 == build_lookup_table (t, em->db)))
+     goto finish;
+
    *emis = 0.0;
 
    for (i=0; i < nlines; i++)
@@ -3500,6 +4191,14 @@ static void set_memory_usage_level (void) /*{{{*/
 
 /*}}}*/
 
+/* Like EM_Use_Memory, but describes the tables actually loaded. */
+unsigned int EM_memory_usage_level (void) /*{{{*/
+{
+   return EM_Load_Line_Emis | EM_Load_Cont_Emis;
+}
+
+/*}}}*/
+
 EM_t *EM_start (EM_File_Type *f, void *cl, DB_t *db)
 {
    EM_t *em = NULL;
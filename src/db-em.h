@@ -95,6 +95,7 @@ struct _EM_cont_type_t
 
 extern EM_t *EM_start (EM_File_Type *f, void *cl, DB_t *db);
 extern void EM_end (EM_t *em);
+extern unsigned int EM_memory_usage_level (void);
 
 extern int EM_get_filemap (EM_t *em, char *emis_file, void *cl, unsigned int *num_hdus, double **temp, double **dens);
 
@@ -114,7 +115,11 @@ extern void EM_free_alt_ionization_table (EM_t *em);
 
 extern int EM_get_nlines (EM_line_emis_t *t);
 extern void EM_free_line_emis_list (EM_line_emis_t *p);
+/* line lists are returned in order of increasing wavelength */
 extern EM_line_emis_t *EM_get_line_spectrum (char *flag, float temp, float dens, float *ionpop_new, EM_t *em);
+extern void EM_get_line_cell_stats (EM_t *em, unsigned long *hits, unsigned long *misses,
+                                    unsigned int *num_cells);
+extern int EM_get_line_range (EM_line_emis_t *t, double wlmin, double wlmax, int *k0, int *k1);
 
 extern EM_cont_type_t *EM_new_continuum (int nbins);
 extern void EM_free_continuum (EM_cont_type_t *t);
@@ -0,0 +1,995 @@
+/* -*- mode: C; mode: fold -*- */
+
+/*  This file is part of ISIS, the Interactive Spectral Interpretation System
+    Copyright (C) 1998-2005 Massachusetts Institute of Technology
+
+    This software was developed by the MIT Center for Space Research under
+    contract SV1-61010 from the Smithsonian Institution.
+
+    Author:  John C. Houck  <houck@space.mit.edu>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* $Id$ */
+
+/*{{{ Includes  */
+
+#include "config.h"
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+
+#include <string.h>
+
+/*}}}*/
+
+#define ISIS_FIT_ENGINE_PRIVATE_DATA \
+   double reldiff;         /* relative spread in energies for convergence */ \
+   double absdiff;         /* absolute spread in energies for convergence */ \
+   double diffscale;       /* mutation scale factor */                       \
+   double crossprob;       /* crossover probability */                       \
+   double trigprob;        /* trigonometric mutation probability */          \
+   int maxnfe;             /* max number of function evaluations */          \
+   int max_gens;           /* max number of generations (< 0 : no limit) */  \
+   unsigned int npop;      /* population per parameter */                    \
+   unsigned int strategy;                                                    \
+   unsigned int bc;                                                          \
+   unsigned int num_workers; /* forked processes evaluating the population */
+
+#include "isis.h"
+#include "isismath.h"
+#include "util.h"
+
+/* A compiled version of the differential evolution optimizer in
+ * share/diffevol.sl (J. Davis).  Each generation, a trial vector
+ * is built for every member of the population from the population
+ * at the start of the generation;  the trials are then evaluated
+ * together, possibly by forked worker processes, and a trial
+ * replaces its parent only if it lowers the statistic.
+ */
+
+#define DE_REJECTED      DBL_MAX
+#define DE_MIN_POP       4
+#define DE_MAX_REJECTS   100
+
+enum
+{
+   DE_RAND1EXP = 0,
+   DE_RAND1BIN,
+   DE_BEST1EXP,
+   DE_BEST1BIN,
+   DE_RANDTOBEST1EXP,
+   DE_RANDTOBEST1BIN,
+   DE_MIXEDBIN,
+   DE_MIXEDEXP
+};
+
+static const char *Strategy_Names[] =
+{
+   "rand1exp", "rand1bin", "best1exp", "best1bin",
+   "randtobest1exp", "randtobest1bin", "mixedbin", "mixedexp",
+   NULL
+};
+
+enum
+{
+   DE_BC_NONE = 0,
+   DE_BC_REJECT,
+   DE_BC_REFLECT,
+   DE_BC_TRUNCATE,
+   DE_BC_RAND
+};
+
+static const char *BC_Names[] =
+{
+   "none", "reject", "reflect", "truncate", "rand",
+   NULL
+};
+
+typedef struct
+{
+   Isis_Fit_Type *ift;
+   double *x;
+   double *y;
+   double *weights;
+   double *fx;
+   double *fvec;
+   unsigned int npts;
+   unsigned int npars;
+
+   unsigned int npop;
+   double *pop;           /* npop x npars */
+   double *energy;        /* npop */
+   double *trial;         /* npop x npars */
+   double *trial_energy;  /* npop */
+   unsigned int *pending; /* trials awaiting evaluation */
+   double *best;          /* npars */
+   double best_energy;
+   double worst_energy;
+   double *mutant;        /* npars */
+   int nfe;
+}
+DE_Info_Type;
+
+static int feqs (double a, double b, double reldiff, double absdiff) /*{{{*/
+{
+   double diff = fabs (a - b);
+   double scale;
+
+   if (diff <= absdiff)
+     return 1;
+
+   scale = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+   return (diff <= reldiff * scale);
+}
+
+/*}}}*/
+
+/*{{{ evaluation */
+
+static int eval_task (void *cl, unsigned int task, double *result) /*{{{*/
+{
+   DE_Info_Type *di = (DE_Info_Type *) cl;
+   Isis_Fit_Type *ift = di->ift;
+   Isis_Fit_Statistic_Type *fs = ift->stat;
+   double *p = di->trial + di->pending[task] * di->npars;
+   double statistic;
+
+   if (-1 == ift->compute_model (fs->opt_data, di->x, di->npts, p, di->npars, di->fx))
+     return -1;
+
+   if ((-1 == fs->compute_statistic (fs, di->y, di->fx, di->weights, di->npts,
+                                     di->fvec, &statistic))
+       || (0 == isfinite (statistic)))
+     statistic = DE_REJECTED;
+
+   *result = statistic;
+   return 0;
+}
+
+/*}}}*/
+
+/* Evaluate the trials listed in di->pending[0..num-1].  The statistic
+ * for trial di->pending[k] is stored in di->trial_energy[di->pending[k]].
+ */
+static int evaluate_pending (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int num, double *results) /*{{{*/
+{
+   unsigned int k;
+
+   if (num == 0)
+     return 0;
+
+   if (-1 == isis_fork_map (num, 1, e->num_workers, &eval_task, (void *) di, results))
+     return -1;
+
+   for (k = 0; k < num; k++)
+     {
+        di->trial_energy[di->pending[k]] = results[k];
+     }
+
+   di->nfe += num;
+
+   return 0;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*{{{ mutation and crossover */
+
+static void sample_population (DE_Info_Type *di, unsigned int current, /*{{{*/
+                               unsigned int n, unsigned int *samples)
+{
+   unsigned int i, j;
+
+   for (i = 0; i < n; i++)
+     {
+        unsigned int s;
+        int again;
+        do
+          {
+             s = rand_index (di->npop);
+             again = (s == current);
+             for (j = 0; (again == 0) && (j < i); j++)
+               {
+                  if (samples[j] == s)
+                    again = 1;
+               }
+          }
+        while (again);
+        samples[i] = s;
+     }
+}
+
+/*}}}*/
+
+static int trig_mutant (DE_Info_Type *di, double *mutant, /*{{{*/
+                        double *p1, double *p2, double *p3,
+                        double w1, double w2, double w3)
+{
+   double w0 = di->best_energy;
+   double norm;
+   unsigned int i;
+
+   w1 -= w0;
+   w2 -= w0;
+   w3 -= w0;
+
+   norm = (w1 + w2 + w3) / 3.0;
+   if (0 == isfinite (norm))
+     return -1;
+
+   if (norm != 0.0)
+     {
+        w1 /= norm;
+        w2 /= norm;
+        w3 /= norm;
+     }
+
+   for (i = 0; i < di->npars; i++)
+     {
+        double m = (p1[i] + p2[i] + p3[i]) / 3.0;
+        if (norm != 0.0)
+          m -= w1*(p1[i] - m) + w2*(p2[i] - m) + w3*(p3[i] - m);
+        mutant[i] = m;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+static void rand1_mutant (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int current) /*{{{*/
+{
+   unsigned int s[3];
+   double *p0, *p1, *p2;
+   unsigned int i, n = di->npars;
+
+   sample_population (di, current, 3, s);
+   p0 = di->pop + s[0] * n;
+   p1 = di->pop + s[1] * n;
+   p2 = di->pop + s[2] * n;
+
+   if ((urand () < e->trigprob)
+       && (0 == trig_mutant (di, di->mutant, p0, p1, p2,
+                             di->energy[s[0]], di->energy[s[1]], di->energy[s[2]])))
+     return;
+
+   for (i = 0; i < n; i++)
+     {
+        di->mutant[i] = p0[i] + e->diffscale * (p1[i] - p2[i]);
+     }
+}
+
+/*}}}*/
+
+static void best1_mutant (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int current) /*{{{*/
+{
+   unsigned int s[2];
+   double *p1, *p2;
+   unsigned int i, n = di->npars;
+
+   sample_population (di, current, 2, s);
+   p1 = di->pop + s[0] * n;
+   p2 = di->pop + s[1] * n;
+
+   if ((urand () < e->trigprob)
+       && (0 == trig_mutant (di, di->mutant, di->best, p1, p2,
+                             di->best_energy, di->energy[s[0]], di->energy[s[1]])))
+     return;
+
+   for (i = 0; i < n; i++)
+     {
+        di->mutant[i] = di->best[i] + e->diffscale * (p1[i] - p2[i]);
+     }
+}
+
+/*}}}*/
+
+static void rand_to_best_mutant (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int current) /*{{{*/
+{
+   unsigned int s[2];
+   double *pc, *p1, *p2;
+   unsigned int i, n = di->npars;
+
+   sample_population (di, current, 2, s);
+   pc = di->pop + current * n;
+   p1 = di->pop + s[0] * n;
+   p2 = di->pop + s[1] * n;
+
+   if ((urand () < e->trigprob)
+       && (0 == trig_mutant (di, di->mutant, di->best, p1, p2,
+                             di->best_energy, di->energy[s[0]], di->energy[s[1]])))
+     return;
+
+   for (i = 0; i < n; i++)
+     {
+        di->mutant[i] = pc[i] + e->diffscale * ((di->best[i] - pc[i]) + (p1[i] - p2[i]));
+     }
+}
+
+/*}}}*/
+
+static void binary_crossover (double *p, double *mutant, unsigned int n, double prob) /*{{{*/
+{
+   unsigned int i;
+   int crossed = 0;
+
+   for (i = 0; i < n; i++)
+     {
+        if (urand () < prob)
+          {
+             p[i] = mutant[i];
+             crossed = 1;
+          }
+     }
+
+   if (crossed == 0)
+     {
+        i = rand_index (n);
+        p[i] = mutant[i];
+     }
+}
+
+/*}}}*/
+
+static void exp_crossover (double *p, double *mutant, unsigned int n, double prob) /*{{{*/
+{
+   unsigned int i = rand_index (n);
+   unsigned int k;
+
+   for (k = 0; k < n; k++)
+     {
+        p[i] = mutant[i];
+        if (urand () > prob)
+          break;
+        i = (i + 1) % n;
+     }
+}
+
+/*}}}*/
+
+static void make_trial (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int current) /*{{{*/
+{
+   unsigned int n = di->npars;
+   double *p = di->trial + current * n;
+   unsigned int strategy = e->strategy;
+   int use_bin;
+
+   memcpy ((char *)p, (char *)(di->pop + current * n), n * sizeof(double));
+
+   if ((strategy == DE_MIXEDBIN) || (strategy == DE_MIXEDEXP))
+     {
+        double cutoff = di->best_energy + 0.3 * (di->worst_energy - di->best_energy);
+        int is_bad = (di->energy[current] > cutoff);
+        if (strategy == DE_MIXEDBIN)
+          strategy = is_bad ? DE_BEST1BIN : DE_RAND1BIN;
+        else
+          strategy = is_bad ? DE_RANDTOBEST1EXP : DE_RAND1EXP;
+     }
+
+   switch (strategy)
+     {
+      case DE_RAND1EXP:
+      case DE_RAND1BIN:
+        rand1_mutant (e, di, current);
+        break;
+
+      case DE_BEST1EXP:
+      case DE_BEST1BIN:
+        best1_mutant (e, di, current);
+        break;
+
+      default:
+        rand_to_best_mutant (e, di, current);
+        break;
+     }
+
+   use_bin = ((strategy == DE_RAND1BIN)
+              || (strategy == DE_BEST1BIN)
+              || (strategy == DE_RANDTOBEST1BIN));
+
+   if (use_bin)
+     binary_crossover (p, di->mutant, n, e->crossprob);
+   else
+     exp_crossover (p, di->mutant, n, e->crossprob);
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*{{{ boundary conditions */
+
+static void bc_rand (double *p, double *pmin, double *pmax, unsigned int n) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < n; i++)
+     {
+        if ((p[i] < pmin[i]) || (pmax[i] < p[i]))
+          p[i] = pmin[i] + (pmax[i] - pmin[i]) * urand ();
+     }
+}
+
+/*}}}*/
+
+static void bc_truncate (double *p, double *pmin, double *pmax, unsigned int n) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < n; i++)
+     {
+        if (p[i] < pmin[i]) p[i] = pmin[i];
+        else if (pmax[i] < p[i]) p[i] = pmax[i];
+     }
+}
+
+/*}}}*/
+
+static void bc_reflect (double *p, double *pmin, double *pmax, unsigned int n) /*{{{*/
+{
+   unsigned int i, loops;
+   int again = 1;
+
+   for (loops = 0; again && (loops < 10); loops++)
+     {
+        again = 0;
+        for (i = 0; i < n; i++)
+          {
+             if (p[i] < pmin[i])
+               {
+                  p[i] = 2*pmin[i] - p[i];
+                  again = 1;
+               }
+             else if (pmax[i] < p[i])
+               {
+                  p[i] = 2*pmax[i] - p[i];
+                  again = 1;
+               }
+          }
+     }
+
+   if (again)
+     bc_rand (p, pmin, pmax, n);
+}
+
+/*}}}*/
+
+static int is_in_range (double *p, double *pmin, double *pmax, unsigned int n) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < n; i++)
+     {
+        if ((p[i] < pmin[i]) || (pmax[i] < p[i]))
+          return 0;
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
+static void make_bounded_trial (Isis_Fit_Engine_Type *e, DE_Info_Type *di, unsigned int current) /*{{{*/
+{
+   double *p = di->trial + current * di->npars;
+   unsigned int n = di->npars;
+   unsigned int tries = 0;
+
+   make_trial (e, di, current);
+
+   switch (e->bc)
+     {
+      case DE_BC_REJECT:
+        while (0 == is_in_range (p, e->par_min, e->par_max, n))
+          {
+             /* Give up eventually rather than loop forever on a
+              * population crowded against a boundary */
+             if (++tries >= DE_MAX_REJECTS)
+               {
+                  bc_rand (p, e->par_min, e->par_max, n);
+                  break;
+               }
+             make_trial (e, di, current);
+          }
+        break;
+
+      case DE_BC_REFLECT:
+        bc_reflect (p, e->par_min, e->par_max, n);
+        break;
+
+      case DE_BC_TRUNCATE:
+        bc_truncate (p, e->par_min, e->par_max, n);
+        break;
+
+      case DE_BC_RAND:
+        bc_rand (p, e->par_min, e->par_max, n);
+        break;
+
+      default:
+        break;
+     }
+}
+
+/*}}}*/
+
+/*}}}*/
+
+static void random_member (Isis_Fit_Engine_Type *e, double *p, double *p0, unsigned int n) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < n; i++)
+     {
+        double lo = e->par_min[i];
+        double hi = e->par_max[i];
+
+        if (0 == isfinite (hi - lo))
+          {
+             /* unbounded: sample around the initial value */
+             double s = (p0[i] != 0.0) ? fabs(p0[i]) : 1.0;
+             double l = p0[i] - s, h = p0[i] + s;
+             if (l > lo) lo = l;
+             if (h < hi) hi = h;
+          }
+
+        p[i] = lo + (hi - lo) * urand ();
+     }
+}
+
+/*}}}*/
+
+static int init_population (Isis_Fit_Engine_Type *e, DE_Info_Type *di, /*{{{*/
+                            double *pars, double *results)
+{
+   unsigned int npop = di->npop;
+   unsigned int n = di->npars;
+   unsigned int i, num;
+
+   memcpy ((char *)di->trial, (char *)pars, n * sizeof(double));
+   for (i = 1; i < npop; i++)
+     {
+        random_member (e, di->trial + i * n, pars, n);
+     }
+
+   for (i = 0; i < npop; i++)
+     {
+        di->pending[i] = i;
+     }
+   num = npop;
+
+   for (;;)
+     {
+        if (-1 == evaluate_pending (e, di, num, results))
+          return -1;
+
+        num = 0;
+        for (i = 0; i < npop; i++)
+          {
+             if (di->trial_energy[i] == DE_REJECTED)
+               {
+                  random_member (e, di->trial + i * n, pars, n);
+                  di->pending[num++] = i;
+               }
+          }
+
+        if ((num == 0) || (di->nfe >= e->maxnfe))
+          break;
+     }
+
+   memcpy ((char *)di->pop, (char *)di->trial, npop * n * sizeof(double));
+   memcpy ((char *)di->energy, (char *)di->trial_energy, npop * sizeof(double));
+
+   return 0;
+}
+
+/*}}}*/
+
+static void find_best (DE_Info_Type *di) /*{{{*/
+{
+   unsigned int i, k = 0;
+
+   for (i = 1; i < di->npop; i++)
+     {
+        if (di->energy[i] < di->energy[k])
+          k = i;
+     }
+
+   di->best_energy = di->energy[k];
+   memcpy ((char *)di->best, (char *)(di->pop + k * di->npars), di->npars * sizeof(double));
+}
+
+/*}}}*/
+
+static int diffevol (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
+                     double *x, double *y, double *weights, unsigned int npts,
+                     double *pars, unsigned int npars)
+{
+   Isis_Fit_Engine_Type *e;
+   Isis_Fit_Statistic_Type *fs;
+   DE_Info_Type info;
+   DE_Info_Type *di = &info;
+   double *results = NULL;
+   unsigned int i, n, npop;
+   int max_gens;
+   int ret = -1;
+
+   if ((ift == NULL) || (npars == 0))
+     return -1;
+
+   e = ift->engine;
+   fs = ift->stat;
+
+   memset ((char *)di, 0, sizeof(*di));
+   di->ift = ift;
+   di->x = x;
+   di->y = y;
+   di->weights = weights;
+   di->npts = npts;
+   di->npars = n = npars;
+
+   npop = e->npop * npars;
+   if (npop < DE_MIN_POP)
+     npop = DE_MIN_POP;
+   di->npop = npop;
+
+   if ((NULL == (di->fx = (double *) ISIS_MALLOC (npts * sizeof(double))))
+       || (NULL == (di->fvec = (double *) ISIS_MALLOC (npts * sizeof(double))))
+       || (NULL == (di->pop = (double *) ISIS_MALLOC (npop * n * sizeof(double))))
+       || (NULL == (di->trial = (double *) ISIS_MALLOC (npop * n * sizeof(double))))
+       || (NULL == (di->energy = (double *) ISIS_MALLOC (npop * sizeof(double))))
+       || (NULL == (di->trial_energy = (double *) ISIS_MALLOC (npop * sizeof(double))))
+       || (NULL == (results = (double *) ISIS_MALLOC (npop * sizeof(double))))
+       || (NULL == (di->pending = (unsigned int *) ISIS_MALLOC (npop * sizeof(unsigned int))))
+       || (NULL == (di->best = (double *) ISIS_MALLOC (n * sizeof(double))))
+       || (NULL == (di->mutant = (double *) ISIS_MALLOC (n * sizeof(double)))))
+     goto finish;
+
+   if (-1 == init_population (e, di, pars, results))
+     goto finish;
+
+   find_best (di);
+   if (di->best_energy == DE_REJECTED)
+     {
+        e->warn_hook (clientdata, "de: failed to find a valid initial population\n");
+        goto finish;
+     }
+
+   if (e->verbose > 0)
+     e->verbose_hook (clientdata, di->best_energy, di->best, n);
+
+   max_gens = e->max_gens;
+
+   while ((di->nfe < e->maxnfe) && (max_gens != 0))
+     {
+        double min_energy = di->energy[0];
+        double max_energy = di->energy[0];
+        double prev_best = di->best_energy;
+        unsigned int num;
+
+        if (max_gens > 0)
+          max_gens--;
+
+        for (i = 1; i < npop; i++)
+          {
+             if (di->energy[i] < min_energy) min_energy = di->energy[i];
+             if (di->energy[i] > max_energy) max_energy = di->energy[i];
+          }
+
+        if (feqs (min_energy, max_energy, e->reldiff, e->absdiff))
+          break;
+
+        di->worst_energy = max_energy;
+
+        /* trials are built from the population as it stood at the
+         * start of this generation so they can be evaluated together */
+        for (i = 0; i < npop; i++)
+          {
+             make_bounded_trial (e, di, i);
+             di->pending[i] = i;
+          }
+        num = npop;
+
+        do
+          {
+             unsigned int k;
+
+             if (-1 == evaluate_pending (e, di, num, results))
+               goto finish;
+
+             /* regenerate rejected trials, as the S-Lang version does */
+             for (k = 0, num = 0; k < npop; k++)
+               {
+                  if (di->trial_energy[k] == DE_REJECTED)
+                    {
+                       make_bounded_trial (e, di, k);
+                       di->pending[num++] = k;
+                    }
+               }
+          }
+        while ((num > 0) && (di->nfe < e->maxnfe));
+
+        /* accept a trial only if it lowers the energy */
+        for (i = 0; i < npop; i++)
+          {
+             double en = di->trial_energy[i];
+
+             if (en < di->energy[i])
+               {
+                  di->energy[i] = en;
+                  memcpy ((char *)(di->pop + i * n), (char *)(di->trial + i * n),
+                          n * sizeof(double));
+                  if (en < di->best_energy)
+                    {
+                       di->best_energy = en;
+                       memcpy ((char *)di->best, (char *)(di->trial + i * n),
+                               n * sizeof(double));
+                    }
+               }
+          }
+
+        if ((e->verbose > 0) && (di->best_energy < prev_best))
+          e->verbose_hook (clientdata, di->best_energy, di->best, n);
+     }
+
+   memcpy ((char *)pars, (char *)di->best, n * sizeof(double));
+
+   /* Leave the model evaluated at the best-fit parameters in this
+    * process;  the population may have been evaluated elsewhere. */
+   if (-1 == ift->compute_model (fs->opt_data, x, npts, pars, npars, di->fx))
+     goto finish;
+
+   (void) fs->compute_statistic (fs, y, di->fx, weights, npts, di->fvec, &ift->statistic);
+
+   if (e->verbose > 0)
+     fprintf (stdout, "de: %d function evaluations\n", di->nfe);
+
+   ret = 0;
+
+   finish:
+
+   ISIS_FREE (di->fx);
+   ISIS_FREE (di->fvec);
+   ISIS_FREE (di->pop);
+   ISIS_FREE (di->trial);
+   ISIS_FREE (di->energy);
+   ISIS_FREE (di->trial_energy);
+   ISIS_FREE (di->pending);
+   ISIS_FREE (di->best);
+   ISIS_FREE (di->mutant);
+   ISIS_FREE (results);
+
+   return ret;
+}
+
+/*}}}*/
+
+static void warn_hook (void *clientdata, const char * fmt, ...) /*{{{*/
+{
+   char buf[1024];
+   va_list ap;
+
+   (void) clientdata;
+
+   if (fmt == NULL)
+     return;
+
+   va_start (ap, fmt);
+   if (-1 == isis_vsnprintf (buf, sizeof(buf), fmt, ap))
+     fputs ("**** String buffer overflow in warn_hook\n", stderr);
+   va_end (ap);
+
+   fputs (buf, stdout);
+}
+
+/*}}}*/
+
+static void verbose_hook (void *clientdata, double statistic, /*{{{*/
+                          double *par, unsigned int n)
+{
+   unsigned int i;
+   (void) clientdata;
+   fprintf (stdout, "statistic: %e", statistic);
+   for (i = 0; i < n; i++)
+     fprintf (stdout, "\tp[%u]=%e", i, par[i]);
+   (void) fputs ("\n", stdout);
+}
+
+/*}}}*/
+
+static int handle_double_option (char *subsystem, char *optname, char *value, double *d) /*{{{*/
+{
+   if (1 != sscanf (value, "%lf", d))
+     {
+        fprintf (stderr, "%s;%s option requires a double\n", subsystem, optname);
+        return -1;
+     }
+   return 0;
+}
+
+/*}}}*/
+
+static int handle_int_option (char *subsystem, char *optname, char *value, int *d) /*{{{*/
+{
+   if (1 != sscanf (value, "%d", d))
+     {
+        fprintf (stderr, "%s;%s option requires a int\n", subsystem, optname);
+        return -1;
+     }
+   return 0;
+}
+
+/*}}}*/
+
+static int handle_uint_option (char *subsystem, char *optname, char *value, unsigned int *d) /*{{{*/
+{
+   if (1 != sscanf (value, "%u", d))
+     {
+        fprintf (stderr, "%s;%s option requires an unsigned int\n", subsystem, optname);
+        return -1;
+     }
+   return 0;
+}
+
+/*}}}*/
+
+static int handle_name_option (char *subsystem, char *optname, char *value, /*{{{*/
+                               const char **names, unsigned int *d)
+{
+   unsigned int i;
+
+   for (i = 0; names[i] != NULL; i++)
+     {
+        if (0 == strcmp (value, names[i]))
+          {
+             *d = i;
+             return 0;
+          }
+     }
+
+   fprintf (stderr, "%s;%s option requires one of:", subsystem, optname);
+   for (i = 0; names[i] != NULL; i++)
+     fprintf (stderr, " %s", names[i]);
+   fputs ("\n", stderr);
+
+   return -1;
+}
+
+/*}}}*/
+
+#define HANDLE_OPTION(type, name) \
+static int handle_##name##_option (char *subsystem, char *optname, char *value, void *clientdata) \
+{\
+   Isis_Fit_Engine_Type *e; \
+   e = (Isis_Fit_Engine_Type *) clientdata; \
+   if (-1 == handle_##type##_option (subsystem, optname, value, &e->name)) \
+     return -1; \
+   return isis_update_option_string (&e->option_string, optname, value); \
+}
+
+#define HANDLE_NAME_OPTION(names, name) \
+static int handle_##name##_option (char *subsystem, char *optname, char *value, void *clientdata) \
+{\
+   Isis_Fit_Engine_Type *e; \
+   e = (Isis_Fit_Engine_Type *) clientdata; \
+   if (-1 == handle_name_option (subsystem, optname, value, names, &e->name)) \
+     return -1; \
+   return isis_update_option_string (&e->option_string, optname, value); \
+}
+
+HANDLE_OPTION(double, reldiff)
+HANDLE_OPTION(double, absdiff)
+HANDLE_OPTION(double, diffscale)
+HANDLE_OPTION(double, crossprob)
+HANDLE_OPTION(double, trigprob)
+HANDLE_OPTION(int, maxnfe)
+HANDLE_OPTION(int, max_gens)
+HANDLE_OPTION(uint, npop)
+HANDLE_OPTION(uint, num_workers)
+HANDLE_NAME_OPTION(Strategy_Names, strategy)
+HANDLE_NAME_OPTION(BC_Names, bc)
+
+static Isis_Option_Table_Type Option_Table [] =
+{
+     {"reldiff", handle_reldiff_option, ISIS_OPT_REQUIRES_VALUE, "1.e-4", "Relative spread of population statistic at convergence"},
+     {"absdiff", handle_absdiff_option, ISIS_OPT_REQUIRES_VALUE, "1.e-8", "Absolute spread of population statistic at convergence"},
+     {"diffscale", handle_diffscale_option, ISIS_OPT_REQUIRES_VALUE, "0.7", "Mutation scale factor"},
+     {"crossprob", handle_crossprob_option, ISIS_OPT_REQUIRES_VALUE, "0.5", "Crossover probability"},
+     {"trigprob", handle_trigprob_option, ISIS_OPT_REQUIRES_VALUE, "0.0", "Trigonometric mutation probability"},
+     {"maxnfe", handle_maxnfe_option, ISIS_OPT_REQUIRES_VALUE, "1000", "Maximum number of function evaluations"},
+     {"max_gens", handle_max_gens_option, ISIS_OPT_REQUIRES_VALUE, "-1", "Maximum number of generations (< 0 means no limit)"},
+     {"npop", handle_npop_option, ISIS_OPT_REQUIRES_VALUE, "10", "Population per parameter"},
+     {"strategy", handle_strategy_option, ISIS_OPT_REQUIRES_VALUE, "best1bin", "best1bin|best1exp|rand1exp|rand1bin|randtobest1exp|randtobest1bin|mixedbin|mixedexp"},
+     {"bc", handle_bc_option, ISIS_OPT_REQUIRES_VALUE, "rand", "Boundary Conditions: none|reject|reflect|truncate|rand"},
+     {"workers", handle_num_workers_option, ISIS_OPT_REQUIRES_VALUE, "0", "Number of forked processes evaluating the population"},
+     ISIS_OPTION_TABLE_TYPE_NULL
+};
+
+static int set_options (Isis_Fit_Engine_Type *e, Isis_Option_Type *opts) /*{{{*/
+{
+   return isis_process_options (opts, Option_Table, (void *)e, 1);
+}
+
+/*}}}*/
+
+static int set_range_hook (Isis_Fit_Engine_Type *e, Isis_Fit_Range_Hook_Type r) /*{{{*/
+{
+   (void) e; (void) r;
+   return 0;
+}
+
+/*}}}*/
+
+static void deallocate (Isis_Fit_Engine_Type *e)
+{
+   ISIS_FREE (e->engine_name);
+   ISIS_FREE (e->default_statistic_name);
+   ISIS_FREE (e->option_string);
+}
+
+ISIS_FIT_ENGINE_METHOD(de,name,sname)
+{
+   Isis_Fit_Engine_Type *e;
+
+   if (NULL == (e = (Isis_Fit_Engine_Type *) ISIS_MALLOC (sizeof(Isis_Fit_Engine_Type))))
+     return NULL;
+   memset ((char *)e, 0, sizeof (*e));
+
+   if ((NULL == (e->engine_name = isis_make_string (name)))
+       || (NULL == (e->default_statistic_name = isis_make_string (sname))))
+     {
+        deallocate (e);
+        ISIS_FREE (e);
+        return NULL;
+     }
+
+   e->method = diffevol;
+   e->set_options = set_options;
+   e->deallocate = deallocate;
+   e->set_range_hook = set_range_hook;
+   e->range_hook = NULL;
+   e->verbose_hook = verbose_hook;
+   e->warn_hook = warn_hook;
+
+   e->reldiff = 1.e-4;
+   e->absdiff = 1.e-8;
+   e->diffscale = 0.7;
+   e->crossprob = 0.5;
+   e->trigprob = 0.0;
+   e->maxnfe = 1000;
+   e->max_gens = -1;
+   e->npop = 10;
+   e->strategy = DE_BEST1BIN;
+   e->bc = DE_BC_RAND;
+   e->num_workers = 0;
+
+   e->option_string = isis_make_default_option_string ("de", Option_Table);
+   if (e->option_string == NULL)
+     {
+        deallocate (e);
+        ISIS_FREE (e);
+        return NULL;
+     }
+
+   return e;
+}
@@ -601,6 +601,25 @@ static void _get_abundance_table (int *k) /*{{{*/
 
 /*}}}*/
 
+/* (hits, misses, num_cells) of the line interpolation cell cache */
+static void _line_cell_stats (void) /*{{{*/
+{
+   EM_t *em = ptr_to_emissivity_db ();
+   unsigned long hits, misses;
+   unsigned int num_cells;
+
+   if (NULL == em)
+     return;
+
+   EM_get_line_cell_stats (em, &hits, &misses, &num_cells);
+
+   (void) SLang_push_ulong (hits);
+   (void) SLang_push_ulong (misses);
+   (void) SLang_push_uinteger (num_cells);
+}
+
+/*}}}*/
+
 static void _choose_abs_abundance_table (int *k) /*{{{*/
 {
    EM_t *em = ptr_to_emissivity_db ();
@@ -733,6 +752,7 @@ static SLang_Intrin_Fun_Type Emis_Intrinsics [] = /*{{{*/
    MAKE_INTRINSIC("_get_continuum", _get_continuum, V, 0),
    MAKE_INTRINSIC_I("_list_abund_tables", _list_abund_tables, V),
    MAKE_INTRINSIC_I("_choose_abs_abundance_table", _choose_abs_abundance_table, V),
+   MAKE_INTRINSIC("_line_cell_stats", _line_cell_stats, V, 0),
    MAKE_INTRINSIC_S("_index_for_abundance_table", _index_for_abundance_table, I),
    MAKE_INTRINSIC_I("_get_abundance_table", _get_abundance_table, V),
    MAKE_INTRINSIC("_add_abund_table", _add_abund_table, I, 0),
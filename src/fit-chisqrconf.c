@@ -39,9 +39,14 @@
 #  include <stdlib.h>
 #endif
 
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#endif
+
 #include <slang.h>
 
 #include "isis.h"
+#include "isismath.h"
 #include "util.h"
 #include "fit.h"
 #include "errors.h"
@@ -51,6 +56,7 @@
 
 enum
 {
+   EVAL_ABORTED  = -4,
    EVAL_ERROR    = -3,
    EVAL_FAILED   = -2,
    EVAL_INVALID  = -1,
@@ -73,6 +79,10 @@ struct Sample_Type
    double *par;
 };
 
+/* Set when a parallel search finds an improved fit, so searches
+ * still running (possibly in other processes) can stop early. */
+static volatile int *Conf_Restart_Flag;
+
 static int run_fit_improved_hook (void) /*{{{*/
 {
    static char hook_name[] = "isis_fit_improved_hook";
@@ -103,6 +113,9 @@ static int examine_fit_statistic (Param_t *pt, unsigned int idx, double p, doubl
    double improve_tol = 0.5 * sinfo->tolerance * sinfo->delt;
    double dchisqr;
 
+   if ((Conf_Restart_Flag != NULL) && *Conf_Restart_Flag)
+     return EVAL_ABORTED;
+
    if (info->verbose)
      verbose_warn_hook (NULL, "Minimizing for par[%d]= %15.8e\n", idx, p);
 
@@ -177,14 +190,37 @@ static int interp_par (int mode, Sample_Type *a, Sample_Type *b, /*{{{*/
 
 /*}}}*/
 
+/* If slope is non-NULL, slope[i] = d(par[i])/d(param idx) along the
+ * valley of the fit-statistic, e.g. from the covariance matrix;
+ * each fit then starts from the extrapolated valley floor.
+ */
+static void extrapolate_params (Fit_Param_t *par, double *slope, double dp) /*{{{*/
+{
+   int i;
+
+   if (slope == NULL)
+     return;
+
+   for (i = 0; i < par->npars; i++)
+     {
+        double p = par->par[i] + slope[i] * dp;
+        if (p < par->par_min[i]) p = par->par_min[i];
+        else if (par->par_max[i] < p) p = par->par_max[i];
+        par->par[i] = p;
+     }
+}
+
+/*}}}*/
+
 static int bracket_target (Param_t *pt, int idx, double *conf_limit, /*{{{*/
                            double pbest, double ptest, double prange,
                            Sample_Type *a, Sample_Type *b,
-                           Search_Info_Type *sinfo, Fit_Object_Type *fo)
+                           Search_Info_Type *sinfo, Fit_Object_Type *fo,
+                           double *slope)
 {
    Fit_Info_Type *info = fo->info;
    Fit_Param_t *par = info->par;
-   double chisqr, target_chisqr;
+   double chisqr, target_chisqr, plast;
    int i, k, status;
 
    /* 'b' starts at the minimum chisqr.
@@ -198,12 +234,14 @@ static int bracket_target (Param_t *pt, int idx, double *conf_limit, /*{{{*/
    for (i = 0; i < par->npars; i++)
      b->par[i] = par->par[i];
 
+   extrapolate_params (par, slope, ptest - pbest);
    status = examine_fit_statistic (pt, idx, ptest, &chisqr, sinfo, fo);
    if (status != EVAL_OK)
      {
         *conf_limit = ptest;
         return status;
      }
+   plast = ptest;
 
    target_chisqr = sinfo->min_chisqr + sinfo->delt;
 
@@ -226,12 +264,14 @@ static int bracket_target (Param_t *pt, int idx, double *conf_limit, /*{{{*/
 
         /* Try to avoid the endpoint if possible */
         ptest = 0.5 * (prange + ptest);
+        extrapolate_params (par, slope, ptest - plast);
         status = examine_fit_statistic (pt, idx, ptest, &chisqr, sinfo, fo);
         if (status != EVAL_OK)
           {
              *conf_limit = ptest;
              return status;
           }
+        plast = ptest;
 
         if (chisqr >= target_chisqr)
           break;
@@ -253,7 +293,7 @@ static int bracket_target (Param_t *pt, int idx, double *conf_limit, /*{{{*/
 static int find_limit (double *conf_limit, unsigned int idx, /*{{{*/
                        double ptest, double prange, double pbest,
                        Search_Info_Type *sinfo, Fit_Object_Type *fo,
-                       Param_t *pt, char *which)
+                       Param_t *pt, char *which, double *slope)
 {
    Fit_Info_Type *info = fo->info;
    double test, chisqr, target_chisqr, accept_tol;
@@ -292,7 +332,7 @@ static int find_limit (double *conf_limit, unsigned int idx, /*{{{*/
         goto finish;
      }
 
-   status = bracket_target (pt, idx, conf_limit, pbest, ptest, prange, &a, &b, sinfo, fo);
+   status = bracket_target (pt, idx, conf_limit, pbest, ptest, prange, &a, &b, sinfo, fo, slope);
    if (status != EVAL_OK)
      goto finish;
 
@@ -419,6 +459,9 @@ static int find_limit (double *conf_limit, unsigned int idx, /*{{{*/
       case EVAL_ERROR:
         verbose_warn_hook (NULL, "**** internal error\n");
         break;
+      case EVAL_ABORTED:
+        /* another search found an improved fit */
+        break;
       default:
         isis_vmesg (FAIL, I_INTERNAL, __FILE__, __LINE__, "find_limit: invalid status for parameter %d", idx);
         break;
@@ -556,7 +599,7 @@ int get_confidence_limits (Fit_Object_Type *fo, Param_t *pt, Isis_Fit_CLC_Type *
    /* Search for the lower limit */
    pstart = 0.5 * (pbest + par_info->min);
 
-   ret = find_limit (&conf_min, idx, pstart, par_info->min, pbest, &sinfo, fo, pt, "Lower");
+   ret = find_limit (&conf_min, idx, pstart, par_info->min, pbest, &sinfo, fo, pt, "Lower", NULL);
    if (ret == EVAL_ERROR || ret == EVAL_FAILED)
      goto restore_old_params;
    else if (ret == EVAL_IMPROVED)
@@ -576,7 +619,7 @@ int get_confidence_limits (Fit_Object_Type *fo, Param_t *pt, Isis_Fit_CLC_Type *
    if (pstart >= par_info->max)
      pstart = 0.5 * (pbest + par_info->max);
 
-   ret = find_limit (&conf_max, idx, pstart, par_info->max, pbest, &sinfo, fo, pt, "Upper");
+   ret = find_limit (&conf_max, idx, pstart, par_info->max, pbest, &sinfo, fo, pt, "Upper", NULL);
    if (ret == EVAL_ERROR || ret == EVAL_FAILED)
      goto restore_old_params;
    else if (ret == EVAL_IMPROVED)
@@ -613,5 +656,1064 @@ int get_confidence_limits (Fit_Object_Type *fo, Param_t *pt, Isis_Fit_CLC_Type *
 
 /*}}}*/
 
+/*{{{ parallel confidence limits */
+
+/* Searches for the lower and upper limits of several parameters
+ * run concurrently in forked workers.  If any search finds an
+ * improved fit, the others are stopped, the best improved fit is
+ * adopted and all the searches restart from there.  A search that
+ * fails is retried after re-fitting, up to max_param_retries times
+ * per parameter, and at most max_restarts restarts are made overall.
+ */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct
+{
+   Fit_Object_Type *fo;
+   double *base;
+   double *h;
+   int nv;
+}
+Hess_Task_Type;
+
+typedef struct
+{
+   Fit_Object_Type *fo;
+   Param_t *pt;
+   Isis_Fit_CLC_Type *ctrl;
+   int *idx;
+   Fit_Param_t *start;
+   double min_stat;
+   double **covar;
+   int *vary_idx;
+   int nv;
+   double *slope;
+}
+Conf_Task_Type;
+
+static int Local_Restart_Flag;
+
+static volatile int *new_restart_flag (void) /*{{{*/
+{
+   volatile int *flag = &Local_Restart_Flag;
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+   /* shared with the forked workers */
+   void *m = mmap (NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (m != MAP_FAILED)
+     flag = (volatile int *) m;
+#endif
+
+   *flag = 0;
+   return flag;
+}
+
+/*}}}*/
+
+static void free_restart_flag (volatile int *flag) /*{{{*/
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+   if ((flag != NULL) && (flag != &Local_Restart_Flag))
+     (void) munmap ((void *) flag, sizeof(int));
+#else
+   (void) flag;
+#endif
+}
+
+/*}}}*/
+
+/* Tasks 0 ... 2*nv-1 evaluate the diagonal points p_i +/- h_i,
+ * the remaining tasks evaluate 4 corners for each pair i < j.
+ */
+static void hess_offsets (int nv, unsigned int task, /*{{{*/
+                          int *i, int *j, double *si, double *sj)
+{
+   unsigned int u, pair;
+   int n;
+
+   if (task < (unsigned int) (2*nv))
+     {
+        *i = task / 2;
+        *si = (task & 1) ? -1.0 : 1.0;
+        *j = -1;
+        *sj = 0.0;
+        return;
+     }
+
+   u = task - 2*nv;
+   pair = u / 4;
+
+   *i = 0;
+   n = nv - 1;
+   while (pair >= (unsigned int) n)
+     {
+        pair -= n;
+        (*i)++;
+        n--;
+     }
+   *j = *i + 1 + pair;
+
+   *si = (u & 2) ? -1.0 : 1.0;
+   *sj = (u & 1) ? -1.0 : 1.0;
+}
+
+/*}}}*/
+
+static int hess_task (void *cl, unsigned int task, double *result) /*{{{*/
+{
+   Hess_Task_Type *ht = (Hess_Task_Type *) cl;
+   Fit_Param_t *par = ht->fo->info->par;
+   double si, sj;
+   int i, j, k, status;
+
+   hess_offsets (ht->nv, task, &i, &j, &si, &sj);
+
+   for (k = 0; k < ht->nv; k++)
+     par->par[k] = ht->base[k];
+   par->par[i] += si * ht->h[i];
+   if (j >= 0)
+     par->par[j] += sj * ht->h[j];
+
+   status = fit_statistic (ht->fo, 0, result, NULL);
+
+   for (k = 0; k < ht->nv; k++)
+     par->par[k] = ht->base[k];
+
+   return status;
+}
+
+/*}}}*/
+
+/* Estimate the covariance matrix of the variable parameters as
+ * twice the inverse of the finite-difference Hessian of the
+ * fit-statistic about its minimum, stat0.
+ */
+static double **estimate_covariance (Fit_Object_Type *fo, double stat0, /*{{{*/
+                                     unsigned int num_workers)
+{
+   Fit_Param_t *par = fo->info->par;
+   Hess_Task_Type ht;
+   double **covar = NULL;
+   double *stat = NULL;
+   unsigned int num_tasks;
+   int i, j, nv, ok = 0;
+
+   nv = par->npars;
+   if (nv <= 0)
+     return NULL;
+
+   ht.fo = fo;
+   ht.nv = nv;
+   ht.base = (double *) ISIS_MALLOC (2 * nv * sizeof(double));
+   if (ht.base == NULL)
+     return NULL;
+   ht.h = ht.base + nv;
+
+   for (i = 0; i < nv; i++)
+     {
+        double p = par->par[i];
+        double h = par->step[i];
+
+        if (h <= 0.0)
+          h = par->relstep[i] * fabs(p);
+        if (h <= 0.0)
+          h = 1.e-4 * ((p != 0.0) ? fabs(p) : 1.0);
+
+        if (p - h < par->par_min[i]) h = p - par->par_min[i];
+        if (p + h > par->par_max[i]) h = par->par_max[i] - p;
+        if (h <= 0.0)
+          goto finish;
+
+        ht.base[i] = p;
+        ht.h[i] = h;
+     }
+
+   num_tasks = 2*nv + 2*nv*(nv-1);
+
+   if ((NULL == (stat = (double *) ISIS_MALLOC (num_tasks * sizeof(double))))
+       || (NULL == (covar = JDMdouble_matrix (nv, nv))))
+     goto finish;
+
+   if (-1 == isis_fork_map (num_tasks, 1, num_workers, &hess_task, (void *) &ht, stat))
+     goto finish;
+
+   for (i = 0; i < nv; i++)
+     {
+        double *s = stat + 2*i;
+        covar[i][i] = (s[0] - 2*stat0 + s[1]) / (ht.h[i] * ht.h[i]);
+     }
+
+   num_tasks = 2*nv;
+   for (i = 0; i < nv; i++)
+     {
+        for (j = i+1; j < nv; j++)
+          {
+             double *s = stat + num_tasks;
+             covar[i][j] = (s[0] - s[1] - s[2] + s[3]) / (4 * ht.h[i] * ht.h[j]);
+             covar[j][i] = covar[i][j];
+             num_tasks += 4;
+          }
+     }
+
+   /* stat ~ stat0 + (1/2) dp^T H dp,  covariance = 2 H^{-1} */
+   if (-1 == JDM_ludecomp_inverse (covar, nv))
+     goto finish;
+
+   for (i = 0; i < nv; i++)
+     {
+        for (j = 0; j < nv; j++)
+          covar[i][j] *= 2.0;
+        if ((covar[i][i] <= 0.0) || (0 == isfinite (covar[i][i])))
+          goto finish;
+     }
+
+   ok = 1;
+   finish:
+   if (ok == 0)
+     {
+        JDMfree_double_matrix (covar, nv);
+        covar = NULL;
+     }
+   ISIS_FREE (stat);
+   ISIS_FREE (ht.base);
+
+   return covar;
+}
+
+/*}}}*/
+
+/* Builds slope[i] = d(par[i])/d(param idx) for the variable
+ * parameters that remain when param idx is frozen and returns
+ * the covariance estimate of the confidence limit offset.
+ */
+static double covariance_slope (Conf_Task_Type *ct, int idx, double *slope) /*{{{*/
+{
+   Fit_Param_t *par = ct->fo->info->par;
+   double cqq;
+   int i, j, q;
+
+   for (q = 0; q < ct->nv; q++)
+     {
+        if (ct->vary_idx[q] == idx)
+          break;
+     }
+   if (q == ct->nv)
+     return -1.0;
+
+   cqq = ct->covar[q][q];
+   if (cqq <= 0.0)
+     return -1.0;
+
+   for (i = 0; i < par->npars; i++)
+     {
+        slope[i] = 0.0;
+        for (j = 0; j < ct->nv; j++)
+          {
+             if (ct->vary_idx[j] == par->idx[i])
+               {
+                  slope[i] = ct->covar[j][q] / cqq;
+                  break;
+               }
+          }
+     }
+
+   return sqrt (ct->ctrl->delta_stat * cqq);
+}
+
+/*}}}*/
+
+/* Task 2k searches for the lower limit of param idx[k],
+ * task 2k+1 for its upper limit.  The result vector holds
+ * the status, the limit and, if the search found an improved
+ * fit, the values of all the parameters.
+ */
+static int conf_task (void *cl, unsigned int task, double *result) /*{{{*/
+{
+   Conf_Task_Type *ct = (Conf_Task_Type *) cl;
+   Fit_Object_Type *fo = ct->fo;
+   Param_t *pt = ct->pt;
+   int idx = ct->idx[task / 2];
+   int upper = task & 1;
+   Search_Info_Type sinfo;
+   Param_Info_t *p;
+   Fit_Param_t *all = NULL;
+   double *slope = NULL;
+   double pbest, prange, pstart, sigma, limit;
+   unsigned int freeze;
+   int i, status = EVAL_ERROR;
+
+   result[0] = EVAL_ERROR;
+   result[1] = 0.0;
+
+   if (NULL == (p = Fit_param_info (pt, idx)))
+     return 0;
+
+   if (-1 == Fit_unpack_all_params (pt, ct->start->par))
+     return 0;
+
+   freeze = p->freeze;
+   Fit_set_freeze (pt, idx, 1);
+   Fit_get_param_value (pt, idx, &pbest);
+   limit = pbest;
+
+   if (-1 == fit_object_config (fo, pt, 1))
+     goto finish;
+
+   sinfo.min_chisqr = ct->min_stat;
+   sinfo.delt = ct->ctrl->delta_stat;
+   sinfo.tolerance = ct->ctrl->tol;
+
+   prange = upper ? p->max : p->min;
+   pstart = 0.5 * (pbest + prange);
+
+   if (ct->covar != NULL)
+     {
+        slope = ct->slope;
+        sigma = covariance_slope (ct, idx, slope);
+        if (sigma > 0.0)
+          {
+             /* start just outside the expected limit so the
+              * first step brackets it */
+             double ptest = upper ? pbest + 1.25*sigma : pbest - 1.25*sigma;
+             if ((p->min < ptest) && (ptest < p->max))
+               pstart = ptest;
+          }
+        else slope = NULL;
+     }
+
+   if (ct->ctrl->verbose > 0)
+     verbose_warn_hook (NULL, "Best fit par[%d]= %15.8e: stat=%15.8e\n",
+                        idx, pbest, sinfo.min_chisqr);
+
+   status = find_limit (&limit, idx, pstart, prange, pbest, &sinfo, fo, pt,
+                        upper ? "Upper" : "Lower", slope);
+
+   if (status == EVAL_IMPROVED)
+     {
+        /* stop the other searches */
+        if (Conf_Restart_Flag != NULL)
+          *Conf_Restart_Flag = 1;
+
+        Fit_set_freeze (pt, idx, freeze);
+        if ((NULL != (all = new_fit_param_type (ct->start->npars)))
+            && (0 == Fit_pack_all_params (pt, all))
+            && (all->npars == ct->start->npars))
+          {
+             for (i = 0; i < all->npars; i++)
+               result[2+i] = all->par[i];
+          }
+        else status = EVAL_ERROR;
+        free_fit_param_type (all);
+     }
+
+   finish:
+   Fit_set_freeze (pt, idx, freeze);
+   (void) Fit_unpack_all_params (pt, ct->start->par);
+
+   result[0] = status;
+   result[1] = limit;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int validate_conf_params (Param_t *pt, int *idx, unsigned int n) /*{{{*/
+{
+   unsigned int k;
+
+   for (k = 0; k < n; k++)
+     {
+        Param_Info_t *p;
+        double value;
+
+        if (NULL == (p = get_valid_param_info (pt, idx[k])))
+          return -1;
+
+        if (p->freeze != 0)
+          {
+             isis_vmesg (INTR, I_WARNING, __FILE__, __LINE__, "parameter %d is frozen", idx[k]);
+             return -1;
+          }
+
+        if ((0 != Fit_get_param_value (pt, idx[k], &value))
+            || (0 == isfinite (value)))
+          {
+             isis_vmesg (INTR, I_ERROR, __FILE__, __LINE__, "parameter %d has an invalid value", idx[k]);
+             return -1;
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Evaluates the fit-statistic for a packed set of all the parameters */
+static int candidate_statistic (Fit_Object_Type *fo, Param_t *pt, double *all_par, double *stat) /*{{{*/
+{
+   if ((-1 == Fit_unpack_all_params (pt, all_par))
+       || (-1 == fit_object_config (fo, pt, 1))
+       || (-1 == fit_statistic (fo, 0, stat, NULL)))
+     return -1;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* covar, if non-NULL, is an nv_covar x nv_covar covariance matrix of
+ * the variable parameters at the current best fit, stored by rows.
+ * Otherwise, the covariance matrix is estimated numerically.
+ */
+int get_confidence_limits_parallel (Fit_Object_Type *fo, Param_t *pt, /*{{{*/
+                                    Isis_Fit_CLC_Type *ctrl, int *idx, unsigned int n,
+                                    double *covar, unsigned int nv_covar,
+                                    unsigned int num_workers,
+                                    int max_restarts, int max_param_retries,
+                                    double *pconf_min, double *pconf_max)
+{
+   Conf_Task_Type ct;
+   Fit_Param_t *initial_pars = NULL;
+   double *results = NULL;
+   int *num_retries = NULL;
+   unsigned int k, result_size = 0;
+   int num_all, num_vary, round = 0;
+   int ret = -1;
+
+   memset ((char *)&ct, 0, sizeof ct);
+
+   if ((fo == NULL) || (ctrl == NULL) || (idx == NULL) || (n == 0)
+       || (pconf_min == NULL) || (pconf_max == NULL))
+     return -1;
+
+   if (-1 == validate_conf_params (pt, idx, n))
+     return -1;
+
+   for (k = 0; k < n; k++)
+     {
+        Fit_get_param_value (pt, idx[k], &pconf_min[k]);
+        pconf_max[k] = pconf_min[k];
+     }
+
+   if (-1 == Fit_count_params (pt, &num_all, &num_vary))
+     return -1;
+
+   init_verbose_hook ();
+
+   result_size = 2 + num_all;
+
+   if ((NULL == (initial_pars = new_fit_param_type (num_all)))
+       || (NULL == (ct.start = new_fit_param_type (num_all)))
+       || (NULL == (ct.vary_idx = (int *) ISIS_MALLOC (num_all * sizeof(int))))
+       || (NULL == (ct.slope = (double *) ISIS_MALLOC (num_all * sizeof(double))))
+       || (NULL == (results = (double *) ISIS_MALLOC (2 * n * result_size * sizeof(double))))
+       || (NULL == (num_retries = (int *) ISIS_MALLOC (n * sizeof(int)))))
+     goto finish;
+
+   memset ((char *)num_retries, 0, n * sizeof(int));
+
+   if (-1 == Fit_pack_all_params (pt, initial_pars))
+     goto finish;
+
+   ct.fo = fo;
+   ct.pt = pt;
+   ct.ctrl = ctrl;
+   ct.idx = idx;
+
+   Conf_Restart_Flag = new_restart_flag ();
+
+   for (round = 0; round <= max_restarts; round++)
+     {
+        Fit_Param_t *par;
+        double best_stat;
+        int best = -1, retry = 0;
+
+        if ((-1 == fit_object_config (fo, pt, 1))
+            || (-1 == fit_statistic (fo, 0, &ct.min_stat, NULL))
+            || (-1 == Fit_pack_all_params (pt, ct.start)))
+          goto finish;
+
+        par = fo->info->par;
+        ct.nv = par->npars;
+        for (k = 0; k < (unsigned int) ct.nv; k++)
+          ct.vary_idx[k] = par->idx[k];
+
+        if ((round == 0) && (covar != NULL) && (nv_covar == (unsigned int) ct.nv))
+          {
+             if (NULL == (ct.covar = JDMdouble_matrix (ct.nv, ct.nv)))
+               goto finish;
+             for (k = 0; k < (unsigned int) (ct.nv * ct.nv); k++)
+               ct.covar[k / ct.nv][k % ct.nv] = covar[k];
+          }
+        else
+          {
+             if ((round == 0) && (covar != NULL))
+               isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__,
+                           "covariance matrix size does not match %d variable parameters; ignoring it",
+                           ct.nv);
+             ct.covar = estimate_covariance (fo, ct.min_stat, num_workers);
+          }
+
+        *Conf_Restart_Flag = 0;
+
+        if (-1 == isis_fork_map (2*n, result_size, num_workers, &conf_task, (void *) &ct, results))
+          goto finish;
+
+        JDMfree_double_matrix (ct.covar, ct.nv);
+        ct.covar = NULL;
+
+        /* Of the improved fits, adopt the best one */
+        best_stat = ct.min_stat;
+        for (k = 0; k < 2*n; k++)
+          {
+             double *r = results + k * result_size;
+             double stat;
+
+             if ((int) r[0] != EVAL_IMPROVED)
+               continue;
+
+             if ((0 == candidate_statistic (fo, pt, r + 2, &stat))
+                 && (stat < best_stat))
+               {
+                  best_stat = stat;
+                  best = k;
+               }
+          }
+
+        if (best < 0)
+          {
+             /* As in the serial search, a parameter whose search
+              * failed gets a re-fit and another try */
+             for (k = 0; k < n; k++)
+               {
+                  int lo = (int) results[(2*k) * result_size];
+                  int hi = (int) results[(2*k+1) * result_size];
+
+                  if (num_retries[k] >= max_param_retries)
+                    continue;
+
+                  if (((lo != EVAL_OK) && (lo != EVAL_INVALID))
+                      || ((hi != EVAL_OK) && (hi != EVAL_INVALID)))
+                    {
+                       num_retries[k]++;
+                       retry = 1;
+                    }
+               }
+          }
+
+        if ((best < 0) && (retry == 0))
+          {
+             for (k = 0; k < 2*n; k++)
+               {
+                  double *r = results + k * result_size;
+                  int status = (int) r[0];
+                  double *limit = (k & 1) ? &pconf_max[k/2] : &pconf_min[k/2];
+
+                  if ((status == EVAL_OK) || (status == EVAL_INVALID))
+                    *limit = r[1];
+                  else
+                    {
+                       /* out of retries:  don't pass the best-fit
+                        * value off as a limit */
+                       *limit = isis_nan ();
+                       isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__,
+                                   "%s limit search for parameter %d did not finish",
+                                   (k & 1) ? "upper" : "lower", idx[k/2]);
+                    }
+               }
+             (void) Fit_unpack_all_params (pt, ct.start->par);
+             ret = 0;
+             break;
+          }
+
+        if (best < 0)
+          {
+             verbose_warn_hook (NULL, "**** Confidence limit search failed; re-fitting and restarting\n");
+             if (-1 == Fit_unpack_all_params (pt, ct.start->par))
+               goto finish;
+          }
+        else
+          {
+             verbose_warn_hook (NULL, "**** Found improved fit, stat= %0.6g; restarting confidence limit searches\n",
+                                best_stat);
+             if (-1 == Fit_unpack_all_params (pt, results + best * result_size + 2))
+               goto finish;
+          }
+
+        if ((-1 == fit_object_config (fo, pt, 1))
+            || (-1 == fit_statistic (fo, 1, &best_stat, NULL))
+            || (-1 == Fit_unpack_variable_params (pt, fo->info->par->par)))
+          goto finish;
+
+        for (k = 0; k < n; k++)
+          {
+             Fit_get_param_value (pt, idx[k], &pconf_min[k]);
+             pconf_max[k] = pconf_min[k];
+          }
+     }
+
+   if (round > max_restarts)
+     isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__,
+                 "confidence limit search kept restarting; giving up after %d restarts",
+                 max_restarts);
+
+   finish:
+   /* If no improved fit was adopted, restore the initial state */
+   if ((ret != 0) && (round == 0)
+       && (initial_pars != NULL) && (initial_pars->npars == num_all))
+     (void) Fit_unpack_all_params (pt, initial_pars->par);
+
+   /* Evaluate the model once more to leave it consistent
+    * with the parameter values */
+   if (0 == fit_object_config (fo, pt, 1))
+     {
+        double not_used;
+        (void) fit_statistic (fo, 0, &not_used, NULL);
+     }
+
+   free_restart_flag (Conf_Restart_Flag);
+   Conf_Restart_Flag = NULL;
+
+   if (ct.covar != NULL)
+     JDMfree_double_matrix (ct.covar, ct.nv);
+   deinit_verbose_hook ();
+   free_fit_param_type (initial_pars);
+   free_fit_param_type (ct.start);
+   ISIS_FREE (ct.vary_idx);
+   ISIS_FREE (ct.slope);
+   ISIS_FREE (results);
+   ISIS_FREE (num_retries);
+
+   return ret;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*{{{ confidence maps */
+
+/* The grid is swept as a wavefront moving out from the grid point
+ * nearest the best fit.  Each fit starts from the parameters of
+ * its best finished neighbor, and grid points are handed out to
+ * the workers as they become ready.  The pending points next to a
+ * finished one are kept in a heap ordered by distance from the
+ * seed point, which map_done updates.
+ */
+
+enum
+{
+   MAP_PENDING = 0,
+   MAP_RUNNING = 1,
+   MAP_DONE    = 2,
+   MAP_SKIP    = 3,
+   MAP_QUEUED  = 4      /* pending, and in the frontier heap */
+};
+
+typedef struct
+{
+   Fit_Object_Type *fo;
+   Param_t *pt;
+   Isis_Conf_Map_Type *m;
+   Fit_Param_t *all;
+   unsigned char *state;
+   unsigned char *have_pars;
+   unsigned int *heap;              /* frontier, nearest the seed first */
+   unsigned int heap_len;
+   double *pars;
+   double *best_pars;
+   unsigned int num_all;
+   unsigned int seed_x, seed_y;
+   unsigned int num_since_save;
+}
+Conf_Map_Type;
+
+static unsigned int nearest_grid_point (double *x, unsigned int n, double v) /*{{{*/
+{
+   unsigned int i, k = 0;
+
+   for (i = 1; i < n; i++)
+     {
+        if (fabs(x[i] - v) < fabs(x[k] - v))
+          k = i;
+     }
+
+   return k;
+}
+
+/*}}}*/
+
+/* Returns the index of the finished neighbor of grid point k with the
+ * lowest fit-statistic and known parameters, -1 if there is none,
+ * or -2 if the only finished neighbors have no parameters
+ * (e.g. they were loaded from an earlier run).
+ */
+static int best_neighbor (Conf_Map_Type *cm, unsigned int k) /*{{{*/
+{
+   Isis_Conf_Map_Type *m = cm->m;
+   unsigned int i = k % m->nx, j = k / m->nx;
+   unsigned int ii, jj;
+   int best = -1;
+
+   for (jj = (j > 0) ? j-1 : 0; (jj <= j+1) && (jj < m->ny); jj++)
+     {
+        for (ii = (i > 0) ? i-1 : 0; (ii <= i+1) && (ii < m->nx); ii++)
+          {
+             unsigned int n = jj * m->nx + ii;
+
+             if ((n == k) || (cm->state[n] != MAP_DONE))
+               continue;
+
+             if (cm->have_pars[n] == 0)
+               {
+                  if (best == -1) best = -2;
+                  continue;
+               }
+
+             if ((best < 0) || (m->map[n] < m->map[best]))
+               best = n;
+          }
+     }
+
+   return best;
+}
+
+/*}}}*/
+
+static unsigned int seed_distance (Conf_Map_Type *cm, unsigned int k) /*{{{*/
+{
+   unsigned int di = k % cm->m->nx, dj = k / cm->m->nx;
+
+   di = (di > cm->seed_x) ? di - cm->seed_x : cm->seed_x - di;
+   dj = (dj > cm->seed_y) ? dj - cm->seed_y : cm->seed_y - dj;
+
+   return (di > dj) ? di : dj;
+}
+
+/*}}}*/
+
+/* heap order:  nearest the seed first, then lowest index */
+static int heap_before (Conf_Map_Type *cm, unsigned int a, unsigned int b) /*{{{*/
+{
+   unsigned int da = seed_distance (cm, a), db = seed_distance (cm, b);
+
+   if (da != db)
+     return da < db;
+
+   return a < b;
+}
+
+/*}}}*/
+
+static void frontier_push (Conf_Map_Type *cm, unsigned int k) /*{{{*/
+{
+   unsigned int *h = cm->heap;
+   unsigned int i = cm->heap_len++;
+
+   while (i > 0)
+     {
+        unsigned int parent = (i - 1) / 2;
+        if (0 == heap_before (cm, k, h[parent]))
+          break;
+        h[i] = h[parent];
+        i = parent;
+     }
+   h[i] = k;
+
+   cm->state[k] = MAP_QUEUED;
+}
+
+/*}}}*/
+
+static unsigned int frontier_pop (Conf_Map_Type *cm) /*{{{*/
+{
+   unsigned int *h = cm->heap;
+   unsigned int top = h[0], last, i, n;
+
+   n = --cm->heap_len;
+   last = h[n];
+   i = 0;
+
+   for (;;)
+     {
+        unsigned int c = 2*i + 1;
+        if (c >= n)
+          break;
+        if ((c + 1 < n) && heap_before (cm, h[c+1], h[c]))
+          c++;
+        if (0 == heap_before (cm, h[c], last))
+          break;
+        h[i] = h[c];
+        i = c;
+     }
+   if (n > 0)
+     h[i] = last;
+
+   return top;
+}
+
+/*}}}*/
+
+/* Queue the pending neighbors of grid point k */
+static void frontier_add_neighbors (Conf_Map_Type *cm, unsigned int k) /*{{{*/
+{
+   Isis_Conf_Map_Type *m = cm->m;
+   unsigned int i = k % m->nx, j = k / m->nx;
+   unsigned int ii, jj;
+
+   for (jj = (j > 0) ? j-1 : 0; (jj <= j+1) && (jj < m->ny); jj++)
+     {
+        for (ii = (i > 0) ? i-1 : 0; (ii <= i+1) && (ii < m->nx); ii++)
+          {
+             unsigned int n = jj * m->nx + ii;
+             if (cm->state[n] == MAP_PENDING)
+               frontier_push (cm, n);
+          }
+     }
+}
+
+/*}}}*/
+
+static int map_next (void *cl, unsigned int num_busy, unsigned int *task, double *input) /*{{{*/
+{
+   Conf_Map_Type *cm = (Conf_Map_Type *) cl;
+   Isis_Conf_Map_Type *m = cm->m;
+   unsigned int k, num = m->nx * m->ny;
+   unsigned int dist, min_pending_dist = UINT_MAX;
+   int from = -1, pick = -1;
+
+   if (cm->heap_len > 0)
+     {
+        pick = frontier_pop (cm);
+        from = best_neighbor (cm, pick);
+     }
+   else
+     {
+        /* Nothing is next to a finished grid point.  Wait for
+         * the busy workers, if any, else start a new front. */
+        if (num_busy > 0)
+          return 0;
+
+        for (k = 0; k < num; k++)
+          {
+             if (cm->state[k] != MAP_PENDING)
+               continue;
+             dist = seed_distance (cm, k);
+             if (dist < min_pending_dist)
+               {
+                  min_pending_dist = dist;
+                  pick = k;
+               }
+          }
+        if (pick < 0)
+          return -1;
+        from = -1;
+     }
+
+   if (from >= 0)
+     memcpy ((char *)input, (char *)(cm->pars + from * cm->num_all), cm->num_all * sizeof(double));
+   else
+     memcpy ((char *)input, (char *)cm->best_pars, cm->num_all * sizeof(double));
+
+   cm->state[pick] = MAP_RUNNING;
+   *task = pick;
+
+   return 1;
+}
+
+/*}}}*/
+
+/* result = [statistic, all parameters] */
+static int map_work (void *cl, unsigned int task, double *input, double *result) /*{{{*/
+{
+   Conf_Map_Type *cm = (Conf_Map_Type *) cl;
+   Isis_Conf_Map_Type *m = cm->m;
+   Fit_Object_Type *fo = cm->fo;
+   Param_t *pt = cm->pt;
+   Param_Info_t *px, *py;
+   unsigned int freeze_x, freeze_y, i;
+   int num_all, num_vary;
+   double stat;
+
+   if ((NULL == (px = Fit_param_info (pt, m->ix)))
+       || (NULL == (py = Fit_param_info (pt, m->iy))))
+     return -1;
+
+   if (-1 == Fit_unpack_all_params (pt, input))
+     return -1;
+
+   freeze_x = px->freeze;
+   freeze_y = py->freeze;
+   Fit_set_param_value (pt, m->ix, m->xs[task % m->nx]);
+   Fit_set_param_value (pt, m->iy, m->ys[task / m->nx]);
+   Fit_set_freeze (pt, m->ix, 1);
+   Fit_set_freeze (pt, m->iy, 1);
+
+   stat = isis_nan ();
+
+   if (0 == Fit_count_params (pt, &num_all, &num_vary))
+     {
+        if (num_vary > 0)
+          {
+             if ((0 == fit_object_config (fo, pt, 1))
+                 && (0 == fit_statistic (fo, 1, &stat, NULL)))
+               (void) Fit_unpack_variable_params (pt, fo->info->par->par);
+          }
+        else if (0 == fit_object_config (fo, pt, 0))
+          (void) fit_statistic (fo, 0, &stat, NULL);
+     }
+
+   result[0] = stat;
+   if ((0 == Fit_pack_all_params (pt, cm->all))
+       && ((unsigned int) cm->all->npars == cm->num_all))
+     {
+        for (i = 0; i < cm->num_all; i++)
+          result[1+i] = cm->all->par[i];
+     }
+   else
+     {
+        for (i = 0; i < cm->num_all; i++)
+          result[1+i] = input[i];
+     }
+
+   Fit_set_freeze (pt, m->ix, freeze_x);
+   Fit_set_freeze (pt, m->iy, freeze_y);
+   (void) Fit_unpack_all_params (pt, cm->best_pars);
+
+   return 0;
+}
+
+/*}}}*/
+
+static int map_done (void *cl, unsigned int task, double *result) /*{{{*/
+{
+   Conf_Map_Type *cm = (Conf_Map_Type *) cl;
+   Isis_Conf_Map_Type *m = cm->m;
+
+   m->map[task] = result[0];
+   cm->state[task] = MAP_DONE;
+   frontier_add_neighbors (cm, task);
+
+   if (isfinite (result[0]))
+     {
+        memcpy ((char *)(cm->pars + task * cm->num_all), (char *)(result + 1),
+                cm->num_all * sizeof(double));
+        cm->have_pars[task] = 1;
+     }
+
+   cm->num_since_save++;
+   if ((m->save != NULL) && (m->save_interval > 0)
+       && (cm->num_since_save >= m->save_interval))
+     {
+        cm->num_since_save = 0;
+        if (-1 == (*m->save)(m->save_cl, m->map))
+          return -1;
+     }
+
+   return 0;
+}
+
 /*}}}*/
 
+/* On input, grid points with non-NaN map values are taken as
+ * already computed (e.g. by an interrupted run) and are kept.
+ */
+int conf_map_grid (Fit_Object_Type *fo, Param_t *pt, Isis_Conf_Map_Type *m) /*{{{*/
+{
+   Conf_Map_Type cm;
+   unsigned int k, num, num_tasks = 0;
+   int num_all, num_vary;
+   double x, y;
+   int ret = -1;
+
+   if ((fo == NULL) || (m == NULL) || (m->map == NULL)
+       || (m->xs == NULL) || (m->ys == NULL)
+       || (m->nx == 0) || (m->ny == 0))
+     return -1;
+
+   memset ((char *)&cm, 0, sizeof cm);
+
+   if ((0 != Fit_get_param_value (pt, m->ix, &x))
+       || (0 != Fit_get_param_value (pt, m->iy, &y)))
+     return -1;
+
+   if (-1 == Fit_count_params (pt, &num_all, &num_vary))
+     return -1;
+
+   num = m->nx * m->ny;
+   cm.fo = fo;
+   cm.pt = pt;
+   cm.m = m;
+   cm.num_all = num_all;
+   cm.seed_x = nearest_grid_point (m->xs, m->nx, x);
+   cm.seed_y = nearest_grid_point (m->ys, m->ny, y);
+
+   if ((NULL == (cm.all = new_fit_param_type (num_all)))
+       || (NULL == (cm.best_pars = (double *) ISIS_MALLOC (num_all * sizeof(double))))
+       || (NULL == (cm.pars = (double *) ISIS_MALLOC (num * num_all * sizeof(double))))
+       || (NULL == (cm.state = (unsigned char *) ISIS_MALLOC (num))))
+     goto finish;
+   if ((NULL == (cm.have_pars = (unsigned char *) ISIS_MALLOC (num)))
+       || (NULL == (cm.heap = (unsigned int *) ISIS_MALLOC (num * sizeof(unsigned int)))))
+     goto finish;
+
+   if (-1 == Fit_pack_all_params (pt, cm.all))
+     goto finish;
+   memcpy ((char *)cm.best_pars, (char *)cm.all->par, num_all * sizeof(double));
+
+   memset ((char *)cm.have_pars, 0, num);
+   for (k = 0; k < num; k++)
+     {
+        if ((m->skip != NULL) && m->skip[k])
+          cm.state[k] = MAP_SKIP;
+        else if (0 == isnan (m->map[k]))
+          cm.state[k] = MAP_DONE;
+        else
+          {
+             cm.state[k] = MAP_PENDING;
+             num_tasks++;
+          }
+     }
+
+   /* the seed point, and any next to points already computed */
+   k = cm.seed_y * m->nx + cm.seed_x;
+   if (cm.state[k] == MAP_PENDING)
+     frontier_push (&cm, k);
+   for (k = 0; k < num; k++)
+     {
+        if (cm.state[k] == MAP_DONE)
+          frontier_add_neighbors (&cm, k);
+     }
+
+   ret = isis_fork_queue (num_tasks, num_all, 1 + num_all, m->num_workers,
+                          &map_next, &map_work, &map_done, (void *) &cm);
+
+   if ((m->save != NULL) && (cm.num_since_save > 0))
+     {
+        if (-1 == (*m->save)(m->save_cl, m->map))
+          ret = -1;
+     }
+
+   finish:
+   (void) Fit_unpack_all_params (pt, cm.best_pars);
+
+   free_fit_param_type (cm.all);
+   ISIS_FREE (cm.best_pars);
+   ISIS_FREE (cm.pars);
+   ISIS_FREE (cm.state);
+   ISIS_FREE (cm.have_pars);
+   ISIS_FREE (cm.heap);
+
+   return ret;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*}}}*/
@@ -108,9 +108,85 @@ struct Cached_Grid_Type
    unsigned int updated_cached_model_values;  /* boolean */
 };
 
+enum
+{
+   DEPS_NONE = 0,
+   DEPS_RECORDING = 1,
+   DEPS_VALID = 2
+};
+
+/* per-dataset scratch space reused across model evaluations */
+typedef struct
+{
+   double *cts;            /* full-resolution counts (+ opt_data bkg) */
+   double *model;          /* noticed model values + eval workspace */
+   double *rebin;          /* rebinned counts */
+   double *kernel_params;
+   unsigned int cts_size;
+   unsigned int model_size;
+   unsigned int rebin_size;
+   unsigned int num_kernel_params;
+
+   /* Function instances read while computing last_model,
+    * stored as (fun_type, fun_id, num_params) triples,
+    * and the parameter values they had at the time.
+    */
+   unsigned int *deps;
+   double *dep_values;
+   double *last_model;
+   unsigned int num_deps, max_deps;
+   unsigned int num_dep_values, max_dep_values;
+   unsigned int last_model_size;
+   unsigned int model_serial;
+   unsigned int response_serial;
+   int dep_status;
+   int with_opt_data;
+}
+Fit_Workspace_t;
+
+enum
+{
+   DERIV_OFF = 0,
+   DERIV_RECORD = 1,
+   DERIV_APPLY = 2
+};
+
+/* One evaluation of a fit-function instance, together with its
+ * derivatives with respect to those of its parameters that vary.
+ */
+typedef struct
+{
+   unsigned int fun_type;
+   unsigned int fun_id;
+   unsigned int num_bins;
+   unsigned int num_derivs;
+   unsigned int *vary_idx;     /* derivative j is for vary_idx[j] */
+   double *val;                /* num_bins * (1 + num_derivs) */
+}
+Deriv_Component_t;
+
+/* While recording, each component evaluation is saved.  While
+ * applying, the saved values are replayed in the same order,
+ * with the target parameter's derivative added to them.
+ */
+typedef struct
+{
+   int mode;
+   int failed;
+   Param_Info_t **vary;
+   unsigned int num_vary;
+   Deriv_Component_t *comps;
+   unsigned int num_comps, max_comps;
+   unsigned int next_comp;
+   unsigned int target;
+   double step;
+}
+Deriv_Record_t;
+
 struct Fit_Data_t
 {
    Hist_t **datasets;
+   Fit_Workspace_t *ws;
    int *offsets;
    int *offset_for_marked;
    Cached_Grid_Type *cache;
@@ -130,6 +206,8 @@ static SLang_Name_Type *Fit_Constraint;
 static SLang_Name_Type *Fit_Range_Hook;
 static SLang_Name_Type *Define_Model_Hook;
 static Fit_Data_t *Current_Fit_Data_Info;
+static Fit_Workspace_t *Dependency_Record;
+static Deriv_Record_t Deriv_Record;
 
 static Kernel_Table_t _Kernel_Table;
 static Kernel_Table_t *Kernel_Table = &_Kernel_Table;
@@ -142,7 +220,10 @@ static int Fit_Store_Model;
 static int Use_Interactive_Param_Init;
 static int Looking_For_Confidence_Limits;
 static int Computing_Statistic_Only;
+static int Fit_Track_Dependencies;
+static int Fit_Analytic_Derivatives;
 static unsigned int Fit_Data_Type;
+static unsigned int Model_Serial;
 
 /* total number of parameters */
 static unsigned int Num_Params;
@@ -166,6 +247,15 @@ static Isis_Hist_t *get_evaluation_grid (void) /*{{{*/
 
 /*}}}*/
 
+/* For callers about to point the evaluation grid at new arrays */
+static Isis_Hist_t *reset_evaluation_grid (void) /*{{{*/
+{
+   Fit_reset_grid_hash ();
+   return &Eval_Grid;
+}
+
+/*}}}*/
+
 static int map_datasets (int (*fun)(Hist_t *, void *), void *cl) /*{{{*/
 {
    enum {check_exclude = 1};
@@ -1377,13 +1467,256 @@ static int call_fitfun_trace_hook (Fit_Fun_t *ff, int fun_id, double *par) /*{{{
 
 /*}}}*/
 
+static int grow_workspace (double **buf, unsigned int *size, unsigned int need) /*{{{*/
+{
+   double *tmp;
+
+   if (need <= *size)
+     return 0;
+
+   if (NULL == (tmp = (double *) ISIS_REALLOC (*buf, need * sizeof(double))))
+     return -1;
+
+   *buf = tmp;
+   *size = need;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* While a dataset model is being computed, note each function
+ * instance it reads, so that later evaluations can tell whether
+ * the model could have changed.
+ */
+static void record_dependency (unsigned int fun_type, unsigned int fun_id, /*{{{*/
+                               double *par, unsigned int num_params)
+{
+   Fit_Workspace_t *ws = Dependency_Record;
+   unsigned int i, *f;
+
+   if ((ws == NULL) || (ws->dep_status != DEPS_RECORDING))
+     return;
+
+   for (i = 0; i < ws->num_deps; i++)
+     {
+        f = ws->deps + 3*i;
+        if ((f[0] == fun_type) && (f[1] == fun_id))
+          return;
+     }
+
+   if (ws->num_deps == ws->max_deps)
+     {
+        unsigned int max_deps = 2*ws->max_deps + 8;
+        unsigned int *tmp;
+        if (NULL == (tmp = (unsigned int *) ISIS_REALLOC (ws->deps, 3 * max_deps * sizeof(unsigned int))))
+          {
+             ws->dep_status = DEPS_NONE;
+             return;
+          }
+        ws->deps = tmp;
+        ws->max_deps = max_deps;
+     }
+
+   if (num_params > 0)
+     {
+        if (-1 == grow_workspace (&ws->dep_values, &ws->max_dep_values,
+                                  ws->num_dep_values + num_params))
+          {
+             ws->dep_status = DEPS_NONE;
+             return;
+          }
+        memcpy ((char *)(ws->dep_values + ws->num_dep_values), (char *)par,
+                num_params * sizeof(double));
+        ws->num_dep_values += num_params;
+     }
+
+   f = ws->deps + 3*ws->num_deps;
+   f[0] = fun_type;
+   f[1] = fun_id;
+   f[2] = num_params;
+   ws->num_deps++;
+}
+
+/*}}}*/
+
+static void free_deriv_components (Deriv_Record_t *dr) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < dr->num_comps; i++)
+     {
+        ISIS_FREE (dr->comps[i].vary_idx);
+        ISIS_FREE (dr->comps[i].val);
+     }
+
+   dr->num_comps = 0;
+   dr->next_comp = 0;
+}
+
+/*}}}*/
+
+/* The function value is on the stack; save a copy of it
+ * along with its derivatives.  Anything that prevents
+ * replaying the evaluation marks the record as failed.
+ */
+static int record_component (Fit_Fun_t *ff, unsigned int fun_id, Isis_Hist_t *g, /*{{{*/
+                             double *par, unsigned int num_extra_args,
+                             SLang_Struct_Type *qualifiers)
+{
+   Deriv_Record_t *dr = &Deriv_Record;
+   Deriv_Component_t *c;
+   SLang_Array_Type *at = NULL;
+   unsigned int i, k, n;
+
+   if ((dr->mode != DERIV_RECORD) || dr->failed)
+     return 0;
+
+   if ((ff->s.category == ISIS_FUN_OPERATOR)
+       || (num_extra_args > 0) || (qualifiers != NULL)
+       || (g->n_notice <= 0))
+     {
+        dr->failed = 1;
+        return 0;
+     }
+
+   if (dr->num_comps == dr->max_comps)
+     {
+        unsigned int max_comps = 2*dr->max_comps + 8;
+        Deriv_Component_t *tmp;
+        if (NULL == (tmp = (Deriv_Component_t *) ISIS_REALLOC (dr->comps, max_comps * sizeof(Deriv_Component_t))))
+          {
+             dr->failed = 1;
+             return 0;
+          }
+        dr->comps = tmp;
+        dr->max_comps = max_comps;
+     }
+
+   c = &dr->comps[dr->num_comps];
+   memset ((char *)c, 0, sizeof *c);
+   c->fun_type = ff->fun_type;
+   c->fun_id = fun_id;
+   c->num_bins = n = g->n_notice;
+
+   for (k = 0; k < dr->num_vary; k++)
+     {
+        Param_Info_t *p = dr->vary[k];
+        if ((p->fun_type == ff->fun_type) && (p->fun_id == fun_id))
+          c->num_derivs++;
+     }
+
+   if ((c->num_derivs > 0) && (ff->s.binned_deriv == NULL))
+     {
+        dr->failed = 1;
+        return 0;
+     }
+
+   if ((NULL == (c->val = (double *) ISIS_MALLOC (n * (1 + c->num_derivs) * sizeof(double))))
+       || ((c->num_derivs > 0)
+           && (NULL == (c->vary_idx = (unsigned int *) ISIS_MALLOC (c->num_derivs * sizeof(unsigned int))))))
+     {
+        ISIS_FREE (c->val);
+        dr->failed = 1;
+        return 0;
+     }
+   dr->num_comps++;
+
+   if (-1 == SLang_pop_array_of_type (&at, SLANG_DOUBLE_TYPE))
+     return -1;
+
+   if (at->num_elements != n)
+     dr->failed = 1;
+   else
+     memcpy ((char *)c->val, (char *)at->data, n * sizeof(double));
+
+   if (-1 == SLang_push_array (at, 1))
+     return -1;
+
+   i = 0;
+   for (k = 0; (k < dr->num_vary) && (dr->failed == 0); k++)
+     {
+        Param_Info_t *p = dr->vary[k];
+        if ((p->fun_type != ff->fun_type) || (p->fun_id != fun_id))
+          continue;
+        c->vary_idx[i] = k;
+        i++;
+        if (-1 == (*ff->s.binned_deriv)(c->val + i*n, g, par, ff->nparams, p->fun_par))
+          dr->failed = 1;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Returns 1 after pushing the recorded value, 0 if the recorded
+ * sequence doesn't match and the function must be evaluated.
+ */
+static int replay_component (Fit_Fun_t *ff, unsigned int fun_id, Isis_Hist_t *g) /*{{{*/
+{
+   Deriv_Record_t *dr = &Deriv_Record;
+   Deriv_Component_t *c;
+   SLang_Array_Type *at;
+   SLindex_Type n;
+   double *v, *dv = NULL;
+   unsigned int i;
+
+   if (dr->failed)
+     return 0;
+
+   if (dr->next_comp >= dr->num_comps)
+     {
+        dr->failed = 1;
+        return 0;
+     }
+
+   c = &dr->comps[dr->next_comp];
+
+   if ((c->fun_type != ff->fun_type)
+       || (c->fun_id != fun_id)
+       || (c->num_bins != (unsigned int) g->n_notice))
+     {
+        dr->failed = 1;
+        return 0;
+     }
+   dr->next_comp++;
+
+   for (i = 0; i < c->num_derivs; i++)
+     {
+        if (c->vary_idx[i] == dr->target)
+          {
+             dv = c->val + (i+1)*c->num_bins;
+             break;
+          }
+     }
+
+   n = c->num_bins;
+   if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1)))
+     return -1;
+
+   v = (double *)at->data;
+   memcpy ((char *)v, (char *)c->val, n * sizeof(double));
+
+   if (dv != NULL)
+     {
+        for (i = 0; i < c->num_bins; i++)
+          v[i] += dr->step * dv[i];
+     }
+
+   if (-1 == SLang_push_array (at, 1))
+     return -1;
+
+   return 1;
+}
+
+/*}}}*/
+
 static int bin_eval (Fit_Fun_t *ff, unsigned int fun_id, unsigned int num_extra_args, SLang_Struct_Type *qualifiers) /*{{{*/
 {
    double *par = NULL;
    Isis_Hist_t *g;
 
-   (void) num_extra_args;
-
    if ((NULL == ff) || (NULL == ff->fun.c))
      return -1;
 
@@ -1399,6 +1732,15 @@ static int bin_eval (Fit_Fun_t *ff, unsigned int fun_id, unsigned int num_extra_
         return -1;
      }
 
+   if (Deriv_Record.mode == DERIV_APPLY)
+     {
+        int status = replay_component (ff, fun_id, g);
+        if (status == -1)
+          SLang_push_double (1.0);
+        if (status != 0)
+          return (status < 0) ? -1 : 0;
+     }
+
    if (ff->nparams)
      {
         par = (double *) ISIS_MALLOC (ff->nparams * sizeof(double));
@@ -1413,9 +1755,18 @@ static int bin_eval (Fit_Fun_t *ff, unsigned int fun_id, unsigned int num_extra_
      }
    else par = NULL;
 
+   record_dependency (ff->fun_type, fun_id, par, ff->nparams);
+
    if (((ff->trace_hook != NULL)
         && (-1 == call_fitfun_trace_hook (ff, fun_id, par)))
-       || (-1 == (*ff->bin_eval_method)(ff, g, par, qualifiers)))
+       || (-1 == Fit_cached_bin_eval (ff, fun_id, g, par, num_extra_args, qualifiers)))
+     {
+        SLang_push_double (1.0);
+        ISIS_FREE (par);
+        return -1;
+     }
+
+   if (-1 == record_component (ff, fun_id, g, par, num_extra_args, qualifiers))
      {
         SLang_push_double (1.0);
         ISIS_FREE (par);
@@ -1802,6 +2153,7 @@ static int _define_user_model (char *fun_body) /*{{{*/
    Defining_User_Model = 1;
    status = do_define_user_model (fun_body);
    Defining_User_Model = 0;
+   Model_Serial++;
 
    if ((status == 0) && (Define_Model_Hook != NULL))
      status = (SLexecute_function (Define_Model_Hook) == -1) ? -1 : 0;
@@ -2112,7 +2464,7 @@ static int eval_instrumental_background_hook (SLang_Array_Type **bgd, Hist_t *h)
      return 0;
 
    /* g is a pointer to a global structure */
-   if (NULL == (g = get_evaluation_grid ()))
+   if (NULL == (g = reset_evaluation_grid ()))
      return -1;
    g->val = NULL;
 
@@ -2243,12 +2595,41 @@ static int add_instrumental_background (double *cts, Hist_t *h, double *opt_bkg)
 
 /*}}}*/
 
-static int apply_response (double *result, Isis_Hist_t *g, Hist_t *h) /*{{{*/
+/* The model buffer holds the noticed model bins plus the
+ * evaluation workspace.  Sizing it for the whole model grid means
+ * notice changes never reallocate it; only a larger grid does.
+ */
+static int grow_model_workspace (Fit_Workspace_t *ws, Isis_Hist_t *g) /*{{{*/
+{
+   return grow_workspace (&ws->model, &ws->model_size, 2 * g->nbins);
+}
+
+/*}}}*/
+
+static void free_workspace (Fit_Workspace_t *ws) /*{{{*/
+{
+   if (ws == NULL)
+     return;
+
+   ISIS_FREE (ws->cts);
+   ISIS_FREE (ws->model);
+   ISIS_FREE (ws->rebin);
+   ISIS_FREE (ws->kernel_params);
+   ISIS_FREE (ws->deps);
+   ISIS_FREE (ws->dep_values);
+   ISIS_FREE (ws->last_model);
+   memset ((char *)ws, 0, sizeof (*ws));
+}
+
+/*}}}*/
+
+static int apply_response (double *result, Isis_Hist_t *g, Hist_t *h, /*{{{*/
+                           Fit_Workspace_t *ws)
 {
    Isis_Kernel_Def_t *def;
    Isis_Kernel_t *k;
    double *kp = NULL;
-   int hist_index, ret;
+   int hist_index;
 
    if (NULL == h || NULL == g || NULL == result)
      return -1;
@@ -2260,22 +2641,25 @@ static int apply_response (double *result, Isis_Hist_t *g, Hist_t *h) /*{{{*/
    def = k->kernel_def;
    hist_index = Hist_get_index (h);
 
-   kp = Fit_get_kernel_params (Param, hist_index, def);
-   if ((NULL == kp) && (def->num_kernel_parms > 0))
-     return -1;
-
-   ret = k->compute_kernel (k, result, g, kp, def->num_kernel_parms,
-                            evaluate_model);
-   ISIS_FREE (kp);
+   if (def->num_kernel_parms > 0)
+     {
+        if ((-1 == grow_workspace (&ws->kernel_params, &ws->num_kernel_params,
+                                   def->num_kernel_parms))
+            || (-1 == Fit_copy_kernel_params (Param, hist_index, def, ws->kernel_params)))
+          return -1;
+        kp = ws->kernel_params;
+        record_dependency (def->fun_type, hist_index, kp, def->num_kernel_parms);
+     }
 
-   return ret;
+   return k->compute_kernel (k, result, g, kp, def->num_kernel_parms,
+                             evaluate_model);
 }
 
 /*}}}*/
 
 static int provide_opt_data (Hist_t *h, double *opt_bkg, /*{{{*/
                              Isis_Fit_Statistic_Optional_Data_Type *opt_data,
-                             int opt_data_offset)
+                             int opt_data_offset, double *work)
 {
    double *src_at=NULL, *bkg_at=NULL, *binned_bkg;
    double *opt_src_at, *opt_bkg_at;
@@ -2285,7 +2669,7 @@ static int provide_opt_data (Hist_t *h, double *opt_bkg, /*{{{*/
      return 0;
 
    binned_bkg = opt_data->bkg + opt_data_offset;
-   if (-1 == Hist_apply_rebin_and_notice_list (binned_bkg, opt_bkg, h))
+   if (-1 == Hist_apply_rebin_and_notice_list (binned_bkg, opt_bkg, h, work))
      return -1;
 
    if (-1 == Hist_scaling_vectors (h, 1, 1, &src_at, &bkg_at, &nb))
@@ -2307,30 +2691,131 @@ static int provide_opt_data (Hist_t *h, double *opt_bkg, /*{{{*/
 
 /*}}}*/
 
+static void start_dependency_record (Fit_Workspace_t *ws, Hist_t *h) /*{{{*/
+{
+   Hist_Eval_Grid_Method_Type *m;
+
+   ws->dep_status = DEPS_NONE;
+   ws->num_deps = 0;
+   ws->num_dep_values = 0;
+
+   if (Fit_Track_Dependencies == 0)
+     return;
+
+   /* Derived parameters may depend on the active dataset,
+    * post-model hooks may do anything, and models on cached
+    * grids are shared between datasets.
+    */
+   if (Fit_have_derived_params (Param)
+       || (NULL != Hist_post_model_hook (h))
+       || (NULL == (m = Hist_eval_grid_method (h)))
+       || ((m->eval_model != NULL)
+           && (m->eval_model != &eval_model_using_global_grid)))
+     return;
+
+   ws->dep_status = DEPS_RECORDING;
+   Dependency_Record = ws;
+}
+
+/*}}}*/
+
+static int save_dependency_record (Fit_Workspace_t *ws, double *bincts, /*{{{*/
+                                   int nbins, int with_opt_data)
+{
+   if (ws->dep_status != DEPS_RECORDING)
+     return 0;
+
+   ws->dep_status = DEPS_NONE;
+
+   if (-1 == grow_workspace (&ws->last_model, &ws->last_model_size, nbins))
+     return -1;
+   memcpy ((char *)ws->last_model, (char *)bincts, nbins * sizeof(double));
+
+   ws->model_serial = Model_Serial;
+   ws->response_serial = Isis_Response_Serial;
+   ws->with_opt_data = with_opt_data;
+   ws->dep_status = DEPS_VALID;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int model_is_unchanged (Fit_Workspace_t *ws, int nbins, int with_opt_data) /*{{{*/
+{
+   double *v;
+   unsigned int i;
+
+   if ((Fit_Track_Dependencies == 0)
+       || (ws->dep_status != DEPS_VALID)
+       || (ws->num_deps == 0)
+       || (ws->model_serial != Model_Serial)
+       || (ws->response_serial != Isis_Response_Serial)
+       || (ws->with_opt_data != with_opt_data)
+       || (ws->last_model_size < (unsigned int) nbins)
+       || Fit_have_derived_params (Param))
+     return 0;
+
+   v = ws->dep_values;
+   for (i = 0; i < ws->num_deps; i++)
+     {
+        unsigned int *f = ws->deps + 3*i;
+        if (0 == Fit_fun_params_match (Param, f[0], f[1], v, f[2]))
+          return 0;
+        v += f[2];
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
+/* All scratch arrays come from ws, which grows as needed
+ * and is normally owned by the current Fit_Data_t.
+ * When dependency tracking is enabled, ws also remembers
+ * the last model and the parameter values it was computed
+ * from; if none of those values changed, that model is reused.
+ */
 static int compute_hist_model (Hist_t *h, double *bincts, /*{{{*/
                                Isis_Fit_Statistic_Optional_Data_Type *opt_data,
-                               int opt_data_offset)
+                               int opt_data_offset, Fit_Workspace_t *ws)
 {
+   Fit_Workspace_t *prev_record = Dependency_Record;
    Isis_Hist_t *g = NULL;
    double *temp_cts = NULL;
    double *opt_bkg = NULL;
-   int orig_nbins, temp_cts_size;
+   int orig_nbins, temp_cts_size, nbins;
    int ret = -1;
 
-   if (-1 == (orig_nbins = Hist_orig_hist_size (h)))
+   if ((-1 == (orig_nbins = Hist_orig_hist_size (h)))
+       || (-1 == (nbins = Hist_num_data_noticed (h))))
      return -1;
 
+   if (model_is_unchanged (ws, nbins, opt_data != NULL))
+     {
+        /* opt_bkg from the last evaluation is still in ws->cts */
+        memcpy ((char *)bincts, (char *)ws->last_model, nbins * sizeof(double));
+        opt_bkg = opt_data ? (ws->cts + orig_nbins) : NULL;
+        if (-1 == provide_opt_data (h, opt_bkg, opt_data, opt_data_offset, ws->rebin))
+          return -1;
+        goto store_model;
+     }
+
+   start_dependency_record (ws, h);
+
    temp_cts_size = orig_nbins * (opt_data ? 2 : 1);
 
-   /* allocate space for the full-resolution result */
-   if (NULL == (temp_cts = (double *) ISIS_MALLOC (temp_cts_size * sizeof(double))))
+   /* space for the full-resolution result */
+   if ((-1 == grow_workspace (&ws->cts, &ws->cts_size, temp_cts_size))
+       || (-1 == grow_workspace (&ws->rebin, &ws->rebin_size, orig_nbins)))
      return -1;
+   temp_cts = ws->cts;
    memset ((char *)temp_cts, 0, temp_cts_size * sizeof(double));
 
    opt_bkg = opt_data ? (temp_cts + orig_nbins) : NULL;
 
    /* g is a pointer to a global structure */
-   if (NULL == (g = get_evaluation_grid ()))
+   if (NULL == (g = reset_evaluation_grid ()))
      return -1;
    g->val = NULL;
 
@@ -2338,27 +2823,29 @@ static int compute_hist_model (Hist_t *h, double *bincts, /*{{{*/
    if (-1 == Hist_get_model_grid (g, h))
      goto finish;
 
-   /* allocate space for the noticed bins in the source model,
+   /* space for the noticed bins in the source model,
     * plus some temporary work space which may or may not be used.
     * (use temp_workspace_for_eval() to get a pointer to this space)
     */
 
-   if (NULL == (g->val = (double *) ISIS_MALLOC ((g->n_notice + g->nbins) * sizeof(double))))
+   if (-1 == grow_model_workspace (ws, g))
      goto finish;
+   g->val = ws->model;
 
-   if (-1 == apply_response (temp_cts, g, h))
+   if (-1 == apply_response (temp_cts, g, h, ws))
      goto finish;
 
-   ISIS_FREE (g->val);
    memset ((char *)g, 0, sizeof (*g));
 
    if (-1 == add_instrumental_background (temp_cts, h, opt_bkg))
      goto finish;
 
-   if (-1 == Hist_apply_rebin_and_notice_list (bincts, temp_cts, h))
+   Dependency_Record = prev_record;
+
+   if (-1 == Hist_apply_rebin_and_notice_list (bincts, temp_cts, h, ws->rebin))
      goto finish;
 
-   if (-1 == provide_opt_data (h, opt_bkg, opt_data, opt_data_offset))
+   if (-1 == provide_opt_data (h, opt_bkg, opt_data, opt_data_offset, ws->rebin))
      goto finish;
 
    if (is_flux(Fit_Data_Type))
@@ -2367,6 +2854,11 @@ static int compute_hist_model (Hist_t *h, double *bincts, /*{{{*/
           goto finish;
      }
 
+   if (-1 == save_dependency_record (ws, bincts, nbins, opt_data != NULL))
+     goto finish;
+
+   store_model:
+
    if (Fit_Store_Model)
      {
         unsigned int model_type = 0;
@@ -2379,8 +2871,12 @@ static int compute_hist_model (Hist_t *h, double *bincts, /*{{{*/
    ret = 0;
    finish:
 
-   ISIS_FREE (g->val);
-   ISIS_FREE (temp_cts);
+   if (g != NULL)
+     g->val = NULL;
+
+   if (ret == -1)
+     ws->dep_status = DEPS_NONE;
+   Dependency_Record = prev_record;
 
    return ret;
 }
@@ -2391,22 +2887,41 @@ typedef struct
 {
    double *model;
    Isis_Fit_Statistic_Optional_Data_Type *opt_data;
+   Fit_Data_t *d;
    int offset;
+   int index;
 }
 Model_Map_Info_Type;
 
 static int compute_hist_model_hook (Hist_t *h, void *cl) /*{{{*/
 {
    Model_Map_Info_Type *map_info = (Model_Map_Info_Type *)cl;
+   Fit_Data_t *d = map_info->d;
+   Fit_Workspace_t tmp_ws, *ws;
    int ret;
 
    if (Hist_num_data_noticed (h) < 1)
      return 0;
 
+   /* datasets are visited in the order Fit_load_data stored them */
+   if ((d != NULL) && (d->ws != NULL)
+       && (map_info->index < d->num_datasets)
+       && (d->datasets[map_info->index] == h))
+     ws = &d->ws[map_info->index];
+   else
+     {
+        memset ((char *)&tmp_ws, 0, sizeof tmp_ws);
+        ws = &tmp_ws;
+     }
+
    ret = compute_hist_model (h, map_info->model + map_info->offset,
                              map_info->opt_data,
-                             map_info->offset);
+                             map_info->offset, ws);
    map_info->offset += Hist_num_data_noticed (h);
+   map_info->index++;
+
+   if (ws == &tmp_ws)
+     free_workspace (ws);
 
    return ret;
 }
@@ -2470,7 +2985,9 @@ static int compute_model (double *model, double *par_list, int npars_vary, /*{{{
 
    map_info.model = model;
    map_info.opt_data = opt_data;
+   map_info.d = d;
    map_info.offset = 0;
+   map_info.index = 0;
 
    if (opt_data) opt_data->num = 0;
 
@@ -2747,32 +3264,302 @@ return_status:
 
 /*}}}*/
 
-/*}}}*/
-
-/*{{{ assemble data to fit */
+/*{{{ analytic derivatives */
 
-static int prepare_kernel_for_fit (Hist_t *h) /*{{{*/
+/* Derivatives are propagated by replaying the recorded function
+ * values through the model and the response, so the fit-function
+ * must be linear in each component that depends on a variable
+ * parameter (sums and products are), and everything after it
+ * must be linear too.
+ */
+static int jacobian_is_available (Fit_Data_t *d) /*{{{*/
 {
-   Isis_Kernel_Def_t *def;
-   char *params;
+   int i;
 
-   /* Prevent re-initializing the fit-kernel
-    * while the fit is in progress -- e.g. if the
-    * user-defined fit function calls flux_corr()
-    */
-   if (Isis_Fit_In_Progress
-       && (NULL != Hist_get_kernel (h)))
+   if ((Fit_Analytic_Derivatives == 0)
+       || (d == NULL) || (d->ws == NULL)
+       || Computing_Statistic_Only
+       || (Unpack != Fit_unpack_variable_params)
+       || (d->nbins != d->nbins_after_datasets_combined)
+       || is_flux (Fit_Data_Type)
+       || Fit_have_derived_params (Param)
+       || Fit_have_tied_params (Param))
      return 0;
 
-   /* Can't use Hist_get_kernel() here because we're
-    * defining the kernel type. */
-   if (NULL == (def = get_histogram_kernel (Kernel_Table, h)))
-     return -1;
+   for (i = 0; i < d->num_datasets; i++)
+     {
+        Hist_t *h = d->datasets[i];
+        Hist_Eval_Grid_Method_Type *m;
+        Isis_Kernel_t *k;
 
-   /* ok if params == NULL (e.g. std kernel) */
-   params = get_kernel_params (Kernel_Table, h);
+        if ((NULL != Hist_post_model_hook (h))
+            || (NULL != Hist_get_instrumental_background_hook (h))
+            || (NULL == (m = Hist_eval_grid_method (h)))
+            || ((m->eval_model != NULL)
+                && (m->eval_model != &eval_model_using_global_grid))
+            || (NULL == (k = Hist_get_kernel (h)))
+            || (k->kernel_def->num_kernel_parms > 0))
+          return 0;
+     }
 
-   if (-1 == Hist_reallocate_kernel (h, params, def))
+   return 1;
+}
+
+/*}}}*/
+
+static int replay_hist_model (Hist_t *h, Fit_Workspace_t *ws, /*{{{*/
+                              unsigned int target, double step, double *bincts)
+{
+   Deriv_Record_t *dr = &Deriv_Record;
+
+   dr->target = target;
+   dr->step = step;
+   dr->next_comp = 0;
+
+   if (-1 == compute_hist_model (h, bincts, NULL, 0, ws))
+     return -1;
+
+   if (dr->next_comp != dr->num_comps)
+     dr->failed = 1;
+
+   return dr->failed ? -1 : 0;
+}
+
+/*}}}*/
+
+/* Computes d(model)/d(par) for variable parameter k from
+ * model(c + t*dc) - model(c - t*dc), where c is the recorded
+ * component value and dc its derivative.  The step t brings
+ * t*dc to the size of c to limit cancellation.
+ */
+static int hist_deriv_column (Hist_t *h, Fit_Workspace_t *ws, unsigned int k, /*{{{*/
+                              int nbins, double *base, double *work,
+                              double *col, int *seen)
+{
+   Deriv_Record_t *dr = &Deriv_Record;
+   double cmax = 0.0, dmax = 0.0, bmax = 0.0, tol, t;
+   double *plus = work, *minus = work + nbins;
+   unsigned int i, j, b;
+   int found = 0;
+
+   for (i = 0; i < dr->num_comps; i++)
+     {
+        Deriv_Component_t *c = &dr->comps[i];
+        for (j = 0; j < c->num_derivs; j++)
+          {
+             double *dv = c->val + (j+1)*c->num_bins;
+             if (c->vary_idx[j] != k)
+               continue;
+             found = 1;
+             for (b = 0; b < c->num_bins; b++)
+               {
+                  if (fabs(c->val[b]) > cmax) cmax = fabs(c->val[b]);
+                  if (fabs(dv[b]) > dmax) dmax = fabs(dv[b]);
+               }
+          }
+     }
+
+   if (found)
+     *seen = 1;
+
+   if (col == NULL)
+     return 0;
+
+   if ((found == 0) || (dmax == 0.0))
+     {
+        memset ((char *)col, 0, nbins * sizeof(double));
+        return 0;
+     }
+
+   t = ((cmax > 0.0) ? cmax : 1.0) / dmax;
+
+   if ((-1 == replay_hist_model (h, ws, k, t, plus))
+       || (-1 == replay_hist_model (h, ws, k, -t, minus)))
+     return -1;
+
+   dmax = 0.0;
+   for (b = 0; b < (unsigned int) nbins; b++)
+     {
+        col[b] = plus[b] - minus[b];
+        if (fabs(col[b]) > dmax) dmax = fabs(col[b]);
+        if (fabs(base[b]) > bmax) bmax = fabs(base[b]);
+        if (fabs(plus[b]) > bmax) bmax = fabs(plus[b]);
+        if (fabs(minus[b]) > bmax) bmax = fabs(minus[b]);
+     }
+
+   /* a model that is linear in the component has
+    * plus - base == base - minus
+    */
+   tol = 1.e-6 * dmax + 1.e3 * DBL_EPSILON * bmax;
+   for (b = 0; b < (unsigned int) nbins; b++)
+     {
+        if (fabs(plus[b] + minus[b] - 2.0 * base[b]) > tol)
+          return -1;
+        col[b] /= 2.0 * t;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Isis_Fit_Jacobian_Type:  returns -1 without raising an error
+ * when the derivatives can't be computed this way, so the caller
+ * can fall back on numerical derivatives.
+ */
+static int _fitjac (Isis_Fit_Statistic_Optional_Data_Type *opt_data, /*{{{*/
+                    double *x, unsigned int nbins,
+                    double *par, unsigned int npars,
+                    double *fx, double **dfdp)
+{
+   static char hook_name[] = "isis_start_eval_hook";
+   Deriv_Record_t *dr = &Deriv_Record;
+   Fit_Data_t *d = Current_Fit_Data_Info;
+   int track_deps = Fit_Track_Dependencies;
+   int store_model = Fit_Store_Model;
+   double *work = NULL;
+   int *seen = NULL;
+   unsigned int k;
+   int i, max_nbins, ret = -1;
+   (void) x;
+
+   if ((0 == jacobian_is_available (d))
+       || (nbins != (unsigned int) d->nbins)
+       || (npars == 0))
+     return -1;
+
+   if (dfdp == NULL)
+     return 0;
+
+   max_nbins = 0;
+   for (i = 0; i < d->num_datasets; i++)
+     {
+        int n = Hist_num_data_noticed (d->datasets[i]);
+        if (n > max_nbins) max_nbins = n;
+     }
+
+   if ((NULL == (work = (double *) ISIS_MALLOC (3 * max_nbins * sizeof(double))))
+       || (NULL == (seen = (int *) ISIS_MALLOC (npars * sizeof(int))))
+       || (NULL == (dr->vary = (Param_Info_t **) ISIS_MALLOC (npars * sizeof(Param_Info_t *)))))
+     goto finish;
+
+   if (-1 == (*Unpack)(Param, par))
+     goto finish;
+
+   if (2 == SLang_is_defined (hook_name))
+     (void) SLang_run_hooks (hook_name, 0);
+
+   cached_models_need_updating (d);
+
+   for (k = 0; k < npars; k++)
+     {
+        if (NULL == (dr->vary[k] = Fit_variable_param_info (Param, k)))
+          goto finish;
+        seen[k] = 0;
+     }
+   dr->num_vary = npars;
+   dr->failed = 0;
+
+   if (opt_data) opt_data->num = 0;
+
+   Fit_Track_Dependencies = 0;
+
+   for (i = 0; i < d->num_datasets; i++)
+     {
+        Hist_t *h = d->datasets[i];
+        Fit_Workspace_t *ws = &d->ws[i];
+        int offset = d->offsets[i];
+        int n = Hist_num_data_noticed (h);
+
+        if (n < 1)
+          continue;
+
+        /* one full evaluation records the components ... */
+        free_deriv_components (dr);
+        dr->mode = DERIV_RECORD;
+        Fit_Store_Model = store_model;
+        if ((-1 == compute_hist_model (h, fx + offset, opt_data, offset, ws))
+            || dr->failed)
+          goto finish;
+
+        /* ... which are then replayed for each parameter */
+        dr->mode = DERIV_APPLY;
+        Fit_Store_Model = 0;
+        if (-1 == replay_hist_model (h, ws, npars, 0.0, work))
+          goto finish;
+
+        for (k = 0; k < npars; k++)
+          {
+             double *col = dfdp[k] ? (dfdp[k] + offset) : NULL;
+             if (-1 == hist_deriv_column (h, ws, k, n, work, work + n, col, &seen[k]))
+               goto finish;
+          }
+     }
+
+   /* a variable parameter that no component read must
+    * have reached the model some other way.
+    */
+   for (k = 0; k < npars; k++)
+     {
+        if (seen[k] == 0)
+          goto finish;
+     }
+
+   Num_Statistic_Evaluations++;
+   ret = 0;
+
+   finish:
+
+   dr->mode = DERIV_OFF;
+   free_deriv_components (dr);
+   ISIS_FREE (dr->comps);
+   dr->max_comps = 0;
+   ISIS_FREE (dr->vary);
+   dr->num_vary = 0;
+   dr->failed = 0;
+
+   Fit_Track_Dependencies = track_deps;
+   Fit_Store_Model = store_model;
+
+   ISIS_FREE (work);
+   ISIS_FREE (seen);
+
+   if (SLang_get_error ())
+     ret = -1;
+
+   return ret;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*}}}*/
+
+/*{{{ assemble data to fit */
+
+static int prepare_kernel_for_fit (Hist_t *h) /*{{{*/
+{
+   Isis_Kernel_Def_t *def;
+   char *params;
+
+   /* Prevent re-initializing the fit-kernel
+    * while the fit is in progress -- e.g. if the
+    * user-defined fit function calls flux_corr()
+    */
+   if (Isis_Fit_In_Progress
+       && (NULL != Hist_get_kernel (h)))
+     return 0;
+
+   /* Can't use Hist_get_kernel() here because we're
+    * defining the kernel type. */
+   if (NULL == (def = get_histogram_kernel (Kernel_Table, h)))
+     return -1;
+
+   /* ok if params == NULL (e.g. std kernel) */
+   params = get_kernel_params (Kernel_Table, h);
+
+   if (-1 == Hist_reallocate_kernel (h, params, def))
      {
         isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "allocating kernel for data set %d",
                     Hist_get_index(h));
@@ -2973,6 +3760,14 @@ void free_fit_data (Fit_Data_t *d) /*{{{*/
    ISIS_FREE (d->offset_for_marked);
    ISIS_FREE (d->tmp);
 
+   if (d->ws != NULL)
+     {
+        int i;
+        for (i = 0; i < d->num_datasets; i++)
+          free_workspace (&d->ws[i]);
+        ISIS_FREE (d->ws);
+     }
+
    t = d->cache;
    while (t)
      {
@@ -3004,6 +3799,7 @@ static Fit_Data_t *new_fit_data (int nbins) /*{{{*/
        || NULL == (d->datasets = (Hist_t **) ISIS_MALLOC (d->num_datasets * sizeof(Hist_t *)))
        || NULL == (d->offsets = (int *) ISIS_MALLOC (d->num_datasets * sizeof(int)))
        || NULL == (d->offset_for_marked = (int *) ISIS_MALLOC (d->num_datasets * sizeof(int)))
+       || NULL == (d->ws = (Fit_Workspace_t *) ISIS_MALLOC (d->num_datasets * sizeof(Fit_Workspace_t)))
        )
      {
         free_fit_data (d);
@@ -3011,12 +3807,52 @@ static Fit_Data_t *new_fit_data (int nbins) /*{{{*/
      }
 
    memset ((char *)d->offset_for_marked, 0, d->num_datasets * sizeof(int));
+   memset ((char *)d->ws, 0, d->num_datasets * sizeof(Fit_Workspace_t));
 
    return d;
 }
 
 /*}}}*/
 
+/* Size the per-dataset workspaces up front so that
+ * model evaluations during the fit do not allocate.
+ */
+static int init_fit_workspaces (Fit_Data_t *d) /*{{{*/
+{
+   int i;
+
+   for (i = 0; i < d->num_datasets; i++)
+     {
+        Fit_Workspace_t *ws = &d->ws[i];
+        Hist_t *h = d->datasets[i];
+        Isis_Hist_t g = ISIS_HIST_INIT;
+        Isis_Kernel_t *k;
+        int orig_nbins;
+
+        if ((-1 == (orig_nbins = Hist_orig_hist_size (h)))
+            || (-1 == Hist_get_model_grid (&g, h)))
+          return -1;
+
+        if ((-1 == grow_workspace (&ws->cts, &ws->cts_size, 2*orig_nbins))
+            || (-1 == grow_workspace (&ws->rebin, &ws->rebin_size, orig_nbins))
+            || (-1 == grow_model_workspace (ws, &g)))
+          return -1;
+
+        k = Hist_get_kernel (h);
+        if ((k != NULL) && (k->kernel_def != NULL)
+            && (k->kernel_def->num_kernel_parms > 0))
+          {
+             if (-1 == grow_workspace (&ws->kernel_params, &ws->num_kernel_params,
+                                       k->kernel_def->num_kernel_parms))
+               return -1;
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int grids_match_in_dataset_combinations (Fit_Data_t *d) /*{{{*/
 {
    Hist_t *head = get_histogram_list_head ();
@@ -3194,7 +4030,8 @@ static Fit_Data_t *get_fit_data (void) /*{{{*/
      return NULL;
 #endif
 
-   if (-1 == map_datasets (init_model_structs, NULL))
+   if ((-1 == Hist_mark_shared_rmfs (get_histogram_list_head ()))
+       || (-1 == map_datasets (init_model_structs, NULL)))
      return NULL;
 
    if (NULL == (d = new_fit_data (nbins)))
@@ -3219,6 +4056,12 @@ static Fit_Data_t *get_fit_data (void) /*{{{*/
         return NULL;
      }
 
+   if (-1 == init_fit_workspaces (d))
+     {
+        free_fit_data (d);
+        return NULL;
+     }
+
    return d;
 }
 
@@ -3856,6 +4699,9 @@ static Fit_Object_Type *fit_object_open (void) /*{{{*/
         goto return_error;
      }
 
+   if (Fit_Analytic_Derivatives)
+     fo->ft->compute_jacobian = &_fitjac;
+
    set_fit_method_hooks (fo->ft, info->par);
 
    return fo;
@@ -4413,6 +5259,60 @@ static void fobj_eval_residuals (Fit_Object_MMT_Type *mmt, int *enable_copying)
 
 /*}}}*/
 
+/* Pushes d(model)/d(par) as an [npars, nbins] array, or NULL if
+ * analytic derivatives aren't available for the current fit.
+ */
+static void fobj_eval_jacobian (Fit_Object_MMT_Type *mmt) /*{{{*/
+{
+   Fit_Object_Type *fo = mmt->fo;
+   Fit_Param_t *par = fo->info->par;
+   Isis_Fit_Type *ft = fo->ft;
+   Fit_Object_Data_Type *dt = fo->dt;
+   SLang_Array_Type *sl_jac = NULL;
+   SLindex_Type dims[2];
+   double **dfdp = NULL;
+   double *fx = NULL;
+   int k;
+
+   if (-1 == pop_params (ft, par))
+     {
+        isis_throw_exception (Isis_Error);
+        return;
+     }
+
+   dims[0] = par->npars;
+   dims[1] = dt->num;
+
+   if ((NULL == (fx = (double *) ISIS_MALLOC (dt->num * sizeof(double))))
+       || (NULL == (dfdp = (double **) ISIS_MALLOC (par->npars * sizeof(double *))))
+       || (NULL == (sl_jac = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, dims, 2))))
+     {
+        isis_throw_exception (Isis_Error);
+        goto finish;
+     }
+
+   for (k = 0; k < par->npars; k++)
+     {
+        dfdp[k] = (double *)sl_jac->data + k * dt->num;
+     }
+
+   if (-1 == _fitjac (ft->stat->opt_data, NULL, dt->num, par->par, par->npars, fx, dfdp))
+     {
+        SLang_free_array (sl_jac);
+        sl_jac = NULL;
+     }
+
+   SLang_push_array (sl_jac, 1);
+   sl_jac = NULL;
+
+   finish:
+   SLang_free_array (sl_jac);
+   ISIS_FREE (dfdp);
+   ISIS_FREE (fx);
+}
+
+/*}}}*/
+
 static void fobj_get_data_weights (Fit_Object_MMT_Type *mmt) /*{{{*/
 {
    Fit_Object_Type *fo = mmt->fo;
@@ -4465,6 +5365,174 @@ static void fobj_get_parameters (Fit_Object_MMT_Type *mmt) /*{{{*/
 
 /*}}}*/
 
+/*{{{ ensemble MCMC */
+
+typedef struct
+{
+   int nwalkers;
+   int nsteps;
+   int thin;
+   int workers;
+   double scale;
+   double init_width;
+   char *file;
+   int resume;
+   int verbose;
+}
+Mcmc_Param_Type;
+
+static SLang_CStruct_Field_Type Mcmc_Param_Type_Layout [] =
+{
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, nwalkers, "nwalkers", SLANG_INT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, nsteps, "nsteps", SLANG_INT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, thin, "thin", SLANG_INT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, workers, "workers", SLANG_INT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, scale, "scale", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, init_width, "init_width", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, file, "file", SLANG_STRING_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, resume, "resume", SLANG_INT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Param_Type, verbose, "verbose", SLANG_INT_TYPE, 0),
+   SLANG_END_CSTRUCT_TABLE
+};
+
+typedef struct
+{
+   SLang_Array_Type *walkers;
+   SLang_Array_Type *logp;
+   SLang_Array_Type *acceptance;
+   SLang_Array_Type *autocorr_time;
+   double acceptance_fraction;
+}
+Mcmc_Result_Type;
+
+static SLang_CStruct_Field_Type Mcmc_Result_Type_Layout [] =
+{
+   MAKE_CSTRUCT_FIELD (Mcmc_Result_Type, walkers, "walkers", SLANG_ARRAY_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Result_Type, logp, "logp", SLANG_ARRAY_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Result_Type, acceptance, "acceptance", SLANG_ARRAY_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Result_Type, autocorr_time, "autocorr_time", SLANG_ARRAY_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Mcmc_Result_Type, acceptance_fraction, "acceptance_fraction", SLANG_DOUBLE_TYPE, 0),
+   SLANG_END_CSTRUCT_TABLE
+};
+
+/* log(p) = -statistic/2, which is the log-likelihood (up to a
+ * constant) for chi-square and for the Cash statistic */
+static int mcmc_logp (void *cl, double *par, unsigned int npars, double *logp) /*{{{*/
+{
+   Fit_Object_Type *fo = (Fit_Object_Type *) cl;
+   Isis_Fit_Type *ft = fo->ft;
+   Fit_Object_Data_Type *dt = fo->dt;
+   double stat;
+
+   if (isis_invalid_params (ft->engine, par, npars))
+     {
+        *logp = ISIS_MCMC_INVALID_LOGP;
+        return 0;
+     }
+
+   if (-1 == eval_fit_stat (ft->stat, 0, dt->data, dt->weight, dt->num, par, npars, &stat))
+     return -1;
+
+   *logp = isfinite (stat) ? -0.5 * stat : ISIS_MCMC_INVALID_LOGP;
+
+   return 0;
+}
+
+/*}}}*/
+
+static void fobj_run_mcmc (Fit_Object_MMT_Type *mmt) /*{{{*/
+{
+   Fit_Object_Type *fo = mmt->fo;
+   Fit_Param_t *par = fo->info->par;
+   Mcmc_Param_Type mp;
+   Mcmc_Result_Type mr;
+   Isis_Mcmc_Type m;
+   SLindex_Type dims[2];
+   double *accept, *saved_par = NULL;
+   unsigned int k;
+   int npars = par->npars;
+   int ret, status = -1;
+
+   memset ((char *)&mr, 0, sizeof(mr));
+
+   if (-1 == SLang_pop_cstruct ((VOID_STAR)&mp, Mcmc_Param_Type_Layout))
+     {
+        isis_throw_exception (Isis_Error);
+        return;
+     }
+
+   if ((npars <= 0) || (mp.nwalkers <= 0) || (mp.nsteps < 0)
+       || (mp.thin < 0) || (mp.workers < 0))
+     {
+        isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "mcmc configuration");
+        goto finish;
+     }
+
+   m.nwalkers = mp.nwalkers;
+   m.nsteps = mp.nsteps;
+   m.thin = mp.thin;
+   m.num_workers = mp.workers;
+   m.scale = mp.scale;
+   m.file = mp.file;
+   m.resume = mp.resume;
+   m.verbose = mp.verbose;
+
+   dims[0] = mp.nwalkers;
+   dims[1] = npars;
+
+   if ((NULL == (mr.walkers = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, dims, 2)))
+       || (NULL == (mr.logp = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, dims, 1)))
+       || (NULL == (mr.acceptance = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, dims, 1)))
+       || (NULL == (mr.autocorr_time = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &dims[1], 1))))
+     goto finish;
+
+   if (-1 == isis_mcmc_init_walkers ((double *)mr.walkers->data, m.nwalkers, par->par,
+                                     par->par_min, par->par_max, mp.init_width, npars))
+     goto finish;
+
+   /* A serial run unpacks each proposal into the parameter
+    * table, so put back the starting values afterwards.
+    */
+   if (NULL == (saved_par = (double *) ISIS_MALLOC (npars * sizeof(double))))
+     goto finish;
+   memcpy ((char *)saved_par, (char *)par->par, npars * sizeof(double));
+
+   Fit_Store_Model = 0;
+
+   ret = isis_mcmc_run (&m, &mcmc_logp, (void *) fo,
+                        (double *)mr.walkers->data, (double *)mr.logp->data,
+                        (double *)mr.acceptance->data, (double *)mr.autocorr_time->data,
+                        npars);
+
+   memcpy ((char *)par->par, (char *)saved_par, npars * sizeof(double));
+   if (-1 == fit_object_keep_params (fo, Param))
+     goto finish;
+
+   if (ret == -1)
+     {
+        isis_vmesg (INTR, I_FAILED, __FILE__, __LINE__, "running mcmc");
+        goto finish;
+     }
+
+   accept = (double *)mr.acceptance->data;
+   for (k = 0; k < m.nwalkers; k++)
+     mr.acceptance_fraction += accept[k];
+   mr.acceptance_fraction /= m.nwalkers;
+
+   status = SLang_push_cstruct ((VOID_STAR)&mr, Mcmc_Result_Type_Layout);
+
+   finish:
+   ISIS_FREE (saved_par);
+   if (status)
+     isis_throw_exception (Isis_Error);
+   SLang_free_cstruct ((VOID_STAR)&mr, Mcmc_Result_Type_Layout);
+   SLang_free_cstruct ((VOID_STAR)&mp, Mcmc_Param_Type_Layout);
+}
+
+/*}}}*/
+
+/*}}}*/
+
 typedef struct
 {
    double stat;
@@ -4654,6 +5722,210 @@ static void confidence_limits (int *idx, double *delta_chisqr, int *verbose, dou
 
 /*}}}*/
 
+/* usage: (pmin, pmax) = _confidlev_parallel (idx[], covar_or_NULL, delta, verbose, tol, workers,
+ *                                             max_restarts, max_param_retries) */
+static void confidence_limits_parallel (double *delta_chisqr, int *verbose, /*{{{*/
+                                        double *tolerance, int *num_workers,
+                                        int *max_restarts, int *max_param_retries)
+{
+   Fit_Object_Type *fo = NULL;
+   SLang_Array_Type *sl_idx = NULL, *sl_covar = NULL;
+   SLang_Array_Type *sl_min = NULL, *sl_max = NULL;
+   Isis_Fit_CLC_Type c;
+   double *covar = NULL;
+   unsigned int nv_covar = 0;
+   SLindex_Type n;
+   int status = -1;
+
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+     SLdo_pop ();
+   else if (-1 == SLang_pop_array_of_type (&sl_covar, SLANG_DOUBLE_TYPE))
+     {
+        isis_throw_exception (Isis_Error);
+        return;
+     }
+
+   if ((-1 == SLang_pop_array_of_type (&sl_idx, SLANG_INT_TYPE))
+       || (sl_idx->num_elements == 0))
+     {
+        isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "parameter index list");
+        goto finish;
+     }
+
+   if (0 == delta_stat_is_chisqr_distributed())
+     {
+        isis_vmesg (INTR, I_INFO, __FILE__, __LINE__, "statistic = '%s': confidence limits not supported",
+                    Fit_Statistic);
+        goto finish;
+     }
+
+   /* an empty matrix means the fit method didn't compute one */
+   if ((sl_covar != NULL) && (sl_covar->num_elements > 0))
+     {
+        nv_covar = (unsigned int) sqrt ((double) sl_covar->num_elements);
+        if (nv_covar * nv_covar != sl_covar->num_elements)
+          {
+             isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "covariance matrix is not square");
+             goto finish;
+          }
+        covar = (double *)sl_covar->data;
+     }
+
+   c.delta_stat = *delta_chisqr;
+   c.tol = *tolerance;
+   c.verbose = *verbose;
+
+   n = sl_idx->num_elements;
+   if ((NULL == (sl_min = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1)))
+       || (NULL == (sl_max = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1))))
+     goto finish;
+
+   if (NULL == (fo = fit_object_open ()))
+     {
+        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "initializing fit engine");
+        goto finish;
+     }
+
+   Looking_For_Confidence_Limits = 1;
+   status = get_confidence_limits_parallel (fo, Param, &c, (int *)sl_idx->data, n,
+                                            covar, nv_covar,
+                                            (*num_workers > 0) ? *num_workers : 1,
+                                            *max_restarts, *max_param_retries,
+                                            (double *)sl_min->data, (double *)sl_max->data);
+   Looking_For_Confidence_Limits = 0;
+
+   fit_object_close (fo);
+
+finish:
+   SLang_free_array (sl_idx);
+   SLang_free_array (sl_covar);
+
+   if (status == 0)
+     {
+        SLang_push_array (sl_min, 1);
+        SLang_push_array (sl_max, 1);
+     }
+   else
+     {
+        SLang_free_array (sl_min);
+        SLang_free_array (sl_max);
+        isis_throw_exception (Isis_Error);
+     }
+}
+
+/*}}}*/
+
+typedef struct
+{
+   SLang_Name_Type *save;
+   SLindex_Type dims[2];
+}
+Conf_Map_Save_Type;
+
+static int save_conf_map (void *cl, double *map) /*{{{*/
+{
+   Conf_Map_Save_Type *ms = (Conf_Map_Save_Type *) cl;
+   SLang_Array_Type *at;
+
+   if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, ms->dims, 2)))
+     return -1;
+   memcpy ((char *)at->data, (char *)map, at->num_elements * sizeof(double));
+
+   if ((-1 == SLang_push_array (at, 1))
+       || (-1 == SLexecute_function (ms->save)))
+     return -1;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* usage: map = _conf_map_grid (xs, ys, map, skip_or_NULL, &save_or_NULL,
+ *                              ix, iy, workers, save_interval)
+ */
+static void conf_map_grid_intrin (int *ix, int *iy, int *num_workers, int *save_interval) /*{{{*/
+{
+   SLang_Array_Type *sl_xs = NULL, *sl_ys = NULL, *sl_map = NULL, *sl_skip = NULL;
+   Fit_Object_Type *fo = NULL;
+   Isis_Conf_Map_Type m;
+   Conf_Map_Save_Type ms;
+   int status = -1;
+
+   memset ((char *)&m, 0, sizeof m);
+   ms.save = NULL;
+
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+     SLdo_pop ();
+   else if (NULL == (ms.save = SLang_pop_function ()))
+     goto finish;
+
+   if (SLANG_NULL_TYPE == SLang_peek_at_stack ())
+     SLdo_pop ();
+   else if (-1 == SLang_pop_array_of_type (&sl_skip, SLANG_UCHAR_TYPE))
+     goto finish;
+
+   if ((-1 == SLang_pop_array_of_type (&sl_map, SLANG_DOUBLE_TYPE))
+       || (-1 == SLang_pop_array_of_type (&sl_ys, SLANG_DOUBLE_TYPE))
+       || (-1 == SLang_pop_array_of_type (&sl_xs, SLANG_DOUBLE_TYPE)))
+     goto finish;
+
+   if ((sl_map->num_dims != 2)
+       || (sl_map->dims[0] != (SLindex_Type) sl_ys->num_elements)
+       || (sl_map->dims[1] != (SLindex_Type) sl_xs->num_elements)
+       || ((sl_skip != NULL) && (sl_skip->num_elements != sl_map->num_elements)))
+     {
+        isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "confidence map grid dimensions");
+        goto finish;
+     }
+
+   m.ix = *ix;
+   m.iy = *iy;
+   m.xs = (double *)sl_xs->data;
+   m.ys = (double *)sl_ys->data;
+   m.nx = sl_xs->num_elements;
+   m.ny = sl_ys->num_elements;
+   m.map = (double *)sl_map->data;
+   m.skip = sl_skip ? (unsigned char *)sl_skip->data : NULL;
+   m.num_workers = (*num_workers > 0) ? *num_workers : 1;
+
+   if (ms.save != NULL)
+     {
+        ms.dims[0] = m.ny;
+        ms.dims[1] = m.nx;
+        m.save = &save_conf_map;
+        m.save_cl = (void *) &ms;
+        m.save_interval = (*save_interval > 0) ? *save_interval : 0;
+     }
+
+   if (NULL == (fo = fit_object_open ()))
+     {
+        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "initializing fit engine");
+        goto finish;
+     }
+
+   Looking_For_Confidence_Limits = 1;
+   status = conf_map_grid (fo, Param, &m);
+   Looking_For_Confidence_Limits = 0;
+
+   fit_object_close (fo);
+
+finish:
+   SLang_free_function (ms.save);
+   SLang_free_array (sl_xs);
+   SLang_free_array (sl_ys);
+   SLang_free_array (sl_skip);
+
+   if (status == 0)
+     SLang_push_array (sl_map, 1);
+   else
+     {
+        SLang_free_array (sl_map);
+        isis_throw_exception (Isis_Error);
+     }
+}
+
+/*}}}*/
+
 /*}}}*/
 
 /* etc */
@@ -5001,7 +6273,7 @@ int isis_eval_model_on_alt_grid (Isis_Hist_t *x) /*{{{*/
     * then, replace the global evaluation grid with 'x'
     */
 
-   if (NULL == (g = get_evaluation_grid ()))
+   if (NULL == (g = reset_evaluation_grid ()))
      return -1;
    /* copy structs */
    save_g = *g;
@@ -5046,7 +6318,7 @@ static void get_model_on_user_grid (void) /*{{{*/
    Isis_Hist_t *g;
    User_Function_Type *f;
 
-   if (NULL == (g = get_evaluation_grid ()))
+   if (NULL == (g = reset_evaluation_grid ()))
      return;
 
    f = get_user_function ();
@@ -5363,6 +6635,8 @@ static SLang_Intrin_Var_Type Fit_Intrin_Vars [] =
     */
    MAKE_VARIABLE("_num_statistic_evaluations", &Num_Statistic_Evaluations, I, 0),
    MAKE_VARIABLE("Isis_Default_Relstep", &Isis_Default_Relstep, D, 0),
+   MAKE_VARIABLE("Fit_Track_Dependencies", &Fit_Track_Dependencies, I, 0),
+   MAKE_VARIABLE("Fit_Analytic_Derivatives", &Fit_Analytic_Derivatives, I, 0),
    SLANG_END_INTRIN_VAR_TABLE
 };
 
@@ -5410,6 +6684,8 @@ static SLang_Intrin_Fun_Type Fit_Intrinsics [] =
    MAKE_INTRINSIC_1("_eval_model", eval_model, I, R),
    MAKE_INTRINSIC_1("_eval_statistic_only", eval_statistic_only, I, R),
    MAKE_INTRINSIC_4("_confidlev", confidence_limits, V, I, D, I, D),
+   MAKE_INTRINSIC_6("_confidlev_parallel", confidence_limits_parallel, V, D, I, D, I, I, I),
+   MAKE_INTRINSIC_4("_conf_map_grid", conf_map_grid_intrin, V, I, I, I, I),
    MAKE_INTRINSIC_I("_set_conf_limit_search", _set_conf_limit_search, V),
    MAKE_INTRINSIC("_array_fit", array_fit, V, 0),
    MAKE_INTRINSIC("_get_differential_model", get_differential_model, V, 0),
@@ -5455,12 +6731,16 @@ static SLang_Intrin_Fun_Type Fit_Intrinsics [] =
    MAKE_INTRINSIC_1("get_fitfun_info", Fit_get_fun_info, V, S),
    MAKE_INTRINSIC_1("set_fitfun_post_hook", Fit_set_fun_post_hook, V, S),
    MAKE_INTRINSIC_1("set_fitfun_trace_hook", Fit_set_fun_trace_hook, V, S),
+   MAKE_INTRINSIC_1("set_fitfun_cache_size", Fit_set_fun_cache_size, V, D),
+   MAKE_INTRINSIC("get_fitfun_cache_stats", Fit_push_fun_cache_stats, V, 0),
    MAKE_INTRINSIC_4("set_hard_limits", Fit_set_hard_limits, I, S, S, I, I),
    MAKE_INTRINSIC("open_fit_object_mmt_intrin", open_fit_object_mmt_intrin, V, 0),
    MAKE_INTRINSIC_2("fobj_eval_statistic", fobj_eval_statistic, V, MTO, I),
    MAKE_INTRINSIC_2("fobj_eval_residuals", fobj_eval_residuals, V, MTO, I),
+   MAKE_INTRINSIC_1("fobj_eval_jacobian", fobj_eval_jacobian, V, MTO),
    MAKE_INTRINSIC_1("fobj_get_data_weights", fobj_get_data_weights, V, MTO),
    MAKE_INTRINSIC_1("fobj_get_parameters", fobj_get_parameters, V, MTO),
+   MAKE_INTRINSIC_1("fobj_run_mcmc", fobj_run_mcmc, V, MTO),
    SLANG_END_INTRIN_FUN_TABLE
 };
 
@@ -695,6 +695,9 @@ int init_fit_engine (void) /*{{{*/
    if (-1 == isis_fit_add_engine ("simann", "chisqr", Isis_simann_feng))
      return -1;
 
+   if (-1 == isis_fit_add_engine ("de", "chisqr", Isis_de_feng))
+     return -1;
+
    if (-1 == isis_fit_add_engine ("marquardt", "chisqr", Isis_marquardt_feng))
      return -1;
 
@@ -802,6 +805,7 @@ Isis_Fit_Type *isis_fit_open_fit (char *name, char *sname, Isis_Fit_Fun_Type *fu
    f->stat = s;
    f->statistic = DBL_MAX;
    f->covariance_matrix = NULL;
+   f->compute_jacobian = NULL;
 
    Isis_Fit_In_Progress = 1;
 
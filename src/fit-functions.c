@@ -650,10 +650,470 @@ static void slangfun_destroy_fun (Fit_Fun_t *ff) /*{{{*/
 
 /*}}}*/
 
+/*{{{ component cache */
+
+/* Optional cache of fit-function component values, keyed on
+ * (fun_type, fun_id, parameter values, evaluation grid, active
+ * dataset).  Any other global state a function depends on is
+ * not part of the key.
+ * Entries are kept in most-recently-used order and the least
+ * recently used entries are dropped to stay within max_bytes.
+ * Lookups go through a chained hash table on the key, which
+ * doubles in size when it holds more entries than buckets.
+ */
+
+typedef struct Fun_Cache_Entry_t Fun_Cache_Entry_t;
+struct Fun_Cache_Entry_t
+{
+   Fun_Cache_Entry_t *prev;
+   Fun_Cache_Entry_t *next;
+   Fun_Cache_Entry_t *hash_next;
+   unsigned long key;
+   unsigned long grid_hash;
+   unsigned int fun_type;
+   unsigned int fun_id;
+   unsigned int nparams;
+   int dataset;                   /* Isis_Active_Dataset */
+   double *bin_lo;                /* grid identity */
+   double *bin_hi;
+   int *notice_list;
+   int n_notice;
+   double *par;
+   double *val;
+   size_t num_bytes;
+};
+
+static struct
+{
+   Fun_Cache_Entry_t *head;
+   Fun_Cache_Entry_t *tail;
+   Fun_Cache_Entry_t **buckets;
+   unsigned int num_buckets;      /* power of 2 */
+   size_t num_bytes;
+   size_t max_bytes;
+   unsigned int num_entries;
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+}
+Fun_Cache;
+
+#define FNV_OFFSET  2166136261UL
+#define FNV_PRIME   16777619UL
+
+static unsigned long hash_bytes (unsigned long h, void *p, size_t n) /*{{{*/
+{
+   unsigned char *s = (unsigned char *)p;
+
+   while (n-- > 0)
+     {
+        h ^= *s++;
+        h = (h * FNV_PRIME) & 0xffffffffUL;
+     }
+
+   return h;
+}
+
+/*}}}*/
+
+/* The hash of the current evaluation grid is computed once and
+ * reused by every component evaluated on it.  Fit_reset_grid_hash
+ * is called whenever the evaluation grid is pointed at new arrays,
+ * whose addresses may coincide with those of freed ones.
+ */
+static struct
+{
+   double *bin_lo;
+   double *bin_hi;
+   int *notice_list;
+   int n_notice;
+   unsigned long hash;
+   int valid;
+}
+Grid_Hash;
+
+void Fit_reset_grid_hash (void) /*{{{*/
+{
+   Grid_Hash.valid = 0;
+}
+
+/*}}}*/
+
+static unsigned long hash_grid (Isis_Hist_t *g) /*{{{*/
+{
+   unsigned long h = FNV_OFFSET;
+   int i;
+
+   if (Grid_Hash.valid
+       && (Grid_Hash.bin_lo == g->bin_lo)
+       && (Grid_Hash.bin_hi == g->bin_hi)
+       && (Grid_Hash.notice_list == g->notice_list)
+       && (Grid_Hash.n_notice == g->n_notice))
+     return Grid_Hash.hash;
+
+   for (i = 0; i < g->n_notice; i++)
+     {
+        int k = g->notice_list[i];
+        h = hash_bytes (h, &g->bin_lo[k], sizeof(double));
+        h = hash_bytes (h, &g->bin_hi[k], sizeof(double));
+     }
+
+   Grid_Hash.bin_lo = g->bin_lo;
+   Grid_Hash.bin_hi = g->bin_hi;
+   Grid_Hash.notice_list = g->notice_list;
+   Grid_Hash.n_notice = g->n_notice;
+   Grid_Hash.hash = h;
+   Grid_Hash.valid = 1;
+
+   return h;
+}
+
+/*}}}*/
+
+static unsigned int cache_bucket (unsigned long key, unsigned long grid_hash) /*{{{*/
+{
+   return (unsigned int) ((key ^ grid_hash) & (Fun_Cache.num_buckets - 1));
+}
+
+/*}}}*/
+
+static void hash_cache_entry (Fun_Cache_Entry_t *e) /*{{{*/
+{
+   unsigned int b = cache_bucket (e->key, e->grid_hash);
+
+   e->hash_next = Fun_Cache.buckets[b];
+   Fun_Cache.buckets[b] = e;
+}
+
+/*}}}*/
+
+static void unhash_cache_entry (Fun_Cache_Entry_t *e) /*{{{*/
+{
+   Fun_Cache_Entry_t **p;
+
+   if (Fun_Cache.buckets == NULL)
+     return;
+
+   p = &Fun_Cache.buckets[cache_bucket (e->key, e->grid_hash)];
+   while (*p != NULL)
+     {
+        if (*p == e)
+          {
+             *p = e->hash_next;
+             break;
+          }
+        p = &(*p)->hash_next;
+     }
+
+   e->hash_next = NULL;
+}
+
+/*}}}*/
+
+static int grow_cache_buckets (void) /*{{{*/
+{
+   Fun_Cache_Entry_t **b, *e;
+   unsigned int n;
+
+   n = (Fun_Cache.num_buckets > 0) ? 2 * Fun_Cache.num_buckets : 256;
+
+   if (NULL == (b = (Fun_Cache_Entry_t **) ISIS_MALLOC (n * sizeof(Fun_Cache_Entry_t *))))
+     return -1;
+   memset ((char *)b, 0, n * sizeof(Fun_Cache_Entry_t *));
+
+   ISIS_FREE (Fun_Cache.buckets);
+   Fun_Cache.buckets = b;
+   Fun_Cache.num_buckets = n;
+
+   for (e = Fun_Cache.head; e != NULL; e = e->next)
+     {
+        hash_cache_entry (e);
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+static void unlink_cache_entry (Fun_Cache_Entry_t *e) /*{{{*/
+{
+   if (e->prev) e->prev->next = e->next;
+   else Fun_Cache.head = e->next;
+
+   if (e->next) e->next->prev = e->prev;
+   else Fun_Cache.tail = e->prev;
+
+   e->prev = e->next = NULL;
+}
+
+/*}}}*/
+
+static void push_cache_entry (Fun_Cache_Entry_t *e) /*{{{*/
+{
+   e->prev = NULL;
+   e->next = Fun_Cache.head;
+   if (Fun_Cache.head)
+     Fun_Cache.head->prev = e;
+   Fun_Cache.head = e;
+   if (Fun_Cache.tail == NULL)
+     Fun_Cache.tail = e;
+}
+
+/*}}}*/
+
+static void free_cache_entry (Fun_Cache_Entry_t *e) /*{{{*/
+{
+   if (e == NULL)
+     return;
+
+   unhash_cache_entry (e);
+   unlink_cache_entry (e);
+   Fun_Cache.num_bytes -= e->num_bytes;
+   Fun_Cache.num_entries--;
+
+   ISIS_FREE (e->par);
+   ISIS_FREE (e->val);
+   ISIS_FREE (e);
+}
+
+/*}}}*/
+
+static void flush_fun_cache (void) /*{{{*/
+{
+   while (Fun_Cache.head != NULL)
+     {
+        free_cache_entry (Fun_Cache.head);
+     }
+
+   ISIS_FREE (Fun_Cache.buckets);
+   Fun_Cache.num_buckets = 0;
+}
+
+/*}}}*/
+
+static Fun_Cache_Entry_t *find_cache_entry (unsigned long key, unsigned long grid_hash, /*{{{*/
+                                            unsigned int fun_type, unsigned int fun_id,
+                                            int dataset, Isis_Hist_t *g,
+                                            double *par, unsigned int nparams)
+{
+   Fun_Cache_Entry_t *e;
+
+   if (Fun_Cache.buckets == NULL)
+     return NULL;
+
+   for (e = Fun_Cache.buckets[cache_bucket (key, grid_hash)]; e != NULL; e = e->hash_next)
+     {
+        if ((e->key != key)
+            || (e->grid_hash != grid_hash)
+            || (e->fun_type != fun_type)
+            || (e->fun_id != fun_id)
+            || (e->dataset != dataset)
+            || (e->nparams != nparams)
+            || (e->n_notice != g->n_notice)
+            || (e->bin_lo != g->bin_lo)
+            || (e->bin_hi != g->bin_hi)
+            || (e->notice_list != g->notice_list))
+          continue;
+
+        if ((nparams == 0)
+            || (0 == memcmp ((char *)e->par, (char *)par, nparams * sizeof(double))))
+          return e;
+     }
+
+   return NULL;
+}
+
+/*}}}*/
+
+static void add_cache_entry (unsigned long key, unsigned long grid_hash, /*{{{*/
+                             unsigned int fun_type, unsigned int fun_id,
+                             int dataset, Isis_Hist_t *g,
+                             double *par, unsigned int nparams, double *val)
+{
+   Fun_Cache_Entry_t *e;
+   size_t num_bytes;
+
+   num_bytes = sizeof(Fun_Cache_Entry_t)
+     + (nparams + g->n_notice) * sizeof(double);
+
+   if (num_bytes > Fun_Cache.max_bytes)
+     return;
+
+   while ((Fun_Cache.tail != NULL)
+          && (Fun_Cache.num_bytes + num_bytes > Fun_Cache.max_bytes))
+     {
+        free_cache_entry (Fun_Cache.tail);
+        Fun_Cache.evictions++;
+     }
+
+   if ((Fun_Cache.num_entries >= Fun_Cache.num_buckets)
+       && (-1 == grow_cache_buckets ())
+       && (Fun_Cache.buckets == NULL))
+     return;
+
+   if (NULL == (e = (Fun_Cache_Entry_t *) ISIS_MALLOC (sizeof(Fun_Cache_Entry_t))))
+     return;
+   memset ((char *)e, 0, sizeof(*e));
+
+   if ((NULL == (e->val = (double *) ISIS_MALLOC (g->n_notice * sizeof(double))))
+       || ((nparams > 0)
+           && (NULL == (e->par = (double *) ISIS_MALLOC (nparams * sizeof(double))))))
+     {
+        ISIS_FREE (e->val);
+        ISIS_FREE (e);
+        return;
+     }
+
+   if (nparams > 0)
+     memcpy ((char *)e->par, (char *)par, nparams * sizeof(double));
+   memcpy ((char *)e->val, (char *)val, g->n_notice * sizeof(double));
+
+   e->key = key;
+   e->grid_hash = grid_hash;
+   e->fun_type = fun_type;
+   e->fun_id = fun_id;
+   e->dataset = dataset;
+   e->nparams = nparams;
+   e->bin_lo = g->bin_lo;
+   e->bin_hi = g->bin_hi;
+   e->notice_list = g->notice_list;
+   e->n_notice = g->n_notice;
+   e->num_bytes = num_bytes;
+
+   push_cache_entry (e);
+   hash_cache_entry (e);
+   Fun_Cache.num_bytes += num_bytes;
+   Fun_Cache.num_entries++;
+}
+
+/*}}}*/
+
+/* Evaluate ff on grid g, leaving the result on the S-Lang stack,
+ * and use the cache when it is enabled and the component
+ * result depends only on its parameters and the grid.
+ */
+int Fit_cached_bin_eval (Fit_Fun_t *ff, unsigned int fun_id, Isis_Hist_t *g, /*{{{*/
+                         double *par, unsigned int num_extra_args,
+                         SLang_Struct_Type *qualifiers)
+{
+   SLang_Array_Type *at = NULL;
+   Fun_Cache_Entry_t *e;
+   unsigned long key, grid_hash;
+   int dataset = Isis_Active_Dataset;
+   SLindex_Type n;
+
+   if ((Fun_Cache.max_bytes == 0)
+       || (g->n_notice <= 0)
+       || (ff->s.category == ISIS_FUN_OPERATOR)
+       || (num_extra_args > 0)
+       || (qualifiers != NULL))
+     return (*ff->bin_eval_method)(ff, g, par, qualifiers);
+
+   grid_hash = hash_grid (g);
+   key = hash_bytes (FNV_OFFSET, &ff->fun_type, sizeof(unsigned int));
+   key = hash_bytes (key, &fun_id, sizeof(unsigned int));
+   key = hash_bytes (key, &dataset, sizeof(int));
+   if (ff->nparams > 0)
+     key = hash_bytes (key, par, ff->nparams * sizeof(double));
+
+   n = g->n_notice;
+
+   e = find_cache_entry (key, grid_hash, ff->fun_type, fun_id, dataset, g,
+                         par, ff->nparams);
+   if (e != NULL)
+     {
+        Fun_Cache.hits++;
+        unlink_cache_entry (e);
+        push_cache_entry (e);
+
+        if (NULL == (at = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, &n, 1)))
+          return -1;
+        memcpy ((char *)at->data, (char *)e->val, n * sizeof(double));
+        return SLang_push_array (at, 1);
+     }
+
+   Fun_Cache.misses++;
+
+   if (-1 == (*ff->bin_eval_method)(ff, g, par, qualifiers))
+     return -1;
+
+   /* copy the result, then put it back on the stack */
+   if (-1 == SLang_pop_array_of_type (&at, SLANG_DOUBLE_TYPE))
+     return -1;
+
+   if (at->num_elements == (SLuindex_Type) n)
+     add_cache_entry (key, grid_hash, ff->fun_type, fun_id, dataset, g,
+                      par, ff->nparams, (double *)at->data);
+
+   return SLang_push_array (at, 1);
+}
+
+/*}}}*/
+
+void Fit_set_fun_cache_size (double *max_mbytes) /*{{{*/
+{
+   if ((*max_mbytes < 0) || (0 != isnan (*max_mbytes)))
+     {
+        isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "cache size %g", *max_mbytes);
+        return;
+     }
+
+   flush_fun_cache ();
+   Fun_Cache.max_bytes = (size_t) (*max_mbytes * 1024.0 * 1024.0);
+   Fun_Cache.hits = 0;
+   Fun_Cache.misses = 0;
+   Fun_Cache.evictions = 0;
+}
+
+/*}}}*/
+
+typedef struct
+{
+   double hits;
+   double misses;
+   double evictions;
+   unsigned int num_entries;
+   double mbytes;
+   double max_mbytes;
+}
+Fun_Cache_Stats_Type;
+
+static SLang_CStruct_Field_Type Fun_Cache_Stats_Layout [] =
+{
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, hits, "hits", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, misses, "misses", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, evictions, "evictions", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, num_entries, "num_entries", SLANG_UINT_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, mbytes, "mbytes", SLANG_DOUBLE_TYPE, 0),
+   MAKE_CSTRUCT_FIELD (Fun_Cache_Stats_Type, max_mbytes, "max_mbytes", SLANG_DOUBLE_TYPE, 0),
+   SLANG_END_CSTRUCT_TABLE
+};
+
+void Fit_push_fun_cache_stats (void) /*{{{*/
+{
+   Fun_Cache_Stats_Type s;
+
+   s.hits = (double) Fun_Cache.hits;
+   s.misses = (double) Fun_Cache.misses;
+   s.evictions = (double) Fun_Cache.evictions;
+   s.num_entries = Fun_Cache.num_entries;
+   s.mbytes = (double) Fun_Cache.num_bytes / (1024.0 * 1024.0);
+   s.max_mbytes = (double) Fun_Cache.max_bytes / (1024.0 * 1024.0);
+
+   (void) SLang_push_cstruct ((VOID_STAR)&s, Fun_Cache_Stats_Layout);
+}
+
+/*}}}*/
+
+/*}}}*/
+
 static void free_fit_fun (Fit_Fun_t *ff) /*{{{*/
 {
    if (ff == NULL) return;
 
+   /* cached values may belong to this function */
+   flush_fun_cache ();
+
    if (ff->s.function_exit)
      (*ff->s.function_exit)();
 
@@ -1792,6 +2252,7 @@ void deinit_fit_functions (void) /*{{{*/
 {
    free_all_fit_functions (Fit_Fun);
    Fit_Fun = NULL;
+   Fun_Cache.max_bytes = 0;
 }
 
 /*}}}*/
@@ -73,6 +73,32 @@ static int poly_b (double *val, Isis_Hist_t *g, double *par, unsigned int npar)
 
 /*}}}*/
 
+static int poly_d (double *dval, Isis_Hist_t *g, double *par, unsigned int npar, unsigned int ipar) /*{{{*/
+{
+   int i;
+   double xh, xl, x;
+
+   (void) par;
+
+   if (ipar >= npar)
+     return -1;
+
+   for (i=0; i < g->n_notice; i++)
+     {
+        int n = g->notice_list[i];
+        xh = g->bin_hi[n];
+        xl = g->bin_lo[n];
+        if (ipar == 0) x = 1.0;
+        else if (ipar == 1) x = (xh + xl) / 2.0;
+        else x = (xh*xh + xh*xl + xl*xl) / 3.0;
+        dval[i] = (xh - xl) * x;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int poly_c (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    int i;
@@ -225,6 +251,7 @@ ISIS_USER_SOURCE_MODULE(poly,p,options) /*{{{*/
      return -1;
 
    p->binned = poly_b;
+   p->binned_deriv = poly_d;
    p->function_exit = NULL;
    p->unbinned = poly_c;
    p->init_params_from_screen = poly_p;
@@ -290,6 +317,45 @@ static int lorentz_b (double *val, Isis_Hist_t *g, double *par, unsigned int npa
 }
 /*}}}*/
 
+static int lorentz_d (double *dval, Isis_Hist_t *g, double *par, unsigned int npar, unsigned int ipar) /*{{{*/
+{
+   double area = par[0];
+   double x0   = par[1];
+   double hfw  = par[2] / 2.0;           /* fwhm/2 */
+   int i;
+
+   /* the delta-function limit has no derivative */
+   if ((ipar >= npar) || (hfw <= 0.0))
+     return -1;
+
+   for (i=0; i < g->n_notice; i++)
+     {
+        double dxh, dxl, fh, fl;
+        int n = g->notice_list[i];
+
+        dxh = (g->bin_hi[n] - x0) / hfw;
+        dxl = (g->bin_lo[n] - x0) / hfw;
+        fh = 1.0 / (1.0 + dxh * dxh);
+        fl = 1.0 / (1.0 + dxl * dxl);
+
+        switch (ipar)
+          {
+           case 0:
+             dval[i] = (atan (dxh) - atan (dxl)) / PI;
+             break;
+           case 1:
+             dval[i] = area * (fl - fh) / (PI * hfw);
+             break;
+           default:
+             dval[i] = 0.5 * area * (dxl * fl - dxh * fh) / (PI * hfw);
+             break;
+          }
+     }
+
+   return 0;
+}
+/*}}}*/
+
 static int lorentz_c (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double area = par[0];
@@ -378,6 +444,7 @@ ISIS_USER_SOURCE_MODULE(Lorentz,p,options) /*{{{*/
      return -1;
 
    p->binned = lorentz_b;
+   p->binned_deriv = lorentz_d;
    p->function_exit = NULL;
    p->unbinned = lorentz_c;
    p->init_params_from_screen = lorentz_p;
@@ -431,6 +498,53 @@ static int gauss_b (double *val, Isis_Hist_t *g, double *par, unsigned int npar)
 
 /*}}}*/
 
+/* derivative of area * (P(dxh) - P(dxl)) */
+static double gauss_bin_deriv (double area, double sigma, double dxh, double dxl, /*{{{*/
+                               unsigned int ipar)
+{
+   double ph, pl;
+
+   if (ipar == 0)
+     return isis_gpf (dxh) - isis_gpf (dxl);
+
+   ph = exp (-0.5 * dxh * dxh) / sqrt (2*PI);
+   pl = exp (-0.5 * dxl * dxl) / sqrt (2*PI);
+
+   if (ipar == 1)
+     return area * (pl - ph) / sigma;
+
+   return area * (dxl * pl - dxh * ph) / sigma;
+}
+
+/*}}}*/
+
+static int gauss_d (double *dval, Isis_Hist_t *g, double *par, unsigned int npar, unsigned int ipar) /*{{{*/
+{
+   double area = par[0];
+   double x0   = par[1];
+   double sigma= par[2];
+   int i;
+
+   /* the delta-function limit has no derivative */
+   if ((ipar >= npar) || (sigma <= 0.0))
+     return -1;
+
+   for (i=0; i < g->n_notice; i++)
+     {
+        double dxh, dxl;
+        int n = g->notice_list[i];
+
+        dxh = (g->bin_hi[n] - x0) / sigma;
+        dxl = (g->bin_lo[n] - x0) / sigma;
+
+        dval[i] = gauss_bin_deriv (area, sigma, dxh, dxl, ipar);
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int gauss_c (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double area  = par[0];
@@ -520,6 +634,7 @@ ISIS_USER_SOURCE_MODULE(gauss,p,options) /*{{{*/
      return -1;
 
    p->binned = gauss_b;
+   p->binned_deriv = gauss_d;
    p->function_exit = NULL;
    p->unbinned = gauss_c;
    p->init_params_from_screen = gauss_p;
@@ -575,6 +690,34 @@ static int egauss_b (double *val, Isis_Hist_t *g, double *par, unsigned int npar
 
 /*}}}*/
 
+static int egauss_d (double *dval, Isis_Hist_t *g, double *par, unsigned int npar, unsigned int ipar) /*{{{*/
+{
+   double area = par[0];
+   double e0   = par[1];
+   double sigma= par[2];
+   int i;
+
+   if ((ipar >= npar) || (sigma <= 0.0))
+     return -1;
+
+   for (i=0; i < g->n_notice; i++)
+     {
+        double elo, ehi, dxh, dxl;
+        int n = g->notice_list[i];
+
+        elo = KEV_ANGSTROM / g->bin_hi[n];
+        ehi = KEV_ANGSTROM / g->bin_lo[n];
+
+        dxh = (ehi - e0) / sigma;
+        dxl = (elo - e0) / sigma;
+        dval[i] = gauss_bin_deriv (area, sigma, dxh, dxl, ipar);
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int egauss_c (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double area  = par[0];
@@ -619,6 +762,7 @@ ISIS_USER_SOURCE_MODULE(egauss,p,options) /*{{{*/
      return -1;
 
    p->binned = egauss_b;
+   p->binned_deriv = egauss_d;
    p->function_exit = NULL;
    p->unbinned = egauss_c;
    p->init_params_from_screen = NULL;;
@@ -668,6 +812,47 @@ static int powr_b (double *val, Isis_Hist_t *g, double *par, unsigned int npar)
 
 /*}}}*/
 
+static int powr_d (double *dval, Isis_Hist_t *g, double *par, unsigned int npar, unsigned int ipar) /*{{{*/
+{
+   double norm = par[0];
+   double alph = par[1];
+   double oma = 1.0 + alph;
+   int i, n;
+
+   if (ipar >= npar)
+     return -1;
+
+   for (i=0; i < g->n_notice; i++)
+     {
+        double lu, lv;
+
+        n = g->notice_list[i];
+        lu = log (KEV_ANGSTROM / g->bin_lo[n]);
+        lv = log (KEV_ANGSTROM / g->bin_hi[n]);
+
+        if (fabs(oma) > 1.e4 * DBL_EPSILON)
+          {
+             double pu = exp (oma * lu);
+             double pv = exp (oma * lv);
+             if (ipar == 0)
+               dval[i] = (pu - pv) / oma;
+             else
+               dval[i] = norm * ((pu * lu - pv * lv) - (pu - pv) / oma) / oma;
+          }
+        else
+          {
+             if (ipar == 0)
+               dval[i] = lu - lv;
+             else
+               dval[i] = 0.5 * norm * (lu * lu - lv * lv);
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int powr_c (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double norm = par[0];
@@ -700,6 +885,7 @@ ISIS_USER_SOURCE_MODULE(Powerlaw,p,options) /*{{{*/
      return -1;
 
    p->binned = powr_b;
+   p->binned_deriv = powr_d;
    p->function_exit = NULL;
    p->unbinned = powr_c;
    p->init_params_from_screen = NULL;
@@ -880,27 +880,100 @@ int Fit_get_param_value (Param_t *pt, unsigned int idx, double *value) /*{{{*/
 
 /*}}}*/
 
-double *Fit_get_kernel_params (Param_t *pt, int id, Isis_Kernel_Def_t *def) /*{{{*/
+static int is_derived (Param_Info_t *p, void *cl) /*{{{*/
+{
+   (void) cl;
+   return (p->in_use && (p->fun_str != NULL));
+}
+
+/*}}}*/
+
+int Fit_have_derived_params (Param_t *pt) /*{{{*/
+{
+   return (-1 == map_table (pt, ALL_PARS, is_derived, NULL));
+}
+
+/*}}}*/
+
+static int is_tied (Param_Info_t *p, void *cl) /*{{{*/
+{
+   (void) cl;
+   return (p->in_use && (p->tie_param_name != NULL));
+}
+
+/*}}}*/
+
+int Fit_have_tied_params (Param_t *pt) /*{{{*/
+{
+   return (-1 == map_table (pt, ALL_PARS, is_tied, NULL));
+}
+
+/*}}}*/
+
+/* Returns 1 if the current parameter values of the given
+ * function instance are identical to par[], 0 otherwise
+ */
+int Fit_fun_params_match (Param_t *pt, unsigned int fun_type, unsigned int fun_id, /*{{{*/
+                          double *par, unsigned int num_params)
+{
+   unsigned int i;
+
+   if ((NULL == (pt = locate_fun_params (pt, fun_type, fun_id)))
+       || (pt->num_params != num_params))
+     return 0;
+
+   for (i = 0; i < num_params; i++)
+     {
+        if (pt->info[i].value != par[i])
+          return 0;
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
+int Fit_copy_kernel_params (Param_t *pt, int id, Isis_Kernel_Def_t *def, double *kp) /*{{{*/
 {
-   double *kp;
    Param_t *fun;
    unsigned int i;
 
    /* std kernel has kernel_id = 0 */
-   if ((def == NULL)
+   if ((def == NULL) || (kp == NULL)
        || (def->kernel_id == 0)
        || (def->num_kernel_parms == 0))
-     return NULL;
+     return -1;
 
    if (NULL == (fun = locate_fun_params (pt, def->fun_type, id)))
+     return -1;
+
+   for (i = 0; i < def->num_kernel_parms; i++)
+     {
+        kp[i] = fun->info[i].value;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+double *Fit_get_kernel_params (Param_t *pt, int id, Isis_Kernel_Def_t *def) /*{{{*/
+{
+   double *kp;
+
+   /* std kernel has kernel_id = 0 */
+   if ((def == NULL)
+       || (def->kernel_id == 0)
+       || (def->num_kernel_parms == 0))
      return NULL;
 
    if (NULL == (kp = (double *) ISIS_MALLOC (def->num_kernel_parms * sizeof(double))))
      return NULL;
 
-   for (i = 0; i < def->num_kernel_parms; i++)
+   if (-1 == Fit_copy_kernel_params (pt, id, def, kp))
      {
-        kp[i] = fun->info[i].value;
+        ISIS_FREE (kp);
+        return NULL;
      }
 
    return kp;
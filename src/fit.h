@@ -63,6 +63,8 @@ extern void Fit_get_fun_info (char *name);
 extern int Fit_is_valid_fit_fun (Fit_Fun_t *ff_test);
 extern int Fit_set_fun_post_hook (char *fun_name);
 extern int Fit_set_fun_trace_hook (char *fun_name);
+extern void Fit_set_fun_cache_size (double *max_mbytes);
+extern void Fit_push_fun_cache_stats (void);
 
 struct _Fit_Param_t
 {
@@ -110,6 +112,11 @@ struct _Fit_Fun_t
    void *client_data;
 };
 
+extern int Fit_cached_bin_eval (Fit_Fun_t *ff, unsigned int fun_id, Isis_Hist_t *g,
+                                double *par, unsigned int num_extra_args,
+                                SLang_Struct_Type *qualifiers);
+extern void Fit_reset_grid_hash (void);
+
 struct _Param_Info_t
 {
    double value;
@@ -189,6 +196,11 @@ extern int Fit_append_kernel (Isis_Kernel_Def_t *head, Isis_Kernel_Def_t *def);
 extern Isis_Kernel_Def_t * Fit_find_kernel (Isis_Kernel_Def_t *t, unsigned int kernel_id);
 extern Isis_Kernel_Def_t * Fit_find_kernel_by_name (Isis_Kernel_Def_t *t, char *kernel_name);
 extern double *Fit_get_kernel_params (Param_t *pt, int hist_index, Isis_Kernel_Def_t *def);
+extern int Fit_copy_kernel_params (Param_t *pt, int hist_index, Isis_Kernel_Def_t *def, double *kp);
+extern int Fit_have_derived_params (Param_t *pt);
+extern int Fit_have_tied_params (Param_t *pt);
+extern int Fit_fun_params_match (Param_t *pt, unsigned int fun_type, unsigned int fun_id,
+                                 double *par, unsigned int num_params);
 extern int Fit_set_kernel_param_default (Isis_Kernel_Def_t *def,
                                          int fun_par, Param_Info_t *p);
 
@@ -291,6 +303,53 @@ extern void verbose_info_hook (void *clientdata, double chisqr,
 
 extern int get_confidence_limits (Fit_Object_Type *fo, Param_t *pt, Isis_Fit_CLC_Type *ctrl,
                                   int idx, double *pconf_min, double *pconf_max);
+extern int get_confidence_limits_parallel (Fit_Object_Type *fo, Param_t *pt,
+                                           Isis_Fit_CLC_Type *ctrl, int *idx, unsigned int n,
+                                           double *covar, unsigned int nv_covar,
+                                           unsigned int num_workers,
+                                           int max_restarts, int max_param_retries,
+                                           double *pconf_min, double *pconf_max);
+
+typedef struct
+{
+   unsigned int ix, iy;         /* grid parameter indices */
+   double *xs, *ys;             /* grid values */
+   unsigned int nx, ny;
+   double *map;                 /* [ny][nx] fit-statistic values */
+   unsigned char *skip;         /* optional [ny][nx]; non-zero => not computed */
+   unsigned int num_workers;
+   int (*save)(void *cl, double *map);  /* optional checkpoint */
+   void *save_cl;
+   unsigned int save_interval;  /* grid points between checkpoints */
+}
+Isis_Conf_Map_Type;
+
+extern int conf_map_grid (Fit_Object_Type *fo, Param_t *pt, Isis_Conf_Map_Type *m);
+
+/* ensemble MCMC sampler */
+
+#define ISIS_MCMC_INVALID_LOGP  (-DBL_MAX)
+
+typedef int Isis_Mcmc_Logp_Type (void *cl, double *par, unsigned int npars, double *logp);
+
+typedef struct
+{
+   unsigned int nwalkers;     /* even, >= 2*npars */
+   unsigned int nsteps;
+   unsigned int thin;         /* save every thin-th step */
+   unsigned int num_workers;  /* forked processes evaluating log(p) */
+   double scale;              /* stretch move scale parameter, > 1 */
+   char *file;                /* chain file, may be NULL */
+   int resume;                /* continue from the last step in file */
+   int verbose;
+}
+Isis_Mcmc_Type;
+
+extern int isis_mcmc_init_walkers (double *walkers, unsigned int nwalkers, double *par,
+                                   double *pmin, double *pmax, double width, unsigned int npars);
+extern int isis_mcmc_run (Isis_Mcmc_Type *m, Isis_Mcmc_Logp_Type *logp_fun, void *cl,
+                          double *walkers, double *logp, double *accept, double *tau,
+                          unsigned int npars);
 
 /* engine */
 
@@ -333,6 +392,7 @@ extern Isis_Fit_Engine_Type *Isis_marquardt_feng (char *name, char *sname);
 extern Isis_Fit_Engine_Type *Isis_mpfit_feng (char *name, char *sname);
 extern Isis_Fit_Engine_Type *Isis_subplex_feng (char *name, char *sname);
 extern Isis_Fit_Engine_Type *Isis_simann_feng (char *name, char *sname);
+extern Isis_Fit_Engine_Type *Isis_de_feng (char *name, char *sname);
 extern Isis_Fit_Statistic_Type *Isis_chisqr_stat (void);
 extern Isis_Fit_Statistic_Type *Isis_cash_stat (void);
 extern Isis_Fit_Statistic_Type *Isis_ml_stat (void);
@@ -2661,6 +2661,7 @@ static Isis_Arf_t *_factor_rsp (Isis_Rmf_t *rmf) /*{{{*/
      }
 
    memset ((char *)arf->arf_err, 0, n * sizeof(double));
+   Isis_Response_Serial++;
 
    return arf;
 }
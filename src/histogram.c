@@ -3762,6 +3762,7 @@ int Hist_set_exposure (Hist_t *h, double exposure) /*{{{*/
      return -1;
 
    h->exposure = exposure;
+   Isis_Response_Serial++;
 
    return 0;
 }
@@ -4463,6 +4464,8 @@ int Hist_rebin (Hist_t *h, double *lo, double *hi, int nbins) /*{{{*/
         h->f_rsp.arf = NULL;
      }
 
+   Isis_Response_Serial++;
+
    return finish_hist_init (h);
 
 error_return:
@@ -4793,6 +4796,10 @@ static int update_notice_list (Hist_t *h) /*{{{*/
    if (h->nbins == h->orig_nbins)
      memcpy ((char *)h->orig_notice, (char *)h->notice, h->orig_nbins * sizeof(int));
 
+   /* the data grid or notice list changed, so folded models
+    * kept for re-use no longer match the data */
+   Isis_Response_Serial++;
+
    return 0;
 }
 
@@ -4957,7 +4964,7 @@ static void print_notice_match (Hist_t *h, int *notice) /*{{{*/
 /*}}}*/
 #endif
 
-static int set_model_notice (Hist_t *h) /*{{{*/
+static int set_model_notice (Hist_t *h, int all_channels) /*{{{*/
 {
    Isis_Hist_t *m = &h->model_flux;
    Isis_Rsp_t *r;
@@ -4971,12 +4978,21 @@ static int set_model_notice (Hist_t *h) /*{{{*/
    if (NULL == (notice = (int *) ISIS_MALLOC (h->orig_nbins * sizeof(int))))
      return -1;
 
-   memset ((char *)notice, 0, h->orig_nbins * sizeof(int));
    memset ((char *)m->notice, 0, m->nbins * sizeof(int));
 
-   if (-1 == transfer_notice (h->bin_lo, h->bin_hi, h->notice_list, h->n_notice,
-                              h->orig_bin_lo, h->orig_bin_hi, h->orig_nbins, notice))
-     goto finish;
+   if (all_channels)
+     {
+        int i;
+        for (i = 0; i < h->orig_nbins; i++)
+          notice[i] = 1;
+     }
+   else
+     {
+        memset ((char *)notice, 0, h->orig_nbins * sizeof(int));
+        if (-1 == transfer_notice (h->bin_lo, h->bin_hi, h->notice_list, h->n_notice,
+                                   h->orig_bin_lo, h->orig_bin_hi, h->orig_nbins, notice))
+          goto finish;
+     }
 
    have_multi_rsp = (h->f_rsp.next != NULL) ? 1 : 0;
 
@@ -5050,12 +5066,16 @@ static int update_model_notice_list (Hist_t *h) /*{{{*/
 
    if (allow_ignore)
      {
-        if (-1 == set_model_notice (h))
+        if (-1 == set_model_notice (h, 0))
           return -1;
      }
    else
      {
         int i;
+        /* kernels that use every model bin may also read every
+         * detector channel, so the RMFs must not prune the fold */
+        if (-1 == set_model_notice (h, 1))
+          return -1;
         for (i = 0; i < m->nbins; i++)
           m->notice[i] = 1;
      }
@@ -5063,11 +5083,60 @@ static int update_model_notice_list (Hist_t *h) /*{{{*/
    if (-1 == _update_notice_list (m->notice, &m->notice_list, &m->n_notice, m->nbins))
      return -1;
 
+   Isis_Response_Serial++;
+
    return update_notice_list (h);
 }
 
 /*}}}*/
 
+/* Flag the RMFs that fold for more than one noticed dataset, or
+ * more than once in a combined response, so that they notice the
+ * union of the channel masks rather than the last one set.
+ * While marking, -1 means "seen once".
+ */
+int Hist_mark_shared_rmfs (Hist_t *head) /*{{{*/
+{
+   Isis_Rsp_t *r;
+   Hist_t *h;
+
+   if (head == NULL)
+     return 0;
+
+   for (h = head->next; h != NULL; h = h->next)
+     {
+        for (r = &h->f_rsp; r != NULL; r = r->next)
+          {
+             if (r->rmf != NULL)
+               r->rmf->notice_shared = 0;
+          }
+     }
+
+   for (h = head->next; h != NULL; h = h->next)
+     {
+        if (h->exclude || (Hist_num_data_noticed (h) < 1))
+          continue;
+        for (r = &h->f_rsp; r != NULL; r = r->next)
+          {
+             if (r->rmf != NULL)
+               r->rmf->notice_shared = (r->rmf->notice_shared == 0) ? -1 : 1;
+          }
+     }
+
+   for (h = head->next; h != NULL; h = h->next)
+     {
+        for (r = &h->f_rsp; r != NULL; r = r->next)
+          {
+             if ((r->rmf != NULL) && (r->rmf->notice_shared < 0))
+               r->rmf->notice_shared = 0;
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 int Hist_init_model_structs (Hist_t *h) /*{{{*/
 {
    if (h == NULL)
@@ -6778,6 +6847,8 @@ static int attach_rsp (Hist_t *h, Isis_Rsp_t *rsp) /*{{{*/
         map_rsp_list (h->a_rsp.next, &incr_rsp_refcount);
      }
 
+   Isis_Response_Serial++;
+
    if (-1 == set_fit_response (h, rsp))
      return -1;
 
@@ -7454,7 +7525,11 @@ int Hist_apply_rebin (double *x, Hist_t *h, double **rebinned, int *nbins) /*{{{
 
 /*}}}*/
 
-int Hist_apply_rebin_and_notice_list (double *bin_and_notice_result, double *x, Hist_t *h)/*{{{*/
+/* If work is not NULL, it must hold h->orig_nbins values and
+ * is used in place of a temporary rebinned array.
+ */
+int Hist_apply_rebin_and_notice_list (double *bin_and_notice_result, double *x, Hist_t *h, /*{{{*/
+                                      double *work)
 {
    double *xn;
    int allocated = 0;
@@ -7463,6 +7538,12 @@ int Hist_apply_rebin_and_notice_list (double *bin_and_notice_result, double *x,
    /* optionally rebin the result */
    if (h->nbins == h->orig_nbins)
      xn = x;
+   else if (work != NULL)
+     {
+        if (-1 == apply_rebin (x, h->orig_nbins, h->rebin, h->nbins, work))
+          return -1;
+        xn = work;
+     }
    else
      {
         allocated = 1;
@@ -8079,7 +8160,7 @@ int Hist_flux_corr_model (Hist_t *h, double *bincts) /*{{{*/
      return -1;
    memset ((char *)wt_sum, 0, h->nbins * sizeof(double));
 
-   if (-1 == Hist_apply_rebin_and_notice_list (wt_sum, h->flux_weights, h))
+   if (-1 == Hist_apply_rebin_and_notice_list (wt_sum, h->flux_weights, h, NULL))
      {
         ISIS_FREE(wt_sum);
         return -1;
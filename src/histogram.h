@@ -242,6 +242,7 @@ extern int Hist_print_stats (FILE *fp, Hist_Stat_t *s);
 extern int Hist_get_index (Hist_t *h);
 extern int Hist_orig_hist_size (Hist_t *h);
 extern int Hist_init_model_structs (Hist_t *h);
+extern int Hist_mark_shared_rmfs (Hist_t *head);
 extern int Hist_get_model_grid (Isis_Hist_t *g, Hist_t *h);
 extern int _Hist_get_orig_hist_grid (Hist_t *h, Isis_Hist_t *g);
 extern int Hist_replace_hist_grid (Hist_t *h, double *bin_lo, double *bin_hi, int nbins);
@@ -265,7 +266,7 @@ extern int Hist_rebin_min_counts (Hist_t *h, void *s);
 extern int Hist_rebin_index (Hist_t *h, void *s);
 extern int Hist_get_hist_rebin_info (Hist_t *h, int **rebin, int *orig_nbins);
 extern int Hist_do_rebin (Hist_t *h, int (*rebin_fcn)(Hist_t *, void *), void *s);
-extern int Hist_apply_rebin_and_notice_list (double *bin_and_notice_result, double *x, Hist_t *h);
+extern int Hist_apply_rebin_and_notice_list (double *bin_and_notice_result, double *x, Hist_t *h, double *work);
 extern int Hist_apply_rebin (double *x, Hist_t *h, double **rebinned, int *nbins);
 extern int Hist_rebin (Hist_t *h, double *lo, double *hi, int nbins);
 extern int Hist_set_stat_error_hook (Hist_t *h, SLang_Name_Type *hook, void (*delete_hook)(SLang_Name_Type *));
@@ -140,6 +140,19 @@ struct Isis_Rmf_t
    char instrument[ISIS_RMF_BUFSIZE];
    char *arg_string;		       /* may be NULL */
    void *client_data;
+
+   /* optional: fold that is only required to be correct in
+    * the channels given to set_noticed_model_bins (may be NULL) */
+   int (*redistribute_noticed)(Isis_Rmf_t *, unsigned int, double, double *, unsigned int);
+
+   /* optional: fold a whole packed model vector in one call,
+    * replacing the per-bin redistribute loop (may be NULL) */
+   int (*redistribute_vector)(Isis_Rmf_t *, double *, unsigned int, double *, int *, unsigned int);
+
+   /* set before the model notice lists are built:  nonzero if the
+    * RMF folds for more than one dataset or response, in which case
+    * set_noticed_model_bins must keep the union of the channel masks */
+   int notice_shared;
 };
 
 typedef int Isis_Rmf_Load_Method_t (Isis_Rmf_t *, void *);
@@ -378,6 +391,8 @@ Isis_User_Grid_t;
 
 typedef int Isis_Binned_Function_t (double *, Isis_Hist_t *, double *, unsigned int);
 typedef int Isis_Unbinned_Function_t (double *, Isis_User_Grid_t *, double *, unsigned int);
+/* fills the derivative of the binned model with respect to par[ipar] */
+typedef int Isis_Binned_Derivative_t (double *, Isis_Hist_t *, double *, unsigned int, unsigned int);
 
 enum
 {
@@ -405,6 +420,7 @@ typedef struct
    unsigned int *default_freeze;
    unsigned int num_parameters;
    unsigned int category;          /* addmul, operator, etc. */
+   Isis_Binned_Derivative_t *binned_deriv;   /* optional */
 }
 Isis_User_Source_t;
 
@@ -505,6 +521,14 @@ typedef int Isis_Fit_Fun_Type(Isis_Fit_Statistic_Optional_Data_Type *opt_data,
                               double *x, unsigned int nbins,
                               double *par, unsigned int npars,
                               double *fx);
+/* Computes fx and dfdp[i][k] = d(fx[k])/d(par[i]) for each
+ * non-NULL dfdp[i].  Returns -1 if the derivatives aren't available.
+ * With dfdp == NULL, only reports whether they are available.
+ */
+typedef int Isis_Fit_Jacobian_Type(Isis_Fit_Statistic_Optional_Data_Type *opt_data,
+                                   double *x, unsigned int nbins,
+                                   double *par, unsigned int npars,
+                                   double *fx, double **dfdp);
 struct Isis_Fit_Type
 {
    Isis_Fit_Fun_Type *compute_model;
@@ -512,6 +536,7 @@ struct Isis_Fit_Type
    Isis_Fit_Statistic_Type *stat;
    double statistic;
    double *covariance_matrix;   /* npars x npars */
+   Isis_Fit_Jacobian_Type *compute_jacobian;   /* may be NULL */
 };
 
 extern void isis_fit_free_fit_engine (Isis_Fit_Engine_Type *e);
@@ -59,6 +59,7 @@ extern void random_seed (unsigned long seed);
 extern double urand (void);
 extern double grand (void);
 extern double prand (double rate);
+extern unsigned int rand_index (unsigned int n);
 
 #if 0
 {
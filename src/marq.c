@@ -30,7 +30,8 @@
    double dec;             /* lambda adjustment */                     \
    double add;             /* additive damping factor */               \
    double max_step_frac;   /* max relative param step */               \
-   unsigned int max_loops;
+   unsigned int max_loops;                                             \
+   unsigned int num_workers; /* forked processes for derivatives */
 
 #include "isis.h"
 #include "isismath.h"
@@ -112,70 +113,162 @@ static int howmany_iterations (Isis_Fit_Engine_Type *e) /*{{{*/
 
 /*}}}*/
 
+/* Computes the model y_1 for a step in parameter i, doubling
+ * the step until the model changes; returns the final step in *da.
+ */
+static int compute_dyda_column (Isis_Fit_Type *ft, void *clientdata, /*{{{*/
+                                double *x, unsigned int ny, double *y_a,
+                                double *a, unsigned int nparms, int i,
+                                int count_max, double *y_1, double *da_used)
+{
+   Isis_Fit_Engine_Type *e = ft->engine;
+   Isis_Fit_Statistic_Type *fs = ft->stat;
+   double da, sumsq_diff;
+   double ai = a[i];
+   double a_min = e->par_min[i];
+   double a_max = e->par_max[i];
+   unsigned int k;
+   int count = 0;
+
+   /* recommended by Nash */
+   da = (fabs(ai) + sqrt(e->delta)) * sqrt(e->delta);
+
+   do
+     {
+        double a_test = ai + da;
+
+        /* parameter value must stay in bounds */
+        if (a_test < a_min)
+          a_test = a_min;
+        else if (a_max < a_test)
+          a_test = a_max;
+
+        a[i] = a_test;
+
+        if (-1 == ft->compute_model (fs->opt_data, x, ny, a, nparms, y_1))
+          {
+             a[i] = ai;
+             e->warn_hook (clientdata, "function evaluation failed\n");
+             return -1;
+          }
+
+        sumsq_diff = 0.0;
+        for (k=0; k < ny; k++)
+          {
+             double diff = y_1[k] - y_a[k];
+             sumsq_diff += diff * diff;
+          }
+
+        a[i] = ai;
+        *da_used = da;
+        da *= 2;
+        count++;
+     }
+   while (count < count_max && sumsq_diff == 0.0);
+
+   return 0;
+}
+
+/*}}}*/
+
+typedef struct
+{
+   Isis_Fit_Type *ft;
+   void *clientdata;
+   double *x;
+   double *y_a;
+   double *a;
+   unsigned int ny;
+   unsigned int nparms;
+   int count_max;
+}
+Dyda_Task_Type;
+
+/* result = {da, y_1[0:ny-1]} */
+static int dyda_task (void *cl, unsigned int i, double *result) /*{{{*/
+{
+   Dyda_Task_Type *t = (Dyda_Task_Type *)cl;
+
+   return compute_dyda_column (t->ft, t->clientdata, t->x, t->ny, t->y_a,
+                               t->a, t->nparms, i, t->count_max,
+                               result + 1, result);
+}
+
+/*}}}*/
+
 static int _marquardt_compute_alpha_beta (Isis_Fit_Type *ft, void *clientdata, /*{{{*/
                                           double **alpha, double *beta,
                                           double *x, double *y_dat,
                                           double *weight, unsigned int ny,
                                           double *y_a, double *a,
-                                          unsigned int nparms)
+                                          unsigned int nparms, int *use_jacobian)
 {
    Isis_Fit_Engine_Type *e = ft->engine;
-   Isis_Fit_Statistic_Type *fs = ft->stat;
    double *y_1 = NULL;
+   double *columns = NULL;
    double **dyda = NULL;
    int i, count_max, num_pars = nparms;
    unsigned int k;
    int ret = -1;
-   
+
    if ((count_max = howmany_iterations (e)) < 0)
      return -1;
-   
+
    if (NULL == (dyda = JDMdouble_matrix (nparms,ny))
        || NULL == (y_1 = JDMdouble_vector (ny)))
      goto finish;
 
-   for (i=0; i < num_pars; i++)
+   /* Analytic derivatives need one model evaluation instead of
+    * nparms; if they aren't available, don't ask again.
+    */
+   if (*use_jacobian
+       && (-1 == (*ft->compute_jacobian)(ft->stat->opt_data, x, ny, a, nparms, y_1, dyda)))
+     *use_jacobian = 0;
+
+   /* With analytic derivatives, y_1 already holds the model at a */
+   if ((*use_jacobian == 0) && (e->num_workers > 1) && (nparms > 1))
      {
-        double da, sumsq_diff;
-        double ai = a[i];
-        double a_min = e->par_min[i];
-        double a_max = e->par_max[i];
-        int count = 0;
+        Dyda_Task_Type t;
+        double *c = NULL;
+
+        if (NULL == (columns = (double *) ISIS_MALLOC (nparms * (ny + 1) * sizeof(double))))
+          goto finish;
+
+        t.ft = ft;
+        t.clientdata = clientdata;
+        t.x = x;
+        t.y_a = y_a;
+        t.a = a;
+        t.ny = ny;
+        t.nparms = nparms;
+        t.count_max = count_max;
 
-        /* recommended by Nash */
-        da = (fabs(ai) + sqrt(e->delta)) * sqrt(e->delta);
+        if (-1 == isis_fork_map (nparms, ny + 1, e->num_workers, &dyda_task, &t, columns))
+          goto finish;
 
-        do
+        for (i=0; i < num_pars; i++)
           {
-             double a_test = ai + da;
+             c = columns + i * (ny + 1);
+             for (k=0; k < ny; k++)
+               dyda[i][k] = (c[k+1] - y_a[k]) / c[0];
+          }
 
-             /* parameter value must stay in bounds */
-             if (a_test < a_min)
-               a_test = a_min;
-             else if (a_max < a_test)
-               a_test = a_max;
+        /* y_1 is left holding the last model computed */
+        memcpy ((char *)y_1, (char *)(c + 1), ny * sizeof(double));
+     }
+   else if (*use_jacobian == 0)
+     {
+        for (i=0; i < num_pars; i++)
+          {
+             double da;
 
-             a[i] = a_test;
+             if (-1 == compute_dyda_column (ft, clientdata, x, ny, y_a, a, nparms,
+                                            i, count_max, y_1, &da))
+               goto finish;
 
-             if (-1 == ft->compute_model (fs->opt_data, x, ny, a, nparms, y_1))
-               {
-                  e->warn_hook (clientdata, "function evaluation failed\n");
-                  goto finish;
-               }
-             
-             sumsq_diff = 0.0;
              for (k=0; k < ny; k++)
-               {
-                  double diff = y_1[k] - y_a[k];
-                  dyda[i][k] = diff / da;
-                  sumsq_diff += diff * diff;
-               }
-
-             a[i] = ai;
-             da *= 2;
-             count++;
+               dyda[i][k] = (y_1[k] - y_a[k]) / da;
           }
-        while (count < count_max && sumsq_diff == 0.0);
      }
 
    for (i=0; i < num_pars; i++)
@@ -204,8 +297,9 @@ static int _marquardt_compute_alpha_beta (Isis_Fit_Type *ft, void *clientdata, /
    finish:
 
    ISIS_FREE (y_1);
+   ISIS_FREE (columns);
    JDMfree_double_matrix (dyda,nparms);
-      
+
    return ret;
 }
 
@@ -223,6 +317,7 @@ static int marquardt (Isis_Fit_Type *ft, void *clientdata, /*{{{*/
    unsigned int *piv = NULL;
    double chisqr, chisqr0, chisqr1, lambda, dchisqr = 0.0;
    unsigned int i, j, k;
+   int use_jacobian = (ft->compute_jacobian != NULL);
    int ret = -1;
 
    beta = a1 = y_1 = alpha_diag = vec = NULL;
@@ -265,7 +360,7 @@ static int marquardt (Isis_Fit_Type *ft, void *clientdata, /*{{{*/
      {
         if (-1 == _marquardt_compute_alpha_beta (ft, clientdata,
                                                  alpha, beta, x, y, weight, ny,
-                                                 y_1, a, nparms))
+                                                 y_1, a, nparms, &use_jacobian))
           {
              e->warn_hook (clientdata, "marquardt:  Failed computing matrix of derivatives d(chisqr)/d(param)\n");
              ft->statistic = chisqr;
@@ -389,17 +484,32 @@ static int marquardt (Isis_Fit_Type *ft, void *clientdata, /*{{{*/
 
    finish:
 
-#if 0
-   if (!ret)
+   /* The covariance matrix is the inverse of the undamped
+    * curvature matrix from the last iteration.
+    */
+   if (ret == 0)
      {
+        ISIS_FREE (ft->covariance_matrix);
+
         for (j=0; j < nparms; j++)
-          for (k=0; k < nparms; k++)
-            cov[j][k] = alpha[j][k];
+          {
+             for (k=0; k < nparms; k++)
+               cov[j][k] = alpha[j][k];
+             cov[j][j] = alpha_diag[j];
+          }
 
         if (-1 == JDM_ludecomp_inverse (cov, nparms))
-          vmessage ("singular covariance matrix\n");
+          {
+             if (e->verbose > 0)
+               e->warn_hook (clientdata, "marquardt: singular covariance matrix\n");
+          }
+        else if (NULL != (ft->covariance_matrix = (double *) ISIS_MALLOC (nparms * nparms * sizeof(double))))
+          {
+             for (j=0; j < nparms; j++)
+               for (k=0; k < nparms; k++)
+                 ft->covariance_matrix[j*nparms + k] = cov[j][k];
+          }
      }
-#endif
 
    JDMfree_double_matrix (cov, nparms);
    JDMfree_double_matrix (alpha, nparms);
@@ -520,6 +630,22 @@ static int handle_loops_option (char *subsystem, char *optname, char *value, voi
 
 /*}}}*/
 
+static int handle_workers_option (char *subsystem, char *optname, char *value, void *clientdata) /*{{{*/
+{
+   Isis_Fit_Engine_Type *e;
+   unsigned int num_workers;
+   e = (Isis_Fit_Engine_Type *) clientdata;
+   if (1 != sscanf (value, "%u", &num_workers))
+     {
+        fprintf (stderr, "%s;%s option requires an unsigned int\n", subsystem, optname);
+        return -1;
+     }
+   e->num_workers = num_workers;
+   return isis_update_option_string (&e->option_string, optname, value);
+}
+
+/*}}}*/
+
 static Isis_Option_Table_Type Option_Table [] =
 {
      {"tol", handle_tol_option, ISIS_OPT_REQUIRES_VALUE, "1.e-4", "Fractional chisqr acceptance tolerance"},
@@ -529,6 +655,7 @@ static Isis_Option_Table_Type Option_Table [] =
      {"add", handle_add_option, ISIS_OPT_REQUIRES_VALUE, "0.0", "Additive damping factor"},
      {"max_step_frac", handle_max_step_option, ISIS_OPT_REQUIRES_VALUE, "0.0", "Max relative param step"},
      {"max_loops", handle_loops_option, ISIS_OPT_REQUIRES_VALUE, "50", "Max number of iterations"},
+     {"workers", handle_workers_option, ISIS_OPT_REQUIRES_VALUE, "0", "Number of forked processes computing derivatives"},
      ISIS_OPTION_TABLE_TYPE_NULL
 };
 
@@ -590,6 +717,7 @@ ISIS_FIT_ENGINE_METHOD(marquardt,name,sname)
    e->add = 0.0;
    e->max_step_frac = 0.0;
    e->max_loops = 50;
+   e->num_workers = 0;
 
    e->option_string = isis_make_default_option_string ("marquardt", Option_Table);
    if (e->option_string == NULL)
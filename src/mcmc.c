@@ -0,0 +1,496 @@
+/* -*- mode: C; mode: fold -*- */
+
+/*  This file is part of ISIS, the Interactive Spectral Interpretation System
+    Copyright (C) 1998-2005 Massachusetts Institute of Technology
+
+    This software was developed by the MIT Center for Space Research under
+    contract SV1-61010 from the Smithsonian Institution.
+
+    Author:  John C. Houck  <houck@space.mit.edu>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* $Id$ */
+
+/*{{{ includes */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+
+#include <slang.h>
+
+#include "isis.h"
+#include "isismath.h"
+#include "util.h"
+#include "fit.h"
+#include "errors.h"
+
+/*}}}*/
+
+/* Affine-invariant ensemble sampler using the "stretch move" of
+ * Goodman & Weare (2010, Comm. App. Math. Comp. Sci. 5, 65).
+ * The ensemble is split into two halves;  proposals for every walker
+ * in one half are built from the current positions of the other
+ * half, so a whole half-ensemble may be evaluated at once.
+ *
+ * The chain file starts with a short header
+ *     char magic[8] = "ISISMCMC";
+ *     unsigned int npars, nwalkers;
+ * followed by one record per saved step, each holding, for every
+ * walker, npars parameter values followed by log(p).  Values are
+ * written in native byte order.
+ */
+
+#define MCMC_MAGIC         "ISISMCMC"
+#define MCMC_MAGIC_LEN     8
+#define MCMC_HEADER_SIZE   (MCMC_MAGIC_LEN + 2*sizeof(unsigned int))
+#define MCMC_MAX_TRIES     100
+#define MCMC_WINDOW        5.0
+
+typedef struct
+{
+   Isis_Mcmc_Logp_Type *logp;
+   void *cl;
+   double *prop;
+   unsigned int npars;
+}
+Mcmc_Task_Type;
+
+int isis_mcmc_init_walkers (double *walkers, unsigned int nwalkers, double *par, /*{{{*/
+                            double *pmin, double *pmax, double width, unsigned int npars)
+{
+   unsigned int k, i;
+
+   if ((walkers == NULL) || (par == NULL) || (nwalkers == 0))
+     return -1;
+
+   memcpy ((char *)walkers, (char *)par, npars * sizeof(double));
+
+   for (k = 1; k < nwalkers; k++)
+     {
+        double *w = walkers + k * npars;
+        for (i = 0; i < npars; i++)
+          {
+             double s = width * ((par[i] != 0.0) ? fabs(par[i]) : 1.0);
+             unsigned int tries = 0;
+             do
+               {
+                  w[i] = par[i] + s * grand ();
+               }
+             while (((w[i] < pmin[i]) || (pmax[i] < w[i]))
+                    && (++tries < MCMC_MAX_TRIES));
+
+             if (tries == MCMC_MAX_TRIES)
+               w[i] = pmin[i] + (pmax[i] - pmin[i]) * urand ();
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/*{{{ chain file */
+
+static FILE *open_chain_file (char *file, int resume, unsigned int npars, /*{{{*/
+                              unsigned int nwalkers, double *walkers, double *logp,
+                              int *have_logp)
+{
+   size_t rec_size = nwalkers * (npars + 1) * sizeof(double);
+   unsigned int hdr[2];
+   char magic[MCMC_MAGIC_LEN];
+   FILE *fp = NULL;
+   long size, nrec;
+
+   *have_logp = 0;
+
+   if (resume && (NULL != (fp = fopen (file, "r+b"))))
+     {
+        if ((1 != fread (magic, MCMC_MAGIC_LEN, 1, fp))
+            || (0 != memcmp (magic, MCMC_MAGIC, MCMC_MAGIC_LEN))
+            || (2 != fread (hdr, sizeof(unsigned int), 2, fp)))
+          {
+             isis_vmesg (FAIL, I_READ_FAILED, __FILE__, __LINE__, "%s: not an MCMC chain file", file);
+             goto return_error;
+          }
+
+        if ((hdr[0] != npars) || (hdr[1] != nwalkers))
+          {
+             isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__,
+                         "%s: chain has %u parameters and %u walkers, expected %u and %u",
+                         file, hdr[0], hdr[1], npars, nwalkers);
+             goto return_error;
+          }
+
+        if ((0 != fseek (fp, 0, SEEK_END))
+            || (-1 == (size = ftell (fp))))
+          goto read_error;
+
+        /* a trailing partial record is overwritten */
+        nrec = (size - (long) MCMC_HEADER_SIZE) / (long) rec_size;
+
+        if (nrec > 0)
+          {
+             double *rec, *r;
+             unsigned int k;
+
+             if (NULL == (rec = (double *) ISIS_MALLOC (rec_size)))
+               goto return_error;
+
+             if ((0 != fseek (fp, (long) MCMC_HEADER_SIZE + (nrec-1) * (long) rec_size, SEEK_SET))
+                 || (1 != fread (rec, rec_size, 1, fp)))
+               {
+                  ISIS_FREE (rec);
+                  goto read_error;
+               }
+
+             for (k = 0, r = rec; k < nwalkers; k++, r += npars + 1)
+               {
+                  memcpy ((char *)(walkers + k * npars), (char *)r, npars * sizeof(double));
+                  logp[k] = r[npars];
+               }
+             ISIS_FREE (rec);
+             *have_logp = 1;
+          }
+        else nrec = 0;
+
+        if (0 != fseek (fp, (long) MCMC_HEADER_SIZE + nrec * (long) rec_size, SEEK_SET))
+          goto read_error;
+
+        return fp;
+     }
+
+   if (NULL == (fp = fopen (file, "wb")))
+     {
+        isis_vmesg (FAIL, I_WRITE_OPEN_FAILED, __FILE__, __LINE__, "%s", file);
+        return NULL;
+     }
+
+   hdr[0] = npars;
+   hdr[1] = nwalkers;
+
+   if ((1 != fwrite (MCMC_MAGIC, MCMC_MAGIC_LEN, 1, fp))
+       || (2 != fwrite (hdr, sizeof(unsigned int), 2, fp)))
+     {
+        isis_vmesg (FAIL, I_WRITE_FAILED, __FILE__, __LINE__, "%s", file);
+        goto return_error;
+     }
+
+   return fp;
+
+   read_error:
+   isis_vmesg (FAIL, I_READ_FAILED, __FILE__, __LINE__, "%s", file);
+   return_error:
+   (void) fclose (fp);
+   return NULL;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/* Integrated autocorrelation time of parameter ip, averaging the
+ * normalized autocorrelation function over walkers and truncating
+ * the sum with the self-consistent window of Sokal (1989).
+ */
+static double autocorr_time (double *chain, unsigned int nrec, unsigned int nwalkers, /*{{{*/
+                             unsigned int npars, unsigned int ip,
+                             double *mean, double *var, int *converged)
+{
+   unsigned int stride = npars + 1;
+   unsigned int k, i, t, nused = 0;
+   double tau = 1.0;
+
+   *converged = 0;
+
+#define X(i,k) chain[((i)*nwalkers + (k))*stride + ip]
+
+   for (k = 0; k < nwalkers; k++)
+     {
+        double m = 0.0, v = 0.0;
+        for (i = 0; i < nrec; i++)
+          m += X(i,k);
+        m /= nrec;
+        for (i = 0; i < nrec; i++)
+          {
+             double d = X(i,k) - m;
+             v += d * d;
+          }
+        mean[k] = m;
+        var[k] = v;
+        if (v > 0.0)
+          nused++;
+     }
+
+   if (nused == 0)
+     return (double) nrec;
+
+   for (t = 1; t < nrec; t++)
+     {
+        double rho = 0.0;
+
+        for (k = 0; k < nwalkers; k++)
+          {
+             double c = 0.0, m = mean[k];
+             if (var[k] <= 0.0)
+               continue;
+             for (i = 0; i + t < nrec; i++)
+               c += (X(i,k) - m) * (X(i+t,k) - m);
+             rho += c / var[k];
+          }
+
+        tau += 2.0 * rho / nused;
+
+        if (t >= MCMC_WINDOW * tau)
+          {
+             *converged = 1;
+             break;
+          }
+     }
+
+#undef X
+
+   return tau;
+}
+
+/*}}}*/
+
+static int logp_task (void *cl, unsigned int task, double *result) /*{{{*/
+{
+   Mcmc_Task_Type *mt = (Mcmc_Task_Type *) cl;
+   double *p = mt->prop + task * mt->npars;
+
+   if (-1 == mt->logp (mt->cl, p, mt->npars, result))
+     return -1;
+
+   if (isnan (*result))
+     *result = ISIS_MCMC_INVALID_LOGP;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int accept_move (double logp_new, double logp_old, double log_z) /*{{{*/
+{
+   if (logp_new == ISIS_MCMC_INVALID_LOGP)
+     return 0;
+   if (logp_old == ISIS_MCMC_INVALID_LOGP)
+     return 1;
+   return log (urand ()) < log_z + logp_new - logp_old;
+}
+
+/*}}}*/
+
+int isis_mcmc_run (Isis_Mcmc_Type *m, Isis_Mcmc_Logp_Type *logp_fun, void *cl, /*{{{*/
+                   double *walkers, double *logp, double *accept, double *tau,
+                   unsigned int npars)
+{
+   Mcmc_Task_Type mt;
+   FILE *fp = NULL;
+   double *prop = NULL, *prop_logp = NULL, *log_z = NULL;
+   double *chain = NULL, *work = NULL;
+   unsigned int *naccept = NULL;
+   unsigned int nwalkers, half, nrec, step, k, i;
+   unsigned int stride = npars + 1;
+   double a;
+   int have_logp = 0;
+   int ret = -1;
+
+   if ((m == NULL) || (logp_fun == NULL) || (walkers == NULL) || (npars == 0))
+     return -1;
+
+   nwalkers = m->nwalkers;
+   half = nwalkers / 2;
+   a = m->scale;
+
+   if ((nwalkers % 2) || (nwalkers < 2 * npars) || (nwalkers < 4))
+     {
+        isis_vmesg (FAIL, I_INVALID, __FILE__, __LINE__,
+                    "number of walkers must be even and at least 2*npars = %u", 2*npars);
+        return -1;
+     }
+
+   if (a <= 1.0)
+     {
+        isis_vmesg (FAIL, I_INVALID, __FILE__, __LINE__, "stretch scale must be > 1");
+        return -1;
+     }
+
+   if (m->thin == 0)
+     m->thin = 1;
+   nrec = m->nsteps / m->thin;
+
+   if ((NULL == (prop = (double *) ISIS_MALLOC (half * npars * sizeof(double))))
+       || (NULL == (prop_logp = (double *) ISIS_MALLOC (half * sizeof(double))))
+       || (NULL == (log_z = (double *) ISIS_MALLOC (half * sizeof(double))))
+       || (NULL == (work = (double *) ISIS_MALLOC (2 * nwalkers * sizeof(double))))
+       || (NULL == (naccept = (unsigned int *) ISIS_MALLOC (nwalkers * sizeof(unsigned int))))
+       || ((nrec > 0)
+           && (NULL == (chain = (double *) ISIS_MALLOC (nrec * nwalkers * stride * sizeof(double))))))
+     goto finish;
+
+   memset ((char *)naccept, 0, nwalkers * sizeof(unsigned int));
+
+   if ((m->file != NULL) && (*m->file != 0))
+     {
+        fp = open_chain_file (m->file, m->resume, npars, nwalkers, walkers, logp, &have_logp);
+        if (fp == NULL)
+          goto finish;
+     }
+
+   mt.logp = logp_fun;
+   mt.cl = cl;
+   mt.npars = npars;
+
+   if (have_logp == 0)
+     {
+        mt.prop = walkers;
+        if (-1 == isis_fork_map (nwalkers, 1, m->num_workers, &logp_task, (void *) &mt, logp))
+          goto finish;
+     }
+
+   mt.prop = prop;
+
+   for (step = 0; step < m->nsteps; step++)
+     {
+        unsigned int h;
+
+        for (h = 0; h < 2; h++)
+          {
+             unsigned int first = h * half;
+             unsigned int other = (1 - h) * half;
+
+             for (k = 0; k < half; k++)
+               {
+                  double *xk = walkers + (first + k) * npars;
+                  double *xj = walkers + (other + rand_index (half)) * npars;
+                  double *y = prop + k * npars;
+                  double u = (a - 1.0) * urand () + 1.0;
+                  double z = u * u / a;
+
+                  for (i = 0; i < npars; i++)
+                    y[i] = xj[i] + z * (xk[i] - xj[i]);
+
+                  log_z[k] = (npars - 1) * log (z);
+               }
+
+             if (-1 == isis_fork_map (half, 1, m->num_workers, &logp_task, (void *) &mt, prop_logp))
+               goto finish;
+
+             for (k = 0; k < half; k++)
+               {
+                  unsigned int w = first + k;
+                  if (accept_move (prop_logp[k], logp[w], log_z[k]))
+                    {
+                       memcpy ((char *)(walkers + w * npars), (char *)(prop + k * npars),
+                               npars * sizeof(double));
+                       logp[w] = prop_logp[k];
+                       naccept[w]++;
+                    }
+               }
+          }
+
+        if ((step + 1) % m->thin == 0)
+          {
+             double *r = chain + ((step + 1) / m->thin - 1) * nwalkers * stride;
+
+             for (k = 0; k < nwalkers; k++, r += stride)
+               {
+                  memcpy ((char *)r, (char *)(walkers + k * npars), npars * sizeof(double));
+                  r[npars] = logp[k];
+               }
+
+             if (fp != NULL)
+               {
+                  r -= nwalkers * stride;
+                  if ((nwalkers * stride != fwrite (r, sizeof(double), nwalkers * stride, fp))
+                      || (0 != fflush (fp)))
+                    {
+                       isis_vmesg (FAIL, I_WRITE_FAILED, __FILE__, __LINE__, "%s", m->file);
+                       goto finish;
+                    }
+               }
+          }
+
+        if ((m->verbose > 0) && (((step + 1) % 100 == 0) || (step + 1 == m->nsteps)))
+          {
+             unsigned int n = 0;
+             for (k = 0; k < nwalkers; k++)
+               n += naccept[k];
+             fprintf (stdout, "mcmc: step %u/%u, acceptance fraction %0.3f\n",
+                      step + 1, m->nsteps, (double) n / ((double) nwalkers * (step + 1)));
+          }
+     }
+
+   if (accept != NULL)
+     {
+        for (k = 0; k < nwalkers; k++)
+          accept[k] = (m->nsteps > 0) ? (double) naccept[k] / m->nsteps : 0.0;
+     }
+
+   if (tau != NULL)
+     {
+        int warned = 0;
+        for (i = 0; i < npars; i++)
+          {
+             int converged;
+             if (nrec < 2)
+               {
+                  tau[i] = isis_nan ();
+                  continue;
+               }
+             tau[i] = autocorr_time (chain, nrec, nwalkers, npars, i,
+                                     work, work + nwalkers, &converged);
+             if ((converged == 0) && (warned == 0))
+               {
+                  isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__,
+                              "chain is too short for a reliable autocorrelation time estimate");
+                  warned = 1;
+               }
+             /* in units of steps, not saved records */
+             tau[i] *= m->thin;
+          }
+     }
+
+   ret = 0;
+
+   finish:
+
+   if ((fp != NULL) && (0 != fclose (fp)) && (ret == 0))
+     {
+        isis_vmesg (FAIL, I_WRITE_FAILED, __FILE__, __LINE__, "%s", m->file);
+        ret = -1;
+     }
+
+   ISIS_FREE (prop);
+   ISIS_FREE (prop_logp);
+   ISIS_FREE (log_z);
+   ISIS_FREE (work);
+   ISIS_FREE (naccept);
+   ISIS_FREE (chain);
+
+   return ret;
+}
+
+/*}}}*/
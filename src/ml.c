@@ -41,32 +41,75 @@
 
 /* ML statistic */
 
+/* log(y!) for small integer counts, which are by far the most common
+ * data values;  lgamma is comparatively expensive */
+#define NUM_LOG_FACTORIALS 1024
+static double Log_Factorial[NUM_LOG_FACTORIALS];
+static int Log_Factorial_Ready;
+
+static void init_log_factorials (void) /*{{{*/
+{
+   unsigned int i;
+
+   Log_Factorial[0] = 0.0;
+   for (i = 1; i < NUM_LOG_FACTORIALS; i++)
+     {
+        Log_Factorial[i] = lgamma ((double) i + 1.0);
+     }
+
+   Log_Factorial_Ready = 1;
+}
+
+/*}}}*/
+
+static double log_factorial (double y) /*{{{*/
+{
+   if ((y >= 0.0) && (y < NUM_LOG_FACTORIALS))
+     {
+        unsigned int k = (unsigned int) y;
+        if ((double) k == y)
+          return Log_Factorial[k];
+     }
+
+   return lgamma (y + 1);
+}
+
+/*}}}*/
+
 static int ml_function (Isis_Fit_Statistic_Type *st, /*{{{*/
                           double *y, double *fx, double *w, unsigned int npts,
                           double *vec, double *stat)
 {
-   double sum, s, *val;
-   unsigned int i;
+   double sum, c;
+   unsigned int i, k, n;
 
    (void) w;
    (void) st;
 
-   if (NULL == (val = (double *) ISIS_MALLOC (npts * sizeof(double))))
-     return -1;
+   if (Log_Factorial_Ready == 0)
+     init_log_factorials ();
+
+   sum = 0.0;
+   c = 0.0;
 
-   for (i = 0; i < npts; i++)
+   /* vec holds the per-bin terms, so each block is summed
+    * right after it is computed, while still in cache */
+   for (k = 0; k < npts; k += n)
      {
-        double fxi = fx[i];
-        double log_fxi = (fxi > 0) ? log(fxi) : (double) DBL_MIN_10_EXP;
+        n = npts - k;
+        if (n > ISIS_SUM_BLOCK)
+          n = ISIS_SUM_BLOCK;
 
-        s = 2 * (fxi + lgamma (y[i] + 1) - y[i] * log_fxi);
+        for (i = k; i < k + n; i++)
+          {
+             double fxi = fx[i];
+             double log_fxi = (fxi > 0) ? log(fxi) : (double) DBL_MIN_10_EXP;
 
-        val[i] = s;
-        vec[i] = s;
-     }
+             vec[i] = 2 * (fxi + log_factorial (y[i]) - y[i] * log_fxi);
+          }
 
-   sum = isis_kahan_sum (val, npts);
-   ISIS_FREE(val);
+        isis_kahan_add (&sum, &c, isis_pairwise_sum (vec + k, n));
+     }
 
    if (0 == isfinite (sum))
      sum = DBL_MAX;
@@ -518,6 +518,61 @@ static void do_model_calculation (Model_t *m) /*{{{*/
 
 /*}}}*/
 
+static void gauss_cdf_intrin (void) /*{{{*/
+{
+   SLang_Array_Type *sl_x = NULL, *sl_p = NULL;
+   double *x, *p;
+   SLuindex_Type i;
+
+   if (-1 == SLang_pop_array_of_type (&sl_x, SLANG_DOUBLE_TYPE))
+     return;
+
+   if (NULL == (sl_p = SLang_create_array (SLANG_DOUBLE_TYPE, 0, NULL, sl_x->dims, sl_x->num_dims)))
+     {
+        SLang_free_array (sl_x);
+        return;
+     }
+
+   x = (double *)sl_x->data;
+   p = (double *)sl_p->data;
+
+   for (i = 0; i < sl_x->num_elements; i++)
+     p[i] = Model_gauss_cdf (x[i]);
+
+   SLang_free_array (sl_x);
+   SLang_push_array (sl_p, 1);
+}
+
+/*}}}*/
+
+/* val[] = _thermal_line_profile (lo[], hi[], flux, wl, sigma) */
+static void thermal_line_profile_intrin (double *flux, double *wl, double *sigma) /*{{{*/
+{
+   Model_Result_Type gr;
+
+   memset ((char *)&gr, 0, sizeof gr);
+
+   if (-1 == get_model_grid (&gr))
+     {
+        isis_vmesg (INTR, I_WARNING, __FILE__, __LINE__, "wavelength grid not set");
+        goto finish;
+     }
+
+   if (-1 == Model_spread_gaussian ((double *)gr.lo->data, (double *)gr.hi->data,
+                                    gr.lo->num_elements, (double *)gr.val->data,
+                                    *flux, *wl, *sigma))
+     {
+        isis_vmesg (INTR, I_INVALID, __FILE__, __LINE__, "line center %g is not on the grid", *wl);
+     }
+
+   finish:
+
+   SLang_push_array (gr.val, 1);
+   free_model_grid (&gr);
+}
+
+/*}}}*/
+
 static int handle_abundance_list (SLang_Array_Type **sl_abun, SLang_Array_Type **sl_elem) /*{{{*/
 {
    *sl_abun = *sl_elem = NULL;
@@ -831,12 +886,22 @@ static SLang_IConstant_Type Model_Intrin_Const [] = /*{{{*/
 };
 /*}}}*/
 
+static SLang_Intrin_Var_Type Model_Intrin_Vars [] = /*{{{*/
+{
+   MAKE_VARIABLE("Model_Num_Threads", &Model_Num_Threads, SLANG_INT_TYPE, 0),
+   SLANG_END_INTRIN_VAR_TABLE
+};
+
+/*}}}*/
+
 static SLang_Intrin_Fun_Type Model_Intrinsics [] = /*{{{*/
 {
    MAKE_INTRINSIC_1("_load_ascii_model", _load_ascii_model, I, S),
    MAKE_INTRINSIC_1("_save_ascii_model", _save_ascii_model, I, S),
    MAKE_INTRINSIC_1("_edit_model", _edit_model, V, S),
    MAKE_INTRINSIC_I("_set_model_profile", _set_model_profile, V),
+   MAKE_INTRINSIC("_gauss_cdf", gauss_cdf_intrin, V, 0),
+   MAKE_INTRINSIC_3("_thermal_line_profile", thermal_line_profile_intrin, V, D, D, D),
    MAKE_INTRINSIC("_list_model", _list_model, V, 0),
    MAKE_INTRINSIC("_calc_model_list", calc_model_list, V, 0),
    MAKE_INTRINSIC_1("_add_component", add_component, V, I),
@@ -931,6 +996,9 @@ int init_model_module_ns (char *ns_name) /*{{{*/
    if (-1 == SLns_add_iconstant_table (pub_ns, Model_Intrin_Const, NULL))
      return isis_trace_return(-1);
 
+   if (-1 == SLns_add_intrin_var_table (pub_ns, Model_Intrin_Vars, NULL))
+     return isis_trace_return(-1);
+
    if (-1 == SLns_add_intrin_fun_table (ns, Model_Intrinsics, NULL))
      return isis_trace_return(-1);
 
@@ -45,12 +45,20 @@
 #include "model.h"
 #include "errors.h"
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 /*}}}*/
 
 /*{{{ data types */
 
 static Isis_Line_Profile_Type *Model_Profile = NULL;
 static Isis_Line_Profile_Type map_thermal_profile;
+static void init_gauss_table (void);
+
+#define MODEL_MAX_THREADS   64
+int Model_Num_Threads = 1;
 
 /*}}}*/
 
@@ -460,6 +468,7 @@ void Model_set_profile_function (int idx) /*{{{*/
         msg = "delta-function";
         break;
       default:
+        init_gauss_table ();
         Model_Profile = map_thermal_profile;
         msg = "thermal";
         break;
@@ -469,82 +478,188 @@ void Model_set_profile_function (int idx) /*{{{*/
 
 /*}}}*/
 
-static int profile_thermal (double *f, double wllo, double wlhi, /*{{{*/
-                            double wl0, double atwt, double *params, int num_params,
-                            void *cl)
+/* Thermal line profiles are Gaussians, so the fraction of the line
+ * flux in a bin is a difference of the Gaussian cumulative distribution
+ * P(x) at the bin edges.  P(x) is tabulated, with its derivative, at
+ * GAUSS_STEPS points per sigma and evaluated by cubic Hermite
+ * interpolation, with absolute error < 1e-10.  The profile is cut off
+ * at GAUSS_NSIGMA sigma, where 1 - P(x) < 1e-9, so the two wings
+ * together lose about 2e-9 of the line flux.
+ */
+
+#define GAUSS_NSIGMA   6
+#define GAUSS_STEPS    64
+#define GAUSS_TABLE_SIZE   (2 * GAUSS_NSIGMA * GAUSS_STEPS + 1)
+
+static double Gauss_Cdf[GAUSS_TABLE_SIZE];
+static double Gauss_Pdf[GAUSS_TABLE_SIZE];
+static int Gauss_Table_Ready;
+
+static double gauss_pdf (double x) /*{{{*/
 {
-   double temperature = params[0];
-   double vturb = params[1];
-   double sigma;
-   double dxl, dxh;
+   return 0.3989422804014327 * exp (-0.5 * x * x);
+}
+
+/*}}}*/
 
-   (void) num_params; (void) cl;
+static void init_gauss_table (void) /*{{{*/
+{
+   /* 3-point Gauss-Legendre nodes and weights on [-1,1] */
+   static double node[3] = {-0.7745966692414834, 0.0, 0.7745966692414834};
+   static double weight[3] = {5.0/9.0, 8.0/9.0, 5.0/9.0};
+   double h = 1.0 / GAUSS_STEPS;
+   int i, k, mid = GAUSS_NSIGMA * GAUSS_STEPS;
 
-   /* use wl0 as the line center rather than the value listed
-    * in the DB_line_t struct -- might be redshifted.
-    */
+   if (Gauss_Table_Ready)
+     return;
 
-   sigma = (wl0 / CLIGHT) * sqrt (BOLTZ * temperature / atwt / AMU
-                                  + 0.5 * vturb * vturb);
+   /* integrate outward from P(0) = 1/2 and use P(-x) = 1 - P(x) */
+   Gauss_Cdf[mid] = 0.5;
+   Gauss_Pdf[mid] = gauss_pdf (0.0);
 
-   dxh = (wlhi - wl0) / sigma;
-   dxl = (wllo - wl0) / sigma;
+   for (i = mid + 1; i < GAUSS_TABLE_SIZE; i++)
+     {
+        double x0 = (i - 1 - mid) * h;
+        double sum = 0.0;
 
-   *f = isis_gpf (dxh) - isis_gpf (dxl);
+        for (k = 0; k < 3; k++)
+          sum += weight[k] * gauss_pdf (x0 + 0.5 * h * (1.0 + node[k]));
 
-   return 0;
+        Gauss_Cdf[i] = Gauss_Cdf[i-1] + 0.5 * h * sum;
+        Gauss_Pdf[i] = gauss_pdf ((i - mid) * h);
+
+        Gauss_Cdf[2*mid - i] = 1.0 - Gauss_Cdf[i];
+        Gauss_Pdf[2*mid - i] = Gauss_Pdf[i];
+     }
+
+   Gauss_Table_Ready = 1;
 }
 
 /*}}}*/
 
-#define FAINT_TOL 1.e-4
-/* Line wing faintness limit.  Larger values should make the code run
- * faster but may underestimate the total contribution of faint
- * line wings.   Smaller will take more time, but should be more accurate.
- */
+static double gauss_cdf (double x) /*{{{*/
+{
+   double u, t, t1, h = 1.0 / GAUSS_STEPS;
+   int i;
 
-static int map_thermal_profile (Isis_Hist_t *g, double flux, double wl, double atomic_weight, int mid, /*{{{*/
-                                double *profile_params, int num_profile_params, void *profile_options)
+   if (x <= -GAUSS_NSIGMA)
+     return 0.0;
+   else if (x >= GAUSS_NSIGMA)
+     return 1.0;
+
+   u = (x + GAUSS_NSIGMA) * GAUSS_STEPS;
+   i = (int) u;
+   if (i > GAUSS_TABLE_SIZE - 2)
+     i = GAUSS_TABLE_SIZE - 2;
+   t = u - i;
+   t1 = 1.0 - t;
+
+   return (t1*t1*(1.0 + 2.0*t) * Gauss_Cdf[i]
+           + t*t*(3.0 - 2.0*t) * Gauss_Cdf[i+1]
+           + h * t * t1 * (t1 * Gauss_Pdf[i] - t * Gauss_Pdf[i+1]));
+}
+
+/*}}}*/
+
+/* Doppler width of a line, in units of the line wavelength */
+static double thermal_width (double temperature, double vturb, double atwt) /*{{{*/
 {
-   double f, av, de, faint;
-   double *wllo, *wlhi, *val;
-   int i, nbins;
+   return sqrt (BOLTZ * temperature / atwt / AMU + 0.5 * vturb * vturb) / CLIGHT;
+}
 
-   if (g == NULL)
-     return -1;
+/*}}}*/
+
+/* Add a Gaussian line of width sigma centered at wl; mid is the bin
+ * containing wl.
+ */
+static void spread_gaussian (Isis_Hist_t *g, double flux, double wl, double sigma, int mid) /*{{{*/
+{
+   double *wllo = g->bin_lo;
+   double *wlhi = g->bin_hi;
+   double *val = g->val;
+   double wmin = wl - GAUSS_NSIGMA * sigma;
+   double wmax = wl + GAUSS_NSIGMA * sigma;
+   double p_lo, p_hi;
+   int i, nbins = g->nbins;
+
+   if (!(sigma > 0.0))
+     {
+        val[mid] += flux;
+        return;
+     }
 
-   wllo = g->bin_lo;
-   wlhi = g->bin_hi;
-   val = g->val;
-   nbins = g->nbins;
+   p_lo = gauss_cdf ((wllo[mid] - wl) / sigma);
+   p_hi = gauss_cdf ((wlhi[mid] - wl) / sigma);
+   val[mid] += flux * (p_hi - p_lo);
 
-   for (i = mid; i >= 0; i--)
+   for (i = mid - 1; (i >= 0) && (wlhi[i] > wmin); i--)
      {
-        if (-1 == profile_thermal (&f, wllo[i], wlhi[i], wl, atomic_weight,
-                                   profile_params, num_profile_params,
-                                   profile_options))
-          return -1;
-        de = f * flux;
-        av = fabs (val[i]);
-        faint = (av > 0.0) && (fabs(de) < FAINT_TOL * av);
-        val[i] += de;
-        if (faint)
-          break;
+        /* bins are usually contiguous */
+        p_hi = (wlhi[i] == wllo[i+1]) ? p_lo : gauss_cdf ((wlhi[i] - wl) / sigma);
+        p_lo = gauss_cdf ((wllo[i] - wl) / sigma);
+        val[i] += flux * (p_hi - p_lo);
      }
 
-   for (i = mid+1; i < nbins; i++)
+   p_hi = gauss_cdf ((wlhi[mid] - wl) / sigma);
+
+   for (i = mid + 1; (i < nbins) && (wllo[i] < wmax); i++)
      {
-        if (-1 == profile_thermal (&f, wllo[i], wlhi[i], wl, atomic_weight,
-                                   profile_params, num_profile_params,
-                                   profile_options))
-          return -1;
-        de = f * flux;
-        av = fabs (val[i]);
-        faint = (av > 0.0) && (fabs(de) < FAINT_TOL * av);
-        val[i] += de;
-        if (faint)
-          break;
+        p_lo = (wllo[i] == wlhi[i-1]) ? p_hi : gauss_cdf ((wllo[i] - wl) / sigma);
+        p_hi = gauss_cdf ((wlhi[i] - wl) / sigma);
+        val[i] += flux * (p_hi - p_lo);
      }
+}
+
+/*}}}*/
+
+/* The kernel, exported for testing */
+
+double Model_gauss_cdf (double x) /*{{{*/
+{
+   init_gauss_table ();
+   return gauss_cdf (x);
+}
+
+/*}}}*/
+
+int Model_spread_gaussian (double *wllo, double *wlhi, int nbins, double *val, /*{{{*/
+                           double flux, double wl, double sigma)
+{
+   Isis_Hist_t g = ISIS_HIST_INIT;
+   int mid;
+
+   if (-1 == (mid = find_bin (wl, wllo, wlhi, nbins)))
+     return -1;
+
+   g.bin_lo = wllo;
+   g.bin_hi = wlhi;
+   g.val = val;
+   g.nbins = nbins;
+
+   init_gauss_table ();
+   spread_gaussian (&g, flux, wl, sigma, mid);
+
+   return 0;
+}
+
+/*}}}*/
+
+static int map_thermal_profile (Isis_Hist_t *g, double flux, double wl, double atomic_weight, int mid, /*{{{*/
+                                double *profile_params, int num_profile_params, void *profile_options)
+{
+   double sigma;
+
+   (void) num_profile_params; (void) profile_options;
+
+   if (g == NULL)
+     return -1;
+
+   /* use wl as the line center rather than the value listed
+    * in the DB_line_t struct -- might be redshifted.
+    */
+   sigma = wl * thermal_width (profile_params[0], profile_params[1], atomic_weight);
+
+   spread_gaussian (g, flux, wl, sigma, mid);
 
    return 0;
 }
@@ -687,15 +802,20 @@ return_status:
 
 /*}}}*/
 
+/* When line_sum is non-NULL, line fluxes are accumulated there,
+ * indexed by line->indx, instead of in the shared wavelength tables.
+ */
 static int add_spread_lines (double *val, double *wllo, double *wlhi, int nbins, /*{{{*/
-                             EM_line_emis_t *t, Model_t *m, Model_Info_Type *info)
+                             EM_line_emis_t *t, Model_t *m, Model_Info_Type *info,
+                             double *line_sum)
 {
    Isis_Line_Profile_Type *map_profile;
    double thermal_profile_params[2];
+   double width[ISIS_MAX_PROTON_NUMBER+1];
    double *profile_params = NULL;
    int num_profile_params = 0;
    void *profile_options = NULL;
-   int k, nlines;
+   int k, k0, k1, mid;
    float atwt;
    Isis_Hist_t g;
 
@@ -739,22 +859,29 @@ static int add_spread_lines (double *val, double *wllo, double *wlhi, int nbins,
         profile_options = NULL;
      }
 
-   nlines = EM_get_nlines (t);
-   if (-1 == nlines)
+   /* The lines are sorted by wavelength, so the lines on the grid
+    * are found by bisection and each line's bin by walking up the grid.
+    */
+   if (-1 == EM_get_line_range (t, wllo[0], wlhi[nbins-1], &k0, &k1))
      return -1;
 
-   for (k = 0; k < nlines; k++)
+   for (k = 0; k <= ISIS_MAX_PROTON_NUMBER; k++)
+     width[k] = -1.0;
+
+   mid = 0;
+
+   for (k = k0; k < k1; k++)
      {
         DB_line_t *line;
         double flux, emis;
         float emis_f, wl, flux_f;
-        int mid, Z, q;
+        int Z, q;
 
         if (-1 == _EM_get_line_emis_wl (&line, &emis_f, &wl, k, t))
           return -1;
         emis = (double) emis_f;
 
-        if (wl < wllo[0] || wlhi[nbins-1] < wl)
+        if (isnan (wl))
           continue;
 
         if (info->line_emis_modifier != NULL)
@@ -766,9 +893,9 @@ static int add_spread_lines (double *val, double *wllo, double *wlhi, int nbins,
         if (emis <= 0.0)
           continue;
 
-        mid = find_bin ((double) wl, wllo, wlhi, nbins);
-        if (mid < 0)
-          continue;
+        /* as for find_bin, a line between two bins goes in the lower one */
+        while ((mid + 1 < nbins) && (wllo[mid+1] <= wl))
+          mid++;
 
         flux = m->norm * emis;
 
@@ -778,11 +905,14 @@ static int add_spread_lines (double *val, double *wllo, double *wlhi, int nbins,
         flux *= m->rel_abund[Z];
 
         /* Side-effect: increment line fluxes stored in wavelength tables: */
-        line->flux += flux;
+        if (line_sum != NULL)
+          line_sum[line->indx] += flux;
+        else
+          line->flux += flux;
 
         /* each model component remembers its contribution to the line flux */
         flux_f = (float) flux;
-        SLang_set_array_element (m->line_flux, &line->indx, &flux_f);
+        ((float *) m->line_flux->data)[line->indx] = flux_f;
 
         /* profile = NULL imples a delta function. */
         if (NULL == map_profile)
@@ -790,6 +920,18 @@ static int add_spread_lines (double *val, double *wllo, double *wlhi, int nbins,
              val[mid] += flux;
              continue;
           }
+        else if (map_profile == map_thermal_profile)
+          {
+             /* the Doppler width depends only on the element */
+             if (width[Z] < 0.0)
+               {
+                  if (-1 == DB_get_atomic_weight_amu (&atwt, line))
+                    return -1;
+                  width[Z] = thermal_width (thermal_profile_params[0],
+                                            thermal_profile_params[1], (double) atwt);
+               }
+             spread_gaussian (&g, flux, (double) wl, wl * width[Z], mid);
+          }
         else
           {
              if (-1 == DB_get_atomic_weight_amu (&atwt, line))
@@ -837,15 +979,360 @@ static int shift_grid_to_emitter_frame (EM_cont_type_t *cont, double *wllo, doub
 
 /*}}}*/
 
+typedef struct
+{
+   Model_Info_Type *info;
+   double *wllo, *wlhi;
+   int nbins;
+   char *flag;
+   float *ionpop_new;
+   int include_lines, include_contin;
+   EM_cont_type_t *cont;        /* emitter frame grid and continuum */
+   double *tmp_val;             /* redshifted component */
+   double *val;                 /* sum over components */
+   double *line_sum;            /* NULL => accumulate in line->flux */
+}
+Spectrum_Work_Type;
+
+static int init_line_flux (Model_t *m, SLindex_Type db_nlines) /*{{{*/
+{
+   if (m->line_flux == NULL)
+     {
+        if (NULL == (m->line_flux = SLang_create_array (SLANG_FLOAT_TYPE, 1, NULL, &db_nlines, 1)))
+          return -1;
+     }
+   memset ((char *)m->line_flux->data, 0, db_nlines * sizeof(float));
+   return 0;
+}
+
+/*}}}*/
+
+/* 1) Shift the input observer frame grid into the source frame
+ * 2) Compute the emissivity in each rest-frame bin
+ * 3) Shift the emissivity in each bin back to the observer frame,
+ *    (just the time-dilation factor, since I'm assuming that
+ *     the model values are photons/sec/whatever
+ *                      NOT ergs/sec/whatever!).
+ */
+static int component_spectrum (Model_t *m, Spectrum_Work_Type *w) /*{{{*/
+{
+   Model_Info_Type *info = w->info;
+   EM_cont_type_t *cont = w->cont;
+   double *val_ptr;
+   int i, cont_nbins = cont->nbins;
+
+   if (m->norm == 0)
+     return 0;
+
+   if (m->redshift != 0.0)
+     {
+        memset ((char *)w->tmp_val, 0, w->nbins * sizeof(double));
+        val_ptr = w->tmp_val;
+     }
+   else val_ptr = w->val;
+
+   if (-1 == shift_grid_to_emitter_frame (cont, w->wllo, w->wlhi, m->redshift))
+     return -1;
+
+   if (info->ionpop_modifier != NULL)
+     {
+        if (-1 == call_ionpop_modifier (m, info, w->ionpop_new))
+          return -1;
+     }
+
+   if (w->include_lines)
+     {
+        EM_line_emis_t *emis_list;
+        int status;
+
+        emis_list = EM_get_line_spectrum (w->flag, m->temperature, m->density, w->ionpop_new, info->em);
+        if (NULL == emis_list)
+          return -1;
+
+        status = add_spread_lines (val_ptr, cont->wllo, cont->wlhi, cont_nbins,
+                                   emis_list, m, info, w->line_sum);
+        EM_free_line_emis_list (emis_list);
+        if (status)
+          return -1;
+     }
+
+   if (w->include_contin)
+     {
+        EM_cont_select_t s;
+        double m_norm;
+        double *c_val, *p_val;
+
+        s.Z = 0; s.q = -1;  s.rel_abun = m->rel_abund;
+        if (-1 == EM_get_continuum (cont, m->temperature, m->density, w->ionpop_new, &s, info->em))
+          return -1;
+
+        m_norm = m->norm;
+
+        switch (info->contrib_flag)
+          {
+           case MODEL_CONTIN_TRUE:
+             c_val = cont->true_contin;
+             for (i = 0; i < cont_nbins; i++)
+               val_ptr[i] += m_norm * c_val[i];
+             break;
+
+           case MODEL_CONTIN_PSEUDO:
+             c_val = cont->pseudo;
+             for (i = 0; i < cont_nbins; i++)
+               val_ptr[i] += m_norm * c_val[i];
+             break;
+
+           default:
+             c_val = cont->true_contin;
+             p_val = cont->pseudo;
+             for (i = 0; i < cont_nbins; i++)
+               val_ptr[i] += m_norm * (c_val[i] + p_val[i]);
+             break;
+          }
+     }
+
+   if (m->redshift != 0.0)
+     {
+        float gm = lorentz_gamma (m->redshift);
+        for (i = 0; i < cont_nbins; i++)
+          w->val[i] += w->tmp_val[i] / gm;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+#ifdef HAVE_PTHREAD_H
+
+/* Components are dealt out to the threads round-robin.  Each thread
+ * sums its components into a private spectrum and line flux table,
+ * (the first thread uses the output spectrum directly) and the
+ * results are added together once all the threads have finished.
+ * The first task runs in the calling thread, which is the one that
+ * checks for a user break; a break or a failure stops all the tasks.
+ * Failures are reported by the caller after the threads have joined.
+ */
+
+typedef struct
+{
+   Spectrum_Work_Type w;
+   Model_t *h;
+   unsigned int first, stride;
+   volatile int *stop;
+   int check_break;
+   int status;
+   int failed_component;
+}
+Spectrum_Task_Type;
+
+static void *spectrum_thread (void *arg) /*{{{*/
+{
+   Spectrum_Task_Type *t = (Spectrum_Task_Type *) arg;
+   Model_t *m;
+   unsigned int i;
+
+   t->status = 0;
+   t->failed_component = -1;
+
+   for (m = t->h, i = 0; m != NULL; m = m->next, i++)
+     {
+        if (i % t->stride != t->first)
+          continue;
+
+        if (t->check_break && isis_user_break())
+          *t->stop = 1;
+        if (*t->stop)
+          break;
+
+        if (-1 == component_spectrum (m, &t->w))
+          {
+             t->status = -1;
+             t->failed_component = (int) i;
+             *t->stop = 1;
+             break;
+          }
+     }
+
+   return NULL;
+}
+
+/*}}}*/
+
+static int threaded_spectrum (Model_t *h, Spectrum_Work_Type *w, unsigned int num_threads, /*{{{*/
+                              SLindex_Type db_nlines)
+{
+   pthread_t threads[MODEL_MAX_THREADS];
+   int started[MODEL_MAX_THREADS];
+   Spectrum_Task_Type *tasks;
+   Model_t *m;
+   volatile int stop = 0;
+   unsigned int i, n = 0;
+   int k, ret = -1;
+
+   for (m = h; m != NULL; m = m->next)
+     {
+        if (-1 == init_line_flux (m, db_nlines))
+          return -1;
+     }
+
+   if (NULL == (tasks = (Spectrum_Task_Type *) ISIS_MALLOC (num_threads * sizeof(Spectrum_Task_Type))))
+     return -1;
+   memset ((char *)tasks, 0, num_threads * sizeof(Spectrum_Task_Type));
+
+   for (n = 0; n < num_threads; n++)
+     {
+        Spectrum_Task_Type *t = &tasks[n];
+
+        t->w = *w;
+        t->h = h;
+        t->first = n;
+        t->stride = num_threads;
+        t->stop = &stop;
+        t->check_break = (n == 0);
+
+        if ((NULL == (t->w.cont = EM_new_continuum (w->nbins)))
+            || (NULL == (t->w.tmp_val = (double *) ISIS_MALLOC (w->nbins * sizeof(double)))))
+          goto finish;
+
+        if (n > 0)
+          {
+             if (NULL == (t->w.val = (double *) ISIS_MALLOC (w->nbins * sizeof(double))))
+               goto finish;
+             memset ((char *)t->w.val, 0, w->nbins * sizeof(double));
+          }
+
+        if (w->include_lines)
+          {
+             if (NULL == (t->w.line_sum = (double *) ISIS_MALLOC (db_nlines * sizeof(double))))
+               goto finish;
+             memset ((char *)t->w.line_sum, 0, db_nlines * sizeof(double));
+          }
+     }
+
+   /* A task whose thread can't be started is run here instead. */
+   for (i = 1; i < n; i++)
+     {
+        started[i] = (0 == pthread_create (&threads[i], NULL, spectrum_thread, (void *) &tasks[i]));
+        if (started[i] == 0)
+          (void) spectrum_thread ((void *) &tasks[i]);
+     }
+
+   (void) spectrum_thread ((void *) &tasks[0]);
+
+   for (i = 1; i < n; i++)
+     {
+        if (started[i])
+          (void) pthread_join (threads[i], NULL);
+     }
+
+   for (i = 0; i < n; i++)
+     {
+        if (tasks[i].status)
+          {
+             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "computing model component %d",
+                         tasks[i].failed_component);
+             goto finish;
+          }
+     }
+
+   /* As in the serial loop, a user break leaves a partial spectrum */
+   for (i = 1; i < n; i++)
+     {
+        double *v = tasks[i].w.val;
+        for (k = 0; k < w->nbins; k++)
+          w->val[k] += v[k];
+     }
+
+   if (w->include_lines)
+     {
+        for (k = 0; k < db_nlines; k++)
+          {
+             DB_line_t *line;
+             double flux = 0.0;
+
+             for (i = 0; i < n; i++)
+               flux += tasks[i].w.line_sum[k];
+             if (flux == 0.0)
+               continue;
+
+             if (NULL == (line = DB_get_line_from_index (k, w->info->db)))
+               goto finish;
+             line->flux += flux;
+          }
+     }
+
+   ret = 0;
+
+   finish:
+
+   for (i = 0; i < num_threads; i++)
+     {
+        Spectrum_Task_Type *t = &tasks[i];
+        EM_free_continuum (t->w.cont);
+        ISIS_FREE (t->w.tmp_val);
+        ISIS_FREE (t->w.line_sum);
+        if (i > 0)
+          ISIS_FREE (t->w.val);
+     }
+   ISIS_FREE (tasks);
+
+   return ret;
+}
+
+/*}}}*/
+
+#endif /* HAVE_PTHREAD_H */
+
+/* The S-Lang hooks, user-defined line profiles and emissivity tables
+ * read from disk on demand are not thread-safe.
+ */
+static unsigned int num_spectrum_threads (Model_t *h, Spectrum_Work_Type *w) /*{{{*/
+{
+   Model_Info_Type *info = w->info;
+   unsigned int in_memory, num_components = 0;
+   Model_t *m;
+
+   if (Model_Num_Threads < 2)
+     return 1;
+
+   if ((info->line_emis_modifier != NULL)
+       || (info->ionpop_modifier != NULL)
+       || (info->profile != NULL))
+     return 1;
+
+   in_memory = EM_memory_usage_level ();
+   if ((w->include_lines && (0 == (in_memory & 0x1)))
+       || (w->include_contin && (0 == (in_memory & 0x2))))
+     return 1;
+
+   for (m = h; m != NULL; m = m->next)
+     {
+        if (m->norm != 0)
+          num_components++;
+     }
+
+   if (num_components > (unsigned int) Model_Num_Threads)
+     num_components = Model_Num_Threads;
+   if (num_components > MODEL_MAX_THREADS)
+     num_components = MODEL_MAX_THREADS;
+
+   return (num_components > 0) ? num_components : 1;
+}
+
+/*}}}*/
+
 int Model_spectrum (Model_t *h, Model_Info_Type *info, /*{{{*/
                     double *wllo, double *wlhi, int nbins, double *val)
 {
+   Spectrum_Work_Type w;
    Model_t *m;
    EM_cont_type_t *cont = NULL;
    double *tmp_val = NULL;
    float *ionpop_new = NULL;
    char *flag = NULL;
-   int i, cont_nbins, include_lines, include_contin, ret = -1;
+   int include_lines, include_contin, ret = -1;
+   unsigned int num_threads;
    SLindex_Type db_nlines;
 
    if (NULL == h || NULL == info)
@@ -917,112 +1404,50 @@ int Model_spectrum (Model_t *h, Model_Info_Type *info, /*{{{*/
         memset ((char *)ionpop_new, 0, n*n*sizeof(float));
      }
 
+   memset ((char *)&w, 0, sizeof w);
+   w.info = info;
+   w.wllo = wllo;
+   w.wlhi = wlhi;
+   w.nbins = nbins;
+   w.flag = flag;
+   w.ionpop_new = ionpop_new;
+   w.include_lines = include_lines;
+   w.include_contin = include_contin;
+   w.val = val;
+   w.line_sum = NULL;
+
+   num_threads = num_spectrum_threads (h, &w);
+
+#ifdef HAVE_PTHREAD_H
+   if (num_threads > 1)
+     {
+        ret = threaded_spectrum (h, &w, num_threads, db_nlines);
+        goto finish;
+     }
+#else
+   (void) num_threads;
+#endif
+
    if ((NULL == (cont = EM_new_continuum (nbins)))
        || (NULL == (tmp_val = (double *) ISIS_MALLOC (nbins * sizeof(double)))))
      goto finish;
 
-   cont_nbins = cont->nbins;
-
-   /* 1) Shift the input observer frame grid into the source frame
-    * 2) Compute the emissivity in each rest-frame bin
-    * 3) Shift the emissivity in each bin back to the observer frame,
-    *    (just the time-dilation factor, since I'm assuming that
-    *     the model values are photons/sec/whatever
-    *                      NOT ergs/sec/whatever!).
-    */
+   w.cont = cont;
+   w.tmp_val = tmp_val;
 
    for (m = h; m != NULL; m = m->next)
      {
-        EM_line_emis_t *emis_list = NULL;
-        double *val_ptr;
-
         if (isis_user_break())
           {
              ret = 0;
              goto finish;
           }
 
-        if (m->line_flux == NULL)
-          {
-             if (NULL == (m->line_flux = SLang_create_array (SLANG_FLOAT_TYPE, 1, NULL, &db_nlines, 1)))
-               goto finish;
-          }
-        memset ((char *)m->line_flux->data, 0, db_nlines * sizeof(float));
-
-        if (m->norm == 0)
-          continue;
-
-        if (m->redshift != 0.0)
-          {
-             memset ((char *)tmp_val, 0, nbins * sizeof(double));
-             val_ptr = tmp_val;
-          }
-        else val_ptr = val;
-
-        if (-1 == shift_grid_to_emitter_frame (cont, wllo, wlhi, m->redshift))
+        if (-1 == init_line_flux (m, db_nlines))
           goto finish;
 
-        if (info->ionpop_modifier != NULL)
-          {
-             if (-1 == call_ionpop_modifier (m, info, ionpop_new))
-               goto finish;
-          }
-
-        if (include_lines)
-          {
-             emis_list = EM_get_line_spectrum (flag, m->temperature, m->density, ionpop_new, info->em);
-             if (NULL == emis_list)
-               goto finish;
-
-             if (-1 == add_spread_lines (val_ptr, cont->wllo, cont->wlhi, cont->nbins,
-                                         emis_list, m, info))
-               goto finish;
-
-             EM_free_line_emis_list (emis_list);
-             emis_list = NULL;
-          }
-
-        if (include_contin)
-          {
-             EM_cont_select_t s;
-             double m_norm;
-             double *c_val, *p_val;
-
-             s.Z = 0; s.q = -1;  s.rel_abun = m->rel_abund;
-             if (-1 == EM_get_continuum (cont, m->temperature, m->density, ionpop_new, &s, info->em))
-               goto finish;
-
-             m_norm = m->norm;
-
-             switch (info->contrib_flag)
-               {
-                case MODEL_CONTIN_TRUE:
-                  c_val = cont->true_contin;
-                  for (i = 0; i < cont_nbins; i++)
-                    val_ptr[i] += m_norm * c_val[i];
-                  break;
-
-                case MODEL_CONTIN_PSEUDO:
-                  c_val = cont->pseudo;
-                  for (i = 0; i < cont_nbins; i++)
-                    val_ptr[i] += m_norm * c_val[i];
-                  break;
-
-                default:
-                  c_val = cont->true_contin;
-                  p_val = cont->pseudo;
-                  for (i = 0; i < cont_nbins; i++)
-                    val_ptr[i] += m_norm * (c_val[i] + p_val[i]);
-                  break;
-               }
-          }
-
-        if (m->redshift != 0.0)
-          {
-             float gm = lorentz_gamma (m->redshift);
-             for (i = 0; i < cont_nbins; i++)
-               val[i] += tmp_val[i] / gm;
-          }
+        if (-1 == component_spectrum (m, &w))
+          goto finish;
      }
 
    ret = 0;
@@ -88,6 +88,8 @@ typedef struct
 }
 Model_Info_Type;
 
+extern int Model_Num_Threads;
+
 extern int Model_start (void);
 extern void Model_end (Model_t *model);
 
@@ -101,6 +103,10 @@ extern Model_t *Model_add_component (Model_t *head, Model_t *x,
 extern int Model_spectrum (Model_t *h, Model_Info_Type *info,
                            double *wllo, double *wlhi, int nbins, double *val);
 
+extern double Model_gauss_cdf (double x);
+extern int Model_spread_gaussian (double *wllo, double *wlhi, int nbins, double *val,
+                                  double flux, double wl, double sigma);
+
 #if 0
 {
 #endif
@@ -53,12 +53,111 @@ typedef struct
    double *y;
    double *weights;
    double *fx;
+   double *work;     /* 3*npts, used with analytic derivatives */
    unsigned int npts;
    unsigned int npars;
+   int use_jacobian;
 }
 Fun_Info_Type;
 static Fun_Info_Type Fun_Info;
 
+/* mpfit wants d(fvec)/d(par), where fvec is the statistic vector.
+ * Each element of that vector depends only on the model value in
+ * the same bin, so d(fvec)/d(fx) comes from perturbing every bin
+ * of fx at once.
+ */
+static void apply_statistic_chain_rule (Isis_Fit_Type *ift, double *fvec, /*{{{*/
+                                        double **deriv_vec, int num_pars)
+{
+   Isis_Fit_Statistic_Type *fs = ift->stat;
+   Fun_Info_Type *fi = &Fun_Info;
+   double *fx1 = fi->work;
+   double *vec1 = fi->work + fi->npts;
+   double *slope = fi->work + 2*fi->npts;
+   double h = pow (MP_MACHEP0, 1.0/3.0);
+   double stat;
+   unsigned int i;
+   int j;
+
+   for (i = 0; i < fi->npts; i++)
+     fx1[i] = fi->fx[i] + ((fi->fx[i] != 0.0) ? h * fabs(fi->fx[i]) : h);
+
+   (void)fs->compute_statistic (fs, fi->y, fx1, fi->weights, fi->npts, vec1, &stat);
+
+   for (i = 0; i < fi->npts; i++)
+     slope[i] = (vec1[i] - fvec[i]) / (fx1[i] - fi->fx[i]);
+
+   /* use a central difference where the model stays positive */
+   for (i = 0; i < fi->npts; i++)
+     fx1[i] = (fi->fx[i] > 0.0) ? (2.0 * fi->fx[i] - fx1[i]) : fi->fx[i];
+
+   (void)fs->compute_statistic (fs, fi->y, fx1, fi->weights, fi->npts, vec1, &stat);
+
+   for (i = 0; i < fi->npts; i++)
+     {
+        if (fx1[i] != fi->fx[i])
+          slope[i] = 0.5 * (slope[i] + (fvec[i] - vec1[i]) / (fi->fx[i] - fx1[i]));
+     }
+
+   for (j = 0; j < num_pars; j++)
+     {
+        if (deriv_vec[j] == NULL)
+          continue;
+        for (i = 0; i < fi->npts; i++)
+          deriv_vec[j][i] *= slope[i];
+     }
+}
+
+/*}}}*/
+
+/* forward differences, for when analytic derivatives
+ * were requested but turned out to be unavailable.
+ */
+static int numerical_derivs (Isis_Fit_Type *ift, double *pars, int num_pars, /*{{{*/
+                             double *fvec, double **deriv_vec)
+{
+   Isis_Fit_Engine_Type *e = ift->engine;
+   Isis_Fit_Statistic_Type *fs = ift->stat;
+   Fun_Info_Type *fi = &Fun_Info;
+   double *fx1 = fi->work;
+   double *vec1 = fi->work + fi->npts;
+   double stat;
+   unsigned int i;
+   int j;
+
+   for (j = 0; j < num_pars; j++)
+     {
+        double p0 = pars[j];
+        double h = sqrt (MP_MACHEP0) * fabs(p0);
+
+        if (deriv_vec[j] == NULL)
+          continue;
+
+        if (e->par_step[j] > 0) h = e->par_step[j];
+        if (e->par_relstep[j] > 0) h = fabs(e->par_relstep[j] * p0);
+        if (h == 0.0) h = sqrt (MP_MACHEP0);
+        if (p0 + h > e->par_max[j]) h = -h;
+
+        pars[j] = p0 + h;
+        if (-1 == ift->compute_model (fs->opt_data, fi->x, fi->npts, pars, num_pars, fx1))
+          {
+             pars[j] = p0;
+             return -1;
+          }
+        pars[j] = p0;
+
+        (void)fs->compute_statistic (fs, fi->y, fx1, fi->weights, fi->npts, vec1, &stat);
+
+        for (i = 0; i < fi->npts; i++)
+          deriv_vec[j][i] = (vec1[i] - fvec[i]) / h;
+     }
+
+   /* leave opt_data consistent with pars */
+   return ift->compute_model (fs->opt_data, fi->x, fi->npts, pars, num_pars, fi->fx);
+}
+
+/*}}}*/
+
 static int mpfit_objective (int num_fvec_values, int num_pars, double *pars, /*{{{*/
                             double *fvec, double **deriv_vec, void *client_data)
 {
@@ -67,12 +166,37 @@ static int mpfit_objective (int num_fvec_values, int num_pars, double *pars, /*{
    Isis_Fit_Statistic_Type *fs = ift->stat;
    Fun_Info_Type *fi = &Fun_Info;
 
-   (void) num_fvec_values;  (void) deriv_vec;
+   (void) num_fvec_values;
 
-   if (-1 == ift->compute_model (fs->opt_data, fi->x, fi->npts, pars, num_pars, fi->fx))
-     return -1;
+   if (deriv_vec != NULL)
+     {
+        /* If the analytic derivatives fail, don't ask again */
+        if (fi->use_jacobian
+            && (-1 == ift->compute_jacobian (fs->opt_data, fi->x, fi->npts, pars, num_pars,
+                                             fi->fx, deriv_vec)))
+          fi->use_jacobian = 0;
+
+        if (fi->use_jacobian == 0)
+          {
+             if (-1 == ift->compute_model (fs->opt_data, fi->x, fi->npts, pars, num_pars, fi->fx))
+               return -1;
+             (void)fs->compute_statistic (fs, fi->y, fi->fx, fi->weights, fi->npts, fvec, &ift->statistic);
+             if (-1 == numerical_derivs (ift, pars, num_pars, fvec, deriv_vec))
+               return -1;
+          }
+        else
+          {
+             (void)fs->compute_statistic (fs, fi->y, fi->fx, fi->weights, fi->npts, fvec, &ift->statistic);
+             apply_statistic_chain_rule (ift, fvec, deriv_vec, num_pars);
+          }
+     }
+   else
+     {
+        if (-1 == ift->compute_model (fs->opt_data, fi->x, fi->npts, pars, num_pars, fi->fx))
+          return -1;
 
-   (void)fs->compute_statistic (fs, fi->y, fi->fx, fi->weights, fi->npts, fvec, &ift->statistic);
+        (void)fs->compute_statistic (fs, fi->y, fi->fx, fi->weights, fi->npts, fvec, &ift->statistic);
+     }
 
    if (e->verbose > 0)
      e->verbose_hook (Isis_Client_Data, ift->statistic, pars, fi->npars);
@@ -190,6 +314,11 @@ static int mpfit_method (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
 
    e = ift->engine;
 
+   /* Ask once whether analytic derivatives are available */
+   fi->use_jacobian = ((ift->compute_jacobian != NULL)
+                       && (0 == ift->compute_jacobian (ift->stat->opt_data, x, npts,
+                                                       pars, npars, NULL, NULL)));
+
    if (NULL == (mpfit_pars = (struct mp_par_struct *) ISIS_MALLOC (npars * sizeof *mpfit_pars)))
      return -1;
 
@@ -204,7 +333,9 @@ static int mpfit_method (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
         ps->parname = 0;
         ps->step = e->par_step[i];
         ps->relstep = e->par_relstep[i];
-        ps->side = 0;        /* FIXME !! */
+        /* side=3 means the derivatives are user-supplied,
+         * i.e. computed by mpfit_objective */
+        ps->side = fi->use_jacobian ? 3 : 0;
         /* Note that mpfit's two-sided numerical derivative option
          * does not fully support parameter bounds.  The method used
          * to support parameter bounds with one-sided numerical
@@ -222,6 +353,7 @@ static int mpfit_method (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
    fi->npts = npts;
    fi->npars = npars;
    fi->fx = NULL;
+   fi->work = NULL;
 
    memset ((void *)&mpfit_result, 0, sizeof (struct mp_result_struct));
 
@@ -229,6 +361,10 @@ static int mpfit_method (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
        || (NULL == (ift->covariance_matrix = (double *) ISIS_MALLOC (npars * npars * sizeof(double)))))
      goto finish;
 
+   if (fi->use_jacobian
+       && (NULL == (fi->work = (double *) ISIS_MALLOC (3 * npts * sizeof(double)))))
+     goto finish;
+
    mpfit_result.covar = ift->covariance_matrix;
 
    (void) mpfit (mpfit_objective, npts, npars, pars,
@@ -241,6 +377,7 @@ static int mpfit_method (Isis_Fit_Type *ift, void *clientdata, /*{{{*/
    finish:
 
    free(fi->fx);
+   free(fi->work);
    free(mpfit_pars);
 
    switch (mpfit_result.status)
@@ -48,6 +48,13 @@ double grand (void)
    return g1 * s;
 }
 
+/* uniform random integer in [0, n) */
+unsigned int rand_index (unsigned int n)
+{
+   unsigned int k = (unsigned int) (urand () * n);
+   return (k < n) ? k : n - 1;
+}
+
 /* start _ptrs Poisson random generator, approximation for high rates
  *
  * From W. H\"ormann "The Transformed Rejection Method
@@ -175,6 +175,9 @@ static Isis_Rmf_t *new_rmf (void) /*{{{*/
    rmf->set_data_grid = NULL;
    rmf->get_data_grid = NULL;
    rmf->redistribute = NULL;
+   rmf->redistribute_noticed = NULL;
+   rmf->redistribute_vector = NULL;
+   rmf->notice_shared = 0;
    rmf->delete_client_data = NULL;
 
    rmf->set_noticed_model_bins = default_set_noticed_model_bins;
@@ -427,26 +430,45 @@ int Rmf_apply_rmf (Isis_Rmf_t *rmf, double *x, int num_orig_data, /*{{{*/
                    double *arf_src, int *arf_notice_list,
                    int num_arf_noticed)
 {
+   int (*redistribute)(Isis_Rmf_t *, unsigned int, double, double *, unsigned int);
    int k;
 
    if (NULL == rmf || NULL == arf_src )
      return -1;
 
+   /* When the caller supplies a notice list, only the noticed
+    * detector channels are expected to be correct, so the RMF
+    * may skip the channels nobody will look at.
+    */
+   if ((arf_notice_list != NULL) && (rmf->redistribute_noticed != NULL))
+     redistribute = rmf->redistribute_noticed;
+   else
+     redistribute = rmf->redistribute;
+
    if (rmf->pre_apply != NULL)
      {
         if (-1 == (*rmf->pre_apply)(rmf))
           return -1;
      }
 
-   for (k = 0; k < num_arf_noticed; k++)
+   if (rmf->redistribute_vector != NULL)
      {
-        int nk;
-        if (arf_src[k] == 0.0)
-          continue;
-        nk = (arf_notice_list != NULL) ? arf_notice_list[k] : k;
-        if (-1 == rmf->redistribute (rmf, nk, arf_src[k], x, num_orig_data))
+        if (-1 == (*rmf->redistribute_vector) (rmf, x, num_orig_data, arf_src,
+                                               arf_notice_list, num_arf_noticed))
           return -1;
      }
+   else
+     {
+        for (k = 0; k < num_arf_noticed; k++)
+          {
+             int nk;
+             if (arf_src[k] == 0.0)
+               continue;
+             nk = (arf_notice_list != NULL) ? arf_notice_list[k] : k;
+             if (-1 == (*redistribute) (rmf, nk, arf_src[k], x, num_orig_data))
+               return -1;
+          }
+     }
 
    if (rmf->post_apply != NULL)
      {
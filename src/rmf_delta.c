@@ -44,52 +44,44 @@
 
 /*}}}*/
 
-typedef struct
-{
-   union
-     {
-        double s;
-        double *v;
-     }
-   resp;
-   union
-     {
-        unsigned int s;
-        unsigned int *v;
-     }
-   chan;
-
-   unsigned int num_chan;
-   unsigned int size;
-}
-Elem_Type;
-
+/* The response of model bin i is a run of num_chan[i] overlap
+ * weights for consecutive detector channels starting at
+ * first_chan[i].  The weights of all bins share one block.
+ * When the model and data grids are identical, no table is
+ * built and each model bin maps onto the same detector channel.
+ */
 typedef struct
 {
    Isis_Rmf_Grid_Type *arf;
    Isis_Rmf_Grid_Type *ebounds;
-   Elem_Type *elem;
+   unsigned int *first_chan;     /* [num_arf] */
+   unsigned int *num_chan;       /* [num_arf] */
+   unsigned int *weight_start;   /* [num_arf] */
+   double *weight;
    int num_arf;
+   int is_identity;
+   int is_initialized;
 }
 Rmf_Client_Data_t;
 
+static void free_response (Rmf_Client_Data_t *cl) /*{{{*/
+{
+   ISIS_FREE (cl->first_chan);
+   ISIS_FREE (cl->num_chan);
+   ISIS_FREE (cl->weight_start);
+   ISIS_FREE (cl->weight);
+   cl->num_arf = 0;
+   cl->is_identity = 0;
+   cl->is_initialized = 0;
+}
+
+/*}}}*/
+
 static void free_client_data (Rmf_Client_Data_t *cl) /*{{{*/
 {
-   Elem_Type *end, *e;
    if (cl == NULL) return;
 
-   e = cl->elem;
-   end = cl->elem + cl->num_arf;
-   while (e < end)
-     {
-        if (e->num_chan > 1)
-          {
-             ISIS_FREE (e->resp.v);
-             ISIS_FREE (e->chan.v);
-          }
-        e++;
-     }
-   ISIS_FREE (cl->elem);
+   free_response (cl);
 
    Isis_free_rmf_grid (cl->arf);
    Isis_free_rmf_grid (cl->ebounds);
@@ -105,11 +97,14 @@ static void delete_client_data (Isis_Rmf_t *rmf) /*{{{*/
 
 /*}}}*/
 
-static Elem_Type *get_response (Isis_Rmf_t *rmf) /*{{{*/
+static Rmf_Client_Data_t *get_response (Isis_Rmf_t *rmf) /*{{{*/
 {
    Rmf_Client_Data_t *cl = (Rmf_Client_Data_t *)rmf->client_data;
 
-   return cl->elem;
+   if ((cl == NULL) || (cl->is_initialized == 0))
+     return NULL;
+
+   return cl;
 }
 
 /*}}}*/
@@ -117,29 +112,27 @@ static Elem_Type *get_response (Isis_Rmf_t *rmf) /*{{{*/
 static int redistribute (Isis_Rmf_t *rmf, unsigned int in_lam, double flux, /*{{{*/
                          double *det_chan, unsigned int num_ebounds)
 {
-   Elem_Type *elem = get_response (rmf);
-   Elem_Type *e;
-   unsigned int n;
+   Rmf_Client_Data_t *cl = get_response (rmf);
+   double *d, *w, *wmax;
 
    (void) num_ebounds;
 
-   if (elem == NULL)
+   if (cl == NULL)
      return -1;
 
-   e = &elem[in_lam];
-   n = e->num_chan;
-
-   if (n == 1)
+   if (cl->is_identity)
      {
-        det_chan[ e->chan.s ] += flux * e->resp.s;
+        det_chan[in_lam] += flux;
+        return 0;
      }
-   else if (n > 1)
-     {
-        double *resp = e->resp.v;
-        unsigned int i, *chv = e->chan.v;
 
-        for (i = 0; i < n; i++)
-          det_chan[chv[i]] += flux * resp[i];
+   d = det_chan + cl->first_chan[in_lam];
+   w = cl->weight + cl->weight_start[in_lam];
+   wmax = w + cl->num_chan[in_lam];
+
+   while (w < wmax)
+     {
+        *d++ += flux * *w++;
      }
 
    return 0;
@@ -147,35 +140,36 @@ static int redistribute (Isis_Rmf_t *rmf, unsigned int in_lam, double flux, /*{{
 
 /*}}}*/
 
-static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_notice, /*{{{*/
-                                   int num_model, int *model_notice)
+static int redistribute_vector (Isis_Rmf_t *rmf, double *det_chan, unsigned int num_ebounds, /*{{{*/
+                                double *arf_src, int *notice_list, unsigned int num_noticed)
 {
-   Elem_Type *elem = get_response (rmf);
-   int k;
+   Rmf_Client_Data_t *cl = get_response (rmf);
+   unsigned int k;
 
-   (void) num_chan;
-
-   memset ((char *)model_notice, 0, num_model * sizeof(int));
+   if (cl == NULL)
+     return -1;
 
-   for (k = 0; k < num_model; k++)
+   if (cl->is_identity)
      {
-        Elem_Type *e = &elem[k];
-        unsigned int n = e->num_chan;
-
-        if (n <= 1)
+        if (notice_list == NULL)
           {
-             if (n == 0 || chan_notice[ e->chan.s ])
-               model_notice[k] = 1;
+             for (k = 0; k < num_noticed; k++)
+               det_chan[k] += arf_src[k];
           }
-        else if (n > 1)
+        else
           {
-             unsigned int i, *chv = e->chan.v;
-             for (i = 0; i < n; i++)
-               {
-                  if (chan_notice[chv[i]])
-                    model_notice[k] = 1;
-               }
+             for (k = 0; k < num_noticed; k++)
+               det_chan[notice_list[k]] += arf_src[k];
           }
+        return 0;
+     }
+
+   for (k = 0; k < num_noticed; k++)
+     {
+        unsigned int nk = (notice_list != NULL) ? (unsigned int) notice_list[k] : k;
+        if (arf_src[k] == 0.0)
+          continue;
+        (void) redistribute (rmf, nk, arf_src[k], det_chan, num_ebounds);
      }
 
    return 0;
@@ -183,52 +177,43 @@ static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_noti
 
 /*}}}*/
 
-static int record_response (Elem_Type *e, double f, unsigned int ch) /*{{{*/
+static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_notice, /*{{{*/
+                                   int num_model, int *model_notice)
 {
-   unsigned int i, start_size = 16;
+   Rmf_Client_Data_t *cl = get_response (rmf);
+   int k;
+
+   (void) num_chan;
 
-   e->num_chan++;
+   if (cl == NULL)
+     return -1;
 
-   if (e->num_chan == 1)
+   if (cl->is_identity)
      {
-        e->chan.s = ch;
-        e->resp.s = f;
+        for (k = 0; k < num_model; k++)
+          model_notice[k] = (chan_notice[k] != 0);
         return 0;
      }
-   else if (e->num_chan == 2)
-     {
-        unsigned int ch0 = e->chan.s;
-        double f0 = e->resp.s;
 
-        e->resp.v = (double *) ISIS_MALLOC (start_size * sizeof(double));
-        e->chan.v = (unsigned int *) ISIS_MALLOC (start_size * sizeof(unsigned int));
-        if (e->resp.v == NULL || e->chan.v == NULL)
-          return -1;
+   for (k = 0; k < num_model; k++)
+     {
+        unsigned int i, n = cl->num_chan[k];
+        unsigned int ch = cl->first_chan[k];
+        double *w = cl->weight + cl->weight_start[k];
 
-        e->size = start_size;
-        e->resp.v[0] = f0;
-        e->chan.v[0] = ch0;
-     }
+        /* model bins that miss the data grid entirely stay noticed */
+        model_notice[k] = (n == 0);
 
-   if (e->num_chan > e->size)
-     {
-        unsigned int *i_tmp;
-        double *d_tmp;
-        e->size *= 2;
-
-        if (NULL == (i_tmp = (unsigned int *) ISIS_REALLOC (e->chan.v, e->size * sizeof(unsigned int))))
-          return -1;
-        e->chan.v = i_tmp;
-        
-        if (NULL == (d_tmp = (double *) ISIS_REALLOC (e->resp.v, e->size * sizeof(double))))
-          return -1;
-        e->resp.v = d_tmp;
+        for (i = 0; i < n; i++)
+          {
+             if ((w[i] != 0.0) && chan_notice[ch + i])
+               {
+                  model_notice[k] = 1;
+                  break;
+               }
+          }
      }
 
-   i = e->num_chan - 1;
-   e->chan.v[i] = ch;
-   e->resp.v[i] = f;
-
    return 0;
 }
 
@@ -251,23 +236,34 @@ static double overlap (double alo, double ahi, double dlo, double dhi) /*{{{*/
 
 /*}}}*/
 
-static int init_client_data (Isis_Rmf_t *rmf) /*{{{*/
+static int same_grid (Isis_Rmf_Grid_Type *a, Isis_Rmf_Grid_Type *b) /*{{{*/
+{
+   unsigned int i;
+
+   if (a->nbins != b->nbins)
+     return 0;
+
+   for (i = 0; i < a->nbins; i++)
+     {
+        if ((a->bin_lo[i] != b->bin_lo[i]) || (a->bin_hi[i] != b->bin_hi[i]))
+          return 0;
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
+/* With fill == 0, find the range of detector channels overlapping
+ * each model bin; otherwise, store the overlap weights.
+ */
+static void scan_overlaps (Rmf_Client_Data_t *cl, int fill) /*{{{*/
 {
-   Rmf_Client_Data_t *cl = (Rmf_Client_Data_t *) rmf->client_data;
    Isis_Rmf_Grid_Type *arf = cl->arf;
    Isis_Rmf_Grid_Type *det = cl->ebounds;
-   Elem_Type *elem;
    unsigned int i, ch, na, nd;
    double *alo, *ahi, *dlo, *dhi;
 
-   elem = (Elem_Type *) ISIS_MALLOC (arf->nbins * sizeof(Elem_Type));
-   if (elem == NULL)
-     return -1;
-   memset ((char *)elem, 0, arf->nbins * sizeof (*elem));
-
-   cl->elem = elem;
-   cl->num_arf = arf->nbins;
-
    na = arf->nbins;
    alo = arf->bin_lo;
    ahi = arf->bin_hi;
@@ -287,16 +283,77 @@ static int init_client_data (Isis_Rmf_t *rmf) /*{{{*/
         for (i = i1; (i < na) && (alo[i] < dhi[ch]); i++)
           {
              double o = overlap (alo[i], ahi[i], dlo[ch], dhi[ch]);
-             if (o > 0.0)
+             if (o <= 0.0)
+               continue;
+
+             if (fill)
+               {
+                  cl->weight[cl->weight_start[i] + ch - cl->first_chan[i]]
+                    = o / (ahi[i] - alo[i]);
+               }
+             else if (cl->num_chan[i] == 0)
                {
-                  double r = o / (ahi[i] - alo[i]);
-                  if (-1 == record_response (&elem[i], r, ch))
-                    return -1;
+                  cl->first_chan[i] = ch;
+                  cl->num_chan[i] = 1;
+               }
+             else
+               {
+                  /* channels arrive in increasing order */
+                  cl->num_chan[i] = ch - cl->first_chan[i] + 1;
                }
           }
      }
+}
+
+/*}}}*/
+
+static int init_client_data (Isis_Rmf_t *rmf) /*{{{*/
+{
+   Rmf_Client_Data_t *cl = (Rmf_Client_Data_t *) rmf->client_data;
+   unsigned int i, na, num_weights;
+
+   free_response (cl);
+
+   na = cl->arf->nbins;
+   cl->num_arf = na;
+
+   if (same_grid (cl->arf, cl->ebounds))
+     {
+        cl->is_identity = 1;
+        cl->is_initialized = 1;
+        return 0;
+     }
+
+   if ((NULL == (cl->first_chan = (unsigned int *) ISIS_MALLOC (na * sizeof(unsigned int))))
+       || (NULL == (cl->num_chan = (unsigned int *) ISIS_MALLOC (na * sizeof(unsigned int))))
+       || (NULL == (cl->weight_start = (unsigned int *) ISIS_MALLOC (na * sizeof(unsigned int)))))
+     goto return_error;
+
+   memset ((char *)cl->first_chan, 0, na * sizeof(unsigned int));
+   memset ((char *)cl->num_chan, 0, na * sizeof(unsigned int));
+
+   scan_overlaps (cl, 0);
+
+   num_weights = 0;
+   for (i = 0; i < na; i++)
+     {
+        cl->weight_start[i] = num_weights;
+        num_weights += cl->num_chan[i];
+     }
 
+   /* gaps in the data grid leave zero weights */
+   if (NULL == (cl->weight = (double *) ISIS_MALLOC ((num_weights ? num_weights : 1) * sizeof(double))))
+     goto return_error;
+   memset ((char *)cl->weight, 0, num_weights * sizeof(double));
+
+   scan_overlaps (cl, 1);
+
+   cl->is_initialized = 1;
    return 0;
+
+return_error:
+   free_response (cl);
+   return -1;
 }
 
 /*}}}*/
@@ -388,6 +445,7 @@ int Rmf_load_delta (Isis_Rmf_t *rmf, void *options) /*{{{*/
 
    rmf->init = init_client_data;
    rmf->redistribute = redistribute;
+   rmf->redistribute_vector = redistribute_vector;
    rmf->set_noticed_model_bins = set_noticed_model_bins;
 
    rmf->delete_client_data = delete_client_data;
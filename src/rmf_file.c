@@ -40,16 +40,46 @@
 #  include <stdlib.h>
 #endif
 
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#  define USE_RMF_CACHE_MMAP 1
+#endif
+
 #include "isis.h"
 #include "cfits.h"
 #include "util.h"
 #include "rmf.h"
 #include "errors.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+   && !defined(ISIS_NO_SIMD_FOLD)
+# define HAVE_SIMD_FOLD 1
+# include <immintrin.h>
+#endif
+
 /*}}}*/
 
 int Isis_Rmf_OGIP_Compliance = 2;
 
+#define RMF_MAX_FOLD_THREADS   64
+#define RMF_THREAD_MIN_ELEMS   1000000
+
 /*
  * The input RMF is assumed to have
  * 1) the ARF grid in order of increasing energy
@@ -71,22 +101,29 @@ int Isis_Rmf_OGIP_Compliance = 2;
 
 /*{{{ struct definitions */
 
-typedef struct Rmf_Vector_t Rmf_Vector_t;
 typedef struct Rmf_File_t Rmf_File_t;
-typedef struct Rmf_Element_t Rmf_Element_t;
-
-struct Rmf_Element_t
-{
-   unsigned int first_channel;
-   unsigned int num_channels;
-   float *response;             /* in order of increasing channel number */
-};
 
-struct Rmf_Vector_t
+/* The matrix is stored in compressed-sparse-row form:  each
+ * energy row owns a contiguous range of channel groups, and
+ * all response values live in a single arena so that a fold
+ * walks memory sequentially.
+ */
+typedef struct
 {
-   unsigned int num_grps;       /* number of detector channel groups */
-   Rmf_Element_t *elem;         /* array of detector channel group responses */
-};
+   unsigned int num_rows;       /* number of energy bins */
+   unsigned int num_grps;       /* total number of channel groups */
+   unsigned int max_grps;
+   unsigned int num_elems;      /* total number of response values */
+   unsigned int max_elems;
+   unsigned int *row_start;     /* [num_rows+1] first group of each row */
+   unsigned int *first_channel; /* [num_grps] */
+   unsigned int *num_channels;  /* [num_grps] */
+   unsigned int *resp_start;    /* [num_grps] offset into response arena */
+   float *response;             /* [num_elems] increasing channel number */
+   void *map;                   /* non-NULL if the arrays live in a cache file image */
+   size_t map_size;
+}
+Rmf_Matrix_t;
 
 typedef struct
 {
@@ -108,12 +145,26 @@ typedef struct
    char *ebounds_extname;
    Isis_Rmf_Grid_Type *arf;      /* keV, increasing order */
    Isis_Rmf_Grid_Type *ebounds;  /* keV, increasing order */
-   Rmf_Vector_t *v;              /* keV, increasing order */
+   Rmf_Matrix_t mat;             /* keV, increasing order */
+   Rmf_Matrix_t clip;            /* mat groups clipped to noticed channels */
+   int *chan_notice;             /* channel mask used to build clip */
+   unsigned int num_chan_notice;
    unsigned int num_ebins;
    int offset;                   /* F_CHAN TLMIN value */
+   unsigned int num_threads;     /* threads used by a large fold */
+   unsigned int thread_min;      /* minimum matrix size for a threaded fold */
+   double *thread_buf;           /* per-thread channel buffers */
+   unsigned int thread_buf_len;
+   int lazy;                     /* read matrix rows only when needed */
+   unsigned char *row_loaded;    /* [num_ebins] NULL once every row is loaded */
+   unsigned int num_rows_loaded;
+   unsigned int *row_elems;      /* [num_ebins] response values in each file row */
+   unsigned int *grp_offset;     /* [num_grps] group offset within its file row */
 }
 Rmf_Client_Data_t;
 
+#define RMF_ROW_LOADED(cd,e) (((cd)->row_loaded == NULL) || (cd)->row_loaded[e])
+
 struct Rmf_File_t
 {
    cfitsfile *ft;
@@ -136,8 +187,33 @@ struct Rmf_File_t
    long n_grp_val;
    long f_chan_val;
    long n_chan_val;
+
+   /* Fixed-width vector columns are read for a whole block of rows
+    * at once; variable-length columns must be read one row at a time.
+    */
+   long f_chan_repeat;
+   long n_chan_repeat;
+   long matrix_repeat;
+   int f_chan_is_vla;
+   int n_chan_is_vla;
+   int matrix_is_vla;
 };
 
+/* Scratch space for reading a block of RMF rows */
+typedef struct
+{
+   long max_rows;
+   float *elo;                  /* [max_rows] */
+   float *ehi;                  /* [max_rows] */
+   unsigned int *ngrps;         /* [max_rows] */
+   unsigned int *fchan;         /* [max_rows * f_chan_repeat], fixed-width only */
+   unsigned int *nchan;         /* [max_rows * n_chan_repeat], fixed-width only */
+   float *matrix;               /* [max_rows * matrix_repeat], fixed-width only */
+   unsigned int *row_chans;     /* [2 * max_row_grps] one row of F_CHAN, N_CHAN */
+   unsigned int max_row_grps;
+}
+Rmf_Row_Block_t;
+
 /*}}}*/
 
 static int print_options_help (Rmf_Client_Data_t *cd);
@@ -150,24 +226,325 @@ static Rmf_Client_Data_t *get_client_data (Isis_Rmf_t *rmf) /*{{{*/
 
 /*}}}*/
 
-static void free_rmf_vector (Rmf_Vector_t *v) /*{{{*/
+static void free_rmf_matrix (Rmf_Matrix_t *m) /*{{{*/
 {
-   Rmf_Element_t *elem;
-   Rmf_Element_t *elem_max;
-
-   if ((v == NULL) || ((elem = v->elem) == NULL))
+   if (m == NULL)
      return;
 
-   elem_max = elem + v->num_grps;
+   /* A matrix loaded from the response cache is never resized,
+    * its arrays all point into a single image. */
+   if (m->map != NULL)
+     {
+#ifdef USE_RMF_CACHE_MMAP
+        (void) munmap (m->map, m->map_size);
+#else
+        ISIS_FREE (m->map);
+#endif
+        memset ((char *) m, 0, sizeof (*m));
+        return;
+     }
+
+   ISIS_FREE (m->row_start);
+   ISIS_FREE (m->first_channel);
+   ISIS_FREE (m->num_channels);
+   ISIS_FREE (m->resp_start);
+   ISIS_FREE (m->response);
+   memset ((char *) m, 0, sizeof (*m));
+}
+
+/*}}}*/
+
+static int init_rmf_matrix (Rmf_Matrix_t *m, unsigned int num_rows, /*{{{*/
+                            unsigned int max_grps, unsigned int max_elems)
+{
+   memset ((char *) m, 0, sizeof (*m));
+
+   if (max_grps == 0) max_grps = 1;
+   if (max_elems == 0) max_elems = 1;
+
+   if ((NULL == (m->row_start = (unsigned int *) ISIS_MALLOC ((num_rows + 1) * sizeof(unsigned int))))
+       || (NULL == (m->first_channel = (unsigned int *) ISIS_MALLOC (max_grps * sizeof(unsigned int))))
+       || (NULL == (m->num_channels = (unsigned int *) ISIS_MALLOC (max_grps * sizeof(unsigned int))))
+       || (NULL == (m->resp_start = (unsigned int *) ISIS_MALLOC (max_grps * sizeof(unsigned int))))
+       || (NULL == (m->response = (float *) ISIS_MALLOC (max_elems * sizeof(float)))))
+     {
+        free_rmf_matrix (m);
+        return -1;
+     }
+   memset ((char *) m->row_start, 0, (num_rows + 1) * sizeof(unsigned int));
+
+   m->num_rows = num_rows;
+   m->max_grps = max_grps;
+   m->max_elems = max_elems;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int grow_rmf_groups (Rmf_Matrix_t *m, unsigned int need) /*{{{*/
+{
+   unsigned int *fc, *nc, *rs;
+   unsigned int max_grps;
+
+   max_grps = m->max_grps;
+   while (max_grps < need)
+     max_grps *= 2;
+
+   if (NULL == (fc = (unsigned int *) ISIS_REALLOC (m->first_channel, max_grps * sizeof(unsigned int))))
+     return -1;
+   m->first_channel = fc;
+   if (NULL == (nc = (unsigned int *) ISIS_REALLOC (m->num_channels, max_grps * sizeof(unsigned int))))
+     return -1;
+   m->num_channels = nc;
+   if (NULL == (rs = (unsigned int *) ISIS_REALLOC (m->resp_start, max_grps * sizeof(unsigned int))))
+     return -1;
+   m->resp_start = rs;
+
+   m->max_grps = max_grps;
+   return 0;
+}
+
+/*}}}*/
+
+static int grow_rmf_arena (Rmf_Matrix_t *m, unsigned int need) /*{{{*/
+{
+   unsigned int max_elems;
+   float *r;
+
+   max_elems = m->max_elems;
+   while (max_elems < need)
+     max_elems *= 2;
+
+   if (NULL == (r = (float *) ISIS_REALLOC (m->response, max_elems * sizeof(float))))
+     return -1;
+
+   m->response = r;
+   m->max_elems = max_elems;
+   return 0;
+}
+
+/*}}}*/
+
+/* Append a channel group to the row currently being built,
+ * without storage for its response values.
+ */
+static int append_rmf_group_header (Rmf_Matrix_t *m, unsigned int first_channel, /*{{{*/
+                                    unsigned int num_channels)
+{
+   unsigned int g;
+
+   if ((m->num_grps == m->max_grps)
+       && (-1 == grow_rmf_groups (m, m->num_grps + 1)))
+     return -1;
+
+   g = m->num_grps++;
+   m->first_channel[g] = first_channel;
+   m->num_channels[g] = num_channels;
+   m->resp_start[g] = m->num_elems;
+   m->num_elems += num_channels;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Append a channel group to the row currently being built and
+ * return a pointer to storage for its response values.
+ * The pointer is only valid until the next append.
+ */
+static float *append_rmf_group (Rmf_Matrix_t *m, unsigned int first_channel, /*{{{*/
+                                unsigned int num_channels)
+{
+   if ((m->num_elems + num_channels > m->max_elems)
+       && (-1 == grow_rmf_arena (m, m->num_elems + num_channels)))
+     return NULL;
+
+   if (-1 == append_rmf_group_header (m, first_channel, num_channels))
+     return NULL;
+
+   return m->response + m->resp_start[m->num_grps - 1];
+}
+
+/*}}}*/
+
+/* Rows must be closed in increasing order, including empty rows */
+static void close_rmf_row (Rmf_Matrix_t *m, unsigned int row) /*{{{*/
+{
+   m->row_start[row+1] = m->num_grps;
+}
+
+/*}}}*/
+
+static void trim_rmf_matrix (Rmf_Matrix_t *m) /*{{{*/
+{
+   /* shrinking never fails in practice, but keep the old
+    * blocks if it does */
+   if (m->num_grps < m->max_grps)
+     {
+        unsigned int n = m->num_grps ? m->num_grps : 1;
+        unsigned int *p;
+        if (NULL != (p = (unsigned int *) ISIS_REALLOC (m->first_channel, n * sizeof(unsigned int))))
+          m->first_channel = p;
+        if (NULL != (p = (unsigned int *) ISIS_REALLOC (m->num_channels, n * sizeof(unsigned int))))
+          m->num_channels = p;
+        if (NULL != (p = (unsigned int *) ISIS_REALLOC (m->resp_start, n * sizeof(unsigned int))))
+          m->resp_start = p;
+        m->max_grps = n;
+     }
+
+   if (m->num_elems < m->max_elems)
+     {
+        unsigned int n = m->num_elems ? m->num_elems : 1;
+        float *r;
+        if (NULL != (r = (float *) ISIS_REALLOC (m->response, n * sizeof(float))))
+          {
+             m->response = r;
+             m->max_elems = n;
+          }
+     }
+}
+
+/*}}}*/
+
+static void free_noticed_groups (Rmf_Client_Data_t *cd) /*{{{*/
+{
+   free_rmf_matrix (&cd->clip);
+   ISIS_FREE (cd->chan_notice);
+   cd->num_chan_notice = 0;
+}
+
+/*}}}*/
+
+/* Clip each channel group to the runs of noticed channels.
+ * The clipped groups share the response arena of cd->mat,
+ * so clip.response is never allocated.
+ */
+static int build_noticed_groups (Rmf_Client_Data_t *cd) /*{{{*/
+{
+   Rmf_Matrix_t *m = &cd->mat;
+   Rmf_Matrix_t *c = &cd->clip;
+   int *noticed_base = cd->chan_notice + cd->num_chan_notice - 1;
+   unsigned int e, g, n, pass;
+
+   free_rmf_matrix (c);
+
+   if (NULL == (c->row_start = (unsigned int *) ISIS_MALLOC ((m->num_rows + 1) * sizeof(unsigned int))))
+     return -1;
+   c->num_rows = m->num_rows;
+
+   /* first pass counts the clipped groups, second pass stores them */
+   for (pass = 0; pass < 2; pass++)
+     {
+        n = 0;
+        for (e = 0; e < m->num_rows; e++)
+          {
+             c->row_start[e] = n;
+             for (g = m->row_start[e]; g < m->row_start[e+1]; g++)
+               {
+                  unsigned int k, num_channels = m->num_channels[g];
+                  int *noticed = noticed_base - m->first_channel[g];
+
+                  k = 0;
+                  while (k < num_channels)
+                    {
+                       unsigned int k0;
+
+                       if (noticed[-(int)k] == 0)
+                         {
+                            k++;
+                            continue;
+                         }
+
+                       k0 = k;
+                       while ((k < num_channels) && noticed[-(int)k])
+                         k++;
+
+                       if (pass == 1)
+                         {
+                            c->first_channel[n] = m->first_channel[g] + k0;
+                            c->num_channels[n] = k - k0;
+                            c->resp_start[n] = m->resp_start[g] + k0;
+                         }
+                       n++;
+                    }
+               }
+          }
+        c->row_start[m->num_rows] = n;
+
+        if (pass == 1)
+          break;
+
+        c->num_grps = c->max_grps = n;
+        if (n == 0) n = 1;
+        if ((NULL == (c->first_channel = (unsigned int *) ISIS_MALLOC (n * sizeof(unsigned int))))
+            || (NULL == (c->num_channels = (unsigned int *) ISIS_MALLOC (n * sizeof(unsigned int))))
+            || (NULL == (c->resp_start = (unsigned int *) ISIS_MALLOC (n * sizeof(unsigned int)))))
+          {
+             free_rmf_matrix (c);
+             return -1;
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Record the noticed-channel mask.  An RMF shared by several
+ * datasets or responses folds for the union of their masks.
+ */
+static int set_noticed_channels (Isis_Rmf_t *rmf, int num_chan, int *chan_notice) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   int i, all_noticed;
+
+   all_noticed = 1;
+   for (i = 0; i < num_chan; i++)
+     {
+        if (chan_notice[i] == 0)
+          {
+             all_noticed = 0;
+             break;
+          }
+     }
+
+   if ((cd->chan_notice != NULL)
+       && rmf->notice_shared
+       && (cd->num_chan_notice == (unsigned int) num_chan))
+     {
+        for (i = 0; i < num_chan; i++)
+          {
+             if (chan_notice[i])
+               cd->chan_notice[i] = 1;
+          }
+     }
+   else
+     {
+        if (all_noticed)
+          {
+             free_noticed_groups (cd);
+             return 0;
+          }
+
+        ISIS_FREE (cd->chan_notice);
+        if (NULL == (cd->chan_notice = (int *) ISIS_MALLOC (num_chan * sizeof(int))))
+          {
+             free_noticed_groups (cd);
+             return -1;
+          }
+        cd->num_chan_notice = num_chan;
+        for (i = 0; i < num_chan; i++)
+          cd->chan_notice[i] = (chan_notice[i] != 0);
+     }
 
-   while (elem < elem_max)
+   if (-1 == build_noticed_groups (cd))
      {
-        if (elem->response != NULL) ISIS_FREE (elem->response);
-        elem++;
+        free_noticed_groups (cd);
+        return -1;
      }
 
-   ISIS_FREE (v->elem);
-   v->num_grps = 0;
+   return 0;
 }
 
 /*}}}*/
@@ -312,6 +689,13 @@ static Rmf_File_t *open_rmf_file (char *file, Isis_Rmf_t *rmf) /*{{{*/
    if (-1 == (rft->n_chan_col = columns[4]))
      rft->n_chan_val = allow_as_keyword[4];
 
+   if (((rft->f_chan_col != -1)
+        && (-1 == cfits_get_column_repeat (ft, rft->f_chan_col, &rft->f_chan_repeat, &rft->f_chan_is_vla)))
+       || ((rft->n_chan_col != -1)
+           && (-1 == cfits_get_column_repeat (ft, rft->n_chan_col, &rft->n_chan_repeat, &rft->n_chan_is_vla)))
+       || (-1 == cfits_get_column_repeat (ft, rft->matrix_col, &rft->matrix_repeat, &rft->matrix_is_vla)))
+     goto return_error;
+
    return rft;
 
    return_error:
@@ -333,142 +717,284 @@ static void close_rmf_file (Rmf_File_t **rft) /*{{{*/
 
 /*}}}*/
 
-static int read_rmf_vector (Rmf_File_t *rft, int row, Rmf_Vector_t *v, /*{{{*/
-                            double *elo, double *ehi,
-                            int chan_range[2])
+static void free_row_block (Rmf_Row_Block_t *b) /*{{{*/
 {
-   cfitsfile *ft;
-   unsigned int *nchan=NULL, *fchan=NULL;
-   Rmf_Element_t *elem;
-   Rmf_Element_t *elem_max;
-   float f_elo, f_ehi;
-   unsigned int i;
-   unsigned int ngrps;
-   long offset;
-   int matrix_col;
+   ISIS_FREE (b->elo);
+   ISIS_FREE (b->ehi);
+   ISIS_FREE (b->ngrps);
+   ISIS_FREE (b->fchan);
+   ISIS_FREE (b->nchan);
+   ISIS_FREE (b->matrix);
+   ISIS_FREE (b->row_chans);
+   memset ((char *)b, 0, sizeof(*b));
+}
+
+/*}}}*/
+
+static int grow_row_chans (Rmf_Row_Block_t *b, unsigned int ngrps) /*{{{*/
+{
+   unsigned int *p;
+
+   if (ngrps <= b->max_row_grps)
+     return 0;
 
-   if (rft == NULL || v == NULL)
+   if (NULL == (p = (unsigned int *) ISIS_REALLOC (b->row_chans, 2 * ngrps * sizeof(unsigned int))))
      return -1;
+   b->row_chans = p;
+   b->max_row_grps = ngrps;
+
+   return 0;
+}
 
-   v->num_grps = 0;
-   v->elem = NULL;
+/*}}}*/
+
+static int init_row_block (Rmf_File_t *rft, Rmf_Row_Block_t *b) /*{{{*/
+{
+   long n;
 
-   ft = rft->ft;
+   memset ((char *)b, 0, sizeof(*b));
 
-   if (rft->n_grp_col == -1)
-     ngrps = rft->n_grp_val;
-   else if (-1 == cfits_read_column_uints (ft, rft->n_grp_col, row, 1, &ngrps, 1))
+   /* an empty matrix has no rows to read */
+   if (rft->num_rows < 1)
+     return 0;
+
+   /* The block size is chosen so that cfitsio can buffer a
+    * whole block of table rows.
+    */
+   if ((n = cfits_optimal_numrows (rft->ft)) < 1)
+     n = 1;
+   if (n > rft->num_rows)
+     n = rft->num_rows;
+   b->max_rows = n;
+
+   if ((NULL == (b->elo = (float *) ISIS_MALLOC (n * sizeof(float))))
+       || (NULL == (b->ehi = (float *) ISIS_MALLOC (n * sizeof(float))))
+       || (NULL == (b->ngrps = (unsigned int *) ISIS_MALLOC (n * sizeof(unsigned int))))
+       || (-1 == grow_row_chans (b, 16)))
+     goto return_error;
+
+   if ((rft->f_chan_col != -1) && (rft->f_chan_is_vla == 0)
+       && (NULL == (b->fchan = (unsigned int *) ISIS_MALLOC (n * rft->f_chan_repeat * sizeof(unsigned int)))))
+     goto return_error;
+
+   if ((rft->n_chan_col != -1) && (rft->n_chan_is_vla == 0)
+       && (NULL == (b->nchan = (unsigned int *) ISIS_MALLOC (n * rft->n_chan_repeat * sizeof(unsigned int)))))
+     goto return_error;
+
+   if ((rft->matrix_is_vla == 0)
+       && (NULL == (b->matrix = (float *) ISIS_MALLOC (n * rft->matrix_repeat * sizeof(float)))))
+     goto return_error;
+
+   return 0;
+
+return_error:
+   free_row_block (b);
+   return -1;
+}
+
+/*}}}*/
+
+/* Fetch F_CHAN or N_CHAN values for row r of the block.  Fixed-width
+ * columns were already read for the whole block; variable-length
+ * columns are read here, into buf.
+ */
+static int get_row_chans (Rmf_File_t *rft, int col, long repeat, int is_vla, long val, /*{{{*/
+                          unsigned int *block, long first_row, long r,
+                          unsigned int ngrps, unsigned int *buf, unsigned int **chans)
+{
+   unsigned int i;
+
+   if (col == -1)
      {
-        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading number of RMF groups");
-        return -1;
+        for (i = 0; i < ngrps; i++)
+          buf[i] = (unsigned int) val;
+        *chans = buf;
+        return 0;
      }
 
-   if (-1 == cfits_read_column_floats (ft, rft->energ_lo_col, row, 1, &f_elo, 1)
-       || -1 == cfits_read_column_floats (ft, rft->energ_hi_col, row, 1, &f_ehi, 1))
+   if (is_vla == 0)
      {
-        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF vector energy grid");
-        return -1;
+        if (ngrps > (unsigned int) repeat)
+          {
+             isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "N_GRP=%u exceeds column width %ld",
+                         ngrps, repeat);
+             return -1;
+          }
+        *chans = block + r * repeat;
+        return 0;
      }
 
-   *elo = (double) f_elo;
-   *ehi = (double) f_ehi;
+   if (-1 == cfits_read_column_uints (rft->ft, col, (int) (first_row + r + 1), 1, buf, ngrps))
+     return -1;
 
-   if ((*elo == FLT_MIN) || (*ehi == FLT_MIN))
-     {
-        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "Corrupted energy grid in RMF");
-        return -1;
-     }
+   *chans = buf;
+   return 0;
+}
 
-   if (ngrps == 0)
-     return 0;
+/*}}}*/
 
-   if (NULL == (elem = (Rmf_Element_t *) ISIS_MALLOC (ngrps * sizeof(Rmf_Element_t))))
-     return -1;
-   memset ((char *) elem, 0, ngrps * sizeof(*elem));
+/* Reads rows [first_row, first_row + nrows) (zero-based) into the matrix.
+ * Scalar and fixed-width columns are read with one cfitsio call per
+ * block; variable-length MATRIX rows are read with one call per row,
+ * straight into the response arena.
+ * If row_elems is not NULL, only the group headers are read and
+ * the number of response values in each row is stored there.
+ */
+static int read_rmf_rows (Rmf_File_t *rft, Rmf_Row_Block_t *b, long first_row, long nrows, /*{{{*/
+                          Rmf_Matrix_t *m, Isis_Rmf_Grid_Type *g, int chan_range[2],
+                          unsigned int *row_elems)
+{
+   cfitsfile *ft = rft->ft;
+   int fits_row = (int) first_row + 1;
+   long r;
 
-   if (NULL == (nchan = (unsigned int *) ISIS_MALLOC (2*ngrps * sizeof(unsigned int))))
+   if ((-1 == cfits_read_column_floats (ft, rft->energ_lo_col, fits_row, 1, b->elo, nrows))
+       || (-1 == cfits_read_column_floats (ft, rft->energ_hi_col, fits_row, 1, b->ehi, nrows)))
      {
-        ISIS_FREE(elem);
+        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF vector energy grid");
         return -1;
      }
-   fchan = nchan + ngrps;
 
-   v->num_grps = ngrps;
-   v->elem = elem;
-
-   /* Hopefully the cfitsio library will cache things. In general things will
-    * be in the heap and whether it has a cache or not may be irrelevant.
-    */
-
-   if (-1 == rft->f_chan_col)
+   if (rft->n_grp_col == -1)
      {
-        unsigned int imax = ngrps;
-        unsigned int f_chan_val = rft->f_chan_val;
-
-        for (i = 0; i < imax; i++) fchan [i] = f_chan_val;
+        for (r = 0; r < nrows; r++)
+          b->ngrps[r] = rft->n_grp_val;
      }
-   else if (-1 == cfits_read_column_uints (ft, rft->f_chan_col, row, 1, fchan, ngrps))
+   else if (-1 == cfits_read_column_uints (ft, rft->n_grp_col, fits_row, 1, b->ngrps, nrows))
      {
-        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF fchan column");
-        goto return_error;
+        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading number of RMF groups");
+        return -1;
      }
 
-   if (-1 == rft->n_chan_col)
+   if ((rft->f_chan_col != -1) && (rft->f_chan_is_vla == 0)
+       && (-1 == cfits_read_column_uints (ft, rft->f_chan_col, fits_row, 1, b->fchan,
+                                          nrows * rft->f_chan_repeat)))
      {
-        unsigned int imax = ngrps;
-        unsigned int n_chan_val = rft->n_chan_val;
-
-        for (i = 0; i < imax; i++) nchan [i] = n_chan_val;
+        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF fchan column");
+        return -1;
      }
-   else if (-1 == cfits_read_column_uints (ft, rft->n_chan_col, row, 1, nchan, ngrps))
+
+   if ((rft->n_chan_col != -1) && (rft->n_chan_is_vla == 0)
+       && (-1 == cfits_read_column_uints (ft, rft->n_chan_col, fits_row, 1, b->nchan,
+                                          nrows * rft->n_chan_repeat)))
      {
         isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF nchan column");
-        goto return_error;
+        return -1;
      }
 
-   elem = v->elem;
-   elem_max = elem + ngrps;
-   i = 0;
-
-   matrix_col = rft->matrix_col;
-   offset = 1;
+   if ((rft->matrix_is_vla == 0) && (row_elems == NULL)
+       && (-1 == cfits_read_column_floats (ft, rft->matrix_col, fits_row, 1, b->matrix,
+                                           nrows * rft->matrix_repeat)))
+     {
+        isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF response column");
+        return -1;
+     }
 
-   while (elem < elem_max)
+   for (r = 0; r < nrows; r++)
      {
-        elem->first_channel = fchan[i];
-        elem->num_channels = nchan[i];
+        long row = first_row + r;
+        unsigned int ngrps = b->ngrps[r];
+        unsigned int *fchan, *nchan;
+        unsigned int i, g0, num_elems;
 
-        /* derive min/max channels included in this mapping */
-        if ((int) fchan[i] < chan_range[0])
-          {
-             chan_range[0] = (int)fchan[i];
-          }
-        if (chan_range[1] < (int)fchan[i] + (int)nchan[i] - 1)
+        g->bin_lo[row] = (double) b->elo[r];
+        g->bin_hi[row] = (double) b->ehi[r];
+
+        if ((g->bin_lo[row] == FLT_MIN) || (g->bin_hi[row] == FLT_MIN))
           {
-             chan_range[1] = (int)fchan[i] + (int)nchan[i] - 1;
+             isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "Corrupted energy grid in RMF");
+             return -1;
           }
 
-        elem->response = (float *) ISIS_MALLOC (elem->num_channels * sizeof(float));
-        if ((elem->response == NULL)
-            || (-1 == cfits_read_column_floats (ft, matrix_col, row, offset,
-                                                elem->response, elem->num_channels)))
+        if (row_elems != NULL)
+          row_elems[row] = 0;
+
+        if (ngrps == 0)
           {
-             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF response column");
-             goto return_error;
+             close_rmf_row (m, row);
+             continue;
           }
 
-        offset += elem->num_channels;
-        i++;
-        elem++;
+        if (-1 == grow_row_chans (b, ngrps))
+          return -1;
+
+        if (-1 == get_row_chans (rft, rft->f_chan_col, rft->f_chan_repeat, rft->f_chan_is_vla,
+                                 rft->f_chan_val, b->fchan, first_row, r,
+                                 ngrps, b->row_chans, &fchan))
+          {
+             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF fchan column");
+             return -1;
+          }
+
+        if (-1 == get_row_chans (rft, rft->n_chan_col, rft->n_chan_repeat, rft->n_chan_is_vla,
+                                 rft->n_chan_val, b->nchan, first_row, r,
+                                 ngrps, b->row_chans + ngrps, &nchan))
+          {
+             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF nchan column");
+             return -1;
+          }
+
+        g0 = m->num_grps;
+        num_elems = 0;
+
+        for (i = 0; i < ngrps; i++)
+          {
+             /* derive min/max channels included in this mapping */
+             if ((int) fchan[i] < chan_range[0])
+               {
+                  chan_range[0] = (int)fchan[i];
+               }
+             if (chan_range[1] < (int)fchan[i] + (int)nchan[i] - 1)
+               {
+                  chan_range[1] = (int)fchan[i] + (int)nchan[i] - 1;
+               }
+
+             if (row_elems != NULL)
+               {
+                  if (-1 == append_rmf_group_header (m, fchan[i], nchan[i]))
+                    return -1;
+               }
+             else if (NULL == append_rmf_group (m, fchan[i], nchan[i]))
+               return -1;
+             num_elems += nchan[i];
+          }
+
+        if ((rft->matrix_is_vla == 0)
+            && (num_elems > (unsigned int) rft->matrix_repeat))
+          {
+             isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__,
+                         "RMF row %ld:  %u channels exceeds MATRIX width %ld",
+                         row+1, num_elems, rft->matrix_repeat);
+             return -1;
+          }
+
+        if (row_elems != NULL)
+          {
+             row_elems[row] = num_elems;
+             close_rmf_row (m, row);
+             continue;
+          }
+
+        /* The groups of a row are contiguous in both the file
+         * and the arena, so the whole row is copied at once. */
+        if (rft->matrix_is_vla == 0)
+          {
+             memcpy ((char *)(m->response + m->resp_start[g0]),
+                     (char *)(b->matrix + r * rft->matrix_repeat),
+                     num_elems * sizeof(float));
+          }
+        else if (-1 == cfits_read_column_floats (ft, rft->matrix_col, row+1, 1,
+                                                 m->response + m->resp_start[g0],
+                                                 num_elems))
+          {
+             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF response column");
+             return -1;
+          }
+
+        close_rmf_row (m, row);
      }
 
-   ISIS_FREE(nchan);
    return 0;
-
-   return_error:
-   ISIS_FREE(nchan);
-   free_rmf_vector (v);
-   return -1;
 }
 
 /*}}}*/
@@ -580,28 +1106,30 @@ static int read_rmf_ebounds (cfitsfile *rmf_fp, int chan_range[2], Isis_Rmf_Grid
 static int renumber_detector_channels (Isis_Rmf_t *rmf) /*{{{*/
 {
    Rmf_Client_Data_t *cd = get_client_data (rmf);
-   unsigned int i, num_channels, swapped;
+   Rmf_Matrix_t *m;
+   unsigned int e, g, num_channels, swapped;
 
    if ((rmf == NULL) || (cd == NULL))
      return -1;
 
+   m = &cd->mat;
    num_channels = cd->ebounds->nbins;
    swapped = cd->swapped_channels;
 
-   for (i = 0; i < cd->num_ebins; i++)
+   for (e = 0; e < m->num_rows; e++)
      {
-        Rmf_Vector_t *v = &cd->v[i];
-        unsigned int g;
+        /* rows that aren't loaded yet are reversed when they are read */
+        int loaded = RMF_ROW_LOADED(cd, e);
 
-        for (g = 0; g < v->num_grps; g++)
+        for (g = m->row_start[e]; g < m->row_start[e+1]; g++)
           {
-             Rmf_Element_t *elem = &v->elem[g];
-             elem->first_channel -= cd->offset;
+             m->first_channel[g] -= cd->offset;
              if (swapped)
                {
-                  unsigned int last_chan = elem->first_channel + elem->num_channels - 1;
-                  elem->first_channel = num_channels - last_chan - 1;
-                  reverse_f (elem->response, elem->num_channels);
+                  unsigned int last_chan = m->first_channel[g] + m->num_channels[g] - 1;
+                  m->first_channel[g] = num_channels - last_chan - 1;
+                  if (loaded)
+                    reverse_f (m->response + m->resp_start[g], m->num_channels[g]);
                }
           }
      }
@@ -615,251 +1143,1429 @@ static int validate_rmf (Isis_Rmf_t *rmf) /*{{{*/
 {
    unsigned int e, g, num_ok, ignored;
    Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Matrix_t *m = &cd->mat;
 
    ignored = 0;
    num_ok = 0;
    for (e = 0; e < cd->num_ebins; e++)
      {
-        Rmf_Vector_t *v = &cd->v[e];
-        for (g = 0; g < v->num_grps; g++)
+        for (g = m->row_start[e]; g < m->row_start[e+1]; g++)
           {
-             Rmf_Element_t *elem = &v->elem[g];
-             int first = elem->first_channel;
+             int first = m->first_channel[g];
 
              if (first < 0)
                {
                   ignored++;
                   isis_vmesg (INFO, I_WARNING, __FILE__, __LINE__,
                               "invalid RMF chan: ebin=%d group=%d fchan=%d offset=%d",
-                              e, g,
-                              elem->first_channel + cd->offset,
+                              e, g - m->row_start[e],
+                              m->first_channel[g] + cd->offset,
                               cd->offset);
-                  elem->num_channels = 0;
+                  m->num_channels[g] = 0;
                }
 
-             if (cd->ebounds->nbins < (first + elem->num_channels))
+             if (cd->ebounds->nbins < (first + m->num_channels[g]))
                {
                   ignored++;
                   isis_vmesg (INFO, I_WARNING, __FILE__, __LINE__,
                               "invalid RMF chan: ebin=%d group=%d fchan=%d nchan=%d  num_ebounds=%d",
-                              e, g,
-                              elem->first_channel,
-                              elem->num_channels,
+                              e, g - m->row_start[e],
+                              m->first_channel[g],
+                              m->num_channels[g],
                               cd->ebounds->nbins);
-                  elem->num_channels = 0;
+                  m->num_channels[g] = 0;
+               }
+
+             num_ok += m->num_channels[g];
+          }
+     }
+
+   if (ignored)
+     isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__, "Ignored %u invalid RMF channels", ignored);
+
+   if (num_ok == 0)
+     isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "RMF has no valid output channels");
+
+   return num_ok ? 0 : -1;
+}
+
+/*}}}*/
+
+static int read_order_keyword (cfitsfile *ft, int *order) /*{{{*/
+{
+   static const char *keys[] =
+     {
+        "ORDER", "TG_M", "RFLORDER", NULL
+     };
+   const char **k;
+   int ret = 0;
+
+   for (k = keys; *k != NULL; k++)
+     {
+        if (0 == (ret = cfits_read_int_keyword (order, *k, ft)))
+          break;
+     }
+
+   return ret;
+}
+
+/*}}}*/
+
+/*{{{ lazy row loading */
+
+/* With the lazy option, read_rmf reads only the group headers.
+ * The response values of a row are read when a fold, or a notice
+ * range given to set_noticed_model_bins, first needs them.  The
+ * arena holds the loaded rows in row order, so resp_start increases
+ * with the row number as in a fully loaded matrix; groups of rows
+ * that aren't loaded yet have no storage.
+ */
+
+static void free_lazy_rows (Rmf_Client_Data_t *cd) /*{{{*/
+{
+   ISIS_FREE (cd->row_loaded);
+   ISIS_FREE (cd->row_elems);
+   ISIS_FREE (cd->grp_offset);
+   cd->num_rows_loaded = 0;
+}
+
+/*}}}*/
+
+/* Called after the headers are read, while resp_start still holds
+ * the offsets the groups would have in a fully loaded arena.
+ */
+static int init_lazy_rows (Rmf_Client_Data_t *cd) /*{{{*/
+{
+   Rmf_Matrix_t *m = &cd->mat;
+   unsigned int e, g, n;
+
+   n = m->num_grps ? m->num_grps : 1;
+
+   if ((NULL == (cd->grp_offset = (unsigned int *) ISIS_MALLOC (n * sizeof(unsigned int))))
+       || (NULL == (cd->row_loaded = (unsigned char *) ISIS_MALLOC (m->num_rows + 1))))
+     return -1;
+   memset ((char *)cd->row_loaded, 0, m->num_rows + 1);
+
+   cd->num_rows_loaded = 0;
+   for (e = 0; e < m->num_rows; e++)
+     {
+        unsigned int g0 = m->row_start[e];
+        unsigned int row_base = (g0 < m->num_grps) ? m->resp_start[g0] : 0;
+
+        for (g = g0; g < m->row_start[e+1]; g++)
+          {
+             cd->grp_offset[g] = m->resp_start[g] - row_base;
+             m->resp_start[g] = 0;
+          }
+
+        /* nothing to read */
+        if (cd->row_elems[e] == 0)
+          {
+             cd->row_loaded[e] = 1;
+             cd->num_rows_loaded++;
+          }
+     }
+
+   m->num_elems = 0;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Isis_Verbose is lowered so that warnings already given by
+ * read_rmf aren't repeated.
+ */
+static Rmf_File_t *reopen_rmf_file (Isis_Rmf_t *rmf) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_File_t *rft;
+   int order = rmf->order;
+   int verbose = Isis_Verbose;
+
+   if (Isis_Verbose > FAIL)
+     Isis_Verbose = FAIL;
+   rft = open_rmf_file (cd->f.file, rmf);
+   Isis_Verbose = verbose;
+
+   /* open_rmf_file may have read ORDER from the primary header */
+   rmf->order = order;
+
+   if (rft == NULL)
+     isis_vmesg (FAIL, I_READ_OPEN_FAILED, __FILE__, __LINE__, "%s", cd->f.file);
+
+   return rft;
+}
+
+/*}}}*/
+
+/* Reads the response values of the rows with fetch[e] != 0 into
+ * arena + row_base[e], one block of rows at a time.
+ */
+static int read_lazy_rows (Rmf_File_t *rft, Rmf_Client_Data_t *cd, unsigned char *fetch, /*{{{*/
+                           unsigned int *row_base, float *arena)
+{
+   Rmf_Row_Block_t blk;
+   unsigned int e, num_rows = cd->num_ebins;
+   int ret = -1;
+
+   if (-1 == init_row_block (rft, &blk))
+     return -1;
+
+   e = 0;
+   while (e < num_rows)
+     {
+        unsigned int e0, r;
+
+        if (fetch[e] == 0)
+          {
+             e++;
+             continue;
+          }
+
+        e0 = e;
+        while ((e < num_rows) && fetch[e] && (e - e0 < (unsigned int) blk.max_rows))
+          e++;
+
+        if (rft->matrix_is_vla == 0)
+          {
+             if (-1 == cfits_read_column_floats (rft->ft, rft->matrix_col, (int) e0 + 1, 1, blk.matrix,
+                                                 (e - e0) * rft->matrix_repeat))
+               goto finish;
+
+             for (r = e0; r < e; r++)
+               {
+                  memcpy ((char *)(arena + row_base[r]),
+                          (char *)(blk.matrix + (r - e0) * rft->matrix_repeat),
+                          cd->row_elems[r] * sizeof(float));
                }
+             continue;
+          }
+
+        for (r = e0; r < e; r++)
+          {
+             if ((cd->row_elems[r] > 0)
+                 && (-1 == cfits_read_column_floats (rft->ft, rft->matrix_col, (int) r + 1, 1,
+                                                     arena + row_base[r], cd->row_elems[r])))
+               goto finish;
+          }
+     }
+
+   ret = 0;
+finish:
+   if (ret)
+     isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF response column");
+   free_row_block (&blk);
+   return ret;
+}
+
+/*}}}*/
+
+/* Loads every row with want[e] != 0.  On return, want[e] is set only
+ * for the rows that were read.  The matrix is left unchanged on failure.
+ */
+static int load_lazy_rows (Isis_Rmf_t *rmf, unsigned char *want) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Matrix_t *m = &cd->mat;
+   Rmf_File_t *rft = NULL;
+   unsigned int *row_base = NULL;
+   float *arena = NULL;
+   unsigned int e, g, num_elems, num_fetch;
+   int ret = -1;
+
+   if (cd->row_loaded == NULL)
+     return 0;
+
+   num_fetch = 0;
+   for (e = 0; e < m->num_rows; e++)
+     {
+        if (cd->row_loaded[e])
+          want[e] = 0;
+        else if (want[e])
+          num_fetch++;
+     }
+
+   if (num_fetch == 0)
+     return 0;
+
+   if (NULL == (row_base = (unsigned int *) ISIS_MALLOC (m->num_rows * sizeof(unsigned int))))
+     return -1;
+
+   num_elems = 0;
+   for (e = 0; e < m->num_rows; e++)
+     {
+        row_base[e] = num_elems;
+        if (cd->row_loaded[e] || want[e])
+          num_elems += cd->row_elems[e];
+     }
+
+   if (NULL == (arena = (float *) ISIS_MALLOC ((num_elems ? num_elems : 1) * sizeof(float))))
+     goto finish;
+
+   if ((NULL == (rft = reopen_rmf_file (rmf)))
+       || (-1 == read_lazy_rows (rft, cd, want, row_base, arena)))
+     goto finish;
+
+   for (e = 0; e < m->num_rows; e++)
+     {
+        unsigned int g0 = m->row_start[e], g1 = m->row_start[e+1];
+        int present = cd->row_loaded[e] || want[e];
+
+        if (cd->row_loaded[e] && (g0 < g1))
+          {
+             memcpy ((char *)(arena + row_base[e]),
+                     (char *)(m->response + m->resp_start[g0]),
+                     cd->row_elems[e] * sizeof(float));
+          }
+
+        for (g = g0; g < g1; g++)
+          {
+             m->resp_start[g] = row_base[e] + (present ? cd->grp_offset[g] : 0);
+             if (want[e] && cd->swapped_channels)
+               reverse_f (arena + m->resp_start[g], m->num_channels[g]);
+          }
 
-             num_ok += elem->num_channels;
+        if (want[e])
+          {
+             cd->row_loaded[e] = 1;
+             cd->num_rows_loaded++;
           }
      }
 
-   if (ignored)
-     isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__, "Ignored %u invalid RMF channels", ignored);
+   ISIS_FREE (m->response);
+   m->response = arena;
+   m->num_elems = m->max_elems = num_elems;
+   arena = NULL;
+
+   if (cd->num_rows_loaded == m->num_rows)
+     free_lazy_rows (cd);
+
+   /* the clipped groups point into the old arena */
+   if ((cd->chan_notice != NULL)
+       && (-1 == build_noticed_groups (cd)))
+     {
+        free_noticed_groups (cd);
+        goto finish;
+     }
+
+   ret = 0;
+finish:
+   if (rft != NULL)
+     close_rmf_file (&rft);
+   ISIS_FREE (arena);
+   ISIS_FREE (row_base);
+   return ret;
+}
+
+/*}}}*/
+
+static int load_all_lazy_rows (Isis_Rmf_t *rmf) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   unsigned char *want;
+   int ret;
+
+   if (cd->row_loaded == NULL)
+     return 0;
+
+   if (NULL == (want = (unsigned char *) ISIS_MALLOC (cd->num_ebins + 1)))
+     return -1;
+   memset ((char *)want, 1, cd->num_ebins + 1);
+
+   ret = load_lazy_rows (rmf, want);
+
+   ISIS_FREE (want);
+   return ret;
+}
+
+/*}}}*/
+
+/*}}}*/
+
+/*{{{ binary response cache */
+
+/* If the environment variable ISIS_RMF_CACHE_DIR names a writable
+ * directory, the internal (energy-sorted, renumbered) form of each
+ * RMF file is saved there after it is first read.  Later loads
+ * of the same file map that image copy-on-write instead of parsing
+ * the FITS file, so processes on one host share its pages.
+ *
+ * An image is used only if the source file has the same size,
+ * modification time and header checksum, and was loaded with the
+ * same options.  The format is native-endian and is not meant to be
+ * shared between machines.
+ */
+
+#define RMF_CACHE_MAGIC  "ISISRMF1"
+
+typedef struct
+{
+   char magic[8];
+   unsigned int header_size;
+   unsigned int key_len;         /* strlen(key)+1 bytes follow the header */
+   double src_size;
+   double src_mtime;
+   unsigned int src_checksum;
+   int strict;
+   double threshold;
+   int order;
+   int includes_effective_area;
+   int swapped_channels;
+   int energy_ordered_ebounds;
+   int offset;
+   int arf_units;
+   int ebounds_units;
+   char grating[ISIS_RMF_BUFSIZE];
+   char instrument[ISIS_RMF_BUFSIZE];
+   unsigned int num_ebins;
+   unsigned int num_chan;
+   unsigned int num_grps;
+   unsigned int num_elems;
+}
+Rmf_Cache_Header_t;
+
+static unsigned int fnv1a_hash (unsigned int h, const unsigned char *p, size_t n) /*{{{*/
+{
+   while (n-- > 0)
+     {
+        h ^= *p++;
+        h *= 16777619U;
+     }
+   return h;
+}
+
+/*}}}*/
+
+static size_t rmf_cache_align (size_t n) /*{{{*/
+{
+   return (n + 7) & ~((size_t) 7);
+}
+
+/*}}}*/
+
+/* The cache key covers every option that changes how the file is read */
+static char *rmf_cache_key (Rmf_Client_Data_t *cd, char *file) /*{{{*/
+{
+   char strict[32];
+
+   sprintf (strict, ";strict=%d;lazy=%d", cd->strict, cd->lazy);
+
+   return isis_mkstrcat (file, strict,
+                         ";matrix=", cd->matrix_extname ? cd->matrix_extname : "",
+                         ";ebounds=", cd->ebounds_extname ? cd->ebounds_extname : "",
+                         NULL);
+}
+
+/*}}}*/
+
+static char *rmf_cache_file_name (char *key) /*{{{*/
+{
+   char name[32];
+   char *dir;
+   unsigned int h;
+
+   if ((NULL == (dir = getenv ("ISIS_RMF_CACHE_DIR"))) || (*dir == 0))
+     return NULL;
+
+   h = fnv1a_hash (2166136261U, (unsigned char *) key, strlen (key));
+   sprintf (name, "/rmf_%08x.cache", h);
+
+   return isis_mkstrcat (dir, name, NULL);
+}
+
+/*}}}*/
+
+#define FITS_BLOCK_SIZE  2880
+#define FITS_CARD_SIZE   80
+
+/* name is the keyword blank-padded to 8 characters */
+static int fits_card_long (const char *card, const char *name, long *value) /*{{{*/
+{
+   char buf[FITS_CARD_SIZE + 1];
+
+   if ((0 != strncmp (card, name, 8)) || (card[8] != '='))
+     return 0;
+
+   memcpy (buf, card + 10, FITS_CARD_SIZE - 10);
+   buf[FITS_CARD_SIZE - 10] = 0;
+   *value = strtol (buf, NULL, 10);
+   return 1;
+}
+
+/*}}}*/
+
+/* Hashes the header blocks of every HDU, skipping the data
+ * blocks, so that the cost does not grow with the matrix size.
+ * The headers cover the data through NAXISn, and through the
+ * CHECKSUM and DATASUM keywords when the file has them.
+ * Files that are not plain FITS (e.g. compressed) are identified
+ * by their first block only.
+ */
+static int rmf_header_checksum (FILE *fp, double file_size, unsigned int *sum) /*{{{*/
+{
+   char block[FITS_BLOCK_SIZE];
+   unsigned int h = 2166136261U;
+   double pos = 0.0;
+   size_t n;
+
+   n = fread (block, 1, sizeof(block), fp);
+   if ((n < sizeof(block)) || (0 != strncmp (block, "SIMPLE  =", 9)))
+     {
+        if (ferror (fp))
+          return -1;
+        *sum = fnv1a_hash (h, (unsigned char *) block, n);
+        return 0;
+     }
+
+   while (pos < file_size)
+     {
+        long bitpix = 0, naxis = 0, pcount = 0, gcount = 1;
+        double nelem = 1.0, data_size;
+        int end = 0;
+
+        if ((0 != fseek (fp, (long) pos, SEEK_SET)))
+          return -1;
+
+        while (end == 0)
+          {
+             unsigned int i;
+
+             if (1 != fread (block, sizeof(block), 1, fp))
+               return -1;
+             h = fnv1a_hash (h, (unsigned char *) block, sizeof(block));
+             pos += FITS_BLOCK_SIZE;
+
+             for (i = 0; i < FITS_BLOCK_SIZE / FITS_CARD_SIZE; i++)
+               {
+                  char *card = block + i * FITS_CARD_SIZE;
+                  long v;
+
+                  if (0 == strncmp (card, "END     ", 8))
+                    {
+                       end = 1;
+                       break;
+                    }
+                  if (fits_card_long (card, "BITPIX  ", &bitpix)
+                      || fits_card_long (card, "NAXIS   ", &naxis)
+                      || fits_card_long (card, "PCOUNT  ", &pcount)
+                      || fits_card_long (card, "GCOUNT  ", &gcount))
+                    continue;
+                  if ((0 == strncmp (card, "NAXIS", 5))
+                      && isdigit ((unsigned char) card[5])
+                      && fits_card_long (card, card, &v))
+                    nelem *= (double) v;
+               }
+          }
+
+        if ((bitpix == 0) || (naxis < 0) || (pcount < 0) || (gcount < 0))
+          return -1;
+
+        data_size = (naxis == 0) ? 0.0
+          : (double) (labs (bitpix) / 8) * gcount * (pcount + nelem);
+        pos += FITS_BLOCK_SIZE * ceil (data_size / FITS_BLOCK_SIZE);
+     }
+
+   *sum = h;
+   return 0;
+}
+
+/*}}}*/
+
+static int rmf_source_signature (char *file, Rmf_Cache_Header_t *h) /*{{{*/
+{
+#ifdef HAVE_STAT
+   struct stat st;
+   FILE *fp;
+   int status;
+
+   if (-1 == stat (file, &st))
+     return -1;
+
+   if (NULL == (fp = fopen (file, "rb")))
+     return -1;
+
+   h->src_size = (double) st.st_size;
+   h->src_mtime = (double) st.st_mtime;
+
+   status = rmf_header_checksum (fp, h->src_size, &h->src_checksum);
+   fclose (fp);
+
+   return status;
+#else
+   (void) file; (void) h;
+   return -1;
+#endif
+}
+
+/*}}}*/
+
+static size_t rmf_cache_payload_size (Rmf_Cache_Header_t *h) /*{{{*/
+{
+   return 2 * h->num_ebins * sizeof(double)
+     + 2 * h->num_chan * sizeof(double)
+     + (h->num_ebins + 1) * sizeof(unsigned int)
+     + 3 * h->num_grps * sizeof(unsigned int)
+     + h->num_elems * sizeof(float);
+}
+
+/*}}}*/
+
+static int load_rmf_cache (Isis_Rmf_t *rmf, char *file) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Cache_Header_t h, src;
+   Rmf_Matrix_t *m = &cd->mat;
+   char *key = NULL, *name = NULL, *stored_key = NULL;
+   char *image = NULL, *p;
+   size_t offset, size = 0;
+   FILE *fp = NULL;
+   int ret = -1;
+
+   if ((NULL == (key = rmf_cache_key (cd, file)))
+       || (NULL == (name = rmf_cache_file_name (key))))
+     goto finish;
+
+   if (NULL == (fp = fopen (name, "rb")))
+     goto finish;
+
+   if ((1 != fread (&h, sizeof(h), 1, fp))
+       || (0 != memcmp (h.magic, RMF_CACHE_MAGIC, sizeof(h.magic)))
+       || (h.header_size != sizeof(h))
+       || (h.key_len != strlen (key) + 1)
+       || (h.strict != cd->strict))
+     goto finish;
+
+   if ((NULL == (stored_key = (char *) ISIS_MALLOC (h.key_len)))
+       || (1 != fread (stored_key, h.key_len, 1, fp))
+       || (0 != strcmp (stored_key, key)))
+     goto finish;
+
+   if ((-1 == rmf_source_signature (file, &src))
+       || (src.src_size != h.src_size)
+       || (src.src_mtime != h.src_mtime)
+       || (src.src_checksum != h.src_checksum))
+     goto finish;
+
+   offset = rmf_cache_align (sizeof(h) + h.key_len);
+   size = offset + rmf_cache_payload_size (&h);
+
+#ifdef USE_RMF_CACHE_MMAP
+   /* Private and writable, so in-place edits such as factor_rsp
+    * copy only the pages they touch. */
+   image = (char *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno (fp), 0);
+   if (image == (char *) MAP_FAILED)
+     {
+        image = NULL;
+        goto finish;
+     }
+   {
+      struct stat st;
+      if ((-1 == fstat (fileno (fp), &st)) || ((size_t) st.st_size != size))
+        goto finish;
+   }
+#else
+   if ((NULL == (image = (char *) ISIS_MALLOC (size)))
+       || (0 != fseek (fp, 0L, SEEK_SET))
+       || (1 != fread (image, size, 1, fp)))
+     goto finish;
+#endif
+
+   p = image + offset;
+
+   if ((NULL == (cd->arf = Isis_new_rmf_grid (h.num_ebins, (double *) p,
+                                              (double *) p + h.num_ebins)))
+       || (NULL == (cd->ebounds = Isis_new_rmf_grid (h.num_chan, (double *) p + 2*h.num_ebins,
+                                                     (double *) p + 2*h.num_ebins + h.num_chan))))
+     goto finish;
+   p += 2 * (h.num_ebins + h.num_chan) * sizeof(double);
+
+   cd->arf->units = h.arf_units;
+   cd->ebounds->units = h.ebounds_units;
+
+   memset ((char *) m, 0, sizeof(*m));
+   m->num_rows = h.num_ebins;
+   m->num_grps = m->max_grps = h.num_grps;
+   m->num_elems = m->max_elems = h.num_elems;
+   m->row_start = (unsigned int *) p;       p += (h.num_ebins + 1) * sizeof(unsigned int);
+   m->first_channel = (unsigned int *) p;   p += h.num_grps * sizeof(unsigned int);
+   m->num_channels = (unsigned int *) p;    p += h.num_grps * sizeof(unsigned int);
+   m->resp_start = (unsigned int *) p;      p += h.num_grps * sizeof(unsigned int);
+   m->response = (float *) p;
+   m->map = image;
+   m->map_size = size;
+   image = NULL;
+
+   cd->num_ebins = h.num_ebins;
+   cd->threshold = h.threshold;
+   cd->swapped_channels = h.swapped_channels;
+   cd->energy_ordered_ebounds = h.energy_ordered_ebounds;
+   cd->offset = h.offset;
+   rmf->order = h.order;
+   rmf->includes_effective_area = h.includes_effective_area;
+   isis_strcpy (rmf->grating, h.grating, ISIS_RMF_BUFSIZE);
+   isis_strcpy (rmf->instrument, h.instrument, ISIS_RMF_BUFSIZE);
+
+   ret = 0;
+   finish:
+
+   if (ret != 0)
+     {
+        Isis_free_rmf_grid (cd->arf);
+        Isis_free_rmf_grid (cd->ebounds);
+        cd->arf = cd->ebounds = NULL;
+     }
+#ifdef USE_RMF_CACHE_MMAP
+   if (image != NULL)
+     (void) munmap (image, size);
+#else
+   ISIS_FREE (image);
+#endif
+   if (fp != NULL)
+     fclose (fp);
+   ISIS_FREE (stored_key);
+   ISIS_FREE (name);
+   ISIS_FREE (key);
+   return ret;
+}
+
+/*}}}*/
+
+static int write_rmf_cache_image (FILE *fp, Isis_Rmf_t *rmf, Rmf_Cache_Header_t *h, char *key) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Matrix_t *m = &cd->mat;
+   static const char zeros[8] = {0};
+   size_t pad = rmf_cache_align (sizeof(*h) + h->key_len) - (sizeof(*h) + h->key_len);
+
+   if ((1 != fwrite (h, sizeof(*h), 1, fp))
+       || (1 != fwrite (key, h->key_len, 1, fp))
+       || ((pad > 0) && (1 != fwrite (zeros, pad, 1, fp))))
+     return -1;
+
+   if ((h->num_ebins != fwrite (cd->arf->bin_lo, sizeof(double), h->num_ebins, fp))
+       || (h->num_ebins != fwrite (cd->arf->bin_hi, sizeof(double), h->num_ebins, fp))
+       || (h->num_chan != fwrite (cd->ebounds->bin_lo, sizeof(double), h->num_chan, fp))
+       || (h->num_chan != fwrite (cd->ebounds->bin_hi, sizeof(double), h->num_chan, fp))
+       || (h->num_ebins + 1 != fwrite (m->row_start, sizeof(unsigned int), h->num_ebins + 1, fp))
+       || (h->num_grps != fwrite (m->first_channel, sizeof(unsigned int), h->num_grps, fp))
+       || (h->num_grps != fwrite (m->num_channels, sizeof(unsigned int), h->num_grps, fp))
+       || (h->num_grps != fwrite (m->resp_start, sizeof(unsigned int), h->num_grps, fp))
+       || (h->num_elems != fwrite (m->response, sizeof(float), h->num_elems, fp)))
+     return -1;
+
+   return 0;
+}
+
+/*}}}*/
+
+static void save_rmf_cache (Isis_Rmf_t *rmf, char *file) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Cache_Header_t h;
+   char *key = NULL, *name = NULL, *tmp = NULL;
+   char suffix[32];
+   FILE *fp = NULL;
+   int status = -1;
+
+   if ((NULL == (key = rmf_cache_key (cd, file)))
+       || (NULL == (name = rmf_cache_file_name (key))))
+     goto finish;
+
+   memset ((char *) &h, 0, sizeof(h));
+   if (-1 == rmf_source_signature (file, &h))
+     goto finish;
+
+   memcpy (h.magic, RMF_CACHE_MAGIC, sizeof(h.magic));
+   h.header_size = sizeof(h);
+   h.key_len = strlen (key) + 1;
+   h.strict = cd->strict;
+   h.threshold = cd->threshold;
+   h.order = rmf->order;
+   h.includes_effective_area = rmf->includes_effective_area;
+   h.swapped_channels = cd->swapped_channels;
+   h.energy_ordered_ebounds = cd->energy_ordered_ebounds;
+   h.offset = cd->offset;
+   h.arf_units = cd->arf->units;
+   h.ebounds_units = cd->ebounds->units;
+   isis_strcpy (h.grating, rmf->grating, ISIS_RMF_BUFSIZE);
+   isis_strcpy (h.instrument, rmf->instrument, ISIS_RMF_BUFSIZE);
+   h.num_ebins = cd->num_ebins;
+   h.num_chan = cd->ebounds->nbins;
+   h.num_grps = cd->mat.num_grps;
+   h.num_elems = cd->mat.num_elems;
+
+   /* write a private file, then rename it into place, so that
+    * concurrent readers never see a partial image */
+   sprintf (suffix, ".%lu.tmp", (unsigned long) getpid ());
+   if (NULL == (tmp = isis_mkstrcat (name, suffix, NULL)))
+     goto finish;
+
+   if (NULL == (fp = fopen (tmp, "wb")))
+     goto finish;
+
+   if (-1 == write_rmf_cache_image (fp, rmf, &h, key))
+     goto finish;
+
+   if (0 != fclose (fp))
+     {
+        fp = NULL;
+        goto finish;
+     }
+   fp = NULL;
+
+   if (0 != rename (tmp, name))
+     goto finish;
+
+   status = 0;
+   finish:
+
+   if (fp != NULL)
+     fclose (fp);
+   if ((status != 0) && (tmp != NULL))
+     {
+        (void) remove (tmp);
+        if (name != NULL)
+          isis_vmesg (INFO, I_INFO, __FILE__, __LINE__, "RMF cache not written: %s", name);
+     }
+   ISIS_FREE (tmp);
+   ISIS_FREE (name);
+   ISIS_FREE (key);
+}
+
+/*}}}*/
+
+/*}}}*/
+
+static int read_rmf (Isis_Rmf_t *rmf, char *file) /*{{{*/
+{
+   Rmf_Client_Data_t *cd;
+   Rmf_File_t *rft = NULL;
+   Isis_Rmf_Grid_Type *g = NULL;
+   Rmf_Row_Block_t blk;
+   long row;
+   int ret = -1;
+   int reversed, min_chan, rmf_order;
+   int chan_range[2];
+
+   if ((file == NULL) || (rmf == NULL))
+     return -1;
+
+   if (!isis_strcasecmp (file, "NONE"))
+     return -1;
+
+   cd = (Rmf_Client_Data_t *) rmf->client_data;
+   memset ((char *)&blk, 0, sizeof(blk));
+
+   if (0 == load_rmf_cache (rmf, file))
+     {
+        cd->is_initialized = 1;
+        return 0;
+     }
+
+   if (NULL == (rft = open_rmf_file (file, rmf)))
+     {
+        isis_vmesg (FAIL, I_READ_OPEN_FAILED, __FILE__, __LINE__, "%s", file);
+        return -1;
+     }
+   rmf->includes_effective_area = rft->includes_effective_area;
+
+   cd->num_ebins = rft->num_rows;
+
+   if (-1 == cfits_read_string_keyword (rmf->grating, "GRATING", rft->ft))
+     isis_vmesg (INFO, I_KEY_NOT_FOUND, __FILE__, __LINE__, "GRATING");
+
+   if (-1 == cfits_read_string_keyword (rmf->instrument, "DETNAM", rft->ft))
+     isis_vmesg (INFO, I_KEY_NOT_FOUND, __FILE__, __LINE__, "DETNAM");
+
+   if (0 == read_order_keyword (rft->ft, &rmf_order))
+     rmf->order = rmf_order;
+
+   if (-1 == cfits_read_double_keyword (&cd->threshold, "LO_THRES", rft->ft))
+     cd->threshold = 1.e-6;
+
+   if (NULL == (cd->arf = Isis_new_rmf_grid (cd->num_ebins, NULL, NULL)))
+     goto finish;
+
+   /* FIXME - get arf_grid units from header */
+   cd->arf->units = U_KEV;
+
+   if ((-1 == init_rmf_matrix (&cd->mat, cd->num_ebins, cd->num_ebins,
+                               cd->lazy ? 1 : 16*cd->num_ebins))
+       || (-1 == init_row_block (rft, &blk)))
+     goto finish;
+
+   if (cd->lazy
+       && (NULL == (cd->row_elems = (unsigned int *) ISIS_MALLOC ((cd->num_ebins + 1) * sizeof(unsigned int)))))
+     goto finish;
+
+   chan_range[0] = INT_MAX;
+   chan_range[1] = -INT_MAX;
+
+   g = cd->arf;
+   for (row = 0; row < rft->num_rows; row += blk.max_rows)
+     {
+        long nrows = rft->num_rows - row;
+        if (nrows > blk.max_rows)
+          nrows = blk.max_rows;
+
+        if (-1 == read_rmf_rows (rft, &blk, row, nrows, &cd->mat, g, chan_range, cd->row_elems))
+          {
+             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__,
+                         "reading RMF vectors in rows %ld-%ld", row+1, row+nrows);
+             goto finish;
+          }
+     }
+
+   if (cd->lazy && (-1 == init_lazy_rows (cd)))
+     goto finish;
+
+   trim_rmf_matrix (&cd->mat);
+
+   /* Try to fix common sloppiness */
+   if (g->bin_lo[0] < 0)
+     {
+        isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__, "negative ENERG_LO=%g set to zero",
+                    g->bin_lo[0]);
+        g->bin_lo[0] = 0.0;
+     }
+
+   if (-1 == _isis_fixup_lo_hi_grids (g->bin_lo, g->bin_hi, g->nbins, &reversed, 0))
+     {
+        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "Invalid grid in RMF");
+        goto finish;
+     }
+
+   if (reversed ||
+       ((g->nbins > 1) && (g->bin_lo[0] > g->bin_lo[1])))
+     {
+        isis_vmesg (FAIL, I_UNSUPPORTED_FORMAT, __FILE__, __LINE__, "RMF energies in decreasing order");
+        goto finish;
+     }
+
+   if (-1 == read_rmf_ebounds (rft->ft, chan_range, &cd->ebounds, &cd->energy_ordered_ebounds, &cd->swapped_channels,
+                               &min_chan, cd))
+     goto finish;
+
+   /* channels might have been numbered starting at zero or one */
+   if (rft->offset >= 0)
+     cd->offset = rft->offset;
+   else
+     cd->offset = min_chan;
+
+   if (-1 == renumber_detector_channels (rmf))
+     goto finish;
+
+   if (-1 == validate_rmf (rmf))
+     goto finish;
+
+   /* a partly loaded matrix can't be cached */
+   if (cd->lazy == 0)
+     save_rmf_cache (rmf, file);
+
+   cd->is_initialized = 1;
+   ret = 0;
+
+   finish:
+
+   free_row_block (&blk);
+   close_rmf_file (&rft);
+
+   return ret;
+}
+
+/*}}}*/
+
+/* Method Interface */
+
+static void delete_client_data (Isis_Rmf_t *rmf) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+
+   if (NULL != cd)
+     {
+        free_rmf_matrix (&cd->mat);
+        free_noticed_groups (cd);
+        free_lazy_rows (cd);
+        ISIS_FREE (cd->thread_buf);
+        Isis_free_rmf_grid (cd->arf);
+        Isis_free_rmf_grid (cd->ebounds);
+        if (cd->type == RMF_TYPE_FILE)
+          ISIS_FREE (cd->f.file);
+        else if (cd->type == RMF_TYPE_SLANG)
+          SLang_free_function (cd->f.funct);
+
+        ISIS_FREE (cd->matrix_extname);
+        ISIS_FREE (cd->ebounds_extname);
+     }
+
+   ISIS_FREE (rmf->client_data);
+}
+/*}}}*/
+
+/*{{{ fold kernels */
+
+/* Each kernel computes
+ *    d[j] += flux * r[n-1-j],   j = 0..n-1
+ * because the detector channel array is in wavelength order
+ * while each group's responses are in increasing energy order.
+ * Each channel receives one multiply-add per energy row, as in
+ * the scalar loop, so the kernels agree to within the rounding
+ * of that operation (the compiler may fuse it where FMA exists).
+ */
+typedef void Fold_Kernel_Type (double *d, const float *r, unsigned int n, double flux);
+
+static void fold_scalar (double *d, const float *r, unsigned int n, double flux) /*{{{*/
+{
+   const float *rr = r + n - 1;
+   unsigned int j;
+
+   for (j = 0; j < n; j++)
+     d[j] += flux * rr[-(int)j];
+}
+
+/*}}}*/
+
+#ifdef HAVE_SIMD_FOLD
+
+__attribute__((target("sse2")))
+static void fold_sse2 (double *d, const float *r, unsigned int n, double flux) /*{{{*/
+{
+   __m128d f = _mm_set1_pd (flux);
+   unsigned int j = 0;
+
+   for ( ; j + 4 <= n; j += 4)
+     {
+        __m128 v = _mm_loadu_ps (r + n - 4 - j);
+        __m128d lo, hi;
+        v = _mm_shuffle_ps (v, v, _MM_SHUFFLE(0,1,2,3));
+        lo = _mm_cvtps_pd (v);
+        hi = _mm_cvtps_pd (_mm_movehl_ps (v, v));
+        _mm_storeu_pd (d + j, _mm_add_pd (_mm_loadu_pd (d + j), _mm_mul_pd (f, lo)));
+        _mm_storeu_pd (d + j + 2, _mm_add_pd (_mm_loadu_pd (d + j + 2), _mm_mul_pd (f, hi)));
+     }
+
+   if (j < n)
+     fold_scalar (d + j, r, n - j, flux);
+}
+
+/*}}}*/
+
+__attribute__((target("avx2")))
+static void fold_avx2 (double *d, const float *r, unsigned int n, double flux) /*{{{*/
+{
+   __m256d f = _mm256_set1_pd (flux);
+   unsigned int j = 0;
+
+   for ( ; j + 4 <= n; j += 4)
+     {
+        __m128 v = _mm_loadu_ps (r + n - 4 - j);
+        __m256d x;
+        v = _mm_shuffle_ps (v, v, _MM_SHUFFLE(0,1,2,3));
+        x = _mm256_cvtps_pd (v);
+        _mm256_storeu_pd (d + j, _mm256_add_pd (_mm256_loadu_pd (d + j), _mm256_mul_pd (f, x)));
+     }
+
+   if (j < n)
+     fold_scalar (d + j, r, n - j, flux);
+}
+
+/*}}}*/
+
+__attribute__((target("avx512f")))
+static void fold_avx512 (double *d, const float *r, unsigned int n, double flux) /*{{{*/
+{
+   __m512d f = _mm512_set1_pd (flux);
+   __m256i rev = _mm256_set_epi32 (0,1,2,3,4,5,6,7);
+   unsigned int j = 0;
+
+   for ( ; j + 8 <= n; j += 8)
+     {
+        __m256 v = _mm256_loadu_ps (r + n - 8 - j);
+        __m512d x;
+        v = _mm256_permutevar8x32_ps (v, rev);
+        x = _mm512_cvtps_pd (v);
+        _mm512_storeu_pd (d + j, _mm512_add_pd (_mm512_loadu_pd (d + j), _mm512_mul_pd (f, x)));
+     }
+
+   if (j < n)
+     fold_scalar (d + j, r, n - j, flux);
+}
+
+/*}}}*/
+
+#endif
+
+static Fold_Kernel_Type *Fold_Kernel;
+
+static void select_fold_kernel (void) /*{{{*/
+{
+   if (Fold_Kernel != NULL)
+     return;
+
+   Fold_Kernel = fold_scalar;
+
+#ifdef HAVE_SIMD_FOLD
+   __builtin_cpu_init ();
+   if (__builtin_cpu_supports ("avx512f"))
+     Fold_Kernel = fold_avx512;
+   else if (__builtin_cpu_supports ("avx2"))
+     Fold_Kernel = fold_avx2;
+   else if (__builtin_cpu_supports ("sse2"))
+     Fold_Kernel = fold_sse2;
+#endif
+}
+
+/*}}}*/
+
+/*}}}*/
+
+static int fold_groups (Rmf_Matrix_t *m, float *arena, unsigned int in_egy, double flux, /*{{{*/
+                        double *det_chan, unsigned int num_ebounds)
+{
+   Fold_Kernel_Type *fold = Fold_Kernel;
+   unsigned int g, g_end;
+
+   g_end = m->row_start[in_egy+1];
+
+   for (g = m->row_start[in_egy]; g < g_end; g++)
+     {
+        unsigned int num_channels = m->num_channels[g];
+        /* lowest wavelength-ordered channel touched by this group */
+        double *d = det_chan + num_ebounds - m->first_channel[g] - num_channels;
+
+        if (num_channels > 0)
+          (*fold) (d, arena + m->resp_start[g], num_channels, flux);
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+static int redistribute (Isis_Rmf_t *rmf, unsigned int in_lam, double flux, /*{{{*/
+                         double *det_chan, unsigned int num_ebounds)
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+
+   if ((cd->row_loaded != NULL)
+       && (-1 == load_all_lazy_rows (rmf)))
+     return -1;
+
+   return fold_groups (&cd->mat, cd->mat.response, cd->num_ebins - in_lam - 1,
+                       flux, det_chan, num_ebounds);
+}
+/*}}}*/
+
+static int redistribute_noticed (Isis_Rmf_t *rmf, unsigned int in_lam, double flux, /*{{{*/
+                                 double *det_chan, unsigned int num_ebounds)
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Matrix_t *m;
+
+   /* The noticed rows were loaded by set_noticed_model_bins,
+    * so a miss means the notice list changed behind its back */
+   if ((cd->row_loaded != NULL)
+       && (cd->row_loaded[cd->num_ebins - in_lam - 1] == 0)
+       && (-1 == load_all_lazy_rows (rmf)))
+     return -1;
+
+   m = (cd->chan_notice != NULL) ? &cd->clip : &cd->mat;
+
+   return fold_groups (m, cd->mat.response, cd->num_ebins - in_lam - 1,
+                       flux, det_chan, num_ebounds);
+}
+/*}}}*/
+
+/*{{{ threaded fold */
+
+#ifdef HAVE_PTHREAD_H
+
+/* For very large matrices, the noticed energy rows are split into
+ * num_threads ranges holding roughly equal numbers of response values.
+ * The first range is folded directly into the output vector and the
+ * others into private channel buffers, which are then added into
+ * the output, again split over the threads by channel range.
+ */
+
+typedef struct
+{
+   Rmf_Matrix_t *m;
+   float *arena;
+   unsigned int num_ebins;
+   double *arf_src;
+   int *notice_list;
+   unsigned int k0, k1;          /* packed model bins [k0,k1) */
+   double *det_chan;
+   unsigned int num_ebounds;
+   int zero_det_chan;
+   double *bufs;                 /* reduction: buffers to add into det_chan */
+   unsigned int num_bufs;
+   unsigned int j0, j1;          /* reduction: channels [j0,j1) */
+}
+Fold_Task_Type;
+
+static void fold_rows (Fold_Task_Type *t) /*{{{*/
+{
+   unsigned int k;
 
-   if (num_ok == 0)
-     isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "RMF has no valid output channels");
+   if (t->zero_det_chan)
+     memset ((char *) t->det_chan, 0, t->num_ebounds * sizeof(double));
 
-   return num_ok ? 0 : -1;
+   for (k = t->k0; k < t->k1; k++)
+     {
+        unsigned int nk;
+        if (t->arf_src[k] == 0.0)
+          continue;
+        nk = (t->notice_list != NULL) ? (unsigned int) t->notice_list[k] : k;
+        (void) fold_groups (t->m, t->arena, t->num_ebins - nk - 1, t->arf_src[k],
+                            t->det_chan, t->num_ebounds);
+     }
 }
 
 /*}}}*/
 
-static int read_order_keyword (cfitsfile *ft, int *order) /*{{{*/
+static void reduce_channels (Fold_Task_Type *t) /*{{{*/
 {
-   static const char *keys[] =
-     {
-        "ORDER", "TG_M", "RFLORDER", NULL
-     };
-   const char **k;
-   int ret = 0;
+   unsigned int b, j;
 
-   for (k = keys; *k != NULL; k++)
+   for (b = 0; b < t->num_bufs; b++)
      {
-        if (0 == (ret = cfits_read_int_keyword (order, *k, ft)))
-          break;
+        double *buf = t->bufs + b * t->num_ebounds;
+        for (j = t->j0; j < t->j1; j++)
+          t->det_chan[j] += buf[j];
      }
-
-   return ret;
 }
 
 /*}}}*/
 
-static int read_rmf (Isis_Rmf_t *rmf, char *file) /*{{{*/
+static void *fold_rows_thread (void *arg) /*{{{*/
 {
-   Rmf_Client_Data_t *cd;
-   Rmf_File_t *rft = NULL;
-   Isis_Rmf_Grid_Type *g = NULL;
-   int row, ret = -1;
-   int reversed, min_chan, rmf_order;
-   int chan_range[2];
+   fold_rows ((Fold_Task_Type *) arg);
+   return NULL;
+}
 
-   if ((file == NULL) || (rmf == NULL))
-     return -1;
+/*}}}*/
 
-   if (!isis_strcasecmp (file, "NONE"))
-     return -1;
+static void *reduce_channels_thread (void *arg) /*{{{*/
+{
+   reduce_channels ((Fold_Task_Type *) arg);
+   return NULL;
+}
 
-   cd = (Rmf_Client_Data_t *) rmf->client_data;
+/*}}}*/
 
-   if (NULL == (rft = open_rmf_file (file, rmf)))
+/* Runs tasks 1..n-1 in new threads and task 0 in this one.
+ * A task whose thread can't be started is run here instead.
+ */
+static void run_fold_tasks (void *(*fun)(void *), Fold_Task_Type *tasks, unsigned int n) /*{{{*/
+{
+   pthread_t threads[RMF_MAX_FOLD_THREADS];
+   int started[RMF_MAX_FOLD_THREADS];
+   unsigned int i;
+
+   for (i = 1; i < n; i++)
      {
-        isis_vmesg (FAIL, I_READ_OPEN_FAILED, __FILE__, __LINE__, "%s", file);
-        return -1;
+        started[i] = (0 == pthread_create (&threads[i], NULL, fun, (void *) &tasks[i]));
+        if (started[i] == 0)
+          (void) (*fun) ((void *) &tasks[i]);
      }
-   rmf->includes_effective_area = rft->includes_effective_area;
-
-   cd->num_ebins = rft->num_rows;
-
-   if (-1 == cfits_read_string_keyword (rmf->grating, "GRATING", rft->ft))
-     isis_vmesg (INFO, I_KEY_NOT_FOUND, __FILE__, __LINE__, "GRATING");
-
-   if (-1 == cfits_read_string_keyword (rmf->instrument, "DETNAM", rft->ft))
-     isis_vmesg (INFO, I_KEY_NOT_FOUND, __FILE__, __LINE__, "DETNAM");
 
-   if (0 == read_order_keyword (rft->ft, &rmf_order))
-     rmf->order = rmf_order;
+   (void) (*fun) ((void *) &tasks[0]);
 
-   if (-1 == cfits_read_double_keyword (&cd->threshold, "LO_THRES", rft->ft))
-     cd->threshold = 1.e-6;
+   for (i = 1; i < n; i++)
+     {
+        if (started[i])
+          (void) pthread_join (threads[i], NULL);
+     }
+}
 
-   if (NULL == (cd->arf = Isis_new_rmf_grid (cd->num_ebins, NULL, NULL)))
-     goto finish;
+/*}}}*/
 
-   /* FIXME - get arf_grid units from header */
-   cd->arf->units = U_KEV;
+/* number of response values in rows with wavelength index < in_lam */
+static unsigned int elems_below (Rmf_Matrix_t *m, unsigned int num_ebins, unsigned int in_lam) /*{{{*/
+{
+   unsigned int g = m->row_start[num_ebins - in_lam];
+   return m->num_elems - ((g < m->num_grps) ? m->resp_start[g] : m->num_elems);
+}
 
-   if (NULL == (cd->v = (Rmf_Vector_t *) ISIS_MALLOC (cd->num_ebins * sizeof(Rmf_Vector_t))))
-     goto finish;
-   memset ((char *)cd->v, 0, cd->num_ebins * sizeof (Rmf_Vector_t));
+/*}}}*/
 
-   chan_range[0] = INT_MAX;
-   chan_range[1] = -INT_MAX;
+static int redistribute_vector (Isis_Rmf_t *rmf, double *det_chan, unsigned int num_ebounds, /*{{{*/
+                                double *arf_src, int *notice_list, unsigned int num_noticed)
+{
+   Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Fold_Task_Type tasks[RMF_MAX_FOLD_THREADS];
+   Fold_Task_Type proto;
+   unsigned int n, i, lo, span, k;
 
-   g = cd->arf;
-   for (row = 0; row < rft->num_rows; row++)
+   if (cd->row_loaded != NULL)
      {
-        if (-1 == read_rmf_vector (rft, row+1, &cd->v[row],
-                                   &g->bin_lo[row], &g->bin_hi[row], chan_range))
+        for (k = 0; k < num_noticed; k++)
           {
-             isis_vmesg (FAIL, I_FAILED, __FILE__, __LINE__, "reading RMF vector in row %d", row);
-             goto finish;
+             unsigned int nk = (notice_list != NULL) ? (unsigned int) notice_list[k] : k;
+             if (cd->row_loaded[cd->num_ebins - nk - 1] == 0)
+               break;
           }
+        if ((k < num_noticed)
+            && (-1 == load_all_lazy_rows (rmf)))
+          return -1;
      }
 
-   /* Try to fix common sloppiness */
-   if (g->bin_lo[0] < 0)
+   memset ((char *) &proto, 0, sizeof(proto));
+   proto.m = ((notice_list != NULL) && (cd->chan_notice != NULL)) ? &cd->clip : &cd->mat;
+   proto.arena = cd->mat.response;
+   proto.num_ebins = cd->num_ebins;
+   proto.arf_src = arf_src;
+   proto.notice_list = notice_list;
+   proto.num_ebounds = num_ebounds;
+
+   n = cd->num_threads;
+   if (n > num_noticed)
+     n = num_noticed;
+
+   if ((n < 2) || (cd->mat.num_elems < cd->thread_min))
      {
-        isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__, "negative ENERG_LO=%g set to zero",
-                    g->bin_lo[0]);
-        g->bin_lo[0] = 0.0;
+        proto.k0 = 0;
+        proto.k1 = num_noticed;
+        proto.det_chan = det_chan;
+        fold_rows (&proto);
+        return 0;
      }
 
-   if (-1 == _isis_fixup_lo_hi_grids (g->bin_lo, g->bin_hi, g->nbins, &reversed, 0))
+   if (cd->thread_buf_len < (n - 1) * num_ebounds)
      {
-        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "Invalid grid in RMF");
-        goto finish;
+        ISIS_FREE (cd->thread_buf);
+        cd->thread_buf_len = 0;
+        cd->thread_buf = (double *) ISIS_MALLOC ((n - 1) * num_ebounds * sizeof(double));
+        if (cd->thread_buf == NULL)
+          return -1;
+        cd->thread_buf_len = (n - 1) * num_ebounds;
      }
 
-   if (reversed ||
-       ((g->nbins > 1) && (g->bin_lo[0] > g->bin_lo[1])))
+   /* split the packed model bins so each range has about the same
+    * number of response values */
+#define NOTICED_ROW(k) ((notice_list != NULL) ? (unsigned int) notice_list[k] : (k))
+   lo = elems_below (&cd->mat, cd->num_ebins, NOTICED_ROW(0));
+   span = elems_below (&cd->mat, cd->num_ebins, NOTICED_ROW(num_noticed-1) + 1) - lo;
+
+   k = 0;
+   for (i = 0; i < n; i++)
      {
-        isis_vmesg (FAIL, I_UNSUPPORTED_FORMAT, __FILE__, __LINE__, "RMF energies in decreasing order");
-        goto finish;
-     }
+        double target = lo + (double) span * (i + 1) / n;
+        unsigned int k1;
 
-   if (-1 == read_rmf_ebounds (rft->ft, chan_range, &cd->ebounds, &cd->energy_ordered_ebounds, &cd->swapped_channels,
-                               &min_chan, cd))
-     goto finish;
+        tasks[i] = proto;
+        tasks[i].k0 = k;
 
-   /* channels might have been numbered starting at zero or one */
-   if (rft->offset >= 0)
-     cd->offset = rft->offset;
-   else
-     cd->offset = min_chan;
+        if (i == n - 1)
+          k1 = num_noticed;
+        else
+          {
+             /* first k with elems_below(row(k)+1) >= target */
+             unsigned int a = k, b = num_noticed;
+             while (a < b)
+               {
+                  unsigned int mid = a + (b - a) / 2;
+                  if (elems_below (&cd->mat, cd->num_ebins, NOTICED_ROW(mid) + 1) < target)
+                    a = mid + 1;
+                  else
+                    b = mid;
+               }
+             k1 = (a < num_noticed) ? a + 1 : num_noticed;
+          }
 
-   if (-1 == renumber_detector_channels (rmf))
-     goto finish;
+        tasks[i].k1 = k1;
+        k = k1;
 
-   if (-1 == validate_rmf (rmf))
-     goto finish;
+        if (i == 0)
+          tasks[i].det_chan = det_chan;
+        else
+          {
+             tasks[i].det_chan = cd->thread_buf + (i-1) * num_ebounds;
+             tasks[i].zero_det_chan = 1;
+          }
+     }
+#undef NOTICED_ROW
 
-   cd->is_initialized = 1;
-   ret = 0;
+   run_fold_tasks (fold_rows_thread, tasks, n);
 
-   finish:
+   for (i = 0; i < n; i++)
+     {
+        tasks[i].det_chan = det_chan;
+        tasks[i].bufs = cd->thread_buf;
+        tasks[i].num_bufs = n - 1;
+        tasks[i].j0 = (unsigned int) (((double) num_ebounds * i) / n);
+        tasks[i].j1 = (unsigned int) (((double) num_ebounds * (i+1)) / n);
+     }
+   tasks[n-1].j1 = num_ebounds;
 
-   close_rmf_file (&rft);
+   run_fold_tasks (reduce_channels_thread, tasks, n);
 
-   return ret;
+   return 0;
 }
 
 /*}}}*/
 
-/* Method Interface */
-
-static void delete_client_data (Isis_Rmf_t *rmf) /*{{{*/
-{
-   Rmf_Client_Data_t *cd = get_client_data (rmf);
-
-   if (NULL != cd)
-     {
-        if (cd->v != NULL)
-          {
-             unsigned int i;
-             for (i = 0; i < cd->num_ebins; i++)
-               free_rmf_vector (&cd->v[i]);
-             ISIS_FREE (cd->v);
-          }
-        Isis_free_rmf_grid (cd->arf);
-        Isis_free_rmf_grid (cd->ebounds);
-        if (cd->type == RMF_TYPE_FILE)
-          ISIS_FREE (cd->f.file);
-        else if (cd->type == RMF_TYPE_SLANG)
-          SLang_free_function (cd->f.funct);
-
-        ISIS_FREE (cd->matrix_extname);
-        ISIS_FREE (cd->ebounds_extname);
-     }
+#endif /* HAVE_PTHREAD_H */
 
-   ISIS_FREE (rmf->client_data);
-}
 /*}}}*/
 
-static int redistribute (Isis_Rmf_t *rmf, unsigned int in_lam, double flux, /*{{{*/
-                         double *det_chan, unsigned int num_ebounds)
+/* Loads the rows with a channel group that reaches a noticed channel */
+static int load_noticed_rows (Isis_Rmf_t *rmf, int num_chan, int *chan_notice) /*{{{*/
 {
    Rmf_Client_Data_t *cd = get_client_data (rmf);
-   Rmf_Vector_t *v;
-   unsigned int g, in_egy;
+   Rmf_Matrix_t *m = &cd->mat;
+   unsigned char *want;
+   unsigned int e, g;
+   int ret;
 
-   in_egy = cd->num_ebins - in_lam - 1;
-   v = &cd->v[in_egy];
+   if (NULL == (want = (unsigned char *) ISIS_MALLOC (m->num_rows + 1)))
+     return -1;
+   memset ((char *)want, 0, m->num_rows + 1);
 
-   for (g = 0; g < v->num_grps; g++)
+   for (e = 0; e < m->num_rows; e++)
      {
-        Rmf_Element_t *elem = &v->elem[g];
-        float *response = elem->response;
-        int k, num_channels = elem->num_channels;
-        double *d = det_chan + num_ebounds - elem->first_channel - 1;
+        if (cd->row_loaded[e])
+          continue;
+
+        for (g = m->row_start[e]; (g < m->row_start[e+1]) && (want[e] == 0); g++)
+          {
+             int *noticed = (chan_notice + num_chan - 1) - m->first_channel[g];
+             int k, num_channels = m->num_channels[g];
 
-        for (k = 0; k < num_channels; k++)
-          d[-k] += flux * response[k];
+             for (k = 0; k < num_channels; k++)
+               {
+                  if (noticed[-k])
+                    {
+                       want[e] = 1;
+                       break;
+                    }
+               }
+          }
      }
 
-   return 0;
+   ret = load_lazy_rows (rmf, want);
+
+   ISIS_FREE (want);
+   return ret;
 }
+
 /*}}}*/
 
 static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_notice, /*{{{*/
                                    int num_model, int *model_notice)
 {
    Rmf_Client_Data_t *cd = get_client_data (rmf);
+   Rmf_Matrix_t *m;
    unsigned int *undetected_model_bin;
    unsigned int e_model;
 
    if ((NULL == rmf) || (NULL == cd))
      return -1;
 
+   m = &cd->mat;
+
    if (num_chan != (int) cd->ebounds->nbins)
      {
         isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__, "RMF EBOUNDS/data grid mismatch");
@@ -874,6 +2580,10 @@ static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_noti
 
    memset ((char *)model_notice, 0, num_model * sizeof(int));
 
+   if ((cd->row_loaded != NULL)
+       && (-1 == load_noticed_rows (rmf, num_chan, chan_notice)))
+     return -1;
+
    undetected_model_bin = (unsigned int *) ISIS_MALLOC (num_model * sizeof(unsigned int));
    if (undetected_model_bin == NULL)
      return -1;
@@ -882,19 +2592,30 @@ static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_noti
 
    for (e_model = 0; e_model < cd->num_ebins; e_model++)
      {
-        Rmf_Vector_t *v = &cd->v[e_model];
         unsigned int g;
 
-        for (g = 0; g < v->num_grps; g++)
+        /* Rows that aren't loaded don't reach a noticed channel.
+         * Any row with channel groups is taken to be detected. */
+        if (RMF_ROW_LOADED(cd, e_model) == 0)
           {
-             Rmf_Element_t *elem = &v->elem[g];
-             int num_channels = elem->num_channels;
-             int *noticed = (chan_notice + num_chan - 1) - elem->first_channel;
+             for (g = m->row_start[e_model]; g < m->row_start[e_model+1]; g++)
+               {
+                  if (m->num_channels[g] > 0)
+                    undetected_model_bin[num_model - e_model - 1] = 0;
+               }
+             continue;
+          }
+
+        for (g = m->row_start[e_model]; g < m->row_start[e_model+1]; g++)
+          {
+             float *response = m->response + m->resp_start[g];
+             int num_channels = m->num_channels[g];
+             int *noticed = (chan_notice + num_chan - 1) - m->first_channel[g];
              int e_ch;
 
              for (e_ch = 0; e_ch < num_channels; e_ch++)
                {
-                  if (elem->response[e_ch] > 0.0)
+                  if (response[e_ch] > 0.0)
                     {
                        unsigned int k = num_model - e_model - 1;
                        undetected_model_bin[k] = 0;
@@ -913,7 +2634,7 @@ static int set_noticed_model_bins (Isis_Rmf_t *rmf, int num_chan, int *chan_noti
 
    ISIS_FREE (undetected_model_bin);
 
-   return 0;
+   return set_noticed_channels (rmf, num_chan, chan_notice);
 }
 
 /*}}}*/
@@ -999,7 +2720,7 @@ static int dummy_init (Isis_Rmf_t *rmf) /*{{{*/
 static int factor_rsp (Isis_Rmf_t *rmf, double *arf) /*{{{*/
 {
    Rmf_Client_Data_t *cd = get_client_data (rmf);
-   Rmf_Element_t *elem;
+   Rmf_Matrix_t *m;
    float *response;
    int k, num_channels;
    unsigned int in_lam, negative_sum, num_ebins;
@@ -1007,34 +2728,36 @@ static int factor_rsp (Isis_Rmf_t *rmf, double *arf) /*{{{*/
    if (rmf == NULL || arf == NULL || cd == NULL)
      return -1;
 
+   if (-1 == load_all_lazy_rows (rmf))
+     return -1;
+
    /* factor ARF out of RSP matrix
     *   RSP => RMF * ARF
     * where RMF is normalized.
     */
 
+   m = &cd->mat;
    num_ebins = cd->num_ebins;
    negative_sum = 0;
 
    for (in_lam = 0; in_lam < num_ebins; in_lam++)
      {
-        Rmf_Vector_t *v;
-        unsigned int g, in_egy, num_grps;
+        unsigned int g, in_egy, g_start, g_end;
         double sum;
 
         in_egy = cd->num_ebins - in_lam - 1;
 
-        v = &cd->v[in_egy];
-        num_grps = v->num_grps;
+        g_start = m->row_start[in_egy];
+        g_end = m->row_start[in_egy+1];
 
         sum = 0.0;
         arf[in_lam] = 0.0;
 
         /* sum over RMF groups */
-        for (g = 0; g < num_grps; g++)
+        for (g = g_start; g < g_end; g++)
           {
-             elem = &v->elem[g];
-             response = elem->response;
-             num_channels = elem->num_channels;
+             response = m->response + m->resp_start[g];
+             num_channels = m->num_channels[g];
 
              for (k = 0; k < num_channels; k++)
                sum += response[k];
@@ -1049,11 +2772,10 @@ static int factor_rsp (Isis_Rmf_t *rmf, double *arf) /*{{{*/
           }
 
         /* normalize */
-        for (g = 0; g < num_grps; g++)
+        for (g = g_start; g < g_end; g++)
           {
-             elem = &v->elem[g];
-             response = elem->response;
-             num_channels = elem->num_channels;
+             response = m->response + m->resp_start[g];
+             num_channels = m->num_channels[g];
 
              for (k = 0; k < num_channels; k++)
                response[k] /= sum;
@@ -1156,47 +2878,27 @@ static int break_into_groups (double *rmf, unsigned int num, /*{{{*/
 
 static int store_rmf_histogram (double *h, unsigned int num, unsigned int offset, /*{{{*/
                                 double threshold, int *f_chan, int *n_chan, int num_chan,
-                                Rmf_Vector_t *v)
+                                Rmf_Matrix_t *m)
 {
    unsigned int i, n_grp;
-   Rmf_Element_t *elem;
 
    if (-1 == break_into_groups (h + offset, num, &n_grp, f_chan, n_chan, num_chan, threshold))
      return -1;
 
-   v->num_grps = n_grp;
-
-   if (n_grp == 0)
-     {
-        v->elem = NULL;
-        return 0;
-     }
-
-   if (NULL == (elem = (Rmf_Element_t *) ISIS_MALLOC (n_grp * sizeof(Rmf_Element_t))))
-     return -1;
-
-   memset ((char *) elem, 0, n_grp * sizeof (Rmf_Element_t));
-
-   v->elem = elem;
-
    for (i = 0; i < n_grp; i++)
      {
         unsigned int j, num_channels;
         float *response;
         double *h_i;
 
-        elem->first_channel = f_chan[i] + offset;
-        elem->num_channels = num_channels = n_chan[i];
+        num_channels = n_chan[i];
 
-        if (NULL == (response = (float *) ISIS_MALLOC (num_channels * sizeof(float))))
+        if (NULL == (response = append_rmf_group (m, f_chan[i] + offset, num_channels)))
           return -1;
-        elem->response = response;
 
         h_i = h + f_chan[i] + offset;
         for (j = 0; j < num_channels; j++)
           response[j] = (float) h_i[j];
-
-        elem++;
      }
 
    return 0;
@@ -1204,20 +2906,6 @@ static int store_rmf_histogram (double *h, unsigned int num, unsigned int offset
 
 /*}}}*/
 
-static void free_rmf_vectors (Rmf_Vector_t *v, unsigned int num) /*{{{*/
-{
-   unsigned int i;
-
-   if (v == NULL)
-     return;
-
-   for (i = 0; i < num; i++)
-     free_rmf_vector (&v[i]);
-   ISIS_FREE (v);
-}
-
-/*}}}*/
-
 static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned int new_num) /*{{{*/
 {
    double *new_lo, *new_hi, *new_h;
@@ -1225,7 +2913,7 @@ static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned in
    unsigned int old_num;
    Isis_Rmf_Grid_Type *ebounds;
    Rmf_Client_Data_t *cd;
-   Rmf_Vector_t *new_v;
+   Rmf_Matrix_t *m, new_m;
    unsigned int i;
    int *f_chan, *n_chan;
    unsigned int num_rows;
@@ -1234,10 +2922,15 @@ static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned in
    if (cd == NULL)
      return -1;
 
+   if (-1 == load_all_lazy_rows (rmf))
+     return -1;
+
+   m = &cd->mat;
+
    f_chan = n_chan = NULL;
    new_lo = new_hi = new_h = NULL;
    old_h = NULL;
-   new_v = NULL;
+   memset ((char *) &new_m, 0, sizeof (new_m));
 
    /* Note: the lo/hi grid values that are passed in here are in wavelength
     * units (ascending order).  This is checked by the calling
@@ -1269,32 +2962,30 @@ static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned in
 
    num_rows = cd->num_ebins;
 
-   if (NULL == (new_v = (Rmf_Vector_t *) ISIS_MALLOC (num_rows * sizeof(Rmf_Vector_t))))
+   if (-1 == init_rmf_matrix (&new_m, num_rows, m->num_grps, m->num_elems))
      goto return_error;
-   memset ((char *) new_v, 0, num_rows * sizeof (Rmf_Vector_t));
 
    for (i = 0; i < num_rows; i++)
      {
-        Rmf_Vector_t *v;
         unsigned int g;
         double *old_h_start, *old_h_end;
         unsigned int old_h_num, old_h_offset, new_h_num;
         int i_new_start, i_new_end;
 
-        v = cd->v + i;
-
-        if (v->num_grps == 0)
-          continue;
+        if (m->row_start[i] == m->row_start[i+1])
+          {
+             close_rmf_row (&new_m, i);
+             continue;
+          }
 
         old_h_start = NULL;
         old_h_end = NULL;
 
-        for (g = 0; g < v->num_grps; g++)
+        for (g = m->row_start[i]; g < m->row_start[i+1]; g++)
           {
-             Rmf_Element_t *elem = &v->elem[g];
-             unsigned int num_channels = elem->num_channels;
-             float *response = elem->response;
-             double *h = old_h + elem->first_channel;
+             unsigned int num_channels = m->num_channels[g];
+             float *response = m->response + m->resp_start[g];
+             double *h = old_h + m->first_channel[g];
              unsigned int k;
 
              if ((old_h_end == NULL) || ((h + num_channels - 1) > old_h_end))
@@ -1333,22 +3024,26 @@ static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned in
         /* Re-using the file threshold here causes problems.
          * The simplest solution is to use a zero threshold. */
         if (-1 == store_rmf_histogram (new_h, new_h_num, i_new_start,
-                                       0.0, f_chan, n_chan, new_num, new_v + i))
+                                       0.0, f_chan, n_chan, new_num, &new_m))
           goto return_error;
+        close_rmf_row (&new_m, i);
 
-        memset ((char *)new_h+i_new_start, 0, new_h_num * sizeof (double));
-        memset ((char *)old_h+old_h_offset, 0, old_h_num * sizeof (double));
+        memset ((char *)(new_h + i_new_start), 0, new_h_num * sizeof (double));
+        memset ((char *)(old_h + old_h_offset), 0, old_h_num * sizeof (double));
      }
 
+   trim_rmf_matrix (&new_m);
+
    /* If we made it this far, then it has been a success. So make the
     * appropriate replacements
     */
-   free_rmf_vectors (cd->v, num_rows);
+   free_rmf_matrix (m);
+   free_noticed_groups (cd);
 
    ISIS_FREE (ebounds->bin_lo);
    ISIS_FREE (ebounds->bin_hi);
 
-   cd->v = new_v;
+   cd->mat = new_m;
    ebounds->bin_lo = new_lo;
    ebounds->bin_hi = new_hi;
    ebounds->nbins = new_num;
@@ -1364,10 +3059,10 @@ static int rebin_rmf (Isis_Rmf_t *rmf, double *wv_lo, double *wv_hi, unsigned in
 
    ISIS_FREE (f_chan);
    ISIS_FREE (n_chan);
-   ISIS_FREE (new_h);
+   ISIS_FREE (old_h);
 
    free_hist (new_lo, new_hi, new_h);
-   free_rmf_vectors (new_v, new_num);
+   free_rmf_matrix (&new_m);
 
    return -1;
 }
@@ -1424,9 +3119,69 @@ static int handle_ebounds_option (char *subsystem, char *optname, char *value, v
 
 /*}}}*/
 
+static int handle_threads_option (char *subsystem, char *optname, char *value, void *clientdata) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = (Rmf_Client_Data_t *)clientdata;
+   int n;
+
+   if ((1 != sscanf (value, "%d", &n)) || (n < 1))
+     {
+        fprintf (stderr, "Unknown '%s;%s' option value '%s'\n", subsystem, optname, value);
+        return -1;
+     }
+
+   if (n > RMF_MAX_FOLD_THREADS)
+     n = RMF_MAX_FOLD_THREADS;
+
+   cd->num_threads = n;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int handle_thread_min_option (char *subsystem, char *optname, char *value, void *clientdata) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = (Rmf_Client_Data_t *)clientdata;
+   unsigned int n;
+
+   if (1 != sscanf (value, "%u", &n))
+     {
+        fprintf (stderr, "Unknown '%s;%s' option value '%s'\n", subsystem, optname, value);
+        return -1;
+     }
+
+   cd->thread_min = n;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int handle_lazy_option (char *subsystem, char *optname, char *value, void *clientdata) /*{{{*/
+{
+   Rmf_Client_Data_t *cd = (Rmf_Client_Data_t *)clientdata;
+   int lazy;
+
+   if (1 != sscanf (value, "%d", &lazy))
+     {
+        fprintf (stderr, "Unknown '%s;%s' option value '%s'\n", subsystem, optname, value);
+        return -1;
+     }
+
+   cd->lazy = (lazy != 0);
+
+   return 0;
+}
+
+/*}}}*/
+
 static Isis_Option_Table_Type Option_Table [] =
 {
      {"strict", handle_strict_option, ISIS_OPT_REQUIRES_VALUE, "2", "OGIP strictness"},
+     {"threads", handle_threads_option, ISIS_OPT_REQUIRES_VALUE, "1", "number of threads used to fold large matrices"},
+     {"thread_min", handle_thread_min_option, ISIS_OPT_REQUIRES_VALUE, "1000000", "minimum number of matrix elements for a threaded fold"},
+     {"lazy", handle_lazy_option, ISIS_OPT_REQUIRES_VALUE, "0", "read matrix rows only when noticed"},
      {"ebounds", handle_ebounds_option, ISIS_OPT_REQUIRES_VALUE, "EBOUNDS", "EXTNAME of FITS extension containing EBOUNDS grid"},
      {"matrix", handle_matrix_option, ISIS_OPT_REQUIRES_VALUE, "SPECRESP MATRIX", "EXTNAME of FITS extension containing RMF matrix"},
      ISIS_OPTION_TABLE_TYPE_NULL
@@ -1435,6 +3190,8 @@ static Isis_Option_Table_Type Option_Table [] =
 static int set_options (Rmf_Client_Data_t *cd, Isis_Option_Type *opts) /*{{{*/
 {
    cd->strict = Isis_Rmf_OGIP_Compliance;
+   cd->num_threads = 1;
+   cd->thread_min = RMF_THREAD_MIN_ELEMS;
    return isis_process_options (opts, Option_Table, (void *)cd, 1);
 }
 
@@ -1492,12 +3249,15 @@ static int print_options_help (Rmf_Client_Data_t *cd) /*{{{*/
 
 static int init_rmf_t (Isis_Rmf_t *rmf) /*{{{*/
 {
+   select_fold_kernel ();
+
    rmf->set_arf_grid = set_arf_grid;
    rmf->set_data_grid = set_data_grid;
    rmf->get_arf_grid = get_arf_grid;
    rmf->get_data_grid = get_data_grid;
    rmf->init = dummy_init;
    rmf->redistribute = redistribute;
+   rmf->redistribute_noticed = redistribute_noticed;
    rmf->set_noticed_model_bins = set_noticed_model_bins;
    rmf->rebin_rmf = rebin_rmf;
    rmf->factor_rsp = factor_rsp;
@@ -1528,6 +3288,15 @@ int Rmf_load_file (Isis_Rmf_t *rmf, void *options)  /*{{{*/
    if (-1 == parse_options (cd, (char *)options))
      return -1;
 
+   if (cd->num_threads > 1)
+     {
+#ifdef HAVE_PTHREAD_H
+        rmf->redistribute_vector = redistribute_vector;
+#else
+        isis_vmesg (WARN, I_WARNING, __FILE__, __LINE__, "threads not supported, using serial RMF fold");
+#endif
+     }
+
    return read_rmf (rmf, cd->f.file);
 }
 
@@ -1573,11 +3342,10 @@ int Rmf_load_slang (Isis_Rmf_t *rmf, void *options) /*{{{*/
      }
    cd->ebounds->units = U_KEV;
 
-   if (NULL == (cd->v = (Rmf_Vector_t *) ISIS_MALLOC (cd->num_ebins * sizeof(Rmf_Vector_t))))
+   if (-1 == init_rmf_matrix (&cd->mat, cd->num_ebins, cd->num_ebins, num_data_bins))
      {
         goto return_error;
      }
-   memset ((char *)cd->v, 0, cd->num_ebins * sizeof (Rmf_Vector_t));
 
    if ((NULL == (n_chan = (int *) ISIS_MALLOC (num_data_bins*sizeof(int))))
        || (NULL == (f_chan = (int *) ISIS_MALLOC (num_data_bins*sizeof(int)))))
@@ -1610,14 +3378,17 @@ int Rmf_load_slang (Isis_Rmf_t *rmf, void *options) /*{{{*/
           }
         if (-1 == store_rmf_histogram ((double *)at_rmf->data, num_data_bins, 0,
                                        info->threshold, f_chan, n_chan, num_data_bins,
-                                       cd->v + i))
+                                       &cd->mat))
           {
              SLang_free_array (at_rmf);
              goto return_error;
           }
+        close_rmf_row (&cd->mat, i);
         SLang_free_array (at_rmf);
      }
 
+   trim_rmf_matrix (&cd->mat);
+
    ISIS_FREE (n_chan);
    ISIS_FREE (f_chan);
    return 0;
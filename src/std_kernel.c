@@ -33,15 +33,113 @@
 #include <float.h>
 #include <math.h>
 
+/* For a single ARF and RMF, the product of the exposure time,
+ * effective area and redistribution function is cached as a
+ * sparse matrix, one row per noticed model bin, so that folding
+ * a model becomes a single sparse matrix-vector product.
+ */
+typedef struct
+{
+   unsigned int serial;                /* Isis_Response_Serial when built */
+   int *notice_list;
+   int n_notice;
+   unsigned int num_orig_data;
+   int num_evals;                      /* evaluations seen with this key */
+   int built;
+   unsigned int num_grps;
+   unsigned int *row_start;            /* [n_notice+1] -> groups */
+   unsigned int *first_channel;        /* [num_grps] */
+   unsigned int *resp_start;           /* [num_grps+1] -> response */
+   double *response;
+}
+Rsp_Cache_t;
+
+/* With multiple responses, the model is rebinned onto each ARF
+ * grid.  The rebinning is a fixed sparse operator from the noticed
+ * model bins to the noticed ARF bins, so it is built once per
+ * response and reused until a grid or notice list changes.
+ */
+typedef struct
+{
+   int *notice_list;                   /* noticed ARF bins */
+   int n_notice;
+   unsigned int *row_start;            /* [n_notice+1] -> src, weight */
+   unsigned int *src;                  /* packed model bin */
+   double *weight;
+   double *val;                        /* [n_notice] rebinned model */
+}
+Rebin_Op_t;
+
+typedef struct
+{
+   unsigned int serial;                /* Isis_Response_Serial when built */
+   int *notice_list;                   /* model notice list when built */
+   int n_notice;
+   unsigned int num_ops;
+   Rebin_Op_t *ops;                    /* one per response */
+}
+Rebin_Cache_t;
+
 #define ISIS_KERNEL_PRIVATE_DATA \
-   int allows_ignoring_model_intervals;
+   int allows_ignoring_model_intervals; \
+   Rsp_Cache_t *rsp_cache; \
+   Rebin_Cache_t *rebin_cache;
 
 #include "isis.h"
 #include "util.h"
+#include "rmf.h"
 #include "errors.h"
 
+static void free_rsp_cache_matrix (Rsp_Cache_t *c) /*{{{*/
+{
+   ISIS_FREE (c->row_start);
+   ISIS_FREE (c->first_channel);
+   ISIS_FREE (c->resp_start);
+   ISIS_FREE (c->response);
+   c->num_grps = 0;
+   c->built = 0;
+}
+
+/*}}}*/
+
+static void free_rebin_op (Rebin_Op_t *op) /*{{{*/
+{
+   ISIS_FREE (op->notice_list);
+   ISIS_FREE (op->row_start);
+   ISIS_FREE (op->src);
+   ISIS_FREE (op->weight);
+   ISIS_FREE (op->val);
+   op->n_notice = 0;
+}
+
+/*}}}*/
+
+static void free_rebin_cache_ops (Rebin_Cache_t *c) /*{{{*/
+{
+   unsigned int i;
+
+   for (i = 0; i < c->num_ops; i++)
+     free_rebin_op (&c->ops[i]);
+   ISIS_FREE (c->ops);
+   c->num_ops = 0;
+}
+
+/*}}}*/
+
 static void delete_kernel (Isis_Kernel_t *k) /*{{{*/
 {
+   if (k == NULL)
+     return;
+   if (k->rsp_cache != NULL)
+     {
+        free_rsp_cache_matrix (k->rsp_cache);
+        ISIS_FREE (k->rsp_cache);
+     }
+   if (k->rebin_cache != NULL)
+     {
+        free_rebin_cache_ops (k->rebin_cache);
+        ISIS_FREE (k->rebin_cache);
+     }
    ISIS_FREE (k);
 }
 
@@ -56,13 +154,185 @@ static int print_kernel (Isis_Kernel_t *k) /*{{{*/
 
 /*}}}*/
 
-static int match_arf_grid (Isis_Kernel_t *k, Isis_Rsp_t *rsp, Isis_Hist_t *g, Isis_Hist_t *m) /*{{{*/
+/* Mirrors the overlap loop of rebin_histogram, recording the
+ * weights from noticed model bins (pos[f] >= 0) into noticed
+ * ARF bins instead of summing them.  With op->src == NULL, only
+ * the number of weights in each row is counted.
+ */
+static int scan_rebin_weights (Isis_Hist_t *g, int *pos, Isis_Arf_t *a, int *notice, /*{{{*/
+                               Rebin_Op_t *op)
 {
-   Isis_Arf_t *a;
-   double *g_val, *m_val;
+   double *flo = g->bin_lo, *fhi = g->bin_hi;
+   double *tlo = a->bin_lo, *thi = a->bin_hi;
+   int nf = g->nbins, nt = a->nbins;
+   unsigned int num = 0;
+   int f, t, j;
+
+   f = 0;
+   j = 0;
+   for (t = 0; t < nt; t++)
+     {
+        double t0 = tlo[t], t1 = thi[t];
+
+        if (notice[t])
+          op->row_start[j] = num;
+
+        for ( ;f < nf; f++)
+          {
+             double f0, f1, min_max, max_min;
+
+             f0 = flo[f];
+             f1 = fhi[f];
+
+             if (t0 > f1)
+               continue;
+             if (f0 > t1)
+               break;
+
+             if (t0 > f0) max_min = t0;
+             else max_min = f0;
+
+             if (t1 < f1) min_max = t1;
+             else min_max = f1;
+
+             if (f0 == f1)
+               return -1;
+
+             if (notice[t] && (pos[f] >= 0))
+               {
+                  if (op->src != NULL)
+                    {
+                       op->src[num] = pos[f];
+                       op->weight[num] = (min_max - max_min) / (f1 - f0);
+                    }
+                  num++;
+               }
+
+             if (f1 > t1)
+               break;
+          }
+
+        if (notice[t])
+          j++;
+     }
+
+   op->row_start[j] = num;
+
+   return 0;
+}
+
+/*}}}*/
+
+static int build_rebin_op (Rebin_Op_t *op, Isis_Arf_t *a, Isis_Hist_t *g) /*{{{*/
+{
+   int *notice = NULL, *pos = NULL;
+   unsigned int num;
    int i;
 
-   g_val = m_val = NULL;
+   free_rebin_op (op);
+
+   if ((NULL == (notice = (int *) ISIS_MALLOC (a->nbins * sizeof(int))))
+       || (NULL == (pos = (int *) ISIS_MALLOC (g->nbins * sizeof(int)))))
+     goto return_error;
+   memset ((char *)notice, 0, a->nbins * sizeof(int));
+
+   for (i = 0; i < g->nbins; i++)
+     pos[i] = -1;
+   for (i = 0; i < g->n_notice; i++)
+     pos[g->notice_list[i]] = i;
+
+   if ((-1 == transfer_notice (g->bin_lo, g->bin_hi, g->notice_list, g->n_notice,
+                               a->bin_lo, a->bin_hi, a->nbins, notice))
+       || (-1 == _update_notice_list (notice, &op->notice_list, &op->n_notice, a->nbins)))
+     goto return_error;
+
+   if ((NULL == (op->row_start = (unsigned int *) ISIS_MALLOC ((op->n_notice + 1) * sizeof(unsigned int))))
+       || (NULL == (op->val = (double *) ISIS_MALLOC ((op->n_notice ? op->n_notice : 1) * sizeof(double)))))
+     goto return_error;
+
+   if (-1 == scan_rebin_weights (g, pos, a, notice, op))
+     goto return_error;
+
+   num = op->row_start[op->n_notice];
+   if ((NULL == (op->src = (unsigned int *) ISIS_MALLOC ((num ? num : 1) * sizeof(unsigned int))))
+       || (NULL == (op->weight = (double *) ISIS_MALLOC ((num ? num : 1) * sizeof(double)))))
+     goto return_error;
+
+   if (-1 == scan_rebin_weights (g, pos, a, notice, op))
+     goto return_error;
+
+   ISIS_FREE (notice);
+   ISIS_FREE (pos);
+   return 0;
+
+return_error:
+   ISIS_FREE (notice);
+   ISIS_FREE (pos);
+   free_rebin_op (op);
+   return -1;
+}
+
+/*}}}*/
+
+static Rebin_Op_t *get_rebin_op (Isis_Kernel_t *k, unsigned int index, Isis_Rsp_t *rsp, /*{{{*/
+                                 Isis_Hist_t *g)
+{
+   Rebin_Cache_t *c;
+   Rebin_Op_t *op;
+
+   if (k->rebin_cache == NULL)
+     {
+        if (NULL == (k->rebin_cache = (Rebin_Cache_t *) ISIS_MALLOC (sizeof(Rebin_Cache_t))))
+          return NULL;
+        memset ((char *)k->rebin_cache, 0, sizeof(Rebin_Cache_t));
+     }
+
+   c = k->rebin_cache;
+
+   if ((c->ops == NULL)
+       || (c->serial != Isis_Response_Serial)
+       || (c->notice_list != g->notice_list)
+       || (c->n_notice != g->n_notice))
+     {
+        Isis_Rsp_t *r;
+        unsigned int n = 0;
+
+        free_rebin_cache_ops (c);
+
+        for (r = &k->rsp; r != NULL; r = r->next)
+          n++;
+
+        if (NULL == (c->ops = (Rebin_Op_t *) ISIS_MALLOC (n * sizeof(Rebin_Op_t))))
+          return NULL;
+        memset ((char *)c->ops, 0, n * sizeof(Rebin_Op_t));
+        c->num_ops = n;
+
+        c->serial = Isis_Response_Serial;
+        c->notice_list = g->notice_list;
+        c->n_notice = g->n_notice;
+     }
+
+   if (index >= c->num_ops)
+     return NULL;
+
+   op = &c->ops[index];
+
+   /* built lazily; a noticed ARF always has a row_start */
+   if ((op->row_start == NULL)
+       && (-1 == build_rebin_op (op, rsp->arf, g)))
+     return NULL;
+
+   return op;
+}
+
+/*}}}*/
+
+static int match_arf_grid (Isis_Kernel_t *k, unsigned int index, Isis_Rsp_t *rsp, /*{{{*/
+                           Isis_Hist_t *g, Isis_Hist_t *m)
+{
+   Rebin_Op_t *op;
+   double *g_val;
+   int j;
 
    /* When there's only one ARF, the model is computed on that grid.
     * If we've got multiple responses, we interpolate the model
@@ -78,66 +348,230 @@ static int match_arf_grid (Isis_Kernel_t *k, Isis_Rsp_t *rsp, Isis_Hist_t *g, Is
      }
 
    /* harder case: map the model onto the ARF grid */
-   a = rsp->arf;
-   m->nbins = a->nbins;
-   m->bin_lo = a->bin_lo;
-   m->bin_hi = a->bin_hi;
-   m->n_notice = 0;
-   m->val = NULL;
-   m->notice = NULL;
-   m->notice_list = NULL;
-   if ((NULL == (m_val = (double *) ISIS_MALLOC (m->nbins * sizeof(double))))
-       || (NULL == (m->notice = (int *) ISIS_MALLOC (m->nbins * sizeof(int))))
-       || (NULL == (g_val = (double *) ISIS_MALLOC (g->nbins * sizeof(double)))))
+   if (NULL == (op = get_rebin_op (k, index, rsp, g)))
+     return -1;
+
+   g_val = g->val;
+
+   for (j = 0; j < op->n_notice; j++)
      {
-        goto fail;
+        unsigned int i, i_end = op->row_start[j+1];
+        double s = 0.0;
+
+        for (i = op->row_start[j]; i < i_end; i++)
+          s += g_val[op->src[i]] * op->weight[i];
+
+        op->val[j] = s;
      }
-   memset ((char *)m->notice, 0, m->nbins * sizeof(int));
-   memset ((char *)g_val, 0, g->nbins * sizeof(double));
 
-   if (-1 == unpack_noticed (g->val, g->notice_list, g->n_notice, g->nbins, g_val))
-     goto fail;
+   m->nbins = rsp->arf->nbins;
+   m->bin_lo = rsp->arf->bin_lo;
+   m->bin_hi = rsp->arf->bin_hi;
+   m->notice = NULL;
+   m->val = op->val;
+   m->notice_list = op->notice_list;
+   m->n_notice = op->n_notice;
+
+   return 0;
+}
+
+/*}}}*/
 
-   if ((-1 == rebin_histogram (g_val, g->bin_lo, g->bin_hi, g->nbins,
-                                m_val, m->bin_lo, m->bin_hi, m->nbins))
-       || (-1 == transfer_notice (g->bin_lo, g->bin_hi, g->notice_list, g->n_notice,
-                                  m->bin_lo, m->bin_hi, m->nbins, m->notice))
-       || (-1 == _update_notice_list (m->notice, &m->notice_list, &m->n_notice, m->nbins)))
+static int rsp_cache_is_usable (Isis_Kernel_t *k) /*{{{*/
+{
+   Isis_Rmf_t *rmf = k->rsp.rmf;
+
+   /* Only file-based RMFs are worth caching; user-defined RMFs
+    * may carry state that changes between evaluations.  RMFs
+    * with their own whole-vector fold (e.g. threaded) keep it.
+    */
+   if ((k->rsp.next != NULL)
+       || ((rmf->method != RMF_FILE) && (rmf->method != RMF_SLANG))
+       || (rmf->pre_apply != NULL) || (rmf->post_apply != NULL)
+       || (rmf->redistribute_vector != NULL))
+     return 0;
+
+   return 1;
+}
+
+/*}}}*/
+
+static int grow_rsp_cache (Rsp_Cache_t *c, unsigned int *max_grps, unsigned int need_grps, /*{{{*/
+                           unsigned int *max_elems, unsigned int need_elems)
+{
+   if (need_grps > *max_grps)
+     {
+        unsigned int n = 2 * need_grps;
+        unsigned int *f, *r;
+        if (NULL == (f = (unsigned int *) ISIS_REALLOC (c->first_channel, n * sizeof(unsigned int))))
+          return -1;
+        c->first_channel = f;
+        if (NULL == (r = (unsigned int *) ISIS_REALLOC (c->resp_start, (n+1) * sizeof(unsigned int))))
+          return -1;
+        c->resp_start = r;
+        *max_grps = n;
+     }
+
+   if (need_elems > *max_elems)
      {
-        goto fail;
+        unsigned int n = 2 * need_elems;
+        double *d;
+        if (NULL == (d = (double *) ISIS_REALLOC (c->response, n * sizeof(double))))
+          return -1;
+        c->response = d;
+        *max_elems = n;
      }
 
-   /* Finish by packing according to the notice list */
-   if (NULL == (m->val = (double *) ISIS_MALLOC (m->n_notice * sizeof(double))))
-     goto fail;
+   return 0;
+}
+
+/*}}}*/
 
-   for (i = 0; i < m->n_notice; i++)
+static int build_rsp_cache (Isis_Kernel_t *k, Rsp_Cache_t *c) /*{{{*/
+{
+   double *arf = k->rsp.arf->arf;
+   double *tmp = NULL;
+   unsigned int max_grps, max_elems, num_elems;
+   int i, num = c->num_orig_data;
+
+   free_rsp_cache_matrix (c);
+
+   max_grps = max_elems = 0;
+   num_elems = 0;
+
+   if ((NULL == (c->row_start = (unsigned int *) ISIS_MALLOC ((c->n_notice + 1) * sizeof(unsigned int))))
+       || (NULL == (tmp = (double *) ISIS_MALLOC (num * sizeof(double))))
+       || (-1 == grow_rsp_cache (c, &max_grps, 64, &max_elems, 1024)))
+     goto return_error;
+
+   memset ((char *)tmp, 0, num * sizeof(double));
+
+   for (i = 0; i < c->n_notice; i++)
      {
-        int n = m->notice_list[i];
-        m->val[i] = m_val[n];
+        int n = c->notice_list[i];
+        double one = 1.0;
+        double factor = arf[n] * k->exposure_time;
+        int j;
+
+        c->row_start[i] = c->num_grps;
+
+        if (-1 == k->apply_rmf (k->rsp.rmf, tmp, num, &one, &n, 1))
+          goto return_error;
+
+        j = 0;
+        while (j < num)
+          {
+             int first;
+
+             if (tmp[j] == 0.0)
+               {
+                  j++;
+                  continue;
+               }
+
+             if (-1 == grow_rsp_cache (c, &max_grps, c->num_grps + 1,
+                                       &max_elems, num_elems + (num - j)))
+               goto return_error;
+
+             first = j;
+             c->first_channel[c->num_grps] = first;
+             c->resp_start[c->num_grps] = num_elems;
+             while ((j < num) && (tmp[j] != 0.0))
+               {
+                  c->response[num_elems++] = factor * tmp[j];
+                  tmp[j++] = 0.0;
+               }
+             c->num_grps++;
+          }
      }
 
-   ISIS_FREE (g_val);
-   ISIS_FREE (m_val);
-   ISIS_FREE (m->notice);
-   return 1;
+   c->row_start[c->n_notice] = c->num_grps;
+   c->resp_start[c->num_grps] = num_elems;
+   c->built = 1;
+
+   ISIS_FREE (tmp);
+   return 0;
 
-   fail:
-   ISIS_FREE (g_val);
-   ISIS_FREE (m_val);
-   ISIS_FREE (m->notice);
-   ISIS_FREE (m->val);
-   ISIS_FREE (m->notice_list);
-   m->n_notice = 0;
+return_error:
+   ISIS_FREE (tmp);
+   free_rsp_cache_matrix (c);
    return -1;
 }
 
 /*}}}*/
 
+/* Returns 1 if the cached response was applied, 0 if the
+ * caller should fold the model the usual way, -1 on error.
+ */
+static int apply_rsp_cache (Isis_Kernel_t *k, double *result, Isis_Hist_t *g) /*{{{*/
+{
+   Rsp_Cache_t *c;
+   int i;
+
+   if (0 == rsp_cache_is_usable (k))
+     return 0;
+
+   if (k->rsp_cache == NULL)
+     {
+        if (NULL == (k->rsp_cache = (Rsp_Cache_t *) ISIS_MALLOC (sizeof(Rsp_Cache_t))))
+          return -1;
+        memset ((char *)k->rsp_cache, 0, sizeof(Rsp_Cache_t));
+     }
+
+   c = k->rsp_cache;
+
+   if ((c->serial != Isis_Response_Serial)
+       || (c->notice_list != g->notice_list)
+       || (c->n_notice != g->n_notice)
+       || (c->num_orig_data != k->num_orig_data))
+     {
+        free_rsp_cache_matrix (c);
+        c->serial = Isis_Response_Serial;
+        c->notice_list = g->notice_list;
+        c->n_notice = g->n_notice;
+        c->num_orig_data = k->num_orig_data;
+        c->num_evals = 0;
+     }
+
+   /* A one-off evaluation shouldn't pay for building the cache */
+   if (c->built == 0)
+     {
+        if (++c->num_evals < 2)
+          return 0;
+        if (-1 == build_rsp_cache (k, c))
+          return -1;
+     }
+
+   for (i = 0; i < c->n_notice; i++)
+     {
+        double flux = g->val[i];
+        unsigned int gp;
+
+        if (flux == 0.0)
+          continue;
+
+        for (gp = c->row_start[i]; gp < c->row_start[i+1]; gp++)
+          {
+             double *d = result + c->first_channel[gp];
+             double *r = c->response + c->resp_start[gp];
+             double *rmax = c->response + c->resp_start[gp+1];
+             while (r < rmax)
+               {
+                  *d++ += flux * *r++;
+               }
+          }
+     }
+
+   return 1;
+}
+
+/*}}}*/
+
 static int compute_kernel (Isis_Kernel_t *k, double *result, Isis_Hist_t *g, double *par, unsigned int num, /*{{{*/
                            int (*fun)(Isis_Hist_t *))
 {
    Isis_Rsp_t *rsp;
+   unsigned int index;
    int ret = -1;
 
    (void) par; (void) num;
@@ -149,16 +583,19 @@ static int compute_kernel (Isis_Kernel_t *k, double *result, Isis_Hist_t *g, dou
    if (-1 == (*fun)(g))
      return -1;
 
+   if ((ret = apply_rsp_cache (k, result, g)) != 0)
+     return (ret < 0) ? -1 : 0;
+
    /* Fold the model through each of the responses,
     * incrementing 'result' for each such contribution
     */
-   for (rsp = &k->rsp; rsp != NULL; rsp = rsp->next)
+   for (rsp = &k->rsp, index = 0; rsp != NULL; rsp = rsp->next, index++)
      {
         double *arf = rsp->arf->arf;
         Isis_Hist_t m;
-        int i, malloced;
+        int i;
 
-        if ((malloced = match_arf_grid (k, rsp, g, &m)) < 0)
+        if (-1 == match_arf_grid (k, index, rsp, g, &m))
           return -1;
 
         for (i = 0; i < m.n_notice; i++)
@@ -169,12 +606,6 @@ static int compute_kernel (Isis_Kernel_t *k, double *result, Isis_Hist_t *g, dou
 
         ret = k->apply_rmf (rsp->rmf, result, k->num_orig_data,
                             m.val, m.notice_list, m.n_notice);
-        if (malloced)
-          {
-             ISIS_FREE (m.notice_list);
-             ISIS_FREE (m.val);
-          }
-
         if (ret == -1)
           return ret;
      }
@@ -319,6 +750,8 @@ static Isis_Kernel_t *allocate_std_kernel (Isis_Obs_t *o, char *options) /*{{{*/
      return NULL;
 
    k->allows_ignoring_model_intervals = 1;
+   k->rsp_cache = NULL;
+   k->rebin_cache = NULL;
 
    if (-1 == process_options (k, options))
      {
@@ -430,6 +863,8 @@ static Isis_Kernel_t *allocate_yshift_kernel (Isis_Obs_t *o, char *options) /*{{
      return NULL;
 
    k->allows_ignoring_model_intervals = 0;
+   k->rsp_cache = NULL;
+   k->rebin_cache = NULL;
 
    k->delete_kernel = delete_kernel;
    k->compute_kernel = compute_yshift_kernel;
@@ -548,6 +983,8 @@ static Isis_Kernel_t *allocate_gainshift_kernel (Isis_Obs_t *o, char *options) /
      return NULL;
 
    k->allows_ignoring_model_intervals = 0;
+   k->rsp_cache = NULL;
+   k->rebin_cache = NULL;
 
    k->delete_kernel = delete_kernel;
    k->compute_kernel = compute_gainshift_kernel;
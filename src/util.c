@@ -58,6 +58,10 @@
 #  include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_WAIT_H
+#  include <sys/wait.h>
+#endif
+
 #ifdef HAVE_DLFCN_H
 #  include <dlfcn.h>
 #endif
@@ -77,6 +81,7 @@ int Isis_Verbose;
 int Isis_Errno;
 int Isis_Batch_Mode;
 int Isis_Remove_Spectrum_Gaps;
+unsigned int Isis_Response_Serial;
 
 char *Isis_Pager;
 char *Isis_Srcdir;
@@ -237,6 +242,56 @@ double isis_kahan_sum_squares (double *x, unsigned int n) /*{{{*/
 
 /*}}}*/
 
+/* Pairwise summation:  the error grows as log(n) rather than n, and
+ * the independent partial sums in the base case leave the compiler
+ * free to vectorize the loop.
+ */
+#define PAIRWISE_SUM_BASE 32
+double isis_pairwise_sum (double *x, unsigned int n) /*{{{*/
+{
+   double s0, s1, s2, s3;
+   unsigned int i, m;
+
+   if (n > PAIRWISE_SUM_BASE)
+     {
+        m = n / 2;
+        return isis_pairwise_sum (x, m) + isis_pairwise_sum (x + m, n - m);
+     }
+
+   s0 = s1 = s2 = s3 = 0.0;
+
+   for (i = 0; i + 4 <= n; i += 4)
+     {
+        s0 += x[i];
+        s1 += x[i+1];
+        s2 += x[i+2];
+        s3 += x[i+3];
+     }
+
+   for ( ; i < n; i++)
+     {
+        s0 += x[i];
+     }
+
+   return (s0 + s1) + (s2 + s3);
+}
+
+/*}}}*/
+
+/* Add x to a running compensated sum, e.g. to combine the
+ * isis_pairwise_sum results of consecutive blocks */
+void isis_kahan_add (double *sum, double *c, double x) /*{{{*/
+{
+   double y, t;
+
+   y = x - *c;
+   t = *sum + y;
+   *c = (t - *sum) - y;
+   *sum = t;
+}
+
+/*}}}*/
+
 int isis_svd_solve (double **matrix, unsigned int n, double *b) /*{{{*/
 {
    double *a, *t;
@@ -2232,3 +2287,471 @@ int isis_coerce_array_to_type (SLang_Array_Type **at, int type) /*{{{*/
 }
 
 /*}}}*/
+
+/*{{{ forked task map */
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H) && defined(HAVE_UNISTD_H)
+# define ISIS_HAVE_FORK_MAP 1
+#else
+# define ISIS_HAVE_FORK_MAP 0
+#endif
+
+#if ISIS_HAVE_FORK_MAP
+
+static int write_all (int fd, char *buf, size_t n) /*{{{*/
+{
+   while (n > 0)
+     {
+        ssize_t m = write (fd, buf, n);
+        if (m < 0)
+          {
+             if (errno == EINTR)
+               continue;
+             return -1;
+          }
+        buf += m;
+        n -= m;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+static int read_all (int fd, char *buf, size_t n) /*{{{*/
+{
+   while (n > 0)
+     {
+        ssize_t m = read (fd, buf, n);
+        if (m < 0)
+          {
+             if (errno == EINTR)
+               continue;
+             return -1;
+          }
+        if (m == 0)
+          return -1;
+        buf += m;
+        n -= m;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+static int wait_for_worker (pid_t pid, int *status) /*{{{*/
+{
+   while (-1 == waitpid (pid, status, 0))
+     {
+        if (errno != EINTR)
+          return -1;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+/* Each task result is sent as a status flag followed by
+ * result_size values. */
+static void run_fork_worker (int fd, unsigned int first, unsigned int stride, /*{{{*/
+                             unsigned int num_tasks, unsigned int result_size,
+                             Isis_Fork_Task_Type *fun, void *cl)
+{
+   size_t size = (result_size + 1) * sizeof(double);
+   double *buf;
+   unsigned int t;
+   int status = 0;
+
+   if (NULL == (buf = (double *) ISIS_MALLOC (size)))
+     _exit (1);
+
+   for (t = first; t < num_tasks; t += stride)
+     {
+        buf[0] = (double) (*fun)(cl, t, buf + 1);
+        if (-1 == write_all (fd, (char *)buf, size))
+          {
+             status = 1;
+             break;
+          }
+     }
+
+   ISIS_FREE (buf);
+   close (fd);
+   /* don't flush the parent's stdio buffers or run atexit hooks */
+   _exit (status);
+}
+
+/*}}}*/
+
+#endif
+
+/* Computes (*fun)(cl, t, results + t*result_size) for tasks
+ * t = 0 ... num_tasks-1, spreading the tasks across up to
+ * num_workers forked processes.  The workers see a copy-on-write
+ * image of this process, so fun must return everything it
+ * computes through its result vector.  With fewer than two
+ * workers, or without fork(), the tasks run serially here.
+ */
+int isis_fork_map (unsigned int num_tasks, unsigned int result_size, /*{{{*/
+                   unsigned int num_workers, Isis_Fork_Task_Type *fun, void *cl,
+                   double *results)
+{
+#if ISIS_HAVE_FORK_MAP
+   size_t size = (result_size + 1) * sizeof(double);
+   double *buf = NULL;
+   pid_t *pids = NULL;
+   int *fds = NULL;
+   unsigned int w, t, num_started = 0;
+   int ret = 0;
+#endif
+   unsigned int i;
+
+   if ((fun == NULL) || ((results == NULL) && (result_size > 0)))
+     return -1;
+
+   if (num_workers > num_tasks)
+     num_workers = num_tasks;
+
+#if ISIS_HAVE_FORK_MAP
+   if (num_workers < 2)
+     goto serial;
+
+   if ((NULL == (buf = (double *) ISIS_MALLOC (size)))
+       || (NULL == (pids = (pid_t *) ISIS_MALLOC (num_workers * sizeof(pid_t))))
+       || (NULL == (fds = (int *) ISIS_MALLOC (num_workers * sizeof(int)))))
+     {
+        ISIS_FREE (buf);
+        ISIS_FREE (pids);
+        ISIS_FREE (fds);
+        goto serial;
+     }
+
+   fflush (stdout);
+   fflush (stderr);
+
+   for (w = 0; w < num_workers; w++)
+     {
+        int p[2];
+        pid_t pid;
+
+        if (-1 == pipe (p))
+          break;
+
+        if (-1 == (pid = fork ()))
+          {
+             close (p[0]);
+             close (p[1]);
+             break;
+          }
+
+        if (pid == 0)
+          {
+             unsigned int j;
+             close (p[0]);
+             for (j = 0; j < w; j++)
+               close (fds[j]);
+             run_fork_worker (p[1], w, num_workers, num_tasks, result_size, fun, cl);
+          }
+
+        close (p[1]);
+        fds[w] = p[0];
+        pids[w] = pid;
+        num_started++;
+     }
+
+   /* tasks whose worker could not be started are done here */
+   for (w = num_started; w < num_workers; w++)
+     {
+        for (t = w; t < num_tasks; t += num_workers)
+          {
+             if (-1 == (*fun)(cl, t, results + t*result_size))
+               ret = -1;
+          }
+     }
+
+   for (w = 0; w < num_started; w++)
+     {
+        int status = 0;
+
+        for (t = w; t < num_tasks; t += num_workers)
+          {
+             if (-1 == read_all (fds[w], (char *)buf, size))
+               {
+                  ret = -1;
+                  break;
+               }
+             if (buf[0] != 0.0)
+               ret = -1;
+             memcpy ((char *)(results + t*result_size), (char *)(buf + 1),
+                     result_size * sizeof(double));
+          }
+
+        close (fds[w]);
+
+        if ((-1 == wait_for_worker (pids[w], &status))
+            || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+          ret = -1;
+     }
+
+   ISIS_FREE (buf);
+   ISIS_FREE (pids);
+   ISIS_FREE (fds);
+
+   return ret;
+
+   serial:
+#endif
+
+   for (i = 0; i < num_tasks; i++)
+     {
+        if (-1 == (*fun)(cl, i, results + i*result_size))
+          return -1;
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
+#if ISIS_HAVE_FORK_MAP
+
+/* A queue worker reads [task, input] records from its task pipe
+ * until the pipe is closed.  For each task, it announces itself
+ * on the shared ready pipe and then writes [status, result]
+ * to its own result pipe.
+ */
+static void run_queue_worker (int id, int task_fd, int result_fd, int ready_fd, /*{{{*/
+                              unsigned int input_size, unsigned int result_size,
+                              Isis_Fork_Work_Type *work, void *cl)
+{
+   double *in, *out;
+   int status = 0;
+
+   in = (double *) ISIS_MALLOC ((input_size + 1) * sizeof(double));
+   out = (double *) ISIS_MALLOC ((result_size + 1) * sizeof(double));
+   if ((in == NULL) || (out == NULL))
+     _exit (1);
+
+   while (0 == read_all (task_fd, (char *)in, (input_size + 1) * sizeof(double)))
+     {
+        out[0] = (double) (*work)(cl, (unsigned int) in[0], in + 1, out + 1);
+        if ((-1 == write_all (ready_fd, (char *)&id, sizeof(int)))
+            || (-1 == write_all (result_fd, (char *)out, (result_size + 1) * sizeof(double))))
+          {
+             status = 1;
+             break;
+          }
+     }
+
+   ISIS_FREE (in);
+   ISIS_FREE (out);
+   close (task_fd);
+   close (result_fd);
+   close (ready_fd);
+   _exit (status);
+}
+
+/*}}}*/
+
+#endif
+
+/* Like isis_fork_map, but tasks are handed out one at a time as
+ * workers become idle, so the caller can choose each task (and
+ * its input vector) using the results of those already finished.
+ *
+ *  (*next)(cl, num_busy, &task, input)   picks the next task; it
+ *         returns 1 if a task was assigned, 0 if no task can be
+ *         started until a busy task finishes, or -1 on error.
+ *  (*work)(cl, task, input, result)  runs in a worker.
+ *  (*done)(cl, task, result)  runs here, as each result arrives.
+ *
+ * num_tasks is the number of tasks next() will assign in total.
+ */
+int isis_fork_queue (unsigned int num_tasks, unsigned int input_size, /*{{{*/
+                     unsigned int result_size, unsigned int num_workers,
+                     Isis_Fork_Next_Type *next, Isis_Fork_Work_Type *work,
+                     Isis_Fork_Done_Type *done, void *cl)
+{
+   double *in = NULL, *out = NULL;
+#if ISIS_HAVE_FORK_MAP
+   pid_t *pids = NULL;
+   int *task_fds = NULL, *result_fds = NULL, *busy = NULL;
+   int ready[2];
+   unsigned int w, num_started = 0, num_busy = 0;
+#endif
+   unsigned int task, num_done = 0;
+   int ret = -1;
+
+   if ((next == NULL) || (work == NULL) || (done == NULL))
+     return -1;
+
+   if (num_tasks == 0)
+     return 0;
+
+   if ((NULL == (in = (double *) ISIS_MALLOC ((input_size + 1) * sizeof(double))))
+       || (NULL == (out = (double *) ISIS_MALLOC ((result_size + 1) * sizeof(double)))))
+     goto finish;
+
+   if (num_workers > num_tasks)
+     num_workers = num_tasks;
+
+#if ISIS_HAVE_FORK_MAP
+   if (num_workers < 2)
+     goto serial;
+
+   if ((NULL == (pids = (pid_t *) ISIS_MALLOC (num_workers * sizeof(pid_t))))
+       || (NULL == (task_fds = (int *) ISIS_MALLOC (num_workers * sizeof(int))))
+       || (NULL == (result_fds = (int *) ISIS_MALLOC (num_workers * sizeof(int))))
+       || (NULL == (busy = (int *) ISIS_MALLOC (num_workers * sizeof(int))))
+       || (-1 == pipe (ready)))
+     {
+        ISIS_FREE (pids);
+        ISIS_FREE (task_fds);
+        ISIS_FREE (result_fds);
+        ISIS_FREE (busy);
+        goto serial;
+     }
+
+   fflush (stdout);
+   fflush (stderr);
+
+   for (w = 0; w < num_workers; w++)
+     {
+        int tp[2], rp[2];
+        pid_t pid;
+
+        if (-1 == pipe (tp))
+          break;
+        if (-1 == pipe (rp))
+          {
+             close (tp[0]);
+             close (tp[1]);
+             break;
+          }
+
+        if (-1 == (pid = fork ()))
+          {
+             close (tp[0]); close (tp[1]);
+             close (rp[0]); close (rp[1]);
+             break;
+          }
+
+        if (pid == 0)
+          {
+             unsigned int j;
+             close (tp[1]);
+             close (rp[0]);
+             close (ready[0]);
+             for (j = 0; j < w; j++)
+               {
+                  close (task_fds[j]);
+                  close (result_fds[j]);
+               }
+             run_queue_worker (w, tp[0], rp[1], ready[1], input_size, result_size, work, cl);
+          }
+
+        close (tp[0]);
+        close (rp[1]);
+        task_fds[w] = tp[1];
+        result_fds[w] = rp[0];
+        pids[w] = pid;
+        busy[w] = -1;
+        num_started++;
+     }
+
+   /* so that reads see EOF if all the workers exit */
+   close (ready[1]);
+
+   if (num_started == 0)
+     {
+        close (ready[0]);
+        ISIS_FREE (pids);
+        ISIS_FREE (task_fds);
+        ISIS_FREE (result_fds);
+        ISIS_FREE (busy);
+        goto serial;
+     }
+
+   while (num_done < num_tasks)
+     {
+        int id, status;
+
+        for (w = 0; w < num_started; w++)
+          {
+             if (busy[w] >= 0)
+               continue;
+             status = (*next)(cl, num_busy, &task, in + 1);
+             if (status == -1)
+               goto shutdown;
+             if (status == 0)
+               break;
+             in[0] = (double) task;
+             if (-1 == write_all (task_fds[w], (char *)in, (input_size + 1) * sizeof(double)))
+               goto shutdown;
+             busy[w] = (int) task;
+             num_busy++;
+          }
+
+        if (num_busy == 0)
+          goto shutdown;
+
+        if ((-1 == read_all (ready[0], (char *)&id, sizeof(int)))
+            || (id < 0) || ((unsigned int) id >= num_started) || (busy[id] < 0)
+            || (-1 == read_all (result_fds[id], (char *)out, (result_size + 1) * sizeof(double)))
+            || (out[0] != 0.0))
+          goto shutdown;
+
+        task = (unsigned int) busy[id];
+        busy[id] = -1;
+        num_busy--;
+        num_done++;
+
+        if (-1 == (*done)(cl, task, out + 1))
+          goto shutdown;
+     }
+
+   ret = 0;
+
+   shutdown:
+   close (ready[0]);
+   for (w = 0; w < num_started; w++)
+     {
+        int status = 0;
+        close (task_fds[w]);
+        close (result_fds[w]);
+        if ((-1 == wait_for_worker (pids[w], &status))
+            || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+          ret = -1;
+     }
+
+   ISIS_FREE (pids);
+   ISIS_FREE (task_fds);
+   ISIS_FREE (result_fds);
+   ISIS_FREE (busy);
+   goto finish;
+
+   serial:
+#endif
+
+   while (num_done < num_tasks)
+     {
+        if ((1 != (*next)(cl, 0, &task, in + 1))
+            || (0 != (*work)(cl, task, in + 1, out + 1))
+            || (-1 == (*done)(cl, task, out + 1)))
+          goto finish;
+        num_done++;
+     }
+
+   ret = 0;
+
+   finish:
+   ISIS_FREE (in);
+   ISIS_FREE (out);
+   return ret;
+}
+
+/*}}}*/
+
+/*}}}*/
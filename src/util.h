@@ -80,6 +80,10 @@ extern int Isis_Errno;
 extern int Isis_Batch_Mode;
 extern int Isis_Remove_Spectrum_Gaps;
 
+/* Incremented whenever an ARF, RMF, exposure time or notice list
+ * that a fit kernel may have cached is modified. */
+extern unsigned int Isis_Response_Serial;
+
 #include <stdio.h>
 extern int isis_fclose (FILE *fp);
 extern FILE *isis_open_pager (void);
@@ -99,9 +103,26 @@ extern int Isis_pop_double_array (double *x, SLindex_Type n);
 extern double isis_hypot (double x, double y);
 extern double isis_kahan_sum (double *x, unsigned int n);
 extern double isis_kahan_sum_squares (double *x, unsigned int n);
+extern double isis_pairwise_sum (double *x, unsigned int n);
+extern void isis_kahan_add (double *sum, double *c, double x);
+/* block length for statistics summed in one pass with a stack buffer */
+#define ISIS_SUM_BLOCK 256
 extern int isis_svd_solve (double **a, unsigned int n, double *b);
 extern int isis_lu_solve (double **a, unsigned int n, unsigned int *piv, double *b);
 
+typedef int Isis_Fork_Task_Type (void *cl, unsigned int task, double *result);
+extern int isis_fork_map (unsigned int num_tasks, unsigned int result_size,
+                          unsigned int num_workers, Isis_Fork_Task_Type *fun, void *cl,
+                          double *results);
+
+typedef int Isis_Fork_Next_Type (void *cl, unsigned int num_busy, unsigned int *task, double *input);
+typedef int Isis_Fork_Work_Type (void *cl, unsigned int task, double *input, double *result);
+typedef int Isis_Fork_Done_Type (void *cl, unsigned int task, double *result);
+extern int isis_fork_queue (unsigned int num_tasks, unsigned int input_size,
+                            unsigned int result_size, unsigned int num_workers,
+                            Isis_Fork_Next_Type *next, Isis_Fork_Work_Type *work,
+                            Isis_Fork_Done_Type *done, void *cl);
+
 extern char **new_string_array (int n, int len);
 extern void free_string_array (char **p, int n);
 extern int edit_temp_file (int (*save_file)(char *), int (*load_file)(char *), char *file);
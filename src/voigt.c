@@ -396,6 +396,66 @@ static int gauss_quad4 (double lo, double hi, double y, double *q) /*{{{*/
 
 /*}}}*/
 
+/* H(x,y) = Re[w(z)] and its partial derivatives, from
+ *    w'(z) = -2 z w(z) + 2i/sqrt(pi)
+ */
+static int voigt_deriv (double x, double y, double *h, double *h_x, double *h_y) /*{{{*/
+{
+   double u, v;
+
+   if (-1 == wofz (x, y, &u, &v))
+     {
+        isis_vmesg (FAIL, I_ERROR, __FILE__, __LINE__,
+                    "evaluating voigt function for x=%g, y=%g",
+                    x, y);
+        return -1;
+     }
+
+   *h = u;
+   *h_x = -2.0 * (x*u - y*v);
+   *h_y = 2.0 * (x*v + y*u) - 2.0 / SQRT_PI;
+
+   return 0;
+}
+
+/*}}}*/
+
+/* gauss_quad4 and its derivatives with respect to lo, hi and y */
+static int gauss_quad4_deriv (double lo, double hi, double y, /*{{{*/
+                              double *q, double *q_lo, double *q_hi, double *q_y)
+{
+   static double xi[] = {-0.8611363116, -0.3399810436, 0.3399810436, 0.8611363116};
+   static double wt[] = {0.3478548451, 0.6521451549, 0.6521451549, 0.3478548451};
+   double a, b, s, s_x, s_lo, s_hi, s_y;
+   int i;
+
+   a = 0.5 * (hi + lo);
+   b = 0.5 * (hi - lo);
+
+   s = s_lo = s_hi = s_y = 0.0;
+
+   for (i = 0; i < 4; i++)
+     {
+        double h, h_x, h_y;
+        if (-1 == voigt_deriv (a + b*xi[i], y, &h, &h_x, &h_y))
+          return -1;
+        s += wt[i] * h;
+        s_x = wt[i] * h_x;
+        s_lo += s_x * (1.0 - xi[i]);
+        s_hi += s_x * (1.0 + xi[i]);
+        s_y += wt[i] * h_y;
+     }
+
+   *q = b * s;
+   *q_lo = 0.5 * (b * s_lo - s);
+   *q_hi = 0.5 * (b * s_hi + s);
+   *q_y = b * s_y;
+
+   return 0;
+}
+
+/*}}}*/
+
 static int binned_voigt (double *val, Isis_Hist_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double norm = par[0];
@@ -445,6 +505,82 @@ static int binned_voigt (double *val, Isis_Hist_t *g, double *par, unsigned int
 
 /*}}}*/
 
+static int binned_voigt_deriv (double *dval, Isis_Hist_t *g, double *par, /*{{{*/
+                               unsigned int npar, unsigned int ipar)
+{
+   double norm = par[0];
+   double e0 = par[1];      /* center [keV] */
+   double fwhm = par[2];    /* resonance FWHM [keV] */
+   double vtherm = par[3];  /* thermal speed [km/s] */
+   double *lo = g->bin_lo;
+   double *hi = g->bin_hi;
+   int *notice_list = g->notice_list;
+   int num = g->n_notice;
+   double y, width, scale, dscale;
+   int i, n;
+
+   if ((ipar >= npar) || (e0 <= 0) || (vtherm <= 0) || (fwhm < 0))
+     return -1;
+
+   width = (e0 * vtherm / C_KMS);
+   y = (fwhm / FOURPI) / width;
+
+   /* val = scale * Q(xlo, xhi, y) */
+   if (Isis_Voigt_Is_Normalized)
+     {
+        scale = norm / SQRT_PI;
+        dscale = 0.0;
+     }
+   else
+     {
+        scale = norm * width;
+        dscale = scale;
+     }
+
+   for (i=0; i < num; i++)
+     {
+        double xlo, xhi, q, q_lo, q_hi, q_y;
+
+        n = notice_list[i];
+
+        xlo = (KEV_ANGSTROM /hi[n] - e0) / width;
+        xhi = (KEV_ANGSTROM /lo[n] - e0) / width;
+
+        if (ipar == 0)
+          {
+             if (-1 == gauss_quad4 (xlo, xhi, y, &q))
+               return -1;
+             dval[i] = (Isis_Voigt_Is_Normalized ? 1.0/SQRT_PI : width) * q;
+             continue;
+          }
+
+        if (-1 == gauss_quad4_deriv (xlo, xhi, y, &q, &q_lo, &q_hi, &q_y))
+          return -1;
+
+        switch (ipar)
+          {
+           case 1:
+             /* width and y scale with e0 */
+             dval[i] = (dscale * q
+                        - scale * (q_lo * xlo + q_hi * xhi + q_y * y)) / e0
+               - scale * (q_lo + q_hi) / width;
+             break;
+           case 2:
+             dval[i] = scale * q_y / (FOURPI * width);
+             break;
+           default:
+             /* width and y scale with vtherm */
+             dval[i] = (dscale * q
+                        - scale * (q_lo * xlo + q_hi * xhi + q_y * y)) / vtherm;
+             break;
+          }
+     }
+
+   return 0;
+}
+
+/*}}}*/
+
 static int contin_voigt (double *val, Isis_User_Grid_t *g, double *par, unsigned int npar) /*{{{*/
 {
    double norm = par[0];
@@ -502,6 +638,7 @@ ISIS_USER_SOURCE_MODULE(Voigt,p,options)
     * as it stands, fwhm=Gamma but the FWHM is Gamma/(2pi) */
 
    p->binned = binned_voigt;
+   p->binned_deriv = binned_voigt_deriv;
    p->unbinned = contin_voigt;
 
    p->parameter_names = parameter_names;